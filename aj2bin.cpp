@@ -1,7 +1,12 @@
+#include <atomic>
+#include <condition_variable>
 #include <cstdio>
 #include <cstdlib>
+#include <mutex>
+#include <thread>
 #include <serialize.h>
 #include <streams.h>
+#include <tinyfs.h>
 #include <tinytx.h>
 
 char* buffer = (char*)malloc(1024);
@@ -14,17 +19,26 @@ uint256 latest_bblk, latest_blk;
 // bool verifying = false;
 // #define V(args...) if (verifying) printf(args)
 
+thread_local std::vector<uint8_t> decoded;
+
 template<typename T>
-inline void deserialize_hex_string(const char* string, T& object) {
-    CDataStream ds(ParseHex(string), SER_DISK, 0);
-    ds >> object;
+inline void deserialize_hex_string(const char* string, size_t len, T& object) {
+    // decode in place of the previous entry, and read straight from there
+    if (decoded.size() < len / 2) decoded.resize(len / 2);
+    CSpanReader r(SER_DISK, 0, decoded.data(), decoded.data() + DecodeHex(string, len, decoded.data()));
+    r >> object;
 }
 
-template<typename T>
-static inline void write_entry(CAutoFile& out, const T& t, uint8_t pid, int64_t timestamp) {
+static inline void write_entry_header(CAutoFile& out, uint8_t pid, int64_t timestamp) {
     uint64_t diff = timestamp >= last_timestamp ? uint64_t(timestamp - last_timestamp) : 0;
     last_timestamp = timestamp;
-    out << VARINT(diff) << pid << t;
+    out << VARINT(diff) << pid;
+}
+
+template<typename T>
+static inline void write_entry(CAutoFile& out, const T& t, uint8_t pid, int64_t timestamp) {
+    write_entry_header(out, pid, timestamp);
+    out << t;
 }
 
 static inline void read_entry_header(CAutoFile& fin, uint8_t& pid) {
@@ -34,78 +48,82 @@ static inline void read_entry_header(CAutoFile& fin, uint8_t& pid) {
 }
 
 bool read_entry(FILE* in_fp, CAutoFile& out) {
-    // <timestamp> <action> <data...>
-    int64_t timestamp;
-    uint32_t fraction;
-    char action[64];
-    if (fscanf(in_fp, "%" PRIi64 ".%u %s ", &timestamp, &fraction, action) != 3) {
-        return false;
-    }
-    // V("%" PRIi64 ".%u %s\n", timestamp, fraction, action);
-
-    char* bptr = buffer;
-    size_t rem = buffer_cap;
+    // entries which are not written (hashtx, coinbase txs) are skipped by
+    // looping around, rather than recursing, as they may come in long runs
     for (;;) {
-        if (!fgets(bptr, rem, in_fp)) {
-            if (ferror(in_fp)) {
-                fprintf(stderr, "\nerror reading from input file\n");
-                return false;
-            }
-            break;
-        }
-        size_t rbytes = strlen(bptr);
-        if (rbytes == 0) {
-            fprintf(stderr, "\nunable to read from input file\n");
+        // <timestamp> <action> <data...>
+        int64_t timestamp;
+        uint32_t fraction;
+        char action[64];
+        if (fscanf(in_fp, "%" PRIi64 ".%u %s ", &timestamp, &fraction, action) != 3) {
             return false;
         }
-        bptr += rbytes;
-        if (bptr[-1] == '\n') {
-            // end of line
-            break;
-        }
-        rem -= rbytes;
-        if (rem < 2) {
-            rbytes = bptr - buffer;
-            buffer_cap <<= 1;
-            buffer = (char*)realloc(buffer, buffer_cap);
-            bptr = buffer + rbytes;
-            rem = buffer_cap - rbytes;
+        // V("%" PRIi64 ".%u %s\n", timestamp, fraction, action);
+
+        char* bptr = buffer;
+        size_t rem = buffer_cap;
+        for (;;) {
+            if (!fgets(bptr, rem, in_fp)) {
+                if (ferror(in_fp)) {
+                    fprintf(stderr, "\nerror reading from input file\n");
+                    return false;
+                }
+                break;
+            }
+            size_t rbytes = strlen(bptr);
+            if (rbytes == 0) {
+                fprintf(stderr, "\nunable to read from input file\n");
+                return false;
+            }
+            bptr += rbytes;
+            if (bptr[-1] == '\n') {
+                // end of line
+                break;
+            }
+            rem -= rbytes;
+            if (rem < 2) {
+                rbytes = bptr - buffer;
+                buffer_cap <<= 1;
+                buffer = (char*)realloc(buffer, buffer_cap);
+                bptr = buffer + rbytes;
+                rem = buffer_cap - rbytes;
+            }
         }
-    }
 
-    // remove newline
-    if (bptr > buffer && bptr[-1] == '\n') bptr[-1] = 0;
+        // remove newline
+        if (bptr > buffer && bptr[-1] == '\n') bptr[-1] = 0;
 
-    // hashtx <txid>
-    // rawtx <tx hex>
-    // hashblock <block id>
+        // hashtx <txid>
+        // rawtx <tx hex>
+        // hashblock <block id>
 
-    if (!strcmp(action, "hashtx")) {
-        // a transaction entered the mempool; we can't do anything
-        // with it yet, though, as we don't know inputs and stuff
-        // so we loop back and fetch the next entry
-        return read_entry(in_fp, out);
-    }
+        if (!strcmp(action, "hashtx")) {
+            // a transaction entered the mempool; we can't do anything
+            // with it yet, though, as we don't know inputs and stuff
+            // so we loop back and fetch the next entry
+            continue;
+        }
+
+        if (!strcmp(action, "rawtx")) {
+            deserialize_hex_string(buffer, bptr - buffer, latest_tx);
+            // V(" TX %s\n", latest_tx.ToString().c_str());
+            if (!latest_tx.IsCoinBase()) {
+                write_entry(out, latest_tx, 0x01 /* rawtx */, timestamp);
+                return true;
+            }
+            // V(" (coinbase tx; moving along)\n");
+            continue;
+        }
 
-    if (!strcmp(action, "rawtx")) {
-        deserialize_hex_string(buffer, latest_tx);
-        // V(" TX %s\n", latest_tx.ToString().c_str());
-        if (!latest_tx.IsCoinBase()) {
-            write_entry(out, latest_tx, 0x01 /* rawtx */, timestamp);
+        if (!strcmp(action, "hashblock")) {
+            latest_blk = uint256S(buffer);
+            // V(" BLOCK %s\n", latest_blk.ToString().c_str());
+            write_entry(out, latest_blk, 0x02 /* hashblock */, timestamp);
             return true;
         }
-        // V(" (coinbase tx; moving along)\n");
-        return read_entry(in_fp, out);
-    }
 
-    if (!strcmp(action, "hashblock")) {
-        latest_blk = uint256S(buffer);
-        // V(" BLOCK %s\n", latest_blk.ToString().c_str());
-        write_entry(out, latest_blk, 0x02 /* hashblock */, timestamp);
-        return true;
+        return false;
     }
-
-    return false;
 }
 
 bool read_bentry(CAutoFile& fin) {
@@ -128,30 +146,256 @@ bool read_bentry(CAutoFile& fin) {
     return true;
 }
 
+/////// parallel conversion
+
+/**
+ * A line-aligned slice of the (memory mapped) input, parsed and converted by
+ * a worker. The entry headers are left to the writer, as they hold the time
+ * since the previous entry, which may be in the previous chunk.
+ */
+struct chunk {
+    struct entry {
+        int64_t timestamp;
+        uint8_t pid;
+        size_t end;         //!< end of the serialized entry in data
+    };
+    const char* begin;
+    const char* end;
+    std::vector<uint8_t> data;
+    std::vector<entry> entries;
+    bool last{false};       //!< the input ends (or can no longer be parsed) in this chunk
+    std::string error;      //!< set if an entry could not be converted or verified
+    bool done{false};
+
+    chunk(const char* begin_in, const char* end_in) : begin(begin_in), end(end_in) {}
+};
+
+//! Input per chunk; a few times as many chunks as threads are in memory at once
+static const size_t CHUNK_SIZE = 8 << 20;
+
+/**
+ * Parse the line at p, advancing p to the next one:
+ *     <timestamp>.<fraction> <action> <data...>
+ * Returns false if the line is malformed.
+ */
+static bool parse_line(const char*& p, const char* end, int64_t& timestamp, std::string& action, const char*& data, size_t& data_len) {
+    const char* eol = (const char*)memchr(p, '\n', end - p);
+    if (!eol) eol = end;
+    const char* s = p;
+    p = eol < end ? eol + 1 : end;
+    if (s == eol || !isdigit((unsigned char)*s)) return false;
+    for (timestamp = 0; s < eol && isdigit((unsigned char)*s); ++s) timestamp = timestamp * 10 + (*s - '0');
+    if (s == eol || *s++ != '.' || s == eol || !isdigit((unsigned char)*s)) return false;
+    while (s < eol && isdigit((unsigned char)*s)) ++s;
+    while (s < eol && isspace((unsigned char)*s)) ++s;
+    const char* a = s;
+    while (s < eol && !isspace((unsigned char)*s)) ++s;
+    if (s == a) return false;
+    action.assign(a, s);
+    while (s < eol && isspace((unsigned char)*s)) ++s;
+    data = s;
+    data_len = eol - s;
+    return true;
+}
+
+/**
+ * Append t to the chunk, and read it back, to check that the entry is
+ * written as it was read (the verification the sequential conversion does
+ * in a second pass over both files).
+ */
+template<typename T, typename V>
+static bool append_entry(chunk& c, const T& t, uint8_t pid, int64_t timestamp, V verify) {
+    size_t begin = c.data.size();
+    CVectorWriter(SER_DISK, 0, c.data, begin) << t;
+    CSpanReader r(SER_DISK, 0, c.data.data() + begin, c.data.data() + c.data.size());
+    T check;
+    r >> check;
+    if (!r.empty() || !verify(check)) return false;
+    c.entries.push_back(chunk::entry{timestamp, pid, c.data.size()});
+    return true;
+}
+
+static void convert_chunk(chunk& c) {
+    // as in the sequential conversion, txs are only re-serialized, and
+    // compared field by field, so there is no need to hash them
+    tiny::deferred_hashing defer;
+    tiny::tx tx;
+    uint256 blk;
+    std::string action;
+    const char* data;
+    size_t data_len;
+    c.data.reserve((c.end - c.begin) / 2);
+    try {
+        for (const char* p = c.begin; p < c.end; ) {
+            const char* line = p;
+            int64_t timestamp;
+            if (!parse_line(p, c.end, timestamp, action, data, data_len)) {
+                // blank lines are skipped, like fscanf does
+                bool blank = true;
+                for (const char* s = line; s < p; ++s) blank &= isspace((unsigned char)*s) != 0;
+                if (blank) continue;
+                c.last = true;
+                return;
+            }
+            if (action == "hashtx") continue;
+            if (action == "rawtx") {
+                deserialize_hex_string(data, data_len, tx);
+                if (tx.IsCoinBase()) continue;
+                if (!append_entry(c, tx, 0x01 /* rawtx */, timestamp, [&tx](const tiny::tx& check) { return check.verify(tx); })) {
+                    c.error = "verification failed for tx at offset " + std::to_string(line - c.begin) + " of the chunk";
+                }
+            } else if (action == "hashblock") {
+                blk = uint256S(std::string(data, data_len));
+                if (!append_entry(c, blk, 0x02 /* hashblock */, timestamp, [&blk](const uint256& check) { return check == blk; })) {
+                    c.error = "verification failed for block " + blk.ToString();
+                }
+            } else {
+                c.last = true;
+                return;
+            }
+            if (!c.error.empty()) {
+                c.last = true;
+                return;
+            }
+        }
+    } catch (const std::exception& e) {
+        c.error = std::string("unable to convert entry: ") + e.what();
+        c.last = true;
+    }
+}
+
+/**
+ * Convert the input with the given number of threads. The input is memory
+ * mapped and split into line-aligned chunks, which the workers parse,
+ * hex-decode, convert and verify, while the calling thread writes the
+ * finished chunks in input order (holding on to those that finish early).
+ * Returns false if the input could not be read, or an entry did not verify.
+ */
+static bool convert_parallel(const char* path, CAutoFile& out, size_t threads, size_t& entries) {
+    tiny::mapped_file in;
+    if (!in.open(path)) {
+        fprintf(stderr, "unable to open file for reading: %s\n", path);
+        return false;
+    }
+    in.advise_sequential();
+    const char* in_begin = (const char*)in.begin();
+    const char* in_end = (const char*)in.end();
+    std::vector<chunk> chunks;
+    for (const char* p = in_begin; p < in_end; ) {
+        const char* q = in_end - p > (ptrdiff_t)CHUNK_SIZE ? p + CHUNK_SIZE : in_end;
+        if (q < in_end) {
+            const char* eol = (const char*)memchr(q, '\n', in_end - q);
+            q = eol ? eol + 1 : in_end;
+        }
+        chunks.emplace_back(p, q);
+        p = q;
+    }
+
+    std::mutex mutex;
+    std::condition_variable cv;
+    const size_t window = threads * 4;
+    size_t next = 0, written = 0;
+    bool stop = false;
+    auto work = [&]() {
+        std::unique_lock<std::mutex> lock(mutex);
+        for (;;) {
+            cv.wait(lock, [&]() { return stop || next == chunks.size() || next < written + window; });
+            if (stop || next == chunks.size()) return;
+            chunk& c = chunks[next++];
+            lock.unlock();
+            convert_chunk(c);
+            lock.lock();
+            c.done = true;
+            cv.notify_all();
+        }
+    };
+    std::vector<std::thread> workers;
+    for (size_t i = 0; i < threads; ++i) workers.emplace_back(work);
+
+    bool ok = true;
+    for (auto& c : chunks) {
+        {
+            std::unique_lock<std::mutex> lock(mutex);
+            cv.wait(lock, [&c]() { return c.done; });
+        }
+        size_t begin = 0;
+        for (const auto& e : c.entries) {
+            write_entry_header(out, e.pid, e.timestamp);
+            out.write((const char*)c.data.data() + begin, e.end - begin);
+            begin = e.end;
+        }
+        entries += c.entries.size();
+        if (!c.error.empty()) {
+            fprintf(stderr, "\n%s\n", c.error.c_str());
+            ok = false;
+        }
+        bool last = c.last;
+        std::vector<uint8_t>().swap(c.data);
+        std::vector<chunk::entry>().swap(c.entries);
+        std::lock_guard<std::mutex> lock(mutex);
+        ++written;
+        cv.notify_all();
+        if (last) break;
+    }
+    {
+        std::lock_guard<std::mutex> lock(mutex);
+        stop = true;
+        cv.notify_all();
+    }
+    for (auto& w : workers) w.join();
+    return ok;
+}
+
 int main(const int argc, const char** argv)
 {
-    if (argc != 2) {
-        fprintf(stderr, "syntax: %s <input file>\n", argv[0]);
+    if (argc < 2 || argc > 3) {
+        fprintf(stderr, "syntax: %s <input file> [<threads>]\n", argv[0]);
+        fprintf(stderr, "with threads (0 for one per core), the input is memory mapped, and converted and verified in parallel\n");
+        fprintf(stderr, "either way, conversion stops at an entry which cannot be decoded (e.g. a truncated last line); the entries before it are kept in the .bin, and the exit code is 2\n");
         return 1;
     }
+    std::string outf = std::string(argv[1]) + ".bin";
+    if (argc == 3) {
+        size_t threads = atoi(argv[2]);
+        if (threads == 0) threads = std::max(1u, std::thread::hardware_concurrency());
+        FILE* fp = fopen(outf.c_str(), "wb");
+        if (!fp) {
+            fprintf(stderr, "unable to open file for writing: %s\n", outf.c_str());
+            return 2;
+        }
+        CAutoFile af(fp, SER_DISK, 0);
+        size_t entries = 0;
+        bool ok = convert_parallel(argv[1], af, threads, entries);
+        printf("%zu entries\n", entries);
+        return ok ? 0 : 2;
+    }
     FILE* in_fp = fopen(argv[1], "r");
     if (!in_fp) {
         fprintf(stderr, "unable to open file for reading: %s\n", argv[1]);
         return 2;
     }
-    std::string outf = std::string(argv[1]) + ".bin";
     FILE* fp = fopen(outf.c_str(), "wb");
+    size_t entries = 0;
+    bool ok = true;
     {
         CAutoFile af(fp, SER_DISK, 0);
-        size_t entries = 0;
-        while (read_entry(in_fp, af)) {
-            ++entries;
+        // txs are only re-serialized here, so there is no need to hash them (the
+        // verification below does, on both sides)
+        tiny::deferred_hashing defer;
+        try {
+            while (read_entry(in_fp, af)) {
+                ++entries;
+            }
+        } catch (const std::exception& e) {
+            // as in the parallel conversion; entries are only written once decoded
+            fprintf(stderr, "\nunable to convert entry: %s\n", e.what());
+            ok = false;
         }
         printf("%zu entries\n", entries);
         fclose(in_fp);
     }
 
-    // verify
+    // verify the entries that were written
     {
         // verifying = true;
         in_fp = fopen(argv[1], "r");
@@ -159,9 +403,10 @@ int main(const int argc, const char** argv)
         fp = fopen(".foo.bin", "wb");
         CAutoFile inaf(in2_fp, SER_DISK, 0);
         CAutoFile af(fp, SER_DISK, 0);
-        while (read_entry(in_fp, af)) {
+        for (size_t i = 0; i < entries && read_entry(in_fp, af); ++i) {
             assert(read_bentry(inaf));
         }
         fclose(in_fp);
     }
+    return ok ? 0 : 2;
 }
@@ -28,8 +28,10 @@ ajb::ajb(std::shared_ptr<bitcoin::mff> mff_in, std::shared_ptr<tiny::mempool> me
 
 template<typename T>
 inline void deserialize_hex_string(const char* string, T& object) {
-    CDataStream ds(ParseHex(string), SER_DISK, 0);
-    ds >> object;
+    size_t len = strlen(string);
+    std::vector<uint8_t> data(len / 2);
+    CSpanReader r(SER_DISK, 0, data.data(), data.data() + DecodeHex(string, len, data.data()));
+    r >> object;
 }
 
 ///////// AMAP
@@ -82,11 +84,21 @@ int64_t ajb::get_tx_input_amount(tiny::tx& tx)
     return amount;
 }
 
+bool ajb::get_block(const uint256& blockhash, tiny::block& b, uint32_t& height) {
+    if (prefetcher && prefetcher->find(blockhash, b, height)) return true;
+    return rpc->get_block(blockhash, b, height);
+}
+
+bool ajb::get_block(uint32_t height, tiny::block& b, uint256& blockhash) {
+    if (prefetcher) return prefetcher->get(height, b, blockhash);
+    return rpc->get_block(height, b, blockhash);
+}
+
 bool ajb::process_block_hash(const uint256& blockhash, bool reorging) {
     // printf("- read blk %s\n", blockhash.ToString().c_str());
     tiny::block blk;
     uint32_t height;
-    if (rpc->get_block(blockhash, blk, height)) {
+    if (get_block(blockhash, blk, height)) {
         // if this is in the chain, we ignore
         auto b = mff->m_chain.get_block_for_height(height);
         if (!b || b->m_hash != blockhash) {
@@ -112,14 +124,17 @@ bool ajb::process_block_hash(const uint256& blockhash, bool reorging) {
                     printf("filling gap (height=%u)\n", i);
                     tiny::block blk2;
                     uint256 blockhash2;
-                    rpc->get_block(i, blk2, blockhash2);
+                    if (!get_block(i, blk2, blockhash2)) {
+                        fprintf(stderr, "\n*** unable to fetch block at height %u to fill the gap up to block %u=%s\n", i, height, blockhash.ToString().c_str());
+                        exit(1);
+                    }
                     confirm(i, blockhash2, blk2);
                 }
             }
             confirm(height, blockhash, blk);
             if (!reorging) {
                 // determine the time/hash of the next block, if any
-                if (rpc->get_block(height+1, blk, next_block)) {
+                if (get_block(height+1, blk, next_block)) {
                     next_block_time = blk.time + 300;
                 } else {
                     next_block_time = 0;
@@ -130,24 +145,51 @@ bool ajb::process_block_hash(const uint256& blockhash, bool reorging) {
     return true;
 }
 
+bool ajb::fill_window() {
+    std::vector<tiny::tx*> txs;
+    {
+        tiny::deferred_hashing defer;
+        while (pending.size() < window) {
+            entry e;
+            try {
+                in >> VARINT(e.diff) >> e.pid;
+            } catch (std::ios_base::failure& f) {
+                break;
+            }
+            switch (e.pid) {
+            case 0x01: // tx
+                e.tx = std::make_shared<tiny::tx>();
+                in >> *e.tx;
+                txs.push_back(e.tx.get());
+                break;
+            case 0x02: // block hash
+                in >> e.blockhash;
+                break;
+            default:
+                // ???
+                fprintf(stderr, "\nunknown command %02x\n", e.pid);
+                assert(0);
+            }
+            pending.push_back(e);
+        }
+    }
+    tiny::hash_pool::shared().hash(txs.data(), txs.size());
+    return !pending.empty();
+}
+
 bool ajb::read_entry() {
     if (next_block_time && next_block_time <= current_time) {
         return process_block_hash(next_block);
     }
-    uint8_t pid;
-    try {
-        uint64_t diff;
-        in >> VARINT(diff) >> pid;
-        current_time += diff;
-        // if (shared_time) *shared_time = current_time;
-    } catch (std::ios_base::failure& f) {
-        return false;
-    }
-    switch (pid) {
+    if (pending.empty() && !fill_window()) return false;
+    entry e = pending.front();
+    pending.pop_front();
+    current_time += e.diff;
+    // if (shared_time) *shared_time = current_time;
+    switch (e.pid) {
     case 0x01: // tx
         {
-            tiny::tx tx;
-            in >> tx;
+            const tiny::tx& tx = *e.tx;
             // we want to catch up with whatever block was mined before tx
             // unless we already know when the next block is arriving
             if (next_block_time == 0) {
@@ -169,7 +211,7 @@ bool ajb::read_entry() {
                                 process_block_hash(hash2);
                             } else {
                                 // whatever, just confirm the block at height-1
-                                rpc->get_block(height - 1, block, hash2);
+                                get_block(height - 1, block, hash2);
                                 process_block_hash(hash2);
                             }
                         }
@@ -180,20 +222,12 @@ bool ajb::read_entry() {
             }
             // printf("- read tx %s\n", tx.ToString().c_str());
             if (!tx.IsCoinBase()) {
-                mempool->insert_tx(std::make_shared<tiny::tx>(tx));
+                mempool->insert_tx(e.tx);
             }
         }
         return true;
-    case 0x02: // block hash
-        {
-            uint256 blockhash;
-            in >> blockhash;
-            return process_block_hash(blockhash);
-        }
-    default:
-        // ???
-        fprintf(stderr, "\nunknown command %02x\n", pid);
-        assert(0);
+    default: // block hash
+        return process_block_hash(e.blockhash);
     }
 }
 
@@ -210,6 +244,18 @@ void ajb::confirm(uint32_t height, const uint256& hash, tiny::block& b) {
     // }
     // assert(mff->m_chain.get_blocks().size() == 0 || height == mff->get_height() + 1);
     mempool->process_block(height, hash, b.vtx);
+    // record the new outputs, so we don't have to go to RPC for them later
+    if (amap::enabled) {
+        std::vector<std::pair<uint256, amap::amount_list_t>> outputs;
+        outputs.reserve(b.vtx.size());
+        for (const auto& tx : b.vtx) {
+            outputs.emplace_back(tx.hash, amap::amount_list_t());
+            auto& amounts = outputs.back().second;
+            amounts.reserve(tx.vout.size());
+            for (const auto& out : tx.vout) amounts.push_back(out.value);
+        }
+        amap::add_outputs(outputs);
+    }
 }
 
 } // namespace mff
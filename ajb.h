@@ -1,11 +1,13 @@
 #ifndef included_mff_ajb_h_
 #define included_mff_ajb_h_
 
+#include <deque>
 #include <memory>
 
 #include <serialize.h>
 #include <streams.h>
 #include <tinyrpc.h>
+#include <tinyprefetcher.h>
 #include <bcq/bitcoin.h>
 #include <tinymempool.h>
 
@@ -36,9 +38,27 @@ struct ajb {
     int64_t get_output_value(const uint256& txid, int n);
     int64_t get_tx_input_amount(tiny::tx& tx);
 
+    // Block fetching, going through the prefetcher if there is one
+    std::shared_ptr<tiny::block_prefetcher> prefetcher;
+    bool get_block(const uint256& blockhash, tiny::block& b, uint32_t& height);
+    bool get_block(uint32_t height, tiny::block& b, uint256& blockhash);
+
     bool process_block_hash(const uint256& blockhash, bool reorging = false);
 
+    // Read-ahead: entries are read up to `window` at a time, so that their txs can be
+    // hashed together (see tiny::hash_pool) before read_entry() hands them out one by one
+    struct entry {
+        uint64_t diff;
+        uint8_t pid;
+        std::shared_ptr<tiny::tx> tx;
+        uint256 blockhash;
+    };
+    size_t window{256};
+    std::deque<entry> pending;
+    bool fill_window();
+
     bool read_entry();
+    // note that this is the read position, which is up to `window` entries ahead of the last entry handed out
     long tell() { return ftell(in_fp); }
     void flush() { fflush(in_fp); }
 
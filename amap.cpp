@@ -1,6 +1,11 @@
 #include <uint256.h>
 #include <tinyformat.h>
 #include <streams.h>
+#include <tinyfs.h>
+#include <crypto/common.h>
+
+#include <algorithm>
+#include <limits>
 
 #include <amap.h>
 
@@ -8,6 +13,7 @@ namespace amap {
 
 std::string amap_path = "amap";
 bool enabled = false;
+size_t delta_compact_threshold = 2000000;
 
 #include <utilstrencodings.h>
 inline std::string hex(const uint8_t* what, size_t what_sz) {
@@ -59,55 +65,396 @@ bool fbinsearch(FILE* fp, long start, long end, const uint8_t* what, size_t what
 }
 #undef fbdeb
 
-CAmount output_amount(const uint256& txid, int index) {
-    if (!enabled) return -1;
-    if (txid == uint256S("59aa5ee3db978ea8168a6973b505c31b3f5f4757330da4ef45da0f51a81c1fc9")) {
-        fprintf(stderr, "you should not be asking for 59aa5... cause you should ALREADY HAVE IT\n");
-        exit(1);
+// The amount map file format divides the data into 3 sections:
+// - the first section is the prefix and the number of transactions as a
+//   varint. the end of this varint marks the beginning of the offset_marker
+// - the second section is a list of txids and accumulative offsets,
+//   which lets a binary search operation find a txid and its output amounts
+//   by first locating the txid entry, reading its offset value, then jumping to
+//   the file position (offset_marker + (36 - prefix_len)*txid_count) + offset
+// - the third section is a list of amounts, in the form of a varint for the
+//   amount count, and a set of varints for the amounts themselves
+
+/** Decode the amount list starting at p. */
+static void decode_amounts(const uint8_t* p, const uint8_t* end, amount_list_t& amounts_out) {
+    CSpanReader r(SER_DISK, 0, p, end);
+    size_t amounts;
+    r >> VARINT(amounts);
+    amounts_out.resize(amounts);
+    uint64_t amt;
+    for (size_t i = 0; i < amounts; ++i) {
+        r >> VARINT(amt);
+        amounts_out[i] = amt;
     }
-    // The amount map file format divides the data into 3 sections:
-    // - the first section is the prefix and the number of transactions as a
-    //   varint. the end of this varint marks the beginning of the offset_marker
-    // - the second section is a list of txids and accumulative offsets,
-    //   which lets a binary search operation find a txid and its output amounts
-    //   by first locating the txid entry, reading its offset value, then jumping to
-    //   the file position (offset_marker + (36 - prefix_len)*txid_count) + offset
-    // - the third section is a list of amounts, in the form of a varint for the
-    //   amount count, and a set of varints for the amounts themselves
-
-    // figure out which file to open
-    prefix_t prefix;
-    memcpy(&prefix, txid.begin(), prefix_len);
-    std::string fname = amap_path + strprintf("/%x", prefix);
-    FILE* fp = fopen(fname.c_str(), "rb");
-    if (!fp) {
+}
+
+struct reader::table {
+    tiny::mapped_file file;
+    size_t txcount{0};
+    const uint8_t* entries{nullptr};    // start of the second section
+    const uint8_t* amounts{nullptr};    // start of the third section
+    std::list<prefix_t>::iterator lru;  // position in reader::m_lru
+};
+
+reader::reader(const std::string& path, search_mode mode, size_t max_mapped) : m_path(path), m_mode(mode), m_max_mapped(std::max<size_t>(max_mapped, 1)), m_tables(prefix_count) {}
+
+reader::~reader() {}
+
+// the table returned stays valid until the next call, as that may unmap it
+const reader::table& reader::get_table(prefix_t prefix) {
+    std::unique_ptr<table>& t = m_tables[prefix];
+    if (t) {
+        m_lru.splice(m_lru.begin(), m_lru, t->lru);
+        return *t;
+    }
+    if (m_lru.size() >= m_max_mapped) {
+        m_tables[m_lru.back()].reset();
+        m_lru.pop_back();
+    }
+    t.reset(new table());
+    m_lru.push_front(prefix);
+    t->lru = m_lru.begin();
+    std::string fname = m_path + strprintf("/%x", prefix);
+    if (!t->file.open(fname)) {
         fprintf(stderr, "cannot find amap for prefix %x\n", prefix);
         assert(0);
     }
-    CAutoFile af(fp, SER_DISK, 0);
+    // lookups are binary searches, so read-ahead only pollutes the page cache
+    t->file.advise_random();
+    CSpanReader r = t->file.reader();
     prefix_t cmp;
-    size_t txcount;
-    af >> cmp >> VARINT(txcount);
+    r >> cmp >> VARINT(t->txcount);
     if (prefix != cmp) {
         fprintf(stderr, "file prefix != expected prefix: %x != %x\n", cmp, prefix);
         assert(0);
     }
-    long cmarker = ftell(fp);
+    t->entries = r.data();
+    if (r.size() < (36 - prefix_len) * t->txcount) {
+        fprintf(stderr, "amap file %s is truncated (%zu txids, %zu bytes)\n", fname.c_str(), t->txcount, t->file.size());
+        assert(0);
+    }
+    t->amounts = t->entries + (36 - prefix_len) * t->txcount;
+    return *t;
+}
+
+void reader::preload() {
+    for (size_t prefix = 0; prefix < prefix_count && prefix < m_max_mapped; ++prefix) get_table(prefix);
+}
 
-    if (!fbinsearch(fp, cmarker, cmarker + (36 - prefix_len) * txcount, &txid.begin()[prefix_len], 32 - prefix_len, 36 - prefix_len)) {
-        // fprintf(stderr, "cannot find txid %s in file %s\n", txid.ToString().c_str(), fname.c_str());
-        return -1;
+void reader::reload(prefix_t prefix) {
+    std::unique_ptr<table>& t = m_tables[prefix];
+    if (!t) return;
+    m_lru.erase(t->lru);
+    t.reset();
+}
+
+bool reader::read_table(prefix_t prefix, std::vector<std::pair<uint256, amount_list_t>>& txs) {
+    tiny::mapped_file file;
+    if (!file.open(m_path + strprintf("/%x", prefix))) return false;
+    CSpanReader r = file.reader();
+    prefix_t cmp;
+    size_t txcount;
+    r >> cmp >> VARINT(txcount);
+    assert(cmp == prefix);
+    const uint8_t* entries = r.data();
+    const uint8_t* amounts = entries + (36 - prefix_len) * txcount;
+    assert(amounts <= file.end());
+    txs.reserve(txs.size() + txcount);
+    for (size_t i = 0; i < txcount; ++i) {
+        const uint8_t* el = entries + i * (36 - prefix_len);
+        uint256 txid;
+        memcpy(txid.begin(), &prefix, prefix_len);
+        memcpy(txid.begin() + prefix_len, el, 32 - prefix_len);
+        uint32_t offset;
+        memcpy(&offset, el + 32 - prefix_len, 4);
+        txs.emplace_back(txid, amount_list_t());
+        decode_amounts(amounts + offset, file.end(), txs.back().second);
+    }
+    return true;
+}
+
+size_t reader::search_binary(const table& t, const uint8_t* what, size_t l, size_t r) {
+    const size_t what_sz = 32 - prefix_len;
+    const size_t el_sz = 36 - prefix_len;
+    while (r > l) {
+        ++m_probes;
+        size_t m = l + ((r - l) >> 1);
+        int c = memcmp(what, t.entries + m * el_sz, what_sz);
+        if (c == 0) return m;
+        if (c > 0) l = m + 1; else r = m;
     }
+    return (size_t)-1;
+}
+
+size_t reader::search_interpolation(const table& t, const uint8_t* what) {
+    const size_t what_sz = 32 - prefix_len;
+    const size_t el_sz = 36 - prefix_len;
+    // txids are uniformly distributed, so the leading 8 bytes of the txid
+    // tail predict where in the table an entry sits; every key in [l, r)
+    // lies within [lo, hi]
+    const uint64_t key = ReadBE64(what);
+    uint64_t lo = 0, hi = std::numeric_limits<uint64_t>::max();
+    size_t l = 0, r = t.txcount;
+    // a handful of interpolation steps narrows the range down to a few
+    // entries in practice; should the data be skewed, binary search takes
+    // over rather than degrading towards a linear scan
+    for (int steps = 0; r - l > 2 && steps < 8; ++steps) {
+        ++m_probes;
+        size_t m = l + (size_t)((double)(key - lo) / ((double)(hi - lo) + 1.0) * (r - l));
+        if (m >= r) m = r - 1;
+        const uint8_t* el = t.entries + m * el_sz;
+        int c = memcmp(what, el, what_sz);
+        if (c == 0) return m;
+        if (c > 0) {
+            l = m + 1;
+            lo = ReadBE64(el);
+        } else {
+            r = m;
+            hi = ReadBE64(el);
+        }
+    }
+    return search_binary(t, what, l, r);
+}
+
+const uint8_t* reader::find_amounts(const uint256& txid, const uint8_t*& end_out) {
+    prefix_t prefix;
+    memcpy(&prefix, txid.begin(), prefix_len);
+    const table& t = get_table(prefix);
+    const uint8_t* what = &txid.begin()[prefix_len];
+    size_t m = m_mode == search_mode::interpolation ? search_interpolation(t, what) : search_binary(t, what, 0, t.txcount);
+    if (m == (size_t)-1) return nullptr;
     uint32_t offset;
-    fread(&offset, 4, 1, fp);
-    fseek(fp, cmarker + (36 - prefix_len) * txcount + offset, SEEK_SET);
+    memcpy(&offset, t.entries + m * (36 - prefix_len) + 32 - prefix_len, 4);
+    if (t.amounts + offset >= t.file.end()) {
+        fprintf(stderr, "amap offset out of bounds for txid %s\n", txid.ToString().c_str());
+        assert(0);
+    }
+    end_out = t.file.end();
+    return t.amounts + offset;
+}
+
+bool reader::output_amounts(const uint256& txid, amount_list_t& amounts_out) {
+    const uint8_t* end;
+    const uint8_t* p = find_amounts(txid, end);
+    if (!p) return false;
+    decode_amounts(p, end, amounts_out);
+    return true;
+}
+
+CAmount reader::output_amount(const uint256& txid, int index) {
+    const uint8_t* end;
+    const uint8_t* p = find_amounts(txid, end);
+    if (!p) return -1;
+    CSpanReader r(SER_DISK, 0, p, end);
     size_t amounts;
-    af >> VARINT(amounts);
-    assert(amounts > index);
+    r >> VARINT(amounts);
+    assert(index >= 0 && amounts > (size_t)index);
     uint64_t amt = 0;
-    for (int i = 0; i <= index; i++) af >> VARINT(amt);
+    for (int i = 0; i <= index; i++) r >> VARINT(amt);
     return amt;
-    // af closes fp
+}
+
+bool write_table(const std::string& path, prefix_t prefix, std::vector<std::pair<uint256, amount_list_t>>& txs) {
+    std::sort(txs.begin(), txs.end(), [](const std::pair<uint256, amount_list_t>& a, const std::pair<uint256, amount_list_t>& b) {
+        return memcmp(a.first.begin() + prefix_len, b.first.begin() + prefix_len, 32 - prefix_len) < 0;
+    });
+    // the same tx may be seen more than once (e.g. in a stale block), but the
+    // table can only hold one entry per txid
+    txs.erase(std::unique(txs.begin(), txs.end(), [](const std::pair<uint256, amount_list_t>& a, const std::pair<uint256, amount_list_t>& b) {
+        return a.first == b.first;
+    }), txs.end());
+    CDataStream amounts(SER_DISK, 0);
+    std::vector<uint32_t> offsets;
+    offsets.reserve(txs.size());
+    for (const auto& t : txs) {
+        assert(!memcmp(t.first.begin(), &prefix, prefix_len));
+        assert(amounts.size() <= std::numeric_limits<uint32_t>::max());
+        offsets.push_back(amounts.size());
+        size_t count = t.second.size();
+        amounts << VARINT(count);
+        for (CAmount a : t.second) {
+            uint64_t amt = a;
+            amounts << VARINT(amt);
+        }
+    }
+    // write to a temporary file and move it into place once complete, so that
+    // readers never see a partially written table
+    std::string fname = path + strprintf("/%x", prefix);
+    std::string tmpname = fname + ".tmp";
+    FILE* fp = fopen(tmpname.c_str(), "wb");
+    if (!fp) return false;
+    bool ok;
+    {
+        CAutoFile af(fp, SER_DISK, 0);
+        size_t txcount = txs.size();
+        af << prefix << VARINT(txcount);
+        for (size_t i = 0; i < txs.size(); ++i) {
+            af.write((const char*)txs[i].first.begin() + prefix_len, 32 - prefix_len);
+            af.write((const char*)&offsets[i], 4);
+        }
+        af.write(amounts.data(), amounts.size());
+        ok = fflush(fp) == 0 && fsync(fileno(fp)) == 0;
+        // af closes fp
+    }
+    if (!ok || rename(tmpname.c_str(), fname.c_str())) {
+        unlink(tmpname.c_str());
+        return false;
+    }
+    return true;
+}
+
+// The delta log is a plain sequence of records, each consisting of the txid,
+// followed by a varint for the amount count and a varint for each amount.
+
+delta::delta(const std::string& path) : m_path(path) {
+    // replay whatever is in the log already; a record cut short (e.g. by a
+    // crash mid-write) is dropped, along with everything after it
+    long good = 0;
+    tiny::mapped_file file;
+    if (file.open(m_path)) {
+        CSpanReader r = file.reader();
+        try {
+            while (!r.empty()) {
+                uint256 txid;
+                amount_list_t amounts;
+                r >> txid;
+                size_t count;
+                uint64_t amt;
+                r >> VARINT(count);
+                amounts.resize(count);
+                for (size_t i = 0; i < count; ++i) {
+                    r >> VARINT(amt);
+                    amounts[i] = amt;
+                }
+                m_entries[txid] = std::move(amounts);
+                good = r.tell();
+            }
+        } catch (const std::ios_base::failure& e) {
+            fprintf(stderr, "amap delta %s: dropping partial record at position %ld\n", m_path.c_str(), good);
+        }
+        size_t size = file.size();
+        file.close();
+        if ((size_t)good < size && truncate(m_path.c_str(), good)) {
+            fprintf(stderr, "amap delta %s: failed to truncate to %ld bytes\n", m_path.c_str(), good);
+            assert(0);
+        }
+    }
+    m_fp = fopen(m_path.c_str(), "ab");
+    if (!m_fp) {
+        fprintf(stderr, "cannot open amap delta %s\n", m_path.c_str());
+        assert(0);
+    }
+}
+
+delta::~delta() {
+    if (m_fp) fclose(m_fp);
+}
+
+void delta::add(const uint256& txid, const amount_list_t& amounts) {
+    if (m_entries.count(txid)) return;
+    CDataStream ds(SER_DISK, 0);
+    size_t count = amounts.size();
+    ds << txid << VARINT(count);
+    for (CAmount a : amounts) {
+        uint64_t amt = a;
+        ds << VARINT(amt);
+    }
+    if (fwrite(ds.data(), 1, ds.size(), m_fp) != ds.size()) {
+        fprintf(stderr, "failed to write to amap delta %s\n", m_path.c_str());
+        assert(0);
+    }
+    m_entries[txid] = amounts;
+}
+
+void delta::flush() {
+    fflush(m_fp);
+}
+
+const amount_list_t* delta::find(const uint256& txid) const {
+    auto it = m_entries.find(txid);
+    return it == m_entries.end() ? nullptr : &it->second;
+}
+
+bool delta::compact(reader& base) {
+    std::vector<std::vector<std::pair<uint256, amount_list_t>>> prefixes(prefix_count);
+    for (const auto& e : m_entries) {
+        prefix_t prefix;
+        memcpy(&prefix, e.first.begin(), prefix_len);
+        prefixes[prefix].emplace_back(e.first, e.second);
+    }
+    for (size_t prefix = 0; prefix < prefix_count; ++prefix) {
+        auto& txs = prefixes[prefix];
+        if (txs.empty()) continue;
+        base.read_table(prefix, txs);
+        if (!write_table(base.path(), prefix, txs)) {
+            fprintf(stderr, "amap delta compaction failed writing prefix %zx\n", prefix);
+            return false;
+        }
+        base.reload(prefix);
+        txs.clear();
+        txs.shrink_to_fit();
+    }
+    // every table is in place; only now is it safe to let go of the log
+    fflush(m_fp);
+    if (ftruncate(fileno(m_fp), 0)) {
+        fprintf(stderr, "failed to truncate amap delta %s\n", m_path.c_str());
+        return false;
+    }
+    m_entries.clear();
+    return true;
+}
+
+reader& shared_reader() {
+    static reader r(amap_path);
+    return r;
+}
+
+delta& shared_delta() {
+    static delta d(amap_path + "/delta");
+    return d;
+}
+
+inline void check_txid(const uint256& txid) {
+    if (txid == uint256S("59aa5ee3db978ea8168a6973b505c31b3f5f4757330da4ef45da0f51a81c1fc9")) {
+        fprintf(stderr, "you should not be asking for 59aa5... cause you should ALREADY HAVE IT\n");
+        exit(1);
+    }
+}
+
+CAmount output_amount(const uint256& txid, int index) {
+    if (!enabled) return -1;
+    check_txid(txid);
+    const amount_list_t* amounts = shared_delta().find(txid);
+    if (amounts) {
+        assert(index >= 0 && amounts->size() > (size_t)index);
+        return (*amounts)[index];
+    }
+    return shared_reader().output_amount(txid, index);
+}
+
+bool output_amounts(const uint256& txid, amount_list_t& amounts_out) {
+    if (!enabled) return false;
+    check_txid(txid);
+    const amount_list_t* amounts = shared_delta().find(txid);
+    if (amounts) {
+        amounts_out = *amounts;
+        return true;
+    }
+    return shared_reader().output_amounts(txid, amounts_out);
+}
+
+void add_outputs(const std::vector<std::pair<uint256, amount_list_t>>& txs) {
+    if (!enabled) return;
+    delta& d = shared_delta();
+    for (const auto& t : txs) d.add(t.first, t.second);
+    d.flush();
+    if (d.size() >= delta_compact_threshold) {
+        printf("\ncompacting %zu amap delta entries into %s\n", d.size(), amap_path.c_str());
+        if (!d.compact(shared_reader())) {
+            // the log is left as is, so nothing is lost; try again next time
+            fprintf(stderr, "amap delta compaction failed\n");
+        }
+    }
 }
 
 } // namespace amap
@@ -5,10 +5,14 @@
 #ifndef BITCOIN_AMAP_H
 #define BITCOIN_AMAP_H
 
+#include <list>
+#include <memory>
+#include <string>
 #include <vector>
 #include <map>
 
-class uint256;
+#include <tinymap.h>
+
 class CAutoFile;
 
 namespace amap {
@@ -16,11 +20,15 @@ namespace amap {
 extern std::string amap_path;
 extern bool enabled;
 
+/** Number of delta entries at which add_outputs() compacts the delta into the base tables. */
+extern size_t delta_compact_threshold;
+
 typedef int64_t CAmount;
 typedef std::vector<CAmount> amount_list_t;
 
 typedef uint16_t prefix_t;
 const size_t prefix_len = sizeof(prefix_t);
+const size_t prefix_count = 1 << (8 * prefix_len);
 
 /**
  * Binary search for the given data `what` of the given length `what_sz` bytes
@@ -30,12 +38,172 @@ const size_t prefix_len = sizeof(prefix_t);
  */
 bool fbinsearch(FILE* fp, long start, long end, const uint8_t* what, size_t what_sz, size_t el_sz, bool debug = false);
 
+/**
+ * How a reader locates txids within a prefix table.
+ *
+ * binary:        textbook binary search (~log2(txcount) probes)
+ * interpolation: since txids are uniformly distributed, their leading bytes
+ *                predict their position in the table; a few interpolation
+ *                steps narrow the range down, after which binary search
+ *                finishes the job (~4.5 probes for 60k entry tables, vs ~15.5)
+ */
+enum class search_mode {
+    binary,
+    interpolation,
+};
+
+/**
+ * Long-lived amap lookup engine.
+ *
+ * Each prefix file is memory mapped the first time it is needed and stays
+ * mapped until max_mapped other files have been used since, so lookups
+ * in recently used tables are pure in-memory binary searches without any
+ * system calls. There are more prefix files (65536) than the kernel lets
+ * a process have mappings by default (vm.max_map_count, 65530), and the
+ * rest of the process needs map slots too, so not all of them can stay
+ * mapped at once.
+ *
+ * Not thread safe.
+ */
+class reader {
+public:
+    struct table;
+
+    static const size_t default_max_mapped = 8192;
+
+    explicit reader(const std::string& path, search_mode mode = search_mode::interpolation, size_t max_mapped = default_max_mapped);
+    ~reader();
+
+    /**
+     * Fetch all output amounts for the given transaction into amounts_out.
+     * Returns false if the transaction could not be found.
+     */
+    bool output_amounts(const uint256& txid, amount_list_t& amounts_out);
+
+    /**
+     * Fetch the output amount for the given transaction's output at the given index.
+     * Returns -1 if the corresponding transaction could not be found.
+     */
+    CAmount output_amount(const uint256& txid, int index);
+
+    /** Map prefix files up front (as many as max_mapped allows), rather than on first use. */
+    void preload();
+
+    /** Drop the mapping of the given prefix file, e.g. because it was rewritten. */
+    void reload(prefix_t prefix);
+
+    /**
+     * Append every tx in the given prefix file to txs. Returns false if there
+     * is no such file.
+     */
+    bool read_table(prefix_t prefix, std::vector<std::pair<uint256, amount_list_t>>& txs);
+
+    const std::string& path() const { return m_path; }
+
+    search_mode mode() const { return m_mode; }
+    void set_mode(search_mode mode) { m_mode = mode; }
+
+    /** Number of table entries compared against so far (for benchmarking). */
+    uint64_t probes() const { return m_probes; }
+
+    /** Number of prefix files currently mapped. */
+    size_t mapped() const { return m_lru.size(); }
+
+private:
+    std::string m_path;
+    search_mode m_mode;
+    uint64_t m_probes{0};
+    size_t m_max_mapped;
+    std::vector<std::unique_ptr<table>> m_tables;
+    std::list<prefix_t> m_lru;          // mapped prefixes, most recently used first
+
+    const table& get_table(prefix_t prefix);
+    size_t search_binary(const table& t, const uint8_t* what, size_t l, size_t r);
+    size_t search_interpolation(const table& t, const uint8_t* what);
+    const uint8_t* find_amounts(const uint256& txid, const uint8_t*& end_out);
+};
+
+/**
+ * Write the amap file for the given prefix into the directory at path, given
+ * every tx with that prefix along with its output amounts. txs is sorted and
+ * stripped of duplicate txids in the process. The file is written under a
+ * temporary name and renamed into place once complete. Returns false if the
+ * file could not be written.
+ */
+bool write_table(const std::string& path, prefix_t prefix, std::vector<std::pair<uint256, amount_list_t>>& txs);
+
+/**
+ * Append-only record of the outputs of transactions confirmed after the base
+ * amap was built, kept in a log file next to the base tables and indexed in
+ * memory. Without it, every output created since the amap was generated would
+ * have to be fetched over RPC.
+ *
+ * Once it has grown large enough, the delta is compacted, i.e. merged into
+ * the base tables, after which the log is emptied. Should that be
+ * interrupted, the log is still intact, and the next compaction simply merges
+ * it again.
+ */
+class delta {
+public:
+    /** Open the delta log at path, creating it if necessary. */
+    explicit delta(const std::string& path);
+    ~delta();
+
+    /** Append the outputs of the given tx to the log (no-op if already known). */
+    void add(const uint256& txid, const amount_list_t& amounts);
+
+    /** Flush appended records to disk. */
+    void flush();
+
+    /** Return the amounts for the given tx, or nullptr if it is not in the delta. */
+    const amount_list_t* find(const uint256& txid) const;
+
+    size_t size() const { return m_entries.size(); }
+
+    /**
+     * Merge all entries into the base tables of the given reader, then empty
+     * the log. Returns false (keeping the log) if a table could not be written.
+     */
+    bool compact(reader& base);
+
+private:
+    std::string m_path;
+    FILE* m_fp{nullptr};
+    tiny::hashmap<uint256, amount_list_t> m_entries;
+};
+
+/**
+ * The shared reader used by output_amount() and output_amounts(), opened at
+ * amap_path on first use.
+ */
+reader& shared_reader();
+
+/**
+ * The shared delta, checked by output_amount() and output_amounts() before
+ * the base tables, and fed by add_outputs(). Opened at amap_path/delta on
+ * first use.
+ */
+delta& shared_delta();
+
 /**
  * Fetch the output amount for the given transaction's output at the given index.
  * Returns -1 if the corresponding transaction could not be found.
  */
 CAmount output_amount(const uint256& txid, int index);
 
+/**
+ * Fetch all output amounts for the given transaction.
+ * Returns false if the corresponding transaction could not be found.
+ */
+bool output_amounts(const uint256& txid, amount_list_t& amounts_out);
+
+/**
+ * Record the outputs of newly confirmed transactions in the shared delta,
+ * compacting it into the base tables once it reaches delta_compact_threshold
+ * entries.
+ */
+void add_outputs(const std::vector<std::pair<uint256, amount_list_t>>& txs);
+
 } // namespace amap
 
 #endif // BITCOIN_AMAP_H
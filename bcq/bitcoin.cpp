@@ -115,6 +115,44 @@ void mff_analyzer::iterated(long starting_pos, long resulting_pos) {
     }
 }
 
+void mff_analyzer::process_events(const mff_event* events, size_t n) {
+    if (!n) return;
+    uint64_t counts[8] = {0};
+    uint64_t used[8] = {0};
+    // attributed as iterated() does: time_set events do not reach the delegate, so they
+    // count towards the command before them, as does a recorded tx's recording
+    uint8_t cmd = last_command;
+    bool recorded = cmd == mff::cmd_mempool_in && last_txs.size();
+    for (size_t i = 0; i < n; ++i) {
+        const mff_event& ev = events[i];
+        if (ev.cmd != mff::cmd_time_set) {
+            cmd = ev.cmd;
+            recorded = cmd == mff::cmd_mempool_in && ev.object;
+        }
+        long u = ev.resulting_pos - ev.starting_pos;
+        ++counts[cmd];
+        used[cmd] += u;
+        total_bytes += u;
+        if (recorded) {
+            total_txrecs++;
+            total_txrec_bytes += u;
+        }
+    }
+    for (uint8_t c = 0; c < 8; ++c) {
+        if (counts[c]) {
+            count[c] += counts[c];
+            usage[c] += used[c];
+        }
+    }
+    // leave the last_* state as it would be after the batch
+    for (size_t i = n; i-- > 0; ) {
+        if (events[i].cmd != mff::cmd_time_set) {
+            mff::deliver(events[i], *this);
+            break;
+        }
+    }
+}
+
 void mff_analyzer::populate_touched_txids(std::set<uint256>& txids) const {
     txids.clear();
     txids.insert(last_txids.begin(), last_txids.end());
@@ -133,4 +171,13 @@ void mff_analyzer::populate_touched_txids(std::set<uint256>& txids) const {
     if (last_mined_block) txids.insert(last_mined_block->m_hash);
 }
 
+void mff_analyzer::merge(const mff_analyzer& other) {
+    total_bytes += other.total_bytes;
+    total_txrecs += other.total_txrecs;
+    total_txrec_bytes += other.total_txrec_bytes;
+    for (const auto& u : other.usage) usage[u.first] += u.second;
+    for (const auto& c : other.count) count[c.first] += c.second;
+    for (const auto& t : other.touchmap) touchmap[t.first] += t.second;
+}
+
 } // namespace bitcoin
@@ -1,13 +1,19 @@
 #ifndef included_bcq_bitcoin_h_
 #define included_bcq_bitcoin_h_
 
+#include <algorithm>
 #include <map>
 
 #include <inttypes.h>
+#include <sys/stat.h>
+#include <unistd.h>
 
 #include <cqdb/cq.h>
 #include <uint256.h>
 
+#include <bcq/segfilter.h>
+#include <bcq/timeindex.h>
+
 #define BITCOIN_SER(T) \
     template<typename Stream> void serialize(Stream& stm, const T& t) { t.Serialize(stm); } \
     template<typename Stream> void deserialize(Stream& stm, T& t) { t.Unserialize(stm); }
@@ -215,14 +221,35 @@ public:
     }
 };
 
+struct mff_event;
+
+/**
+ * A delegate consuming events in batches (see mff::iterate_batch()), e.g. to
+ * aggregate over many events at once rather than paying for a handful of
+ * virtual calls per event.
+ */
+class mff_batch_delegate {
+public:
+    virtual ~mff_batch_delegate() {}
+
+    /**
+     * Process the given events, in recording order. The events (and the
+     * objects they point to) are only valid for the duration of the call.
+     */
+    virtual void process_events(const mff_event* events, size_t count) =0;
+};
+
 /**
  * The MFF delegate is the equivalent of a full node connected to a simulated bitcoin network
  * that receives transactions and blocks from "peers" around it.
  * The exception is that the full node may choose to not purge transactions, as recommendations
  * are made to the delegate directly.
  */
-class mff_delegate {
+class mff_delegate : public mff_batch_delegate {
 public:
+    /** Hands the events to the methods below, one at a time (see mff::dispatch()). */
+    virtual void process_events(const mff_event* events, size_t count) override;
+
     /**
      * Receive a new (or forgotten) transaction.
      *
@@ -273,6 +300,37 @@ public:
     virtual void iterated(long starting_pos, long resulting_pos) =0;
 };
 
+/**
+ * An event read from an MFF recording (see mff::read_event()). Which fields
+ * are set depends on cmd:
+ *
+ *   cmd_time_set             (none)
+ *   cmd_mempool_in           txid, and object, if the tx was recorded in full
+ *                            rather than referenced (i.e. the first time it
+ *                            is seen in the segment)
+ *   cmd_mempool_out          txid, reason, has_cause/cause
+ *   cmd_mempool_invalidated  txid, reason, has_cause/cause, rawtx
+ *   cmd_block_mined          mined (owned by the mff's chain), tx_hashes, height
+ *   cmd_block_unmined        height
+ *
+ * The others hold whatever they held before.
+ */
+struct mff_event {
+    uint8_t cmd{0};             //!< the command, without flags
+    long time{0};
+    long starting_pos{0};
+    long resulting_pos{0};
+    uint256 txid;
+    std::shared_ptr<tx> object;
+    uint8_t reason{0};
+    bool has_cause{false};
+    uint256 cause;
+    std::vector<uint8_t> rawtx;
+    std::set<uint256> tx_hashes;
+    const block* mined{nullptr};
+    uint32_t height{0};
+};
+
 class mff : public cq::chronology<uint256, tx> {
 public:
     static const uint8_t cmd_time_set               = 0x00;  // 0b00000
@@ -281,6 +339,7 @@ public:
     static const uint8_t cmd_mempool_invalidated    = 0x03;  // 0b00011
     static const uint8_t cmd_block_mined            = 0x04;  // 0b00100
     static const uint8_t cmd_block_unmined          = 0x05;  // 0b00101
+    static const uint8_t cmd_format                 = 0x06;  // 0b00110 (read_event() handles these itself)
     //                                                            ^^
     //                               "offender known" bit -------'  '------- "offender present" bit
     static const uint8_t cmd_flag_offender_present  = 1 <<3; // 0b01000
@@ -293,13 +352,65 @@ public:
     static const uint8_t reason_conflict = 0x04;
     static const uint8_t reason_replaced = 0x05;
 
+    /**
+     * Segment format versions. A segment starts out in format 1 (the
+     * original), unless its first event is a cmd_format marker giving the
+     * version. Format 2 frames the raw tx of cmd_mempool_invalidated events
+     * with an explicit length, so that readers not interested in them can
+     * skip past it. Segments are written in m_segment_format when begun.
+     * A writer resuming a segment (after load()) does not know the format
+     * it was begun in, so it puts a marker before the events it appends;
+     * a marker thus applies to the events following it, up to the next
+     * marker or the end of the segment, and may appear mid-segment. Readers
+     * always read segments from their start, so never miss one.
+     */
+    static const uint8_t format_original = 1;
+    static const uint8_t format_framed   = 2;
+    static const uint8_t format_current  = format_framed;
+
+    /** Event type masks for read_event() and iterate(), e.g. event_mask(cmd_block_mined) | event_mask(cmd_block_unmined). */
+    static constexpr uint8_t event_mask(uint8_t cmd) { return uint8_t(1 << cmd); }
+    static const uint8_t mask_all = 0x3f;
+
     uint64_t m_entries{0};
     chain m_chain;
     mff_delegate* m_delegate;
 
+    /** Sparse time index (see time_index); written while recording, used by seek_time() and seek_height(). */
+    time_index m_time_index;
+    /** Number of events between time index checkpoints (a checkpoint is also made at the start of every segment). */
+    uint32_t m_checkpoint_interval{1000};
+    /** Format segments are written in; format_original keeps new segments readable by readers predating format markers. */
+    uint8_t m_segment_format{format_current};
+
     mff(const std::string& dbpath, const std::string& prefix = "mff", uint32_t cluster_size = 2016, bool readonly = false)
-    : chronology<uint256, tx>(dbpath, prefix, cluster_size, readonly) {
+    : chronology<uint256, tx>(dbpath, prefix, cluster_size, readonly)
+    , m_time_index(time_index::path_for(dbpath, prefix)) {
         m_delegate = nullptr;
+        if (readonly) {
+            m_time_index.load();
+        } else if (!m_time_index.open_for_writing()) {
+            fprintf(stderr, "warning: unable to write time index %s\n", time_index::path_for(dbpath, prefix).c_str());
+        } else if (m_time_index.last()) {
+            m_max_time = m_time_index.last()->time;
+            m_max_height = m_time_index.last()->height;
+        }
+    }
+
+    ~mff() {
+        // a final checkpoint, so that the index covers the recording right up to its end
+        if (!m_readonly && m_file && m_events_since_checkpoint) add_checkpoint();
+        // the segment being filtered need not be the open one (e.g. if a new segment was begun,
+        // but nothing recorded in it yet); the open one is only ever appended to, so its position
+        // is its size, including anything not yet flushed
+        if (!m_readonly && !m_filter_path.empty()) {
+            struct stat st;
+            if (m_file && m_filter_path == m_file->get_path()) {
+                write_filter(m_file->tell());
+            } else if (!stat(m_filter_path.c_str(), &st)) {
+                write_filter(st.st_size);
+            }
+        }
     }
 
     static std::string detect_prefix(const std::string& dbpath);
@@ -310,7 +421,23 @@ public:
     // Writing
     //
 
+    /**
+     * Begin the given segment. A segment begun here has nothing in it yet,
+     * unlike the one left open by load(), so its format only needs a marker
+     * if it is not the original one (see begin_format()).
+     */
+    void begin_segment(cq::id segment_id) {
+        bool had_file = m_file != nullptr;
+        cq::id cluster = get_registry().m_current_cluster;
+        chronology<uint256, tx>::begin_segment(segment_id);
+        if (!had_file || cluster != get_registry().m_current_cluster) {
+            m_begun_cluster = get_registry().m_current_cluster;
+            m_has_begun = true;
+        }
+    }
+
     void unconfirm_tip(long timestamp) {
+        will_record(timestamp);
         push_event(timestamp, cmd_block_unmined);
         *m_file << m_chain.m_tip;
         m_chain.pop_tip();
@@ -320,18 +447,24 @@ public:
         ++m_entries;
         if (m_reg.m_tip < height - 1) begin_segment(height - 1);
         while (m_chain.m_tip && m_chain.m_tip >= height) unconfirm_tip(timestamp);
+        will_record(timestamp);
+        filter_add(hash);
+        for (const auto& x : txs) filter_add(x->m_hash);
         // note: this does not deal with invalidating txs which are double spends; that has to be handled
         // by the caller
         push_event(timestamp, cmd_block_mined, txs);
         hash.Serialize(*m_file);
         *m_file << height;
         m_chain.did_confirm(new block(height, hash, txs));
+        if (height > m_max_height) m_max_height = height;
         if (m_reg.m_tip < height) begin_segment(height);
         CHRON_DOT(this);
     }
 
     void tx_entered(long timestamp, std::shared_ptr<tx> x) {
         ++m_entries;
+        will_record(timestamp);
+        filter_add(x);
         push_event(timestamp, cmd_mempool_in, x, false /* do not refer -- record entire object, not its hash, if unknown */);
         CHRON_DOT(this);
     }
@@ -340,6 +473,9 @@ public:
         ++m_entries;
         bool offender_known = offender.get() && m_references.count(offender->m_hash);
         uint8_t cmd = cmd_mempool_out | (offender.get() ? cmd_flag_offender_present : 0) | (offender_known ? cmd_flag_offender_known : 0);
+        will_record(timestamp);
+        filter_add(x);
+        if (offender) filter_add(offender->m_hash);
         push_event(timestamp, cmd, x);
         *m_file << reason;
         OBREF(offender_known, offender);
@@ -350,10 +486,18 @@ public:
         ++m_entries;
         bool offender_known = offender.get() && m_references.count(offender->m_hash);
         uint8_t cmd = cmd_mempool_invalidated | (offender.get() ? cmd_flag_offender_present : 0) | (offender_known ? cmd_flag_offender_known : 0);
+        will_record(timestamp);
+        filter_add(x);
+        if (offender) filter_add(offender->m_hash);
         push_event(timestamp, cmd, x);
         *m_file << reason;
         OBREF(offender_known, offender);
-        *m_file << rawtx;
+        if (m_format >= format_framed) {
+            *m_file << cq::varint(rawtx.size());
+            m_file->write((const char*)rawtx.data(), rawtx.size());
+        } else {
+            *m_file << rawtx;
+        }
         CHRON_DOT(this);
     }
 
@@ -363,95 +507,267 @@ public:
 
     inline bool iterate() { return registry_iterate(m_file); }
 
-    bool registry_iterate(cq::file* file) override {
-        uint8_t cmd;
-        bool known;
-        auto pos = m_file->tell();
-        std::string f = m_file->get_path();
-        if (!pop_event(cmd, known)) return false;
-        if (m_current_time > 1600000000) {
-            fprintf(stderr, "invalid time!\n");
-            assert(0);
+    /**
+     * Read up to and including the next event whose type is in mask (see
+     * event_mask()), and hand it to the delegate, if any. Other events are
+     * not passed on, and their payloads are skipped rather than decoded,
+     * wherever the format allows it (see read_event()).
+     */
+    bool iterate(uint8_t mask) {
+        if (!read_event(m_event, mask)) return false;
+        if (m_delegate) dispatch(m_event, *m_delegate);
+        return true;
+    }
+
+    /**
+     * Move to the given checkpoint, by going to its segment and skipping ahead
+     * to its offset. The events in between are still decoded (without
+     * involving the delegate), as references may point to objects recorded
+     * earlier in the segment. If already in the checkpoint's cluster, at or
+     * before its offset, reading simply continues from there. An offset of 0
+     * means the first event in the cluster. Returns false if the checkpoint
+     * does not match the recording, in which case the position is undefined.
+     */
+    bool goto_checkpoint(const checkpoint& cp) {
+        if (!m_file || get_registry().m_current_cluster != cp.cluster || cp.offset == 0 || m_file->tell() > cp.offset) {
+            goto_segment(cp.segment);
+            if (!m_file || get_registry().m_current_cluster != cp.cluster) return false;
+            if (cp.offset == 0) return true;
         }
-        if (f != m_file->get_path()) { pos = m_file->tell() - 1; }
-        uint8_t no_offender_cmd = cmd & 0x07;
+        std::string path = m_file->get_path();
+        bool wanted;
+        while (m_file->tell() < cp.offset && m_file->get_path() == path && next_event(m_event, 0, wanted)) {}
+        return m_file->get_path() == path && m_file->tell() == cp.offset;
+    }
 
-        std::shared_ptr<tx> x = std::make_shared<tx>(this);
+    /**
+     * Move to the last checkpoint before anything at or after the given time
+     * was recorded. Returns false if there is no such checkpoint (e.g. because
+     * the recording has no time index), in which case the caller has to find
+     * its way by other means (e.g. rewind()).
+     */
+    bool seek_time(int64_t time) {
+        const checkpoint* cp = m_time_index.before_time(time);
+        return cp && goto_checkpoint(*cp);
+    }
+
+    /** Move to the last checkpoint before the block at the given height was confirmed; see seek_time(). */
+    bool seek_height(uint32_t height) {
+        const checkpoint* cp = m_time_index.before_height(height);
+        return cp && goto_checkpoint(*cp);
+    }
 
+    /**
+     * Read the next event whose type is in mask (see event_mask()) into ev,
+     * without involving the delegate. ev is meant to be reused from one event
+     * to the next: the fields relevant to the event's command are set (see
+     * mff_event), and the buffers in it keep their capacity, so that events
+     * which do not carry a recorded tx do not allocate anything once the
+     * buffers have warmed up.
+     *
+     * Events of other types are read past, with only what is needed to keep
+     * the reader's state (references, chain) up to date decoded; notably,
+     * the raw tx of a cmd_mempool_invalidated event is skipped rather than
+     * read, in segments of format 2 or later. Recorded txs are always
+     * decoded, as later references may point to them.
+     */
+    bool read_event(mff_event& ev, uint8_t mask = mask_all) {
+        bool wanted;
+        do {
+            if (!next_event(ev, mask, wanted)) return false;
+        } while (!wanted);
+        return true;
+    }
+
+    /**
+     * Read up to and including the next event whose type is in mask, and
+     * hand it to the given delegate, whose methods are called as members of
+     * D rather than through mff_delegate, so that they can be inlined (see
+     * mff_static_delegate).
+     */
+    template<typename D>
+    bool iterate_static(D& delegate, uint8_t mask = mask_all) {
+        if (!read_event(m_event, mask)) return false;
+        dispatch(m_event, delegate);
+        return true;
+    }
+
+    /**
+     * Hand a read event to the given delegate; D is an mff_delegate, or
+     * anything with the same methods, such as an mff_static_delegate.
+     */
+    template<typename D>
+    static void dispatch(const mff_event& ev, D& delegate) {
+        deliver(ev, delegate);
+        delegate.iterated(ev.starting_pos, ev.resulting_pos);
+    }
+
+    /** Call the delegate method for the given event, as dispatch() does, but not iterated(); time_set events have none. */
+    template<typename D>
+    static void deliver(const mff_event& ev, D& delegate) {
+        switch (ev.cmd) {
+        case cmd_mempool_in:
+            if (ev.object) delegate.receive_transaction(ev.object); else delegate.receive_transaction_with_txid(ev.txid);
+            break;
+        case cmd_mempool_out:
+            delegate.forget_transaction_with_txid(ev.txid, ev.reason);
+            break;
+        case cmd_mempool_invalidated:
+            delegate.discard_transaction_with_txid(ev.txid, ev.rawtx, ev.reason, ev.has_cause ? &ev.cause : nullptr);
+            break;
+        case cmd_block_mined:
+            delegate.block_confirmed(*ev.mined);
+            break;
+        case cmd_block_unmined:
+            delegate.block_reorged(ev.height);
+            break;
+        }
+    }
+
+    /**
+     * Read up to max events whose type is in mask into events, which is
+     * grown to hold max events if needed; the events in it are reused as in
+     * read_event(). Returns the number of events read, which is less than
+     * max at the end of the recording, and also after a block is mined, so
+     * that the block (see mff_event::mined) is still around until the batch
+     * has been processed.
+     */
+    size_t read_events(std::vector<mff_event>& events, size_t max, uint8_t mask = mask_all) {
+        if (events.size() < max) events.resize(max);
+        size_t count = 0;
+        while (count < max && read_event(events[count], mask)) {
+            if (events[count++].cmd == cmd_block_mined) break;
+        }
+        return count;
+    }
+
+    /** Read a batch of up to max events (see read_events()) and hand it to delegate. Returns the number of events processed. */
+    size_t iterate_batch(mff_batch_delegate& delegate, size_t max = 256, uint8_t mask = mask_all) {
+        size_t count = read_events(m_batch, max, mask);
+        if (count) delegate.process_events(m_batch.data(), count);
+        return count;
+    }
+
+    bool registry_iterate(cq::file* file) override {
+        if (!read_event(m_event)) return false;
+        if (m_delegate) dispatch(m_event, *m_delegate);
+        return true;
+    }
+
+private:
+    mff_event m_event;  // used by iterate()
+    std::vector<mff_event> m_batch;  // used by iterate_batch()
+
+    uint8_t m_format{format_original};  // format of the segment being read or written
+    bool m_has_format{false};
+    cq::id m_format_cluster{0};         // the cluster m_format applies to
+    bool m_has_begun{false};
+    cq::id m_begun_cluster{0};          // the last cluster begun (rather than resumed) by begin_segment()
+
+    /**
+     * Read the next event into ev; the payload is only decoded (and wanted
+     * set) if the event type is in mask. Format markers are consumed here,
+     * and never returned as events.
+     */
+    bool next_event(mff_event& ev, uint8_t mask, bool& wanted) {
+        uint8_t cmd;
+        bool known;
         try {
-            switch (no_offender_cmd) {
+            for (;;) {
+                ev.starting_pos = m_file->tell();
+                cq::id cluster = get_registry().m_current_cluster;
+                if (!pop_event(cmd, known)) return false;
+                if (m_current_time > 1600000000) {
+                    fprintf(stderr, "invalid time!\n");
+                    assert(0);
+                }
+                if (cluster != get_registry().m_current_cluster) { ev.starting_pos = m_file->tell() - 1; }
+                if (!m_has_format || m_format_cluster != get_registry().m_current_cluster) {
+                    // a segment without a marker is in the original format
+                    m_format = format_original;
+                    m_format_cluster = get_registry().m_current_cluster;
+                    m_has_format = true;
+                }
+                if ((cmd & 0x07) != cmd_format) break;
+                *m_file >> m_format;
+                if (m_format > format_current) {
+                    fprintf(stderr, "unsupported segment format %u\n", m_format);
+                    throw std::runtime_error("unsupported segment format");
+                }
+            }
+            ev.cmd = cmd & 0x07;
+            ev.time = m_current_time;
+            wanted = (mask & event_mask(ev.cmd)) != 0;
+            ev.object.reset();
+            ev.has_cause = false;
+            ev.mined = nullptr;
+
+            switch (ev.cmd) {
             case cmd_time_set: break; // nothing needs to be done; the time update has already happened
 
             case cmd_mempool_in: {
                 if (known) {
                     auto ref = pop_reference();
-                    const uint256& txid = m_dictionary.at(ref)->m_hash;
-                    if (m_delegate) m_delegate->receive_transaction_with_txid(txid);
+                    if (wanted) ev.txid = m_dictionary.at(ref)->m_hash;
                 } else {
-                    auto o = pop_object();
-                    if (m_delegate) m_delegate->receive_transaction(o);
-                }
-            } break;
-
-            case cmd_mempool_out: {
-                bool offender_present = (cmd & cmd_flag_offender_present) > 0;
-                bool offender_known = (cmd & cmd_flag_offender_known) > 0;
-                uint256 txid = FERBO(known, txid);
-                uint8_t reason;
-                *m_file >> reason;
-                // uint256* offender_hash = nullptr;
-                uint256 offender_hash_rv;
-                if (offender_present) {
-                    offender_hash_rv = FERBO(offender_known, offender_hash_rv);
-                    // offender_hash = &offender_hash_rv;
+                    // registers the tx, so it has to be decoded either way
+                    auto object = pop_object();
+                    if (wanted) {
+                        ev.object = object;
+                        ev.txid = object->m_hash;
+                    }
                 }
-                if (m_delegate) m_delegate->forget_transaction_with_txid(txid, reason);
             } break;
 
+            case cmd_mempool_out:
             case cmd_mempool_invalidated: {
                 bool offender_present = (cmd & cmd_flag_offender_present) > 0;
                 bool offender_known = (cmd & cmd_flag_offender_known) > 0;
                 uint256 txid = FERBO(known, txid);
-                uint8_t reason;
-                std::vector<uint8_t> rawtx;
-                *m_file >> reason;
-                uint256* offender_hash = nullptr;
-                uint256 offender_hash_rv;
+                ev.txid = txid;
+                *m_file >> ev.reason;
                 if (offender_present) {
-                    offender_hash_rv = FERBO(offender_known, offender_hash_rv);
-                    offender_hash = &offender_hash_rv;
+                    uint256 offender_hash_rv = FERBO(offender_known, offender_hash_rv);
+                    ev.cause = offender_hash_rv;
+                    ev.has_cause = true;
+                }
+                if (ev.cmd == cmd_mempool_invalidated) {
+                    ev.rawtx.clear();
+                    if (m_format < format_framed) {
+                        *m_file >> ev.rawtx;
+                    } else {
+                        uint64_t len = cq::varint::load(m_file);
+                        if (wanted) {
+                            ev.rawtx.resize(len);
+                            m_file->read((char*)ev.rawtx.data(), len);
+                        } else {
+                            m_file->seek(m_file->tell() + len, SEEK_SET);
+                        }
+                    }
                 }
-                *m_file >> rawtx;
-                if (m_delegate) m_delegate->discard_transaction_with_txid(txid, rawtx, reason, offender_hash);
             } break;
 
             case cmd_block_mined: {
                 uint256 hash;
-                auto pos = m_file->tell();
-                uint32_t height;
-                std::set<uint256> tx_hashes;
-                pop_reference_hashes(tx_hashes);
+                ev.tx_hashes.clear();
+                pop_reference_hashes(ev.tx_hashes);
                 hash.Unserialize(*m_file);
-                *m_file >> height;
-                block* b = new block(height, hash, tx_hashes);
+                *m_file >> ev.height;
+                // the chain is kept up to date even if blocks are not wanted, as it is part of the reader's state
+                block* b = new block(ev.height, hash, ev.tx_hashes);
                 m_chain.did_confirm(b);
-                // fprintf(stderr, "- %ld: mined %u [%zu]\n", pos, height, m_chain.get_blocks().size());
-                if (m_delegate) m_delegate->block_confirmed(*b);
+                ev.mined = b;
             } break;
 
             case cmd_block_unmined: {
-                uint32_t unmined_height;
-                auto pos = m_file->tell();
-                *m_file >> unmined_height;
-                // fprintf(stderr, "- %ld: unmining %u [%zu]\n", pos, unmined_height, m_chain.get_blocks().size());
+                *m_file >> ev.height;
                 // the assert below is not valid in cases where the reorg'd block is before the recording began
-                // assert(unmined_height == m_chain.m_tip);
+                // assert(ev.height == m_chain.m_tip);
                 m_chain.pop_tip();
-                if (m_delegate) m_delegate->block_reorged(unmined_height);
             } break;
 
             default:
-                fprintf(stderr, "invalid command: %02x\n", no_offender_cmd);
+                fprintf(stderr, "invalid command: %02x\n", ev.cmd);
                 throw std::runtime_error("invalid command");
             }
         } catch (const cq::io_error& err) {
@@ -463,12 +779,125 @@ public:
             // if readwrite mode, though, we want to die
             throw err;
         }
-        assert(pos < m_file->tell());
-        if (m_delegate) m_delegate->iterated(pos, m_file->tell());
+        ev.resulting_pos = m_file->tell();
+        assert(ev.starting_pos < ev.resulting_pos);
         return true;
     }
+
+    bool m_has_checkpoint{false};
+    uint32_t m_events_since_checkpoint{0};
+    cq::id m_checkpoint_cluster{0};
+    int64_t m_max_time{0};
+    uint32_t m_max_height{0};
+
+    void add_checkpoint() {
+        checkpoint cp;
+        cp.time = std::max<int64_t>(m_max_time, m_current_time);
+        cp.height = std::max(m_max_height, m_chain.m_tip);
+        cp.segment = m_reg.m_tip;
+        cp.cluster = get_registry().m_current_cluster;
+        cp.offset = m_file->tell();
+        m_time_index.add(cp);
+        m_has_checkpoint = true;
+        m_events_since_checkpoint = 0;
+        m_checkpoint_cluster = cp.cluster;
+    }
+
+    /**
+     * Mark the events written from here on as being in m_segment_format. A
+     * segment just begun needs no marker for the original format; a resumed
+     * one always gets one, as the format of the events before it is unknown.
+     */
+    void begin_format(long timestamp, bool resumed) {
+        if (resumed || m_segment_format > format_original) {
+            push_event(timestamp, cmd_format);
+            *m_file << m_segment_format;
+        }
+        m_format = m_segment_format;
+        m_format_cluster = get_registry().m_current_cluster;
+        m_has_format = true;
+    }
+
+    /**
+     * Called before recording an event; marks the format of a new or resumed
+     * segment, adds a time index checkpoint, if one is due, and moves the
+     * segment filter along when the segment changes.
+     */
+    void will_record(long timestamp) {
+        cq::id cluster = get_registry().m_current_cluster;
+        if (!m_has_format || m_format_cluster != cluster) begin_format(timestamp, !m_has_begun || m_begun_cluster != cluster);
+        bool new_segment = !m_has_checkpoint || get_registry().m_current_cluster != m_checkpoint_cluster;
+        if (new_segment) segment_changed(m_has_checkpoint);
+        if (new_segment || m_events_since_checkpoint >= m_checkpoint_interval) add_checkpoint();
+        ++m_events_since_checkpoint;
+        if (timestamp > m_max_time) m_max_time = timestamp;
+    }
+
+    /** Path of the segment whose filter is being collected, or empty if the segment is not being filtered. */
+    std::string m_filter_path;
+    std::vector<uint64_t> m_filter_keys;
+
+    void filter_add(const uint256& hash) {
+        if (!m_filter_path.empty()) m_filter_keys.push_back(segment_filter::fingerprint(hash));
+    }
+
+    void filter_add(const std::shared_ptr<tx>& x) {
+        if (m_filter_path.empty()) return;
+        filter_add(x->m_hash);
+        for (const auto& in : x->m_vin) if (!in.m_txid.IsNull()) filter_add(in.m_txid);
+    }
+
+    void write_filter(uint64_t covered_size) {
+        segment_filter filter;
+        filter.build(m_filter_keys);
+        if (!filter.save(m_filter_path, covered_size)) fprintf(stderr, "warning: unable to write segment filter for %s\n", m_filter_path.c_str());
+        m_filter_keys.clear();
+        m_filter_path.clear();
+    }
+
+    /**
+     * Called when recording moves on to another segment. A filter is only
+     * collected for a segment started while recording, as events recorded
+     * earlier (e.g. before a restart) are not known; any existing filter for
+     * such a segment is removed, as it is about to become outdated (see
+     * mff-build-filters for filling in the gaps).
+     */
+    void segment_changed(bool started_while_recording) {
+        if (!m_filter_path.empty()) {
+            // the previous segment is complete; it was closed when the new one began
+            struct stat st;
+            if (!stat(m_filter_path.c_str(), &st)) write_filter(st.st_size);
+            m_filter_path.clear();
+            m_filter_keys.clear();
+        }
+        if (started_while_recording) {
+            m_filter_path = m_file->get_path();
+        } else {
+            unlink(segment_filter::path_for(m_file->get_path()).c_str());
+        }
+    }
+};
+
+/**
+ * A base for delegates used with mff::iterate_static(). Its methods are the
+ * counterparts of those of mff_delegate, but not virtual, and do nothing; a
+ * delegate derived from it defines the ones it needs, and calls to the rest
+ * compile away.
+ */
+struct mff_static_delegate {
+    void receive_transaction(const std::shared_ptr<tx>& x) {}
+    void receive_transaction_with_txid(const uint256& txid) {}
+    void forget_transaction_with_txid(const uint256& txid, uint8_t reason) {}
+    void discard_transaction_with_txid(const uint256& txid, const std::vector<uint8_t>& rawtx, uint8_t reason, const uint256* cause) {}
+    void block_confirmed(const block& b) {}
+    void block_reorged(uint32_t height) {}
+    void iterated(long starting_pos, long resulting_pos) {}
 };
 
+inline void mff_delegate::process_events(const mff_event* events, size_t count) {
+    for (size_t i = 0; i < count; ++i) mff::dispatch(events[i], *this);
+}
+
 static const std::string reasons[] = {"unknown", "expired", "sizelimit", "reorg", "conflict", "replaced", "???????????????????"};
 inline const std::string& reason_string(uint8_t reason) {
     return reasons[reason < 6 ? reason : 6];
@@ -492,7 +921,7 @@ public:
     std::vector<uint256> last_txids;
     std::vector<std::shared_ptr<tx>> last_txs;
     std::vector<uint8_t> last_rawtx;
-    uint8_t last_command;
+    uint8_t last_command{mff::cmd_time_set}; // until anything else is read
     uint8_t last_reason;
     uint256 last_cause;
     const block* last_mined_block;
@@ -510,8 +939,23 @@ public:
 
     virtual void iterated(long starting_pos, long resulting_pos) override;
 
+    /**
+     * Gather the statistics of a whole batch at once, attributed to the
+     * same commands as iterated() would. The last_* state is only updated
+     * for the last event in the batch, so this is not for use with
+     * populate_touched_txids().
+     */
+    virtual void process_events(const mff_event* events, size_t count) override;
+
     void populate_touched_txids(std::set<uint256>& txids) const;
 
+    /**
+     * Add the statistics (usage, count, touchmap and totals) of another
+     * analyzer, e.g. one which analyzed a different segment (see
+     * segment_scanner). The last_* state is left alone.
+     */
+    void merge(const mff_analyzer& other);
+
 };
 
 } // namespace bitcoin
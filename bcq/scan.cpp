@@ -0,0 +1,21 @@
+#include <bcq/scan.h>
+
+#include <algorithm>
+
+namespace bitcoin {
+
+bool list_segments(const std::string& dbpath, const std::string& prefix, std::vector<segment_info>& segments) {
+    std::vector<std::string> list;
+    if (!cq::listdir(dbpath, list)) return false;
+    for (const std::string& f : list) {
+        // <prefix>NNNNN.cq
+        if (f.size() != prefix.size() + 8 || f.compare(0, prefix.size(), prefix) || f.substr(f.size() - 3) != ".cq") continue;
+        std::string digits = f.substr(prefix.size(), 5);
+        if (digits.find_first_not_of("0123456789") != std::string::npos) continue;
+        segments.push_back(segment_info{(cq::id)atoll(digits.c_str()), dbpath + "/" + f});
+    }
+    std::sort(segments.begin(), segments.end(), [](const segment_info& a, const segment_info& b) { return a.cluster < b.cluster; });
+    return true;
+}
+
+} // namespace bitcoin
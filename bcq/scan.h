@@ -0,0 +1,118 @@
+#ifndef included_bcq_scan_h_
+#define included_bcq_scan_h_
+
+#include <atomic>
+#include <functional>
+#include <map>
+#include <memory>
+#include <mutex>
+#include <thread>
+
+#include <bcq/bitcoin.h>
+
+namespace bitcoin {
+
+struct segment_info {
+    cq::id cluster;
+    std::string path;
+};
+
+/** List the segments (<prefix>NNNNN.cq) of the recording at dbpath, in recording order. */
+bool list_segments(const std::string& dbpath, const std::string& prefix, std::vector<segment_info>& segments);
+
+/**
+ * Runs a delegate over every segment of a recording, on a pool of worker
+ * threads. Every segment is read by a read-only mff of its own, with a
+ * delegate of its own (a copy of the prototype given to run()), and the
+ * delegates are then merged into the result, in recording order, so the
+ * result does not depend on the number of threads or how the work was
+ * spread out.
+ *
+ * D is an mff_delegate with a copy constructor and a
+ *
+ *     void merge(const D& other)
+ *
+ * which folds the results of other (covering the segments right after the
+ * ones covered so far) into it, e.g. mff_analyzer.
+ *
+ * Segments are read independently, so the mff state carried over from one
+ * segment to the next (such as the chain tip) starts out blank for every
+ * segment; delegates relying on it see what a reader starting at that
+ * segment (e.g. with goto_segment()) would see.
+ */
+template<typename D>
+class segment_scanner {
+public:
+    /** Called after every event, e.g. for mff_analyzer::populate_touched_txids(). */
+    std::function<void(mff&, D&)> m_on_event;
+
+    /** Called once a segment has been scanned (from the worker thread). */
+    std::function<void(const segment_info&, const D&)> m_on_segment;
+
+    segment_scanner(const std::string& dbpath, const std::string& prefix, uint32_t cluster_size = 2016, size_t threads = 0)
+    : m_dbpath(dbpath), m_prefix(prefix), m_cluster_size(cluster_size), m_threads(threads ? threads : std::max(1u, std::thread::hardware_concurrency())) {}
+
+    /** Scan all segments; result starts out as a copy of prototype. Returns false if there are no segments. */
+    bool run(const D& prototype, D& result) {
+        std::vector<segment_info> segments;
+        if (!list_segments(m_dbpath, m_prefix, segments) || segments.empty()) return false;
+        result = prototype;
+
+        std::atomic<size_t> next{0};
+        std::mutex mutex;
+        std::map<size_t, std::unique_ptr<D>> done;  // scanned, but not yet merged
+        size_t merged = 0;
+
+        auto worker = [&]() {
+            for (size_t i = next++; i < segments.size(); i = next++) {
+                std::unique_ptr<D> delegate(new D(prototype));
+                scan(segments[i], *delegate);
+                if (m_on_segment) m_on_segment(segments[i], *delegate);
+                std::lock_guard<std::mutex> lock(mutex);
+                done[i].reset(delegate.release());
+                // merge everything which is next in line; the rest waits for the segments before it
+                while (!done.empty() && done.begin()->first == merged) {
+                    result.merge(*done.begin()->second);
+                    done.erase(done.begin());
+                    ++merged;
+                }
+            }
+        };
+
+        std::vector<std::thread> pool;
+        size_t threads = std::min(m_threads, segments.size());
+        for (size_t i = 1; i < threads; ++i) pool.emplace_back(worker);
+        worker();
+        for (auto& t : pool) t.join();
+        return true;
+    }
+
+private:
+    std::string m_dbpath;
+    std::string m_prefix;
+    uint32_t m_cluster_size;
+    size_t m_threads;
+
+    void scan(const segment_info& segment, D& delegate) {
+        struct stat st;
+        if (stat(segment.path.c_str(), &st)) return;
+        mff f(m_dbpath, m_prefix, m_cluster_size, true);
+        f.load();
+        f.goto_segment(segment.cluster * m_cluster_size);
+        if (!f.m_file || f.get_registry().m_current_cluster != segment.cluster) {
+            fprintf(stderr, "unable to go to segment %s\n", segment.path.c_str());
+            return;
+        }
+        f.m_delegate = &delegate;
+        // stop at the end of the segment, rather than reading on into the next one
+        while (f.m_file->tell() < st.st_size && f.iterate()) {
+            // only a truncated event at the very end would take us past it
+            if (f.get_registry().m_current_cluster != segment.cluster) break;
+            if (m_on_event) m_on_event(f, delegate);
+        }
+    }
+};
+
+} // namespace bitcoin
+
+#endif // included_bcq_scan_h_
@@ -0,0 +1,107 @@
+#include <bcq/segfilter.h>
+
+#include <algorithm>
+#include <cstring>
+
+#include <stdio.h>
+#include <sys/stat.h>
+
+#include <crypto/common.h>
+
+namespace bitcoin {
+
+static const uint8_t FLT_MAGIC[8] = {'M', 'F', 'F', 'F', 'L', 'T', 0, 1};
+static const size_t FLT_HEADER_SIZE = sizeof(FLT_MAGIC) + 8 + 8;
+
+std::string segment_filter::path_for(const std::string& segment_path) {
+    size_t len = segment_path.size();
+    if (len > 3 && segment_path.compare(len - 3, 3, ".cq") == 0) return segment_path.substr(0, len - 3) + ".flt";
+    return segment_path + ".flt";
+}
+
+uint64_t segment_filter::fingerprint(const uint256& key) {
+    return ReadLE64(key.begin());
+}
+
+static inline void positions(uint64_t fp, uint64_t& h1, uint64_t& h2) {
+    // double hashing; h2 is odd, so the probes never collapse onto a single bit
+    h1 = fp;
+    h2 = ((fp >> 32) | (fp << 32)) | 1;
+}
+
+void segment_filter::build(std::vector<uint64_t>& fingerprints) {
+    std::sort(fingerprints.begin(), fingerprints.end());
+    fingerprints.erase(std::unique(fingerprints.begin(), fingerprints.end()), fingerprints.end());
+    uint64_t words = std::max<uint64_t>(1, (fingerprints.size() * bits_per_key + 63) / 64);
+    m_bits.assign(words, 0);
+    uint64_t nbits = words * 64;
+    for (uint64_t fp : fingerprints) {
+        uint64_t h1, h2;
+        positions(fp, h1, h2);
+        for (uint32_t i = 0; i < hash_count; ++i) {
+            uint64_t bit = (h1 + i * h2) % nbits;
+            m_bits[bit >> 6] |= uint64_t(1) << (bit & 63);
+        }
+    }
+}
+
+bool segment_filter::may_contain(const uint256& key) const {
+    if (m_bits.empty()) return true;
+    uint64_t nbits = m_bits.size() * 64;
+    uint64_t h1, h2;
+    positions(fingerprint(key), h1, h2);
+    for (uint32_t i = 0; i < hash_count; ++i) {
+        uint64_t bit = (h1 + i * h2) % nbits;
+        if (!(m_bits[bit >> 6] & (uint64_t(1) << (bit & 63)))) return false;
+    }
+    return true;
+}
+
+bool segment_filter::save(const std::string& segment_path, uint64_t covered_size) const {
+    std::string path = path_for(segment_path);
+    std::string tmp = path + ".tmp";
+    FILE* fp = fopen(tmp.c_str(), "wb");
+    if (!fp) return false;
+    uint8_t header[FLT_HEADER_SIZE];
+    memcpy(header, FLT_MAGIC, sizeof(FLT_MAGIC));
+    WriteLE64(header + 8, covered_size);
+    WriteLE64(header + 16, m_bits.size());
+    bool ok = fwrite(header, 1, sizeof(header), fp) == sizeof(header);
+    uint8_t buf[8];
+    for (size_t i = 0; ok && i < m_bits.size(); ++i) {
+        WriteLE64(buf, m_bits[i]);
+        ok = fwrite(buf, 1, 8, fp) == 8;
+    }
+    if (fclose(fp) || !ok || rename(tmp.c_str(), path.c_str())) {
+        remove(tmp.c_str());
+        return false;
+    }
+    return true;
+}
+
+bool segment_filter::load(const std::string& segment_path) {
+    m_bits.clear();
+    struct stat st;
+    if (stat(segment_path.c_str(), &st)) return false;
+    FILE* fp = fopen(path_for(segment_path).c_str(), "rb");
+    if (!fp) return false;
+    uint8_t header[FLT_HEADER_SIZE];
+    bool ok = fread(header, 1, sizeof(header), fp) == sizeof(header) && !memcmp(header, FLT_MAGIC, sizeof(FLT_MAGIC));
+    // a filter for an earlier version of the segment may be missing keys, so it is as good as none
+    ok = ok && ReadLE64(header + 8) == (uint64_t)st.st_size;
+    uint64_t words = ok ? ReadLE64(header + 16) : 0;
+    ok = ok && words > 0 && words <= (uint64_t)st.st_size * 8;
+    if (ok) {
+        m_bits.resize(words);
+        uint8_t buf[8];
+        for (size_t i = 0; ok && i < words; ++i) {
+            ok = fread(buf, 1, 8, fp) == 8;
+            m_bits[i] = ReadLE64(buf);
+        }
+    }
+    fclose(fp);
+    if (!ok) m_bits.clear();
+    return ok;
+}
+
+} // namespace bitcoin
@@ -0,0 +1,54 @@
+#ifndef included_bcq_segfilter_h_
+#define included_bcq_segfilter_h_
+
+#include <string>
+#include <vector>
+
+#include <inttypes.h>
+
+#include <uint256.h>
+
+namespace bitcoin {
+
+/**
+ * Bloom filter of the txids (and block hashes) touched by the events in an
+ * MFF segment, kept as a sidecar file (<prefix>NNNNN.flt) next to the segment
+ * (<prefix>NNNNN.cq). A reader looking for a given txid can skip every
+ * segment whose filter says it is not there.
+ *
+ * The filter records the size of the segment file it was built from, and
+ * a filter for a segment which has since changed is ignored, so a filter
+ * never causes a segment containing a txid to be skipped. Filters are sized
+ * at roughly 10 bits per key, which gives about 1% false positives.
+ */
+class segment_filter {
+public:
+    static const uint32_t bits_per_key = 10;
+    static const uint32_t hash_count = 7;
+
+    /** The filter path for the given segment path (<prefix>NNNNN.cq -> <prefix>NNNNN.flt). */
+    static std::string path_for(const std::string& segment_path);
+
+    /** Keys are txids, which are uniformly distributed already, so the fingerprint is simply part of the key. */
+    static uint64_t fingerprint(const uint256& key);
+
+    /** Build the filter from the given fingerprints (which are sorted and deduplicated in the process). */
+    void build(std::vector<uint64_t>& fingerprints);
+
+    /** Write the filter for the given segment, whose file is covered_size bytes. */
+    bool save(const std::string& segment_path, uint64_t covered_size) const;
+
+    /** Load the filter for the given segment. Returns false if there is none, or if the segment has changed since. */
+    bool load(const std::string& segment_path);
+
+    bool may_contain(const uint256& key) const;
+
+    size_t size() const { return m_bits.size() * 64; }
+
+private:
+    std::vector<uint64_t> m_bits;
+};
+
+} // namespace bitcoin
+
+#endif // included_bcq_segfilter_h_
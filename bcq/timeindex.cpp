@@ -0,0 +1,94 @@
+#include <bcq/timeindex.h>
+
+#include <algorithm>
+#include <cstring>
+
+#include <unistd.h>
+
+#include <crypto/common.h>
+
+namespace bitcoin {
+
+static const uint8_t TIX_MAGIC[8] = {'M', 'F', 'F', 'T', 'I', 'X', 0, 1};
+
+static void encode(const checkpoint& cp, uint8_t* buf) {
+    WriteLE64(buf, cp.time);
+    WriteLE32(buf + 8, cp.height);
+    WriteLE32(buf + 12, cp.segment);
+    WriteLE64(buf + 16, cp.cluster);
+    WriteLE64(buf + 24, cp.offset);
+}
+
+static void decode(const uint8_t* buf, checkpoint& cp) {
+    cp.time = ReadLE64(buf);
+    cp.height = ReadLE32(buf + 8);
+    cp.segment = ReadLE32(buf + 12);
+    cp.cluster = ReadLE64(buf + 16);
+    cp.offset = ReadLE64(buf + 24);
+}
+
+time_index::~time_index() {
+    if (m_fp) fclose(m_fp);
+}
+
+long time_index::read() {
+    m_checkpoints.clear();
+    FILE* fp = fopen(m_path.c_str(), "rb");
+    if (!fp) return -1;
+    uint8_t buf[checkpoint::serialized_size];
+    if (fread(buf, 1, sizeof(TIX_MAGIC), fp) != sizeof(TIX_MAGIC) || memcmp(buf, TIX_MAGIC, sizeof(TIX_MAGIC))) {
+        fclose(fp);
+        return -1;
+    }
+    while (fread(buf, 1, sizeof(buf), fp) == sizeof(buf)) {
+        m_checkpoints.emplace_back();
+        decode(buf, m_checkpoints.back());
+    }
+    fclose(fp);
+    return sizeof(TIX_MAGIC) + m_checkpoints.size() * checkpoint::serialized_size;
+}
+
+bool time_index::load() {
+    return read() != -1;
+}
+
+bool time_index::open_for_writing() {
+    long valid = read();
+    if (valid == -1) {
+        // no index, or something else entirely; start over
+        m_fp = fopen(m_path.c_str(), "wb");
+        if (!m_fp || fwrite(TIX_MAGIC, 1, sizeof(TIX_MAGIC), m_fp) != sizeof(TIX_MAGIC)) return false;
+        return true;
+    }
+    // drop a partial record, if any
+    if (truncate(m_path.c_str(), valid)) return false;
+    m_fp = fopen(m_path.c_str(), "ab");
+    return m_fp != nullptr;
+}
+
+void time_index::add(const checkpoint& cp) {
+    m_checkpoints.push_back(cp);
+    if (!m_fp) return;
+    uint8_t buf[checkpoint::serialized_size];
+    encode(cp, buf);
+    if (fwrite(buf, 1, sizeof(buf), m_fp) != sizeof(buf)) {
+        fprintf(stderr, "failed to write to time index %s\n", m_path.c_str());
+    }
+}
+
+void time_index::flush() {
+    if (m_fp) fflush(m_fp);
+}
+
+const checkpoint* time_index::before_time(int64_t time) const {
+    // checkpoint times never decrease, so the ones below the given time are all up front
+    auto it = std::lower_bound(m_checkpoints.begin(), m_checkpoints.end(), time, [](const checkpoint& cp, int64_t t) { return cp.time < t; });
+    return it == m_checkpoints.begin() ? nullptr : &*(it - 1);
+}
+
+const checkpoint* time_index::before_height(uint32_t height) const {
+    auto it = std::lower_bound(m_checkpoints.begin(), m_checkpoints.end(), height, [](const checkpoint& cp, uint32_t h) { return cp.height < h; });
+    return it == m_checkpoints.begin() ? nullptr : &*(it - 1);
+}
+
+} // namespace bitcoin
@@ -0,0 +1,80 @@
+#ifndef included_bcq_timeindex_h_
+#define included_bcq_timeindex_h_
+
+#include <string>
+#include <vector>
+
+#include <inttypes.h>
+#include <stdio.h>
+
+namespace bitcoin {
+
+/**
+ * A point in an MFF recording at which reading can be resumed.
+ *
+ * time and height are the highest timestamp and block height encountered
+ * before the checkpoint (rather than the current ones), so that they never go
+ * backwards, even across reorgs; this means that nothing at or after a given
+ * time or height happened before a checkpoint whose time or height is below
+ * it.
+ */
+struct checkpoint {
+    int64_t time{0};
+    uint32_t height{0};
+    uint32_t segment{0};    //!< the registry tip, as given to goto_segment()
+    uint64_t cluster{0};    //!< the cluster of the segment file
+    int64_t offset{0};      //!< position of the next event in the segment file
+
+    static const size_t serialized_size = 8 + 4 + 4 + 8 + 8;
+};
+
+/**
+ * Sparse time (and height) index of an MFF recording, kept as a sidecar file
+ * (<dbpath>/<prefix>.tix) next to the segments. The writer adds a checkpoint
+ * every so many events, and at the start of every segment; readers look up
+ * the last checkpoint before the time or height they are interested in, and
+ * start reading there, rather than at the very beginning.
+ *
+ * The file is a header followed by fixed size checkpoint records, appended in
+ * recording order. A partially written record at the end is ignored (and
+ * dropped when the index is next opened for writing).
+ */
+class time_index {
+public:
+    explicit time_index(const std::string& path) : m_path(path) {}
+    ~time_index();
+
+    static std::string path_for(const std::string& dbpath, const std::string& prefix) { return dbpath + "/" + prefix + ".tix"; }
+
+    /** Read the index. Returns false if there is none (or it is not an index). */
+    bool load();
+
+    /** Load the index (if any), and open it for appending. Returns false if it cannot be written. */
+    bool open_for_writing();
+
+    /** Append a checkpoint (in memory, and to the file, if open for writing). */
+    void add(const checkpoint& cp);
+
+    void flush();
+
+    /** The last checkpoint before anything at or after the given time was recorded, or nullptr if there is none. */
+    const checkpoint* before_time(int64_t time) const;
+
+    /** The last checkpoint before any block at or above the given height was recorded, or nullptr if there is none. */
+    const checkpoint* before_height(uint32_t height) const;
+
+    const std::vector<checkpoint>& checkpoints() const { return m_checkpoints; }
+    const checkpoint* last() const { return m_checkpoints.empty() ? nullptr : &m_checkpoints.back(); }
+
+private:
+    std::string m_path;
+    FILE* m_fp{nullptr};
+    std::vector<checkpoint> m_checkpoints;
+
+    /** Read the index, returning the size of the valid part of the file, or -1 if it cannot be read. */
+    long read();
+};
+
+} // namespace bitcoin
+
+#endif // included_bcq_timeindex_h_
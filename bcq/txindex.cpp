@@ -0,0 +1,166 @@
+#include <bcq/txindex.h>
+
+#include <algorithm>
+#include <cstring>
+#include <queue>
+
+#include <unistd.h>
+
+#include <crypto/common.h>
+
+namespace bitcoin {
+
+static const uint8_t TXI_MAGIC[8] = {'M', 'F', 'F', 'T', 'X', 'I', 0, 1};
+static const size_t TXI_HEADER_SIZE = sizeof(TXI_MAGIC) + 8;
+
+static void encode(const uint256& key, const tx_hit& hit, uint8_t* buf) {
+    memcpy(buf, key.begin(), 32);
+    buf += 32;
+    WriteLE32(buf, hit.segment);
+    WriteLE32(buf + 4, hit.height);
+    WriteLE64(buf + 8, hit.cluster);
+    WriteLE64(buf + 16, hit.offset);
+    WriteLE64(buf + 24, hit.time);
+}
+
+static void decode(const uint8_t* buf, tx_hit& hit) {
+    buf += 32;
+    hit.segment = ReadLE32(buf);
+    hit.height = ReadLE32(buf + 4);
+    hit.cluster = ReadLE64(buf + 8);
+    hit.offset = ReadLE64(buf + 16);
+    hit.time = ReadLE64(buf + 24);
+}
+
+/** Check the header of a mapped index (or run) file, and return its record count, or -1 if it is not valid. */
+static int64_t validate(const tiny::mapped_file& file) {
+    if (file.size() < TXI_HEADER_SIZE || memcmp(file.begin(), TXI_MAGIC, sizeof(TXI_MAGIC))) return -1;
+    uint64_t count = ReadLE64(file.begin() + sizeof(TXI_MAGIC));
+    if (file.size() < TXI_HEADER_SIZE + count * tx_index::record_size) return -1;
+    return count;
+}
+
+static FILE* create(const std::string& path, uint64_t count) {
+    FILE* fp = fopen(path.c_str(), "wb");
+    if (!fp) return nullptr;
+    uint8_t header[TXI_HEADER_SIZE];
+    memcpy(header, TXI_MAGIC, sizeof(TXI_MAGIC));
+    WriteLE64(header + sizeof(TXI_MAGIC), count);
+    if (fwrite(header, 1, sizeof(header), fp) != sizeof(header)) {
+        fclose(fp);
+        return nullptr;
+    }
+    return fp;
+}
+
+bool tx_index::open() {
+    m_records = nullptr;
+    m_count = 0;
+    if (!m_file.open(m_path)) return false;
+    int64_t count = validate(m_file);
+    if (count == -1) {
+        m_file.close();
+        return false;
+    }
+    m_file.advise_random();
+    m_records = m_file.begin() + TXI_HEADER_SIZE;
+    m_count = count;
+    return true;
+}
+
+size_t tx_index::find(const uint256& key, std::vector<tx_hit>& hits) const {
+    // lower bound of the key
+    uint64_t lo = 0, hi = m_count;
+    while (lo < hi) {
+        uint64_t mid = lo + (hi - lo) / 2;
+        if (memcmp(m_records + mid * record_size, key.begin(), 32) < 0) lo = mid + 1; else hi = mid;
+    }
+    size_t found = 0;
+    for (; lo < m_count && !memcmp(m_records + lo * record_size, key.begin(), 32); ++lo, ++found) {
+        hits.emplace_back();
+        decode(m_records + lo * record_size, hits.back());
+    }
+    return found;
+}
+
+tx_index::builder::~builder() {
+    for (const auto& run : m_runs) unlink(run.c_str());
+}
+
+void tx_index::builder::add(const uint256& key, const tx_hit& hit) {
+    m_buffer.push_back(entry{key, hit});
+    ++m_added;
+    if (m_buffer.size() >= m_run_limit && !write_run()) m_failed = true;
+}
+
+bool tx_index::builder::write_run() {
+    // entries are added in recording order, which a stable sort keeps for each key
+    std::stable_sort(m_buffer.begin(), m_buffer.end(), [](const entry& a, const entry& b) { return a.key < b.key; });
+    std::string path = m_path + ".run" + std::to_string(m_runs.size());
+    FILE* fp = create(path, m_buffer.size());
+    if (!fp) return false;
+    m_runs.push_back(path);
+    uint8_t buf[record_size];
+    for (const auto& e : m_buffer) {
+        encode(e.key, e.hit, buf);
+        if (fwrite(buf, 1, sizeof(buf), fp) != sizeof(buf)) {
+            fclose(fp);
+            return false;
+        }
+    }
+    m_buffer.clear();
+    return !fclose(fp);
+}
+
+bool tx_index::builder::finish() {
+    if (m_failed) return false;
+    if (m_runs.empty()) {
+        // everything fit in memory; the one run is the index
+        if (!write_run()) return false;
+        if (rename(m_runs[0].c_str(), m_path.c_str())) return false;
+        m_runs.clear();
+        return true;
+    }
+    if (!m_buffer.empty() && !write_run()) return false;
+
+    // merge the runs; for equal keys, earlier runs hold earlier events
+    std::vector<tiny::mapped_file> runs(m_runs.size());
+    std::vector<uint64_t> counts(m_runs.size());
+    uint64_t total = 0;
+    for (size_t i = 0; i < m_runs.size(); ++i) {
+        if (!runs[i].open(m_runs[i])) return false;
+        int64_t count = validate(runs[i]);
+        if (count == -1) return false;
+        counts[i] = count;
+        total += count;
+    }
+    struct cursor {
+        const uint8_t* record;
+        size_t run;
+    };
+    auto later = [](const cursor& a, const cursor& b) {
+        int cmp = memcmp(a.record, b.record, 32);
+        return cmp > 0 || (cmp == 0 && a.run > b.run);
+    };
+    std::priority_queue<cursor, std::vector<cursor>, decltype(later)> heads(later);
+    for (size_t i = 0; i < runs.size(); ++i) {
+        if (counts[i]) heads.push(cursor{runs[i].begin() + TXI_HEADER_SIZE, i});
+    }
+    std::string tmp = m_path + ".tmp";
+    FILE* fp = create(tmp, total);
+    if (!fp) return false;
+    while (!heads.empty()) {
+        cursor c = heads.top();
+        heads.pop();
+        if (fwrite(c.record, 1, record_size, fp) != record_size) {
+            fclose(fp);
+            return false;
+        }
+        c.record += record_size;
+        if (c.record < runs[c.run].begin() + TXI_HEADER_SIZE + counts[c.run] * record_size) heads.push(c);
+    }
+    if (fclose(fp) || rename(tmp.c_str(), m_path.c_str())) return false;
+    return true;
+}
+
+} // namespace bitcoin
@@ -0,0 +1,112 @@
+#ifndef included_bcq_txindex_h_
+#define included_bcq_txindex_h_
+
+#include <string>
+#include <vector>
+
+#include <inttypes.h>
+
+#include <tinyfs.h>
+#include <uint256.h>
+
+#include <bcq/timeindex.h>
+
+namespace bitcoin {
+
+/**
+ * An event in an MFF recording which touches some txid (or block hash).
+ */
+struct tx_hit {
+    uint32_t segment{0};    //!< a segment in the event's cluster, as given to goto_segment()
+    uint32_t height{0};     //!< the chain tip after the event
+    uint64_t cluster{0};    //!< the cluster of the segment file
+    int64_t offset{0};      //!< position of the event in the segment file, or 0 for the first event in the file
+    int64_t time{0};        //!< the time of the event
+
+    static const size_t serialized_size = 4 + 4 + 8 + 8 + 8;
+
+    /** A checkpoint at the event, for mff::goto_checkpoint(). */
+    checkpoint position() const {
+        checkpoint cp;
+        cp.time = time;
+        cp.height = height;
+        cp.segment = segment;
+        cp.cluster = cluster;
+        cp.offset = offset;
+        return cp;
+    }
+};
+
+/**
+ * Inverted index of an MFF recording, mapping txids and block hashes to the
+ * events touching them (see mff_analyzer::populate_touched_txids()). It is
+ * kept as a sidecar file (<dbpath>/<prefix>.txi) next to the segments, and
+ * built by mff-index.
+ *
+ * The file is a header followed by fixed size (key, hit) records, sorted by
+ * key and then by position in the recording, so that the hits for a key are
+ * found with a binary search, and are contiguous.
+ */
+class tx_index {
+public:
+    explicit tx_index(const std::string& path) : m_path(path) {}
+
+    static std::string path_for(const std::string& dbpath, const std::string& prefix) { return dbpath + "/" + prefix + ".txi"; }
+
+    /** Open the index. Returns false if there is none (or it is not an index). */
+    bool open();
+
+    bool is_open() const { return m_records != nullptr; }
+
+    /** Number of (key, hit) records in the index. */
+    uint64_t size() const { return m_count; }
+
+    /** Append the hits for the given key, in recording order; returns the number of hits found. */
+    size_t find(const uint256& key, std::vector<tx_hit>& hits) const;
+
+    static const size_t record_size = 32 + tx_hit::serialized_size;
+
+    /**
+     * Writes a new index. Records are buffered, and written in sorted runs
+     * whenever the buffer reaches run_limit records; finish() then merges the
+     * runs into the index, so building does not need memory proportional to
+     * the size of the recording.
+     */
+    class builder {
+    public:
+        builder(const std::string& path, size_t run_limit = 1 << 23) : m_path(path), m_run_limit(run_limit) {}
+        ~builder();
+
+        void add(const uint256& key, const tx_hit& hit);
+
+        /** Write the index, replacing any existing one. Returns false on failure. */
+        bool finish();
+
+        /** Number of records added so far. */
+        uint64_t size() const { return m_added; }
+
+    private:
+        struct entry {
+            uint256 key;
+            tx_hit hit;
+        };
+        std::string m_path;
+        size_t m_run_limit;
+        uint64_t m_added{0};
+        bool m_failed{false};
+        std::vector<entry> m_buffer;
+        std::vector<std::string> m_runs;
+
+        bool write_run();
+    };
+
+private:
+    std::string m_path;
+    tiny::mapped_file m_file;
+    const uint8_t* m_records{nullptr};
+    uint64_t m_count{0};
+};
+
+} // namespace bitcoin
+
+#endif // included_bcq_txindex_h_
@@ -21,10 +21,10 @@ void save_mempool(std::shared_ptr<tiny::mempool>& mempool, const std::string& pa
 outpoint::outpoint(const tiny::outpoint& o) : outpoint(o.n, o.hash) {}
 
 tx::tx(cq::compressor<uint256>* compressor, const tiny::mempool_entry& entry) : tx(compressor) {
-    auto tref = *entry.x;
+    const auto& tref = *entry.x;
     m_sid = cq::unknownid;
     m_hash = tref.hash;
-    m_weight = tref.GetWeight();
+    m_weight = entry.weight();
     m_fee = entry.fee();
     m_vin.clear();
     m_vout.clear();
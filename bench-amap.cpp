@@ -0,0 +1,115 @@
+// Copyright (c) 2018 The Bitcoin Core developers
+// Distributed under the MIT software license, see the accompanying
+// file COPYING or http://www.opensource.org/licenses/mit-license.php.
+
+// Micro-benchmark of the amap txid lookup strategies, run against a
+// synthetic amap directory.
+
+#include <chrono>
+#include <functional>
+#include <random>
+#include <sys/stat.h>
+
+#include <amap.h>
+#include <streams.h>
+#include <tinyformat.h>
+#include <uint256.h>
+
+static inline uint256 random_txid(std::mt19937_64& rng, size_t prefixes) {
+    uint256 txid;
+    for (int i = 0; i < 4; ++i) {
+        uint64_t v = rng();
+        memcpy(txid.begin() + i * 8, &v, 8);
+    }
+    amap::prefix_t prefix = rng() % prefixes;
+    memcpy(txid.begin(), &prefix, amap::prefix_len);
+    return txid;
+}
+
+// the lookup performed by amap::output_amount before the reader existed
+static bool legacy_lookup(const std::string& path, const uint256& txid) {
+    amap::prefix_t prefix;
+    memcpy(&prefix, txid.begin(), amap::prefix_len);
+    FILE* fp = fopen((path + strprintf("/%x", prefix)).c_str(), "rb");
+    assert(fp);
+    CAutoFile af(fp, SER_DISK, 0);
+    amap::prefix_t cmp;
+    size_t txcount;
+    af >> cmp >> VARINT(txcount);
+    long cmarker = ftell(fp);
+    return amap::fbinsearch(fp, cmarker, cmarker + (36 - amap::prefix_len) * txcount, &txid.begin()[amap::prefix_len], 32 - amap::prefix_len, 36 - amap::prefix_len);
+}
+
+template<typename F>
+static void run(const char* name, const std::vector<uint256>& lookups, F lookup, std::function<uint64_t()> probes) {
+    size_t found = 0;
+    auto start = std::chrono::steady_clock::now();
+    for (const auto& txid : lookups) found += lookup(txid);
+    std::chrono::duration<double, std::nano> elapsed = std::chrono::steady_clock::now() - start;
+    printf("%-14s %10.1f ns/lookup", name, elapsed.count() / lookups.size());
+    if (probes) printf(" %6.2f probes/lookup", (double)probes() / lookups.size());
+    printf(" (%zu/%zu found)\n", found, lookups.size());
+}
+
+int main(int argc, const char** argv) {
+    if (argc < 2 || argc > 5) {
+        fprintf(stderr, "syntax: %s <scratch dir> [<txs>=4000000 [<prefixes>=64 [<lookups>=1000000]]]\n", argv[0]);
+        fprintf(stderr, "the synthetic amap is written to <scratch dir>; txs are confined to the first <prefixes> prefixes so that\n"
+                        "the tables reach realistic sizes without having to write all %zu of them\n", amap::prefix_count);
+        return 1;
+    }
+    std::string path = argv[1];
+    size_t txs = argc > 2 ? atoll(argv[2]) : 4000000;
+    size_t prefixes = argc > 3 ? atoll(argv[3]) : 64;
+    size_t lookup_count = argc > 4 ? atoll(argv[4]) : 1000000;
+    if (prefixes < 1 || prefixes > amap::prefix_count) {
+        fprintf(stderr, "prefixes must be in the range 1..%zu\n", amap::prefix_count);
+        return 1;
+    }
+
+    std::mt19937_64 rng(1);
+    std::vector<std::vector<std::pair<uint256, amap::amount_list_t>>> tables(prefixes);
+    std::vector<uint256> lookups;
+    lookups.reserve(lookup_count);
+    for (size_t i = 0; i < txs; ++i) {
+        uint256 txid = random_txid(rng, prefixes);
+        amap::prefix_t prefix;
+        memcpy(&prefix, txid.begin(), amap::prefix_len);
+        tables[prefix].emplace_back(txid, amap::amount_list_t(1 + rng() % 3, 5000));
+    }
+    // half of the lookups are for known txids, the other half for unknown ones
+    for (size_t i = 0; i < lookup_count; ++i) {
+        if (i & 1) {
+            lookups.push_back(random_txid(rng, prefixes));
+        } else {
+            const auto& table = tables[rng() % prefixes];
+            if (!table.empty()) lookups.push_back(table[rng() % table.size()].first);
+        }
+    }
+
+    mkdir(path.c_str(), 0777);
+    for (size_t prefix = 0; prefix < prefixes; ++prefix) {
+        if (!amap::write_table(path, prefix, tables[prefix])) {
+            fprintf(stderr, "unable to write amap table %zx in %s\n", prefix, path.c_str());
+            return 1;
+        }
+    }
+    tables.clear();
+    printf("%zu txs in %zu tables (~%zu txs/table), %zu lookups\n", txs, prefixes, txs / prefixes, lookups.size());
+
+    run("fbinsearch", lookups, [&](const uint256& txid) { return legacy_lookup(path, txid); }, nullptr);
+
+    amap::amount_list_t amounts;
+    amap::reader binary(path, amap::search_mode::binary);
+    amap::reader interpolation(path, amap::search_mode::interpolation);
+    // map the tables and warm up the page cache, as a long running process would have
+    for (const auto& txid : lookups) {
+        binary.output_amounts(txid, amounts);
+        interpolation.output_amounts(txid, amounts);
+    }
+    uint64_t binary_warmup = binary.probes();
+    uint64_t interpolation_warmup = interpolation.probes();
+
+    run("binary", lookups, [&](const uint256& txid) { return binary.output_amounts(txid, amounts); }, [&]() { return binary.probes() - binary_warmup; });
+    run("interpolation", lookups, [&](const uint256& txid) { return interpolation.output_amounts(txid, amounts); }, [&]() { return interpolation.probes() - interpolation_warmup; });
+}
@@ -0,0 +1,76 @@
+// Copyright (c) 2018 The Bitcoin Core developers
+// Distributed under the MIT software license, see the accompanying
+// file COPYING or http://www.opensource.org/licenses/mit-license.php.
+
+// Micro-benchmark of txid hashing, one tx at a time (tiny::tx::UpdateHash)
+// versus in batches (tiny::UpdateHashes), run against synthetic txs.
+
+#include <chrono>
+#include <functional>
+#include <random>
+
+#include <tinytx.h>
+
+static void run(const char* name, size_t txs, size_t bytes, std::function<void()> fn) {
+    auto start = std::chrono::steady_clock::now();
+    fn();
+    std::chrono::duration<double> elapsed = std::chrono::steady_clock::now() - start;
+    printf("%-14s %12.0f txs/s %8.1f MB/s\n", name, txs / elapsed.count(), bytes / elapsed.count() / 1000000);
+}
+
+int main(int argc, const char** argv) {
+    if (argc > 3) {
+        fprintf(stderr, "syntax: %s [<txs>=200000 [<batch size>=256]]\n", argv[0]);
+        return 1;
+    }
+    size_t count = argc > 1 ? atoll(argv[1]) : 200000;
+    size_t batch = argc > 2 ? atoll(argv[2]) : 256;
+    if (batch < 1) {
+        fprintf(stderr, "batch size must be at least 1\n");
+        return 1;
+    }
+    printf("sha256 implementation: %s\n", SHA256AutoDetect().c_str());
+
+    // mostly 1-3 inputs and 2 outputs, with the occasional large consolidation
+    std::mt19937_64 rng(1);
+    std::vector<tiny::tx> txs(count);
+    size_t bytes = 0;
+    for (size_t i = 0; i < count; ++i) {
+        auto& t = txs[i];
+        t.locktime = i;
+        size_t inputs = rng() % 50 ? 1 + rng() % 3 : 20 + rng() % 100;
+        for (size_t j = 0; j < inputs; ++j) {
+            uint256 prevhash;
+            for (int k = 0; k < 4; ++k) {
+                uint64_t v = rng();
+                memcpy(prevhash.begin() + k * 8, &v, 8);
+            }
+            t.vin.emplace_back(tiny::outpoint(prevhash, rng() % 4), tiny::script_data_t(rng() % 2 ? 107 : 23, 0x51));
+        }
+        t.vout.emplace_back(rng() % 100000000, tiny::script_data_t(22, 0x51));
+        t.vout.emplace_back(rng() % 100000000, tiny::script_data_t(rng() % 2 ? 22 : 34, 0x51));
+        bytes += GetSerializeSize(t, SER_GETHASH, tiny::SERIALIZE_TRANSACTION_NO_WITNESS);
+    }
+    printf("%zu txs, %.1f bytes/tx\n", count, (double)bytes / count);
+
+    run("UpdateHash", count, bytes, [&]() {
+        for (auto& t : txs) t.UpdateHash();
+    });
+    std::vector<uint256> expected(count);
+    for (size_t i = 0; i < count; ++i) expected[i] = txs[i].hash;
+
+    std::vector<tiny::tx*> ptrs;
+    for (auto& t : txs) {
+        t.hash.SetNull();
+        ptrs.push_back(&t);
+    }
+    run("UpdateHashes", count, bytes, [&]() {
+        for (size_t i = 0; i < count; i += batch) tiny::UpdateHashes(&ptrs[i], std::min(batch, count - i));
+    });
+    for (size_t i = 0; i < count; ++i) {
+        if (txs[i].hash != expected[i]) {
+            fprintf(stderr, "hash mismatch for tx %zu\n", i);
+            return 1;
+        }
+    }
+}
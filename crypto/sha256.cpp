@@ -6,17 +6,33 @@
 #include <crypto/common.h>
 
 #include <assert.h>
+#include <stdint.h>
 #include <string.h>
+#include <algorithm>
 #include <atomic>
 
 #if defined(__x86_64__) || defined(__amd64__)
-#if defined(USE_ASM)
+#if defined(USE_ASM) || defined(ENABLE_SHANI) || defined(ENABLE_AVX2)
 #include <cpuid.h>
+#endif
+#if defined(USE_ASM)
 namespace sha256_sse4
 {
 void Transform(uint32_t* s, const unsigned char* chunk, size_t blocks);
 }
 #endif
+#if defined(ENABLE_SHANI)
+namespace sha256_shani
+{
+void Transform(uint32_t* s, const unsigned char* chunk, size_t blocks);
+}
+#endif
+#if defined(ENABLE_AVX2)
+namespace sha256_avx2
+{
+void Transform_8way(uint32_t* const* s, const unsigned char* const* chunk, size_t blocks);
+}
+#endif
 #endif
 
 // Internal implementation code.
@@ -145,18 +161,20 @@ void Transform(uint32_t* s, const unsigned char* chunk, size_t blocks)
 
 typedef void (*TransformType)(uint32_t*, const unsigned char*, size_t);
 
+/** Inputs and outputs of the self-tests. */
+const unsigned char in1[65] = {0, 0x80};
+const unsigned char in2[129] = {
+    0,
+    32, 32, 32, 32, 32, 32, 32, 32, 32, 32, 32, 32, 32, 32, 32, 32, 32, 32, 32, 32, 32, 32, 32, 32, 32, 32, 32, 32, 32, 32, 32, 32, 
+    32, 32, 32, 32, 32, 32, 32, 32, 32, 32, 32, 32, 32, 32, 32, 32, 32, 32, 32, 32, 32, 32, 32, 32, 32, 32, 32, 32, 32, 32, 32, 32, 
+    0x80, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0,
+    0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 2, 0
+};
+const uint32_t init[8] = {0x6a09e667ul, 0xbb67ae85ul, 0x3c6ef372ul, 0xa54ff53aul, 0x510e527ful, 0x9b05688cul, 0x1f83d9abul, 0x5be0cd19ul};
+const uint32_t out1[8] = {0xe3b0c442ul, 0x98fc1c14ul, 0x9afbf4c8ul, 0x996fb924ul, 0x27ae41e4ul, 0x649b934cul, 0xa495991bul, 0x7852b855ul};
+const uint32_t out2[8] = {0xce4153b0ul, 0x147c2a86ul, 0x3ed4298eul, 0xe0676bc8ul, 0x79fc77a1ul, 0x2abe1f49ul, 0xb2b055dful, 0x1069523eul};
+
 bool SelfTest(TransformType tr) {
-    static const unsigned char in1[65] = {0, 0x80};
-    static const unsigned char in2[129] = {
-        0,
-        32, 32, 32, 32, 32, 32, 32, 32, 32, 32, 32, 32, 32, 32, 32, 32, 32, 32, 32, 32, 32, 32, 32, 32, 32, 32, 32, 32, 32, 32, 32, 32, 
-        32, 32, 32, 32, 32, 32, 32, 32, 32, 32, 32, 32, 32, 32, 32, 32, 32, 32, 32, 32, 32, 32, 32, 32, 32, 32, 32, 32, 32, 32, 32, 32, 
-        0x80, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0,
-        0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 2, 0
-    };
-    static const uint32_t init[8] = {0x6a09e667ul, 0xbb67ae85ul, 0x3c6ef372ul, 0xa54ff53aul, 0x510e527ful, 0x9b05688cul, 0x1f83d9abul, 0x5be0cd19ul};
-    static const uint32_t out1[8] = {0xe3b0c442ul, 0x98fc1c14ul, 0x9afbf4c8ul, 0x996fb924ul, 0x27ae41e4ul, 0x649b934cul, 0xa495991bul, 0x7852b855ul};
-    static const uint32_t out2[8] = {0xce4153b0ul, 0x147c2a86ul, 0x3ed4298eul, 0xe0676bc8ul, 0x79fc77a1ul, 0x2abe1f49ul, 0xb2b055dful, 0x1069523eul};
     uint32_t buf[8];
     memcpy(buf, init, sizeof(buf));
     // Process nothing, and check we remain in the initial state.
@@ -172,23 +190,265 @@ bool SelfTest(TransformType tr) {
     return true;
 }
 
-TransformType Transform = sha256::Transform;
+/** Runs blocks through 8 states at once; lane i processes chunk[i] into s[i]. */
+typedef SHA256Transform8 Transform8Type;
 
-} // namespace
+#if defined(ENABLE_AVX2)
+bool SelfTest8(Transform8Type tr) {
+    uint32_t buf[8][8];
+    uint32_t* s[8];
+    const unsigned char* chunk[8];
+    for (int i = 0; i < 8; ++i) {
+        sha256::Initialize(buf[i]);
+        s[i] = buf[i];
+    }
+    // Process the padded empty string in the even lanes, and the first half of 64 spaces in the odd ones (unaligned)
+    for (int i = 0; i < 8; ++i) chunk[i] = i & 1 ? in2 + 1 : in1 + 1;
+    tr(s, chunk, 1);
+    for (int i = 0; i < 8; i += 2) {
+        if (memcmp(buf[i], out1, sizeof(out1))) return false;
+        sha256::Initialize(buf[i]);
+    }
+    // Process it once more in the even lanes, and the second half of the spaces in the odd ones
+    for (int i = 1; i < 8; i += 2) chunk[i] = in2 + 65;
+    tr(s, chunk, 1);
+    for (int i = 0; i < 8; ++i) {
+        if (memcmp(buf[i], i & 1 ? out2 : out1, sizeof(out1))) return false;
+        sha256::Initialize(buf[i]);
+    }
+    // Process all of the spaces in one call
+    for (int i = 0; i < 8; ++i) chunk[i] = in2 + 1;
+    tr(s, chunk, 2);
+    for (int i = 0; i < 8; ++i) {
+        if (memcmp(buf[i], out2, sizeof(out2))) return false;
+    }
+    return true;
+}
+#endif
 
-std::string SHA256AutoDetect()
+void AutoDetectTransform(uint32_t* s, const unsigned char* chunk, size_t blocks);
+
+/** The single-stream implementation; starts out detecting the best one on first use. */
+std::atomic<TransformType> Transform{AutoDetectTransform};
+/** The multi-lane implementation used by SHA256D, if any. */
+Transform8Type Transform8 = nullptr;
+/** The AVX2 implementation, if the CPU has it, whether or not SHA256D uses it. */
+Transform8Type TransformAVX2 = nullptr;
+
+/** The lanes one after another, on the single-stream implementation. */
+void Transform8Scalar(uint32_t* const* s, const unsigned char* const* chunk, size_t blocks)
+{
+    TransformType tr = Transform.load(std::memory_order_relaxed);
+    for (int i = 0; i < 8; ++i) tr(s[i], chunk[i], blocks);
+}
+
+void AutoDetectTransform(uint32_t* s, const unsigned char* chunk, size_t blocks)
+{
+    SHA256AutoDetect();
+    Transform.load(std::memory_order_relaxed)(s, chunk, blocks);
+}
+
+std::string AutoDetect()
 {
-#if defined(USE_ASM) && (defined(__x86_64__) || defined(__amd64__))
+    std::string ret = "standard";
+    TransformType tr = sha256::Transform;
+#if (defined(__x86_64__) || defined(__amd64__)) && (defined(USE_ASM) || defined(ENABLE_SHANI) || defined(ENABLE_AVX2))
     uint32_t eax, ebx, ecx, edx;
-    if (__get_cpuid(1, &eax, &ebx, &ecx, &edx) && (ecx >> 19) & 1) {
-        Transform = sha256_sse4::Transform;
-        assert(SelfTest(Transform));
-        return "sse4";
+    bool have_sse4 = false, have_avx = false, have_avx2 = false, have_shani = false;
+    if (__get_cpuid(1, &eax, &ebx, &ecx, &edx)) {
+        have_sse4 = (ecx >> 19) & 1;
+        have_avx = ((ecx >> 27) & 1) && ((ecx >> 28) & 1);
     }
+    if (have_avx) {
+        // the OS has to save the YMM registers across context switches, too
+        uint32_t xcr0_lo, xcr0_hi;
+        __asm__ ("xgetbv" : "=a"(xcr0_lo), "=d"(xcr0_hi) : "c"(0));
+        have_avx = (xcr0_lo & 6) == 6;
+    }
+    if (__get_cpuid_max(0, nullptr) >= 7) {
+        __cpuid_count(7, 0, eax, ebx, ecx, edx);
+        have_avx2 = have_avx && ((ebx >> 5) & 1);
+        have_shani = have_sse4 && ((ebx >> 29) & 1);
+    }
+#if defined(USE_ASM)
+    if (have_sse4) {
+        tr = sha256_sse4::Transform;
+        assert(SelfTest(tr));
+        ret = "sse4";
+    }
+#endif
+#if defined(ENABLE_SHANI)
+    if (have_shani) {
+        tr = sha256_shani::Transform;
+        assert(SelfTest(tr));
+        ret = "shani";
+    }
+#endif
+#if defined(ENABLE_AVX2)
+    // a single SHA-NI stream outruns 8 AVX2 lanes, so the latter are only used without the former
+    if (have_avx2) {
+        TransformAVX2 = sha256_avx2::Transform_8way;
+        assert(SelfTest8(TransformAVX2));
+        if (ret != "shani") {
+            Transform8 = TransformAVX2;
+            ret += ",avx2(8way)";
+        }
+    }
+#endif
+    (void)have_sse4; (void)have_avx2; (void)have_shani;
 #endif
 
-    assert(SelfTest(Transform));
-    return "standard";
+    assert(SelfTest(tr));
+    Transform.store(tr, std::memory_order_relaxed);
+    return ret;
+}
+
+/** The state of one message hashed by SHA256D. */
+struct Lane {
+    uint32_t s[8];
+    const unsigned char* data;  //!< the next block
+    size_t blocks;              //!< number of blocks left at data
+    unsigned char tail[128];    //!< the padded final block(s), or the padded digest of the first pass
+    size_t tail_blocks;         //!< number of blocks in tail, once data has been used up
+    size_t index;               //!< which message this is
+    bool second;                //!< whether this is the second pass, hashing the digest of the first one
+};
+
+void BeginLane(Lane& lane, const unsigned char* in, size_t len, size_t index)
+{
+    sha256::Initialize(lane.s);
+    lane.data = in;
+    lane.blocks = len / 64;
+    size_t rem = len % 64;
+    memset(lane.tail, 0, sizeof(lane.tail));
+    memcpy(lane.tail, in + 64 * lane.blocks, rem);
+    lane.tail[rem] = 0x80;
+    lane.tail_blocks = rem < 56 ? 1 : 2;
+    WriteBE64(lane.tail + 64 * lane.tail_blocks - 8, (uint64_t)len << 3);
+    lane.index = index;
+    lane.second = false;
+}
+
+/** Move on, once the lane's blocks have been processed. Returns false (and writes out the hash) when the lane is done. */
+bool AdvanceLane(Lane& lane, unsigned char* out)
+{
+    if (lane.tail_blocks) {
+        lane.data = lane.tail;
+        lane.blocks = lane.tail_blocks;
+        lane.tail_blocks = 0;
+        return true;
+    }
+    unsigned char* dest = lane.second ? out + 32 * lane.index : lane.tail;
+    for (int i = 0; i < 8; ++i) WriteBE32(dest + 4 * i, lane.s[i]);
+    if (lane.second) return false;
+    memset(lane.tail + 32, 0, 32);
+    lane.tail[32] = 0x80;
+    WriteBE64(lane.tail + 56, 256);
+    sha256::Initialize(lane.s);
+    lane.data = lane.tail;
+    lane.blocks = 1;
+    lane.second = true;
+    return true;
+}
+
+void FinishLane(Lane& lane, unsigned char* out)
+{
+    TransformType tr = Transform.load(std::memory_order_relaxed);
+    do tr(lane.s, lane.data, lane.blocks); while (AdvanceLane(lane, out));
+}
+
+} // namespace
+
+std::string SHA256AutoDetect()
+{
+    static const std::string name = AutoDetect();
+    return name;
+}
+
+void SHA256D64(unsigned char* out, const unsigned char* in, size_t blocks)
+{
+    // Hash up to 64 inputs at a time, into a buffer of our own, so that
+    // writing the results never clobbers inputs still to be hashed
+    static const size_t CHUNK = 64;
+    const unsigned char* ptrs[CHUNK];
+    size_t lens[CHUNK];
+    unsigned char hashes[CHUNK * 32];
+    for (size_t i = 0; i < CHUNK; ++i) lens[i] = 64;
+    for (size_t done = 0; done < blocks; ) {
+        size_t count = std::min(CHUNK, blocks - done);
+        for (size_t i = 0; i < count; ++i) ptrs[i] = in + 64 * (done + i);
+        SHA256D(hashes, ptrs, lens, count);
+        memcpy(out + 32 * done, hashes, 32 * count);
+        done += count;
+    }
+}
+
+bool SHA256DMultiLane()
+{
+    SHA256AutoDetect();
+    return Transform8 != nullptr;
+}
+
+std::vector<std::pair<std::string, SHA256Transform8>> SHA256Transforms8()
+{
+    SHA256AutoDetect();
+    std::vector<std::pair<std::string, SHA256Transform8>> ret{{"scalar", Transform8Scalar}};
+    if (TransformAVX2) ret.emplace_back("avx2", TransformAVX2);
+    return ret;
+}
+
+void SHA256D(unsigned char* out, const unsigned char* const* in, const size_t* len, size_t count)
+{
+    SHA256AutoDetect();
+    SHA256D(out, in, len, count, Transform8);
+}
+
+void SHA256D(unsigned char* out, const unsigned char* const* in, const size_t* len, size_t count, SHA256Transform8 transform8)
+{
+    SHA256AutoDetect();
+    size_t next = 0;
+    Lane lane;
+    if (transform8 && count >= 8) {
+        Lane lanes[8];
+        uint32_t* s[8];
+        const unsigned char* chunk[8];
+        for (int i = 0; i < 8; ++i) {
+            BeginLane(lanes[i], in[next], len[next], next);
+            ++next;
+            s[i] = lanes[i].s;
+        }
+        // Run all lanes until one of them runs out of messages; a lane which is done takes on the next message
+        int done = -1;
+        while (done < 0) {
+            size_t blocks = SIZE_MAX;
+            for (int i = 0; i < 8 && done < 0; ++i) {
+                while (lanes[i].blocks == 0 && !AdvanceLane(lanes[i], out)) {
+                    if (next == count) {
+                        done = i;
+                        break;
+                    }
+                    BeginLane(lanes[i], in[next], len[next], next);
+                    ++next;
+                }
+                blocks = std::min(blocks, lanes[i].blocks);
+                chunk[i] = lanes[i].data;
+            }
+            if (done >= 0) break;
+            transform8(s, chunk, blocks);
+            for (int i = 0; i < 8; ++i) {
+                lanes[i].data += 64 * blocks;
+                lanes[i].blocks -= blocks;
+            }
+        }
+        // Finish the rest one at a time
+        for (int i = 0; i < 8; ++i) {
+            if (i != done) FinishLane(lanes[i], out);
+        }
+    }
+    for (; next < count; ++next) {
+        BeginLane(lane, in[next], len[next], next);
+        FinishLane(lane, out);
+    }
 }
 
 ////// SHA-256
@@ -207,12 +467,12 @@ CSHA256& CSHA256::Write(const unsigned char* data, size_t len)
         memcpy(buf + bufsize, data, 64 - bufsize);
         bytes += 64 - bufsize;
         data += 64 - bufsize;
-        Transform(s, buf, 1);
+        Transform.load(std::memory_order_relaxed)(s, buf, 1);
         bufsize = 0;
     }
     if (end - data >= 64) {
         size_t blocks = (end - data) / 64;
-        Transform(s, data, blocks);
+        Transform.load(std::memory_order_relaxed)(s, data, blocks);
         data += 64 * blocks;
         bytes += 64 * blocks;
     }
@@ -8,6 +8,8 @@
 #include <stdint.h>
 #include <stdlib.h>
 #include <string>
+#include <utility>
+#include <vector>
 
 /** A hasher class for SHA-256. */
 class CSHA256
@@ -31,4 +33,31 @@ public:
  */
 std::string SHA256AutoDetect();
 
+/** Compute the double-SHA256 of count messages at once; the hash of in[i]
+ *  (of length len[i]) is written to out + 32 * i. Runs several messages side
+ *  by side on the multi-lane implementation, if one was detected.
+ */
+void SHA256D(unsigned char* out, const unsigned char* const* in, const size_t* len, size_t count);
+
+/** Compute the double-SHA256 of blocks 64-byte inputs (e.g. pairs of merkle
+ *  tree nodes) at once, writing them to out + 32 * i. out may be the same as in.
+ */
+void SHA256D64(unsigned char* out, const unsigned char* in, size_t blocks);
+
+/** Whether SHA256D has a multi-lane implementation to run on, i.e. whether batching pays off. */
+bool SHA256DMultiLane();
+
+/** Runs blocks through 8 SHA-256 states at once; lane i processes chunk[i] into s[i]. */
+typedef void (*SHA256Transform8)(uint32_t* const* s, const unsigned char* const* chunk, size_t blocks);
+
+/** Internal, for tests: SHA256D on the given multi-lane implementation (or none, if null),
+ *  rather than on the detected one, so that the lane scheduling can be exercised on any CPU.
+ */
+void SHA256D(unsigned char* out, const unsigned char* const* in, const size_t* len, size_t count, SHA256Transform8 transform8);
+
+/** Internal, for tests: the multi-lane implementations the CPU can run, by name. "scalar",
+ *  which runs the lanes one after another, is always there.
+ */
+std::vector<std::pair<std::string, SHA256Transform8>> SHA256Transforms8();
+
 #endif // BITCOIN_CRYPTO_SHA256_H
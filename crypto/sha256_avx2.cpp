@@ -0,0 +1,122 @@
+// Copyright (c) 2018 The Bitcoin Core developers
+// Distributed under the MIT software license, see the accompanying
+// file COPYING or http://www.opensource.org/licenses/mit-license.php.
+//
+// An 8-lane SHA-256 transform: every 32-bit lane of the AVX2 registers runs
+// the compression function of a separate message. Like sha256_shani.cpp, it
+// is compiled for AVX2 using target attributes, and only used if
+// SHA256AutoDetect() finds the extension at run time.
+
+#if defined(HAVE_CONFIG_H)
+#include <config/bitcoin-config.h>
+#endif
+
+#include <stdint.h>
+#include <stdlib.h>
+
+#if defined(ENABLE_AVX2)
+
+#include <immintrin.h>
+
+#include <crypto/common.h>
+
+#define AVX2_TARGET __attribute__((target("avx2")))
+#define AVX2_INLINE inline __attribute__((always_inline)) AVX2_TARGET
+
+namespace
+{
+const uint32_t K[64] = {
+    0x428a2f98, 0x71374491, 0xb5c0fbcf, 0xe9b5dba5, 0x3956c25b, 0x59f111f1, 0x923f82a4, 0xab1c5ed5,
+    0xd807aa98, 0x12835b01, 0x243185be, 0x550c7dc3, 0x72be5d74, 0x80deb1fe, 0x9bdc06a7, 0xc19bf174,
+    0xe49b69c1, 0xefbe4786, 0x0fc19dc6, 0x240ca1cc, 0x2de92c6f, 0x4a7484aa, 0x5cb0a9dc, 0x76f988da,
+    0x983e5152, 0xa831c66d, 0xb00327c8, 0xbf597fc7, 0xc6e00bf3, 0xd5a79147, 0x06ca6351, 0x14292967,
+    0x27b70a85, 0x2e1b2138, 0x4d2c6dfc, 0x53380d13, 0x650a7354, 0x766a0abb, 0x81c2c92e, 0x92722c85,
+    0xa2bfe8a1, 0xa81a664b, 0xc24b8b70, 0xc76c51a3, 0xd192e819, 0xd6990624, 0xf40e3585, 0x106aa070,
+    0x19a4c116, 0x1e376c08, 0x2748774c, 0x34b0bcb5, 0x391c0cb3, 0x4ed8aa4a, 0x5b9cca4f, 0x682e6ff3,
+    0x748f82ee, 0x78a5636f, 0x84c87814, 0x8cc70208, 0x90befffa, 0xa4506ceb, 0xbef9a3f7, 0xc67178f2,
+};
+
+__m256i AVX2_INLINE Add(__m256i x, __m256i y) { return _mm256_add_epi32(x, y); }
+__m256i AVX2_INLINE Xor(__m256i x, __m256i y) { return _mm256_xor_si256(x, y); }
+__m256i AVX2_INLINE Or(__m256i x, __m256i y) { return _mm256_or_si256(x, y); }
+__m256i AVX2_INLINE And(__m256i x, __m256i y) { return _mm256_and_si256(x, y); }
+template<int n> __m256i AVX2_INLINE Ror(__m256i x) { return Or(_mm256_srli_epi32(x, n), _mm256_slli_epi32(x, 32 - n)); }
+
+__m256i AVX2_INLINE Ch(__m256i x, __m256i y, __m256i z) { return Xor(z, And(x, Xor(y, z))); }
+__m256i AVX2_INLINE Maj(__m256i x, __m256i y, __m256i z) { return Or(And(x, y), And(z, Or(x, y))); }
+__m256i AVX2_INLINE Sigma0(__m256i x) { return Xor(Xor(Ror<2>(x), Ror<13>(x)), Ror<22>(x)); }
+__m256i AVX2_INLINE Sigma1(__m256i x) { return Xor(Xor(Ror<6>(x), Ror<11>(x)), Ror<25>(x)); }
+__m256i AVX2_INLINE sigma0(__m256i x) { return Xor(Xor(Ror<7>(x), Ror<18>(x)), _mm256_srli_epi32(x, 3)); }
+__m256i AVX2_INLINE sigma1(__m256i x) { return Xor(Xor(Ror<17>(x), Ror<19>(x)), _mm256_srli_epi32(x, 10)); }
+
+/** One round of SHA-256, in all lanes; kw is the round constant plus the message word. */
+void AVX2_INLINE Round(__m256i a, __m256i b, __m256i c, __m256i& d, __m256i e, __m256i f, __m256i g, __m256i& h, __m256i kw)
+{
+    __m256i t1 = Add(Add(Add(h, Sigma1(e)), Ch(e, f, g)), kw);
+    __m256i t2 = Add(Sigma0(a), Maj(a, b, c));
+    d = Add(d, t1);
+    h = Add(t1, t2);
+}
+
+/** Word i of the message schedule, expanding w (a ring of the last 16 words) from round 16 on. */
+__m256i AVX2_INLINE Word(__m256i* w, int i)
+{
+    if (i >= 16) w[i & 15] = Add(Add(w[i & 15], sigma1(w[(i - 2) & 15])), Add(w[(i - 7) & 15], sigma0(w[(i - 15) & 15])));
+    return Add(w[i & 15], _mm256_set1_epi32(K[i]));
+}
+
+/** The big-endian 32-bit words at offset in each lane's chunk. */
+__m256i AVX2_INLINE Read8(const unsigned char* const* chunk, size_t offset)
+{
+    return _mm256_set_epi32(ReadBE32(chunk[7] + offset), ReadBE32(chunk[6] + offset), ReadBE32(chunk[5] + offset), ReadBE32(chunk[4] + offset),
+                            ReadBE32(chunk[3] + offset), ReadBE32(chunk[2] + offset), ReadBE32(chunk[1] + offset), ReadBE32(chunk[0] + offset));
+}
+
+__m256i AVX2_INLINE Gather(uint32_t* const* s, int i)
+{
+    return _mm256_set_epi32(s[7][i], s[6][i], s[5][i], s[4][i], s[3][i], s[2][i], s[1][i], s[0][i]);
+}
+
+void AVX2_INLINE Scatter(uint32_t* const* s, int i, __m256i x)
+{
+    alignas(32) uint32_t v[8];
+    _mm256_store_si256((__m256i*)v, x);
+    for (int lane = 0; lane < 8; ++lane) s[lane][i] = v[lane];
+}
+} // namespace
+
+namespace sha256_avx2
+{
+AVX2_TARGET void Transform_8way(uint32_t* const* s, const unsigned char* const* chunk, size_t blocks)
+{
+    if (!blocks) return;
+    const unsigned char* in[8];
+    for (int lane = 0; lane < 8; ++lane) in[lane] = chunk[lane];
+    __m256i a = Gather(s, 0), b = Gather(s, 1), c = Gather(s, 2), d = Gather(s, 3);
+    __m256i e = Gather(s, 4), f = Gather(s, 5), g = Gather(s, 6), h = Gather(s, 7);
+    __m256i w[16];
+
+    while (blocks--) {
+        const __m256i sa = a, sb = b, sc = c, sd = d, se = e, sf = f, sg = g, sh = h;
+        for (int i = 0; i < 16; ++i) w[i] = Read8(in, 4 * i);
+        for (int i = 0; i < 64; i += 8) {
+            Round(a, b, c, d, e, f, g, h, Word(w, i));
+            Round(h, a, b, c, d, e, f, g, Word(w, i + 1));
+            Round(g, h, a, b, c, d, e, f, Word(w, i + 2));
+            Round(f, g, h, a, b, c, d, e, Word(w, i + 3));
+            Round(e, f, g, h, a, b, c, d, Word(w, i + 4));
+            Round(d, e, f, g, h, a, b, c, Word(w, i + 5));
+            Round(c, d, e, f, g, h, a, b, Word(w, i + 6));
+            Round(b, c, d, e, f, g, h, a, Word(w, i + 7));
+        }
+        a = Add(a, sa); b = Add(b, sb); c = Add(c, sc); d = Add(d, sd);
+        e = Add(e, se); f = Add(f, sf); g = Add(g, sg); h = Add(h, sh);
+        for (int lane = 0; lane < 8; ++lane) in[lane] += 64;
+    }
+
+    Scatter(s, 0, a); Scatter(s, 1, b); Scatter(s, 2, c); Scatter(s, 3, d);
+    Scatter(s, 4, e); Scatter(s, 5, f); Scatter(s, 6, g); Scatter(s, 7, h);
+}
+} // namespace sha256_avx2
+
+#endif // ENABLE_AVX2
@@ -9,6 +9,7 @@
 #include <crypto/sha256.h>
 #include <prevector.h>
 #include <serialize.h>
+#include <streams.h>
 #include <uint256.h>
 
 #include <vector>
@@ -84,4 +85,33 @@ uint256 SerializeHash(const T& obj, int nType=SER_GETHASH, int nVersion=PROTOCOL
     return ss.GetHash();
 }
 
+/** Compute the 256-bit hashes of the serializations of count objects at once (see SHA256D). */
+template<typename T>
+void SerializeHashes(const T* const* objs, size_t count, uint256* hashes, int nType=SER_GETHASH, int nVersion=PROTOCOL_VERSION)
+{
+    static_assert(sizeof(uint256) == CSHA256::OUTPUT_SIZE, "hashes must be laid out back to back");
+    if (!SHA256DMultiLane()) {
+        // gathering the serializations would only slow things down
+        for (size_t i = 0; i < count; ++i) hashes[i] = SerializeHash(*objs[i], nType, nVersion);
+        return;
+    }
+    if (!count) return;
+    std::vector<unsigned char> data;
+    data.reserve(count * 512);
+    std::vector<size_t> ends(count);
+    CVectorWriter writer(nType, nVersion, data, 0);
+    for (size_t i = 0; i < count; ++i) {
+        writer << *objs[i];
+        ends[i] = data.size();
+    }
+    std::vector<const unsigned char*> in(count);
+    std::vector<size_t> len(count);
+    for (size_t i = 0; i < count; ++i) {
+        size_t begin = i ? ends[i - 1] : 0;
+        in[i] = data.data() + begin;
+        len[i] = ends[i] - begin;
+    }
+    SHA256D(hashes->begin(), in.data(), len.data(), count);
+}
+
 #endif // BITCOIN_HASH_H
@@ -0,0 +1,348 @@
+// Copyright (c) 2018 The Bitcoin Core developers
+// Distributed under the MIT software license, see the accompanying
+// file COPYING or http://www.opensource.org/licenses/mit-license.php.
+
+// Throughput benchmark of the MFF write path (tx_entered, tx_left,
+// tx_discarded, confirm_block) and read path (iterate, for all events and
+// for block events only, iterate_static and iterate_batch), run against a
+// synthetic, deterministic workload written to a scratch directory.
+//
+// The workload is generated up front, so that only the MFF calls themselves
+// are measured. For each phase, one JSON object is printed on a line of its
+// own (the rest of the output goes to stderr), e.g.
+//
+//   {"bench":"mff","workload":"mainnet","phase":"write","events":500000,
+//    "seconds":1.23,"events_per_s":406504,"bytes_per_event":41.2,
+//    "allocs_per_event":3.1,"p50_ns":850,"p99_ns":9100}
+//
+// bytes_per_event is the on-disk size of the MFF directory divided by the
+// number of events, for all phases. allocs_per_event counts calls to
+// operator new. For the batched phase, p50_ns and p99_ns are per batch.
+
+#include <algorithm>
+#include <atomic>
+#include <chrono>
+#include <new>
+#include <random>
+
+#include <dirent.h>
+#include <sys/stat.h>
+
+#include <bcq/bitcoin.h>
+
+static std::atomic<uint64_t> g_allocs{0};
+
+void* operator new(size_t sz) {
+    ++g_allocs;
+    void* p = malloc(sz ? sz : 1);
+    if (!p) throw std::bad_alloc();
+    return p;
+}
+void operator delete(void* p) noexcept { free(p); }
+
+/**
+ * Relative frequencies of the various events. Every block_interval mempool
+ * events, a block confirming up to block_txs of the mempool's txs is mined;
+ * reorg_per_mille of those replace the current tip instead of extending it.
+ */
+struct workload {
+    const char* name;
+    unsigned enter, leave, discard;
+    size_t block_interval;
+    size_t block_txs;
+    unsigned reorg_per_mille;
+};
+
+static const workload workloads[] = {
+    // mostly new txs, the occasional eviction or replacement, blocks clearing most of the mempool
+    {"mainnet", 90, 6, 4, 2000, 2500, 5},
+    // a congested mempool: lots of evictions and replacements, small blocks, frequent reorgs
+    {"churn",   60, 25, 15, 500, 400, 50},
+    // the mix of the randomized sequences in test/test-cq-bitcoin.cpp: tiny blocks, every other one a reorg
+    {"random",  57, 29, 14, 3, 20, 500},
+};
+
+struct op {
+    enum type_t { enter, leave, discard, block } type;
+    long timestamp;
+    std::shared_ptr<bitcoin::tx> x;
+    std::shared_ptr<bitcoin::tx> offender;
+    uint8_t reason{0};
+    std::vector<uint8_t> rawtx;
+    uint32_t height{0};
+    uint256 hash;
+    std::set<std::shared_ptr<bitcoin::tx>> txs;
+};
+
+struct generator {
+    std::mt19937_64 m_rng;
+    cq::compressor<uint256>* m_compressor;
+    std::vector<std::shared_ptr<bitcoin::tx>> m_pool;
+
+    generator(uint64_t seed, cq::compressor<uint256>* compressor) : m_rng(seed), m_compressor(compressor) {}
+
+    uint256 hash() {
+        uint256 h;
+        for (int i = 0; i < 4; ++i) {
+            uint64_t v = m_rng();
+            memcpy(h.begin() + i * 8, &v, 8);
+        }
+        return h;
+    }
+
+    std::shared_ptr<bitcoin::tx> tx() {
+        auto t = std::make_shared<bitcoin::tx>(m_compressor);
+        t->m_hash = hash();
+        size_t vin = 1 + m_rng() % 3;
+        for (size_t i = 0; i < vin; ++i) {
+            // a third of the inputs spend mempool txs
+            bool chained = !m_pool.empty() && m_rng() % 3 == 0;
+            t->m_vin.emplace_back(m_rng() % 3, chained ? m_pool[m_rng() % m_pool.size()]->m_hash : hash());
+        }
+        size_t vout = 1 + m_rng() % 3;
+        for (size_t i = 0; i < vout; ++i) t->m_vout.push_back(1000 + m_rng() % 100000000);
+        t->m_weight = 400 + 272 * vin + 124 * vout + m_rng() % 200;
+        t->m_fee = t->vsize() * (1 + m_rng() % 100);
+        return t;
+    }
+
+    std::shared_ptr<bitcoin::tx> take(size_t index) {
+        auto t = m_pool[index];
+        m_pool[index] = m_pool.back();
+        m_pool.pop_back();
+        return t;
+    }
+
+    std::shared_ptr<bitcoin::tx> take_random() { return take(m_rng() % m_pool.size()); }
+
+    void generate(const workload& w, size_t events, std::vector<op>& ops) {
+        long timestamp = 1550000000;
+        uint32_t height = 560000;
+        unsigned total = w.enter + w.leave + w.discard;
+        size_t since_block = 0;
+        while (ops.size() < events) {
+            ops.emplace_back();
+            op& o = ops.back();
+            timestamp += m_rng() % 3;
+            o.timestamp = timestamp;
+            if (since_block++ == w.block_interval) {
+                since_block = 0;
+                o.type = op::block;
+                bool reorg = height > 560001 && m_rng() % 1000 < w.reorg_per_mille;
+                o.height = reorg ? height : ++height;
+                o.hash = hash();
+                size_t count = std::min(w.block_txs, m_pool.size());
+                for (size_t i = 0; i < count; ++i) o.txs.insert(take_random());
+                // some txs are only ever seen in blocks
+                for (size_t i = count / 20; i > 0; --i) o.txs.insert(tx());
+                continue;
+            }
+            unsigned r = m_rng() % total;
+            if (r < w.enter || m_pool.size() < 2) {
+                o.type = op::enter;
+                o.x = tx();
+                m_pool.push_back(o.x);
+            } else if (r < w.enter + w.leave) {
+                o.type = op::leave;
+                o.x = take_random();
+                o.reason = m_rng() % 2 ? bitcoin::mff::reason_expired : bitcoin::mff::reason_sizelimit;
+            } else {
+                o.type = op::discard;
+                o.x = take_random();
+                if (m_rng() % 2) {
+                    // replaced by a tx we have not seen (yet)
+                    o.offender = tx();
+                    o.reason = bitcoin::mff::reason_replaced;
+                } else {
+                    // double spent by a tx in the mempool
+                    o.offender = m_pool[m_rng() % m_pool.size()];
+                    o.reason = bitcoin::mff::reason_conflict;
+                }
+                o.rawtx.resize(150 + m_rng() % 300);
+                for (auto& b : o.rawtx) b = m_rng();
+            }
+        }
+    }
+};
+
+/** Counts events without doing anything else, so that only the decoding is measured. */
+struct counting_delegate : public bitcoin::mff_delegate {
+    size_t txs{0}, txids{0}, forgotten{0}, discarded{0}, blocks{0}, reorgs{0};
+    virtual void receive_transaction(std::shared_ptr<bitcoin::tx> x) override { ++txs; }
+    virtual void receive_transaction_with_txid(const uint256& txid) override { ++txids; }
+    virtual void forget_transaction_with_txid(const uint256& txid, uint8_t reason) override { ++forgotten; }
+    virtual void discard_transaction_with_txid(const uint256& txid, const std::vector<uint8_t>& rawtx, uint8_t reason, const uint256* cause = nullptr) override { ++discarded; }
+    virtual void block_confirmed(const bitcoin::block& b) override { ++blocks; }
+    virtual void block_reorged(uint32_t height) override { ++reorgs; }
+    virtual void iterated(long starting_pos, long resulting_pos) override {}
+};
+
+/** The counterpart of counting_delegate for mff::iterate_static(). */
+struct static_counting_delegate : public bitcoin::mff_static_delegate {
+    size_t txs{0}, txids{0}, forgotten{0}, discarded{0}, blocks{0}, reorgs{0};
+    void receive_transaction(const std::shared_ptr<bitcoin::tx>& x) { ++txs; }
+    void receive_transaction_with_txid(const uint256& txid) { ++txids; }
+    void forget_transaction_with_txid(const uint256& txid, uint8_t reason) { ++forgotten; }
+    void discard_transaction_with_txid(const uint256& txid, const std::vector<uint8_t>& rawtx, uint8_t reason, const uint256* cause) { ++discarded; }
+    void block_confirmed(const bitcoin::block& b) { ++blocks; }
+    void block_reorged(uint32_t height) { ++reorgs; }
+};
+
+/** The batched counterpart of counting_delegate (see mff::iterate_batch()). */
+struct counting_batch_delegate : public bitcoin::mff_batch_delegate {
+    size_t counts[8] = {0};
+    size_t blocks{0};
+    virtual void process_events(const bitcoin::mff_event* events, size_t count) override {
+        for (size_t i = 0; i < count; ++i) ++counts[events[i].cmd];
+        blocks = counts[bitcoin::mff::cmd_block_mined];
+    }
+};
+
+static uint64_t dir_size(const std::string& path) {
+    uint64_t size = 0;
+    DIR* dir = opendir(path.c_str());
+    if (!dir) return 0;
+    while (struct dirent* ent = readdir(dir)) {
+        struct stat st;
+        if (ent->d_name[0] != '.' && !stat((path + "/" + ent->d_name).c_str(), &st) && S_ISREG(st.st_mode)) size += st.st_size;
+    }
+    closedir(dir);
+    return size;
+}
+
+struct phase_stats {
+    std::vector<uint32_t> latencies;
+    double seconds{0};
+    uint64_t allocs{0};
+    size_t events{0};  // if not one per latency (i.e. for batches)
+
+    void report(const char* workload, const char* phase, uint64_t bytes) {
+        size_t samples = latencies.size();
+        size_t n = events ? events : samples;
+        std::sort(latencies.begin(), latencies.end());
+        uint32_t p50 = samples ? latencies[samples / 2] : 0;
+        uint32_t p99 = samples ? latencies[std::min(samples - 1, samples * 99 / 100)] : 0;
+        printf("{\"bench\":\"mff\",\"workload\":\"%s\",\"phase\":\"%s\",\"events\":%zu,\"seconds\":%.3f,\"events_per_s\":%.0f,"
+               "\"bytes_per_event\":%.2f,\"allocs_per_event\":%.2f,\"p50_ns\":%u,\"p99_ns\":%u}\n",
+               workload, phase, n, seconds, n / seconds, n ? (double)bytes / n : 0., n ? (double)allocs / n : 0., p50, p99);
+        fflush(stdout);
+    }
+};
+
+typedef std::chrono::steady_clock bench_clock;
+
+static inline uint32_t elapsed_ns(const bench_clock::time_point& start, const bench_clock::time_point& end) {
+    return std::chrono::duration_cast<std::chrono::nanoseconds>(end - start).count();
+}
+
+enum replay_mode {
+    replay_virtual,     // iterate(), through mff_delegate
+    replay_static,      // iterate_static()
+    replay_batched,     // iterate_batch()
+};
+
+static const size_t replay_batch_size = 256;
+
+/**
+ * Read the recording back, passing the events in mask on to a counting
+ * delegate. For batches, the latencies are those of whole batches.
+ */
+static bool replay(const std::string& dbpath, replay_mode mode, uint8_t mask, size_t events, size_t blocks, phase_stats& stats) {
+    fprintf(stderr, "reading (mode %d, mask %02x)\n", mode, mask);
+    counting_delegate counter;
+    static_counting_delegate static_counter;
+    counting_batch_delegate batch_counter;
+    auto mff = std::make_shared<bitcoin::mff>(dbpath, "mff", 2016, true);
+    mff->m_delegate = &counter;
+    mff->load();
+    mff->goto_segment(560000);
+    mff->m_current_time = 0;
+    stats.latencies.reserve(events * 2);
+    uint64_t allocs = g_allocs;
+    auto start = bench_clock::now();
+    for (;;) {
+        auto t = bench_clock::now();
+        if (mode == replay_batched) {
+            size_t count = mff->iterate_batch(batch_counter, replay_batch_size, mask);
+            if (!count) break;
+            stats.events += count;
+        } else if (mode == replay_static) {
+            if (!mff->iterate_static(static_counter, mask)) break;
+        } else if (!mff->iterate(mask)) break;
+        stats.latencies.push_back(elapsed_ns(t, bench_clock::now()));
+    }
+    stats.seconds = std::chrono::duration<double>(bench_clock::now() - start).count();
+    stats.allocs = g_allocs - allocs;
+    size_t replayed = mode == replay_batched ? batch_counter.blocks : mode == replay_static ? static_counter.blocks : counter.blocks;
+    if (replayed < blocks) {
+        fprintf(stderr, "replay came up short: %zu of %zu blocks\n", replayed, blocks);
+        return false;
+    }
+    return true;
+}
+
+int main(int argc, const char** argv) {
+    if (argc < 2 || argc > 5) {
+        fprintf(stderr, "syntax: %s <scratch dir> [<workload>=mainnet [<events>=500000 [<seed>=1]]]\n", argv[0]);
+        fprintf(stderr, "workloads:");
+        for (const auto& w : workloads) fprintf(stderr, " %s", w.name);
+        fprintf(stderr, "\nthe scratch dir is erased before use\n");
+        return 1;
+    }
+    const std::string dbpath = argv[1];
+    const workload* w = nullptr;
+    std::string workload_name = argc > 2 ? argv[2] : "mainnet";
+    for (const auto& candidate : workloads) if (workload_name == candidate.name) w = &candidate;
+    if (!w) {
+        fprintf(stderr, "unknown workload %s\n", workload_name.c_str());
+        return 1;
+    }
+    size_t events = argc > 3 ? atoll(argv[3]) : 500000;
+    uint64_t seed = argc > 4 ? atoll(argv[4]) : 1;
+
+    cq::rmdir_r(dbpath);
+    phase_stats write_stats, read_stats, read_static_stats, read_blocks_stats, read_batched_stats;
+    size_t blocks = 0;
+
+    {
+        auto mff = std::make_shared<bitcoin::mff>(dbpath);
+        mff->load();
+        mff->begin_segment(560000);
+
+        fprintf(stderr, "generating %zu events (workload %s, seed %" PRIu64 ")\n", events, w->name, seed);
+        std::vector<op> ops;
+        ops.reserve(events);
+        generator(seed, mff.get()).generate(*w, events, ops);
+        write_stats.latencies.reserve(ops.size());
+
+        fprintf(stderr, "writing\n");
+        uint64_t allocs = g_allocs;
+        auto start = bench_clock::now();
+        for (const auto& o : ops) {
+            auto t = bench_clock::now();
+            switch (o.type) {
+            case op::enter:   mff->tx_entered(o.timestamp, o.x); break;
+            case op::leave:   mff->tx_left(o.timestamp, o.x, o.reason); break;
+            case op::discard: mff->tx_discarded(o.timestamp, o.x, o.rawtx, o.reason, o.offender); break;
+            case op::block:   mff->confirm_block(o.timestamp, o.height, o.hash, o.txs); ++blocks; break;
+            }
+            write_stats.latencies.push_back(elapsed_ns(t, bench_clock::now()));
+        }
+        write_stats.seconds = std::chrono::duration<double>(bench_clock::now() - start).count();
+        write_stats.allocs = g_allocs - allocs;
+    }
+    uint64_t bytes = dir_size(dbpath);
+    write_stats.report(w->name, "write", bytes);
+
+    static const uint8_t block_events = bitcoin::mff::event_mask(bitcoin::mff::cmd_block_mined) | bitcoin::mff::event_mask(bitcoin::mff::cmd_block_unmined);
+    if (!replay(dbpath, replay_virtual, bitcoin::mff::mask_all, events, blocks, read_stats)) return 1;
+    read_stats.report(w->name, "read", bytes);
+    if (!replay(dbpath, replay_static, bitcoin::mff::mask_all, events, blocks, read_static_stats)) return 1;
+    read_static_stats.report(w->name, "read_static", bytes);
+    if (!replay(dbpath, replay_virtual, block_events, events, blocks, read_blocks_stats)) return 1;
+    read_blocks_stats.report(w->name, "read_blocks", bytes);
+    if (!replay(dbpath, replay_batched, bitcoin::mff::mask_all, events, blocks, read_batched_stats)) return 1;
+    read_batched_stats.report(w->name, "read_batched", bytes);
+
+    cq::rmdir_r(dbpath);
+}
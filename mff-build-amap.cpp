@@ -0,0 +1,277 @@
+// Copyright (c) 2018 The Bitcoin Core developers
+// Distributed under the MIT software license, see the accompanying
+// file COPYING or http://www.opensource.org/licenses/mit-license.php.
+
+// Builds the amap directory (see amap.h) from the block data cache written by
+// tiny::rpc (blockdata/<hash>.mffb: a 4 byte height followed by the block), or
+// from the blocks in a store (see tinystore.h), if given a store directory.
+//
+// This is an external distribution sort in two passes:
+// 1. the block files are split between worker threads, which decode them
+//    and append (txid, output amounts) records to one of 256 spill buckets,
+//    picked by the low byte of the amap prefix; each thread keeps its own
+//    in-memory buffers and spill files, so no locking is needed, and flushes
+//    them to disk whenever they exceed the thread's share of the memory limit
+// 2. the buckets are loaded one at a time per thread, split into their 256
+//    prefixes, sorted and written out (atomically) as amap tables; as many
+//    buckets are processed in parallel as the memory limit allows
+//
+// Nothing is written to the amap directory until every block has been read.
+
+#include <atomic>
+#include <thread>
+
+#include <dirent.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+#include <amap.h>
+#include <streams.h>
+#include <tinyblock.h>
+#include <tinyformat.h>
+#include <tinyfs.h>
+#include <tinystore.h>
+#include <utiltime.h>
+
+static const size_t BUCKETS = 256;
+
+// rough ratio between the in-memory and spilled size of a record
+static const size_t SPILL_EXPANSION = 3;
+
+struct spill_writer {
+    const std::string& m_spill_path;
+    size_t m_thread;
+    size_t m_limit;
+    size_t m_buffered{0};
+    std::vector<CDataStream> m_buffers;
+
+    spill_writer(const std::string& spill_path, size_t thread, size_t limit) : m_spill_path(spill_path), m_thread(thread), m_limit(limit), m_buffers(BUCKETS, CDataStream(SER_DISK, 0)) {}
+
+    void push(const tiny::tx& t) {
+        CDataStream& ds = m_buffers[t.hash.begin()[0]];
+        size_t before = ds.size();
+        ds.write((const char*)t.hash.begin(), 32);
+        size_t count = t.vout.size();
+        ds << VARINT(count);
+        for (const auto& out : t.vout) {
+            uint64_t amt = out.value;
+            ds << VARINT(amt);
+        }
+        m_buffered += ds.size() - before;
+        if (m_buffered > m_limit) flush();
+    }
+
+    void flush() {
+        for (size_t bucket = 0; bucket < BUCKETS; ++bucket) {
+            CDataStream& ds = m_buffers[bucket];
+            if (ds.empty()) continue;
+            std::string fname = m_spill_path + strprintf("/%02zx.%zu", bucket, m_thread);
+            FILE* fp = fopen(fname.c_str(), "ab");
+            if (!fp || fwrite(ds.data(), 1, ds.size(), fp) != ds.size()) {
+                fprintf(stderr, "unable to write spill file %s\n", fname.c_str());
+                exit(1);
+            }
+            fclose(fp);
+            // do not hang on to the capacity of buckets that happened to be large
+            ds = CDataStream(SER_DISK, 0);
+        }
+        m_buffered = 0;
+    }
+};
+
+static bool list_block_files(const std::string& path, std::vector<std::string>& files) {
+    DIR* dir = opendir(path.c_str());
+    if (!dir) return false;
+    while (struct dirent* ent = readdir(dir)) {
+        size_t len = strlen(ent->d_name);
+        if (len > 5 && !strcmp(&ent->d_name[len - 5], ".mffb")) files.push_back(path + "/" + ent->d_name);
+    }
+    closedir(dir);
+    return true;
+}
+
+static void clear_dir(const std::string& path) {
+    DIR* dir = opendir(path.c_str());
+    if (!dir) return;
+    while (struct dirent* ent = readdir(dir)) {
+        if (ent->d_name[0] != '.') unlink((path + "/" + ent->d_name).c_str());
+    }
+    closedir(dir);
+}
+
+static inline long fsize(const std::string& path) {
+    struct stat st;
+    return stat(path.c_str(), &st) ? 0 : st.st_size;
+}
+
+int main(int argc, const char** argv) {
+    if (argc < 3 || argc > 5) {
+        fprintf(stderr, "syntax: %s <blockdata or store path> <amap path> [<threads> [<memory limit (MB)>=1024]]\n", argv[0]);
+        return 1;
+    }
+
+    const std::string blockdata_path = argv[1];
+    const std::string amap_path = argv[2];
+    size_t threads = argc > 3 ? atoi(argv[3]) : std::thread::hardware_concurrency();
+    size_t memory_limit = (argc > 4 ? atoll(argv[4]) : 1024) << 20;
+    if (threads < 1) threads = 1;
+    const std::string spill_path = amap_path + "/.spill";
+
+    std::vector<std::string> files;
+    tiny::store store;
+    std::vector<uint256> store_blocks;
+    bool from_store = access((blockdata_path + "/store.dat").c_str(), F_OK) == 0;
+    if (from_store) {
+        if (!store.open(blockdata_path)) return 1;
+        store.keys(tiny::store::block, store_blocks);
+        if (store_blocks.empty()) {
+            fprintf(stderr, "no blocks found in store %s\n", blockdata_path.c_str());
+            return 1;
+        }
+    } else {
+        if (!list_block_files(blockdata_path, files)) {
+            fprintf(stderr, "unable to open directory %s\n", blockdata_path.c_str());
+            return 1;
+        }
+        if (files.empty()) {
+            fprintf(stderr, "no block files (*.mffb) found in %s\n", blockdata_path.c_str());
+            return 1;
+        }
+    }
+    const size_t block_count = from_store ? store_blocks.size() : files.size();
+    mkdir(amap_path.c_str(), 0777);
+    mkdir(spill_path.c_str(), 0777);
+    // leftovers from an aborted run would otherwise be picked up below
+    clear_dir(spill_path);
+    int64_t start_time = GetTime();
+
+    // pass 1: distribute the txs of every block into the spill buckets
+
+    printf("reading %zu blocks using %zu threads\n", block_count, threads);
+    std::atomic<size_t> next_file{0};
+    std::atomic<size_t> blocks_done{0};
+    std::atomic<uint64_t> txs_done{0};
+    std::atomic<bool> failed{false};
+    std::vector<std::thread> workers;
+    for (size_t i = 0; i < threads; ++i) {
+        workers.emplace_back([&, i]() {
+            spill_writer spill(spill_path, i, memory_limit / threads / SPILL_EXPANSION);
+            tiny::block b;
+            for (size_t f = next_file++; f < block_count && !failed; f = next_file++) {
+                tiny::mapped_file file;
+                try {
+                    if (from_store) {
+                        // decoded straight out of the store's mapping
+                        const uint8_t* data;
+                        size_t len;
+                        if (!store.get(tiny::store::block, store_blocks[f], data, len) || len < sizeof(uint32_t)) throw std::ios_base::failure("missing block");
+                        CSpanReader r(SER_DISK, 0, data + sizeof(uint32_t), data + len); // skip the height
+                        r >> b;
+                    } else {
+                        if (!file.open(files[f])) throw std::ios_base::failure("unable to open file");
+                        CSpanReader r = file.reader(sizeof(uint32_t)); // skip the height
+                        r >> b;
+                    }
+                } catch (const std::ios_base::failure& e) {
+                    fprintf(stderr, "\nfailed to read block %s: %s\n", from_store ? store_blocks[f].ToString().c_str() : files[f].c_str(), e.what());
+                    failed = true;
+                    break;
+                }
+                for (const auto& t : b.vtx) spill.push(t);
+                txs_done += b.vtx.size();
+                ++blocks_done;
+            }
+            spill.flush();
+        });
+    }
+    while (blocks_done < block_count && !failed) {
+        printf(" [%5.2f%%] %zu/%zu blocks, %" PRIu64 " txs     \r", 100.f * blocks_done / block_count, size_t(blocks_done), block_count, uint64_t(txs_done));
+        fflush(stdout);
+        std::this_thread::sleep_for(std::chrono::milliseconds(500));
+    }
+    for (auto& w : workers) w.join();
+    workers.clear();
+    if (failed) {
+        fprintf(stderr, "aborting; the amap directory was not touched\n");
+        return 1;
+    }
+    printf("\n%zu blocks, %" PRIu64 " txs read in %" PRIi64 " s\n", block_count, uint64_t(txs_done), GetTime() - start_time);
+
+    // pass 2: sort each bucket and write out its tables
+
+    std::vector<std::vector<std::string>> bucket_files(BUCKETS);
+    size_t largest_bucket = 0;
+    for (size_t bucket = 0; bucket < BUCKETS; ++bucket) {
+        size_t bucket_size = 0;
+        for (size_t t = 0; t < threads; ++t) {
+            std::string fname = spill_path + strprintf("/%02zx.%zu", bucket, t);
+            long sz = fsize(fname);
+            if (sz == 0) continue;
+            bucket_files[bucket].push_back(fname);
+            bucket_size += sz;
+        }
+        largest_bucket = std::max(largest_bucket, bucket_size);
+    }
+    size_t sorters = std::min(threads, std::max<size_t>(1, memory_limit / std::max<size_t>(1, largest_bucket * SPILL_EXPANSION)));
+    if (largest_bucket * SPILL_EXPANSION > memory_limit) {
+        fprintf(stderr, "warning: the largest bucket (%zu MB) exceeds the memory limit on its own\n", largest_bucket >> 20);
+    }
+    printf("writing tables using %zu threads (largest bucket: %zu MB)\n", sorters, largest_bucket >> 20);
+
+    std::atomic<size_t> next_bucket{0};
+    std::atomic<size_t> buckets_done{0};
+    for (size_t i = 0; i < sorters; ++i) {
+        workers.emplace_back([&]() {
+            std::vector<std::vector<std::pair<uint256, amap::amount_list_t>>> tables(256);
+            for (size_t bucket = next_bucket++; bucket < BUCKETS && !failed; bucket = next_bucket++) {
+                for (const auto& fname : bucket_files[bucket]) {
+                    tiny::mapped_file file;
+                    if (!file.open(fname)) {
+                        fprintf(stderr, "\nunable to open spill file %s\n", fname.c_str());
+                        failed = true;
+                        return;
+                    }
+                    CSpanReader r = file.reader();
+                    while (!r.empty()) {
+                        uint256 txid;
+                        r.read((char*)txid.begin(), 32);
+                        auto& table = tables[txid.begin()[1]];
+                        table.emplace_back(txid, amap::amount_list_t());
+                        auto& amounts = table.back().second;
+                        size_t count;
+                        uint64_t amt;
+                        r >> VARINT(count);
+                        amounts.resize(count);
+                        for (size_t j = 0; j < count; ++j) {
+                            r >> VARINT(amt);
+                            amounts[j] = amt;
+                        }
+                    }
+                }
+                for (size_t hi = 0; hi < 256; ++hi) {
+                    amap::prefix_t prefix;
+                    uint8_t bytes[2] = {uint8_t(bucket), uint8_t(hi)};
+                    memcpy(&prefix, bytes, amap::prefix_len);
+                    if (!amap::write_table(amap_path, prefix, tables[hi])) {
+                        fprintf(stderr, "\nunable to write amap table %x in %s\n", prefix, amap_path.c_str());
+                        failed = true;
+                        return;
+                    }
+                    tables[hi].clear();
+                    tables[hi].shrink_to_fit();
+                }
+                for (const auto& fname : bucket_files[bucket]) unlink(fname.c_str());
+                ++buckets_done;
+            }
+        });
+    }
+    while (buckets_done < BUCKETS && !failed) {
+        printf(" [%5.2f%%] %zu/%zu buckets     \r", 100.f * buckets_done / BUCKETS, size_t(buckets_done), BUCKETS);
+        fflush(stdout);
+        std::this_thread::sleep_for(std::chrono::milliseconds(500));
+    }
+    for (auto& w : workers) w.join();
+    if (failed) return 1;
+    rmdir(spill_path.c_str());
+    printf("\namap written to %s in %" PRIi64 " s\n", amap_path.c_str(), GetTime() - start_time);
+}
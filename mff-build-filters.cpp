@@ -0,0 +1,74 @@
+// Copyright (c) 2018 The Bitcoin Core developers
+// Distributed under the MIT software license, see the accompanying
+// file COPYING or http://www.opensource.org/licenses/mit-license.php.
+
+// Builds the segment filters (see bcq/segfilter.h) of an MFF recording. The
+// writer builds filters as it goes, but only for the segments it started
+// itself, so recordings made before filters existed, or segments which were
+// resumed after a restart, have none; this fills in the gaps. Segments with an
+// up to date filter are skipped, unless --force is given.
+
+#include <utiltime.h>
+
+#include <bcq/bitcoin.h>
+#include <bcq/segfilter.h>
+
+static const uint32_t cluster_size = 2016;
+
+int main(int argc, const char** argv) {
+    if (argc < 2 || argc > 3 || (argc == 3 && strcmp(argv[2], "--force"))) {
+        fprintf(stderr, "syntax: %s <db path> [--force]\n", argv[0]);
+        return 1;
+    }
+    const std::string dbpath = argv[1];
+    bool force = argc == 3;
+
+    auto mff = std::make_shared<bitcoin::mff>(dbpath, bitcoin::mff::detect_prefix(dbpath), cluster_size, true);
+    mff->load();
+    bitcoin::mff_analyzer azr;
+    mff->m_delegate = &azr;
+    mff->rewind();
+
+    std::string segment_path;
+    cq::id cluster = 0;
+    std::vector<uint64_t> keys;
+    std::set<uint256> touched_txids;
+    size_t built = 0, skipped = 0, failed = 0;
+    int64_t start_time = GetTime();
+
+    auto finish_segment = [&]() {
+        if (segment_path.empty()) return;
+        struct stat st;
+        bitcoin::segment_filter filter;
+        filter.build(keys);
+        if (stat(segment_path.c_str(), &st) || !filter.save(segment_path, st.st_size)) {
+            fprintf(stderr, "\nunable to write the filter for %s\n", segment_path.c_str());
+            ++failed;
+        } else {
+            printf("%s: %zu keys, %zu bytes\n", bitcoin::segment_filter::path_for(segment_path).c_str(), keys.size(), filter.size() / 8);
+            ++built;
+        }
+        segment_path.clear();
+        keys.clear();
+    };
+
+    while (mff->iterate()) {
+        if (segment_path.empty() || segment_path != mff->m_file->get_path()) {
+            finish_segment();
+            cluster = mff->get_registry().m_current_cluster;
+            bitcoin::segment_filter existing;
+            if (!force && existing.load(mff->m_file->get_path())) {
+                ++skipped;
+                mff->goto_segment((cluster + 1) * cluster_size);
+                if (!mff->m_file || mff->get_registry().m_current_cluster <= cluster) break;
+                continue;
+            }
+            segment_path = mff->m_file->get_path();
+        }
+        azr.populate_touched_txids(touched_txids);
+        for (const auto& txid : touched_txids) keys.push_back(bitcoin::segment_filter::fingerprint(txid));
+    }
+    finish_segment();
+    printf("%zu filters built, %zu up to date, %zu failed, in %" PRIi64 " s\n", built, skipped, failed, GetTime() - start_time);
+    return failed ? 1 : 0;
+}
@@ -4,6 +4,8 @@
 #include <utiltime.h>
 
 #include <bcq/bitcoin.h>
+#include <bcq/segfilter.h>
+#include <bcq/txindex.h>
 
 #include <streams.h>
 #include <tinytx.h>
@@ -12,13 +14,22 @@ inline char* time_string(int64_t time);
 inline char* size_string(long size);
 
 bool txid_in_vtx(const uint256& txid, const std::vector<std::shared_ptr<bitcoin::tx>>& vtx);
+void show_event(bitcoin::mff& f, const bitcoin::mff_analyzer& azr, const uint256& txid);
+int find_indexed(bitcoin::mff& f, bitcoin::mff_analyzer& azr, const bitcoin::tx_index& index, const uint256& txid, uint32_t block_start, uint32_t block_end, int64_t time_start, int64_t time_end);
+int find_scanned(bitcoin::mff& f, bitcoin::mff_analyzer& azr, const uint256& txid, uint32_t block_start, uint32_t block_end, int64_t time_start, int64_t time_end);
+void seek_start(bitcoin::mff& f, uint32_t block_start, int64_t time_start);
 
 std::string txid_str(const uint256& txid) { return txid.ToString(); }
 void parse_range(const char* expr, uint32_t& block_start, uint32_t& block_end, int64_t& time_start, int64_t& time_end);
 
 int main(int argc, const char** argv) {
-    if (argc < 3 || argc > 4) {
-        fprintf(stderr, "syntax: %s <db path> <txid> [blocks=<block-range>] [period=<time-range>]\n", argv[0]);
+    if (argc < 3 || argc > 5) {
+        fprintf(stderr, "syntax: %s <db path> <txid> [blocks=<block-range>] [period=<time-range>] [--hits-only]\n", argv[0]);
+        fprintf(stderr, "by default, the recording is scanned, and every event touching the txid is shown, along with every\n"
+                        "tx invalidated other than by an RBF follow-up, and the recording's statistics at the end\n"
+                        "--hits-only: only show the events touching the txid, and no statistics; this uses the txid\n"
+                        "             index (see mff-index) if there is one, and scans the recording otherwise,\n"
+                        "             skipping the segments whose filter (see mff-build-filters) rules out the txid\n");
         return 1;
     }
 
@@ -29,7 +40,10 @@ int main(int argc, const char** argv) {
 
     const auto& dbpath = argv[1];
     const auto& txidstr = argv[2];
-    if (argc > 3) parse_range(argv[3], block_start, block_end, time_start, time_end);
+    bool hits_only = false;
+    for (int i = 3; i < argc; ++i) {
+        if (!strcmp(argv[i], "--hits-only")) hits_only = true; else parse_range(argv[i], block_start, block_end, time_start, time_end);
+    }
 
     const uint256 txid = uint256S(argv[2]);
 
@@ -42,18 +56,16 @@ int main(int argc, const char** argv) {
     bitcoin::mff_analyzer azr;
     mff->m_delegate = &azr;
 
-    if (block_start == 0 && time_start == 0) {
-        // rewind to the beginning
-        f.rewind();
-    } else if (block_start) {
-        // go to block cluster
-        uint32_t starting_block = (block_start / 2016) * 2016;
-        f.goto_segment(starting_block);
-    } else {
-        // go to time
-        fprintf(stderr, "time range not yet implemented but it'll be great; in the meantime, using starting time 0 (end time is supported)\n");
-        exit(1);
+    if (hits_only) {
+        // if the recording has been indexed (by mff-index), go straight to the events touching the txid
+        bitcoin::tx_index index(bitcoin::tx_index::path_for(dbpath, bitcoin::mff::detect_prefix(dbpath)));
+        if (index.open()) return find_indexed(f, azr, index, txid, block_start, block_end, time_start, time_end);
+        fprintf(stderr, "no txid index (see mff-index); scanning the recording\n");
+        seek_start(f, block_start, time_start);
+        return find_scanned(f, azr, txid, block_start, block_end, time_start, time_end);
     }
+
+    seek_start(f, block_start, time_start);
     // f.goto_segment(546336);
 
     // start iterating through; if we encounter the transaction, show info about it
@@ -68,6 +80,7 @@ int main(int argc, const char** argv) {
     while (f.iterate()) {
         if (block_end && f.m_chain.m_tip > block_end) break;
         if (time_end && f.m_current_time > time_end) break;
+        if (time_start && f.m_current_time < time_start) continue;
         if (!internal_start_time) {
             internal_start_time = f.m_current_time;
             printf("%s: ----log begins----\n", time_string(internal_start_time));
@@ -96,58 +109,7 @@ int main(int argc, const char** argv) {
             } else force_show = true;
         }
         azr.populate_touched_txids(touched_txids);
-        if (touched_txids.count(txid) || force_show) {
-            printf("%s: %s", time_string(mff->m_current_time), bitcoin::cmd_string(azr.last_command).c_str());
-            if (azr.last_command == bitcoin::mff::cmd_mempool_invalidated) {
-                tiny::tx inv;
-                CDataStream ds(azr.last_rawtx, SER_DISK, PROTOCOL_VERSION);
-                ds >> inv;
-                printf(" %s (%s)\n%s", txid_str(azr.last_txids.back()).c_str(), bitcoin::reason_string(azr.last_reason).c_str(), inv.ToString().c_str());
-                if (!azr.last_cause.IsNull()) {
-                    uint256 replacement = azr.last_cause;
-                    printf(" -> %s", txid_str(replacement).c_str());
-                }
-            } else if (azr.last_command == bitcoin::mff::cmd_mempool_out) {
-                printf(" %s (%s)", txid_str(azr.last_txids.back()).c_str(), bitcoin::reason_string(azr.last_reason).c_str());
-            } else if (azr.last_command == bitcoin::mff::cmd_mempool_in) {
-                if (azr.last_txs.size()) {
-                    // recorded
-                    const auto& t = azr.last_txs.back();
-                    // printf("\n\t%s\n", t->to_string().c_str());
-                    std::string extra = "";
-                    // check if any of our targeted tx's is spent by this tx
-                    // for (const tracked& tracked2 : txids) {
-                    //     uint32_t index;
-                    //     if (t->spends(tracked2.txid, azr.seqs[tracked2.txid], index)) {
-                    //         extra += std::string(" (spends ") + txid_str(tracked2.txid) + ":" + std::to_string(index) + ")";
-                    //         if (tracked2.depth > 0 && txids.find(tracked{t->id}) == txids.end()) {
-                    //             txids.insert(tracked{tracked2, t->id});
-                    //         }
-                    //     }
-                    // }
-                    // if (!t->is(txid) && extra == "") {
-                    // //     // printf(" (");
-                    // // } else if (t->spends(txid, azr.seqs[txid])) {
-                    // //     extra = std::string(" (spends ") + txid_str(txid) + ")";
-                    // //     // printf(" (spends %s: ", txid_str(txid).c_str());
-                    // // } else {
-                    //     extra = " (?)";
-                    //     // printf(" (???: ");
-                    // }
-                    printf(" (first seen %s%s - %" PRIu64 " vbytes, %" PRIu64 " fee, %.3lf fee rate (sat/vb), block #%u)", txid_str(t->m_hash).c_str(), extra.c_str(), t->vsize(), t->m_fee, t->feerate(), mff->m_chain.m_tip);
-                    // const mff::tx& t = *azr.txs[azr.seqs[txid]];
-                    // printf(" (txid seq=%" PRIu64 ") %s", azr.seqs[txid], t->to_string().c_str());
-                    // for (const auto& x : t->vin) if (x.is_known()) printf("\n- %" PRIu64 " = %s", x.get_seq(), azr.txs[x.get_seq()]->id.ToString().c_str());
-                    // we don't wanna bother with tracking TX_REC for multiple txids so we just break the loop here
-                } else {
-                    // re-entry
-                    printf(" (%s)", txid_str(azr.last_txids.back()).c_str());
-                }
-            } else if (azr.last_command == bitcoin::mff::cmd_block_mined) {
-                printf(" (%s in #%u=%s)", txid_str(txid).c_str(), mff->m_chain.m_tip, mff->m_chain.get_blocks().size() > 0 ? mff->m_chain.get_blocks().back()->m_hash.ToString().c_str() : "???");
-            }
-            fputc('\n', stdout);
-        }
+        if (touched_txids.count(txid) || force_show) show_event(f, azr, txid);
     }
     last_block = f.m_chain.m_tip;
     int64_t recorded_end_time = f.m_current_time;
@@ -197,6 +159,140 @@ int main(int argc, const char** argv) {
     }
 }
 
+void show_event(bitcoin::mff& f, const bitcoin::mff_analyzer& azr, const uint256& txid) {
+    printf("%s: %s", time_string(f.m_current_time), bitcoin::cmd_string(azr.last_command).c_str());
+    if (azr.last_command == bitcoin::mff::cmd_mempool_invalidated) {
+        tiny::tx inv;
+        CDataStream ds(azr.last_rawtx, SER_DISK, PROTOCOL_VERSION);
+        ds >> inv;
+        printf(" %s (%s)\n%s", txid_str(azr.last_txids.back()).c_str(), bitcoin::reason_string(azr.last_reason).c_str(), inv.ToString().c_str());
+        if (!azr.last_cause.IsNull()) {
+            uint256 replacement = azr.last_cause;
+            printf(" -> %s", txid_str(replacement).c_str());
+        }
+    } else if (azr.last_command == bitcoin::mff::cmd_mempool_out) {
+        printf(" %s (%s)", txid_str(azr.last_txids.back()).c_str(), bitcoin::reason_string(azr.last_reason).c_str());
+    } else if (azr.last_command == bitcoin::mff::cmd_mempool_in) {
+        if (azr.last_txs.size()) {
+            // recorded
+            const auto& t = azr.last_txs.back();
+            // printf("\n\t%s\n", t->to_string().c_str());
+            std::string extra = "";
+            // check if any of our targeted tx's is spent by this tx
+            // for (const tracked& tracked2 : txids) {
+            //     uint32_t index;
+            //     if (t->spends(tracked2.txid, azr.seqs[tracked2.txid], index)) {
+            //         extra += std::string(" (spends ") + txid_str(tracked2.txid) + ":" + std::to_string(index) + ")";
+            //         if (tracked2.depth > 0 && txids.find(tracked{t->id}) == txids.end()) {
+            //             txids.insert(tracked{tracked2, t->id});
+            //         }
+            //     }
+            // }
+            // if (!t->is(txid) && extra == "") {
+            // //     // printf(" (");
+            // // } else if (t->spends(txid, azr.seqs[txid])) {
+            // //     extra = std::string(" (spends ") + txid_str(txid) + ")";
+            // //     // printf(" (spends %s: ", txid_str(txid).c_str());
+            // // } else {
+            //     extra = " (?)";
+            //     // printf(" (???: ");
+            // }
+            printf(" (first seen %s%s - %" PRIu64 " vbytes, %" PRIu64 " fee, %.3lf fee rate (sat/vb), block #%u)", txid_str(t->m_hash).c_str(), extra.c_str(), t->vsize(), t->m_fee, t->feerate(), f.m_chain.m_tip);
+            // const mff::tx& t = *azr.txs[azr.seqs[txid]];
+            // printf(" (txid seq=%" PRIu64 ") %s", azr.seqs[txid], t->to_string().c_str());
+            // for (const auto& x : t->vin) if (x.is_known()) printf("\n- %" PRIu64 " = %s", x.get_seq(), azr.txs[x.get_seq()]->id.ToString().c_str());
+            // we don't wanna bother with tracking TX_REC for multiple txids so we just break the loop here
+        } else {
+            // re-entry
+            printf(" (%s)", txid_str(azr.last_txids.back()).c_str());
+        }
+    } else if (azr.last_command == bitcoin::mff::cmd_block_mined) {
+        printf(" (%s in #%u=%s)", txid_str(txid).c_str(), f.m_chain.m_tip, f.m_chain.get_blocks().size() > 0 ? f.m_chain.get_blocks().back()->m_hash.ToString().c_str() : "???");
+    }
+    fputc('\n', stdout);
+}
+
+void seek_start(bitcoin::mff& f, uint32_t block_start, int64_t time_start) {
+    if (block_start == 0 && time_start == 0) {
+        // rewind to the beginning
+        f.rewind();
+    } else if (block_start) {
+        // go to the last checkpoint before the block, or failing that, the start of its cluster
+        if (!f.seek_height(block_start)) {
+            uint32_t starting_block = (block_start / 2016) * 2016;
+            f.goto_segment(starting_block);
+        }
+    } else {
+        // go to the last checkpoint before the starting time, or failing that, the beginning
+        if (!f.seek_time(time_start)) {
+            fprintf(stderr, "no time index checkpoint before %s; scanning from the beginning\n", time_string(time_start));
+            f.rewind();
+        }
+    }
+}
+
+// --hits-only, without an index: the same events find_indexed() shows, found by scanning the recording;
+// as nothing but those events is shown, segments whose filter rules out the txid are skipped
+int find_scanned(bitcoin::mff& f, bitcoin::mff_analyzer& azr, const uint256& txid, uint32_t block_start, uint32_t block_end, int64_t time_start, int64_t time_end) {
+    int64_t start_time = GetTime();
+    std::set<uint256> touched_txids;
+    size_t shown = 0;
+    std::string filtered_path;
+    size_t skipped_segments = 0;
+    while (f.iterate()) {
+        if (block_end && f.m_chain.m_tip > block_end) break;
+        if (time_end && f.m_current_time > time_end) break;
+        if (filtered_path != f.m_file->get_path()) {
+            filtered_path = f.m_file->get_path();
+            bitcoin::segment_filter filter;
+            if (filter.load(filtered_path) && !filter.may_contain(txid)) {
+                cq::id cluster = f.get_registry().m_current_cluster;
+                ++skipped_segments;
+                f.goto_segment((cluster + 1) * 2016);
+                if (!f.m_file || f.get_registry().m_current_cluster <= cluster) break;
+                continue;
+            }
+        }
+        // the same range find_indexed() applies to the hits it looks up
+        if ((block_start && f.m_chain.m_tip < block_start) || (time_start && f.m_current_time < time_start)) continue;
+        azr.populate_touched_txids(touched_txids);
+        if (!touched_txids.count(txid)) continue;
+        show_event(f, azr, txid);
+        ++shown;
+    }
+    printf("%zu events shown in %" PRIi64 " seconds", shown, GetTime() - start_time);
+    if (skipped_segments) printf(" (%zu segments skipped by their filters)", skipped_segments);
+    fputc('\n', stdout);
+    return 0;
+}
+
+// --hits-only, with an index: only the events the index lists for the txid are read
+int find_indexed(bitcoin::mff& f, bitcoin::mff_analyzer& azr, const bitcoin::tx_index& index, const uint256& txid, uint32_t block_start, uint32_t block_end, int64_t time_start, int64_t time_end) {
+    int64_t start_time = GetTime();
+    std::vector<bitcoin::tx_hit> hits;
+    index.find(txid, hits);
+    std::set<uint256> touched_txids;
+    size_t shown = 0;
+    for (const auto& hit : hits) {
+        if ((block_start && hit.height < block_start) || (block_end && hit.height > block_end)) continue;
+        if ((time_start && hit.time < time_start) || (time_end && hit.time > time_end)) continue;
+        // hits are in recording order, so consecutive hits in a segment are reached without starting over
+        if (!f.goto_checkpoint(hit.position()) || !f.iterate()) {
+            fprintf(stderr, "index does not match the recording (cluster %" PRIu64 ", offset %" PRIi64 "); rebuild it with mff-index\n", hit.cluster, hit.offset);
+            return 1;
+        }
+        azr.populate_touched_txids(touched_txids);
+        if (!touched_txids.count(txid)) {
+            fprintf(stderr, "index entry for cluster %" PRIu64 ", offset %" PRIi64 " does not touch %s; rebuild the index with mff-index\n", hit.cluster, hit.offset, txid_str(txid).c_str());
+            return 1;
+        }
+        show_event(f, azr, txid);
+        ++shown;
+    }
+    printf("%zu events (of %zu indexed) shown in %" PRIi64 " seconds\n", shown, hits.size(), GetTime() - start_time);
+    return 0;
+}
+
 inline char* time_string(int64_t time) {
     static char buf[128];
     sprintf(buf, "%s", asctime(gmtime((time_t*)(&time))));
@@ -0,0 +1,76 @@
+// Copyright (c) 2018 The Bitcoin Core developers
+// Distributed under the MIT software license, see the accompanying
+// file COPYING or http://www.opensource.org/licenses/mit-license.php.
+
+// Checks every cached block (in the store, and in blockdata/) against its
+// hash and merkle root, the same way tiny::rpc::get_block does as blocks are
+// loaded, spread out over all cores. Truncated or otherwise corrupt entries
+// are listed; with --repair, they are fetched from the node again (see
+// tiny::rpc::from_env), replacing the corrupt entries.
+//
+// Exits with 0 if the cache is (now) fine, and 2 if corrupt entries remain.
+
+#include <chrono>
+#include <unistd.h>
+
+#include <tinyrpc.h>
+
+static int64_t now_ms() {
+    return std::chrono::duration_cast<std::chrono::milliseconds>(std::chrono::steady_clock::now().time_since_epoch()).count();
+}
+
+int main(int argc, const char** argv) {
+    bool repair = argc > 2 && !strcmp(argv[argc - 1], "--repair");
+    int args = argc - repair;
+    if (args < 2 || args > 3) {
+        fprintf(stderr, "syntax: %s <cache path> [<threads>=all cores] [--repair]\n", argv[0]);
+        fprintf(stderr, "the cache path is the directory containing store/ and/or blockdata/\n");
+        return 1;
+    }
+    if (chdir(argv[1])) {
+        fprintf(stderr, "unable to enter %s\n", argv[1]);
+        return 1;
+    }
+    size_t threads = args > 2 ? atoi(argv[2]) : 0;
+
+    tiny::rpc* rpc = tiny::rpc::from_env("bitcoin-cli");
+    auto store = std::make_shared<tiny::store>();
+    if (store->open("store")) rpc->m_store = store;
+
+    int64_t start_time = now_ms();
+    int64_t last_report = 0;
+    size_t blocks = 0;
+    std::vector<uint256> corrupt = rpc->check_cached_blocks(threads, [&](size_t checked, size_t total) {
+        blocks = total;
+        int64_t now = now_ms();
+        if (now - last_report < 250 && checked < total) return;
+        last_report = now;
+        printf(" [%5.2f%%] %zu/%zu blocks     \r", total ? 100.f * checked / total : 100.f, checked, total);
+        fflush(stdout);
+    });
+    int64_t elapsed = std::max<int64_t>(1, now_ms() - start_time);
+    printf("\n%zu blocks checked in %.2f s (%.0f blocks/s), %zu corrupt\n", blocks, elapsed / 1000., blocks * 1000. / elapsed, corrupt.size());
+    for (const auto& hash : corrupt) printf("corrupt: %s\n", hash.ToString().c_str());
+    if (corrupt.empty() || !repair) return corrupt.empty() ? 0 : 2;
+
+    size_t repaired = 0;
+    for (const auto& hash : corrupt) {
+        tiny::block b;
+        uint32_t height;
+        try {
+            if (rpc->get_block(hash, b, height)) {
+                ++repaired;
+                continue;
+            }
+            fprintf(stderr, "the node does not know block %s\n", hash.ToString().c_str());
+        } catch (const std::exception& e) {
+            fprintf(stderr, "unable to repair block %s: %s\n", hash.ToString().c_str(), e.what());
+        }
+    }
+    if (rpc->m_store && !rpc->m_store->flush()) {
+        fprintf(stderr, "unable to flush the store\n");
+        return 1;
+    }
+    printf("%zu/%zu corrupt blocks repaired\n", repaired, corrupt.size());
+    return repaired == corrupt.size() ? 0 : 2;
+}
@@ -0,0 +1,73 @@
+// Copyright (c) 2018 The Bitcoin Core developers
+// Distributed under the MIT software license, see the accompanying
+// file COPYING or http://www.opensource.org/licenses/mit-license.php.
+
+// Builds the inverted txid index (see bcq/txindex.h) of an MFF recording, in
+// one pass over the whole recording. Every event is mapped to the txids (and
+// block hashes) it touches, as reported by
+// mff_analyzer::populate_touched_txids(), and the index maps each of those to
+// the position of the event, so that mff-findtx can go straight to the events
+// touching a given txid.
+
+#include <utiltime.h>
+
+#include <bcq/bitcoin.h>
+#include <bcq/txindex.h>
+
+static const uint32_t cluster_size = 2016;
+
+/** Keeps track of where each event began, which the base analyzer does not. */
+struct positioned_analyzer : public bitcoin::mff_analyzer {
+    long last_pos{0};
+    virtual void iterated(long starting_pos, long resulting_pos) override {
+        last_pos = starting_pos;
+        mff_analyzer::iterated(starting_pos, resulting_pos);
+    }
+};
+
+int main(int argc, const char** argv) {
+    if (argc < 2 || argc > 3) {
+        fprintf(stderr, "syntax: %s <db path> [<run size>=8388608]\n", argv[0]);
+        fprintf(stderr, "the run size is the number of index records kept in memory before they are sorted and written to a temporary file\n");
+        return 1;
+    }
+    const std::string dbpath = argv[1];
+    size_t run_size = argc > 2 ? atoll(argv[2]) : 1 << 23;
+    const std::string prefix = bitcoin::mff::detect_prefix(dbpath);
+
+    auto mff = std::make_shared<bitcoin::mff>(dbpath, prefix, cluster_size, true);
+    mff->load();
+    positioned_analyzer azr;
+    mff->m_delegate = &azr;
+    mff->rewind();
+
+    const std::string path = bitcoin::tx_index::path_for(dbpath, prefix);
+    bitcoin::tx_index::builder builder(path, run_size);
+    std::set<uint256> touched_txids;
+    uint64_t entries = 0;
+    int64_t start_time = GetTime();
+    for (;;) {
+        std::string file_path = mff->m_file ? mff->m_file->get_path() : "";
+        if (!mff->iterate()) break;
+        ++entries;
+        bitcoin::tx_hit hit;
+        hit.cluster = mff->get_registry().m_current_cluster;
+        hit.segment = hit.cluster * cluster_size;
+        // the first event in a new segment file is found by going to the segment itself
+        hit.offset = file_path == mff->m_file->get_path() ? azr.last_pos : 0;
+        hit.height = mff->m_chain.m_tip;
+        hit.time = mff->m_current_time;
+        azr.populate_touched_txids(touched_txids);
+        for (const auto& txid : touched_txids) builder.add(txid, hit);
+        if (!(entries % 10000)) {
+            printf(" %" PRIu64 " entries, %" PRIu64 " hits : cluster=%" PRIu64 " block=%u     \r", entries, builder.size(), hit.cluster, hit.height);
+            fflush(stdout);
+        }
+    }
+    printf("\n%" PRIu64 " entries, %" PRIu64 " hits read in %" PRIi64 " s; writing %s\n", entries, builder.size(), GetTime() - start_time, path.c_str());
+    if (!builder.finish()) {
+        fprintf(stderr, "failed to write index %s\n", path.c_str());
+        return 1;
+    }
+    printf("done in %" PRIi64 " s\n", GetTime() - start_time);
+}
@@ -0,0 +1,146 @@
+// Copyright (c) 2018 The Bitcoin Core developers
+// Distributed under the MIT software license, see the accompanying
+// file COPYING or http://www.opensource.org/licenses/mit-license.php.
+
+// Moves the rpc cache directories (blockdata/ and txdata/, one file per
+// entry) into a packed store (see tinystore.h):
+//
+//     blockdata/<hash>.mffb   -> store::block
+//     blockdata/<height>.hth  -> store::block_hash
+//     txdata/<txid>.mfft      -> store::tx
+//     txdata/<txid>.blk       -> store::tx_block
+//
+// Anything else (e.g. leftovers from interrupted bitcoin-cli fetches) is
+// skipped. Entries already in the store are left alone, so the migration can
+// be resumed if interrupted. With --delete, the migrated files are removed
+// once the store has been flushed to disk.
+
+#include <dirent.h>
+#include <unistd.h>
+
+#include <tinyformat.h>
+#include <tinyfs.h>
+#include <tinystore.h>
+#include <utilstrencodings.h>
+#include <utiltime.h>
+
+struct cache_entry {
+    std::string path;
+    tiny::store::kind kind;
+    uint256 key;
+};
+
+static bool parse_hash(const std::string& name, uint256& hash) {
+    if (name.size() != 64 || !IsHex(name)) return false;
+    hash = uint256S(name);
+    return true;
+}
+
+static bool parse_entry(const std::string& dir, const std::string& fname, cache_entry& entry) {
+    size_t dot = fname.rfind('.');
+    if (dot == std::string::npos) return false;
+    std::string name = fname.substr(0, dot);
+    std::string ext = fname.substr(dot + 1);
+    entry.path = dir + "/" + fname;
+    if (ext == "mffb") {
+        entry.kind = tiny::store::block;
+        return parse_hash(name, entry.key);
+    }
+    if (ext == "hth") {
+        entry.kind = tiny::store::block_hash;
+        if (name.empty() || name.size() > 10 || name.find_first_not_of("0123456789") != std::string::npos) return false;
+        entry.key = tiny::store::height_key(atol(name.c_str()));
+        return true;
+    }
+    if (ext == "mfft") {
+        entry.kind = tiny::store::tx;
+        return parse_hash(name, entry.key);
+    }
+    if (ext == "blk") {
+        entry.kind = tiny::store::tx_block;
+        return parse_hash(name, entry.key);
+    }
+    return false;
+}
+
+static bool list_entries(const std::string& dir, std::vector<cache_entry>& entries, size_t& skipped) {
+    DIR* d = opendir(dir.c_str());
+    if (!d) return false;
+    while (struct dirent* ent = readdir(d)) {
+        if (ent->d_name[0] == '.') continue;
+        cache_entry entry;
+        if (parse_entry(dir, ent->d_name, entry)) entries.push_back(entry); else ++skipped;
+    }
+    closedir(d);
+    return true;
+}
+
+int main(int argc, const char** argv) {
+    if (argc < 3 || argc > 4 || (argc == 4 && strcmp(argv[3], "--delete"))) {
+        fprintf(stderr, "syntax: %s <cache path> <store path> [--delete]\n", argv[0]);
+        fprintf(stderr, "the cache path is the directory containing blockdata/ and txdata/\n");
+        return 1;
+    }
+
+    const std::string cache_path = argv[1];
+    const std::string store_path = argv[2];
+    bool remove = argc == 4;
+
+    std::vector<cache_entry> entries;
+    size_t skipped = 0;
+    bool found = false;
+    for (const char* dir : {"/blockdata", "/txdata"}) {
+        if (list_entries(cache_path + dir, entries, skipped)) found = true;
+    }
+    if (!found) {
+        fprintf(stderr, "no blockdata/ or txdata/ directory in %s\n", cache_path.c_str());
+        return 1;
+    }
+
+    tiny::store store;
+    if (!store.open(store_path)) return 1;
+    int64_t start_time = GetTime();
+    size_t migrated = 0, known = 0, empty = 0;
+    uint64_t bytes = 0;
+    printf("migrating %zu entries (%zu other files skipped)\n", entries.size(), skipped);
+    for (size_t i = 0; i < entries.size(); ++i) {
+        const cache_entry& e = entries[i];
+        if (store.has(e.kind, e.key)) {
+            ++known;
+        } else {
+            tiny::mapped_file file;
+            if (!file.open(e.path)) {
+                fprintf(stderr, "\nunable to open %s\n", e.path.c_str());
+                return 1;
+            }
+            if (file.empty()) {
+                // an interrupted write; the entry is simply fetched again when needed
+                ++empty;
+                continue;
+            }
+            if (!store.put(e.kind, e.key, file.begin(), file.size())) {
+                fprintf(stderr, "\nunable to write %s to the store\n", e.path.c_str());
+                return 1;
+            }
+            ++migrated;
+            bytes += file.size();
+        }
+        if (!(i % 1000)) {
+            printf(" [%5.2f%%] %zu/%zu entries, %" PRIu64 " MB     \r", 100.f * i / entries.size(), i, entries.size(), bytes >> 20);
+            fflush(stdout);
+        }
+    }
+    if (!store.flush()) {
+        fprintf(stderr, "\nunable to flush the store\n");
+        return 1;
+    }
+    printf("\n%zu entries (%" PRIu64 " MB) migrated, %zu already in the store, %zu empty, in %" PRIi64 " s\n", migrated, bytes >> 20, known, empty, GetTime() - start_time);
+
+    if (remove) {
+        size_t removed = 0;
+        for (const auto& e : entries) {
+            if (store.has(e.kind, e.key) && !unlink(e.path.c_str())) ++removed;
+        }
+        printf("%zu files removed\n", removed);
+    }
+}
@@ -10,8 +10,8 @@ void do_stuff();
 inline std::string time_string(int64_t time);
 
 int main(int argc, const char** argv) {
-    if (argc < 3 || argc > 4) {
-        fprintf(stderr, "syntax: %s <db path> <ajb path> [<min feerate>]\n", argv[0]);
+    if (argc < 3 || argc > 5) {
+        fprintf(stderr, "syntax: %s <db path> <ajb path> [<min feerate> [<hash threads>=0]]\n", argv[0]);
         return 1;
     }
 
@@ -19,6 +19,8 @@ int main(int argc, const char** argv) {
     auto& ajbpath = argv[2];
     double min_feerate = 0;
     if (argc > 3) min_feerate = atof(argv[3]);
+    // txs (from the AJB, blocks and mempool.tmp) are hashed in batches; optionally spread those over worker threads
+    if (argc > 4) tiny::hash_pool::shared().start(atoi(argv[4]));
 
     // do some stuff...
     do_stuff();
@@ -42,6 +44,10 @@ int main(int argc, const char** argv) {
     // input is arg 2 (a file)
     mff::ajb a(mff, mempool, argv[2]);
 
+    // keep the upcoming blocks fetched in the background; this needs the native
+    // RPC client, as the bitcoin-cli backend shares temporary files between calls
+    if (rpc->m_client) a.prefetcher = std::make_shared<tiny::block_prefetcher>(*rpc, 16);
+
     // the mempool callback routes mempool operations into mff commands; it also hooks up to the AJB
     // object's timer
     bitcoin::mff_mempool_callback mempool_callback(a.current_time, mff);
@@ -51,6 +57,10 @@ int main(int argc, const char** argv) {
     long internal_start_time = 0;
     long in_bytes = cq::fsize(argv[2]);
     size_t entries = 0;
+#ifdef TINY_COUNT_SERIALIZATIONS
+    uint32_t start_height = mff->m_chain.m_tip;
+    uint64_t start_serializations = tiny::serializations();
+#endif
     while (a.read_entry()) {
         if (a.current_time < 1500000000) { fprintf(stderr, "a.current_time is too low\n"); assert(0); }
         if (a.current_time > 1559201453) { fprintf(stderr, "a.current_time is too high\n"); assert(0); }
@@ -72,13 +82,25 @@ int main(int argc, const char** argv) {
         }
     }
     printf("\n");
+#ifdef TINY_COUNT_SERIALIZATIONS
+    uint32_t blocks = mff->m_chain.m_tip - start_height;
+    uint64_t serializations = tiny::serializations() - start_serializations;
+    printf("%" PRIu64 " tx serializations over %u blocks (%.1f per block)\n", serializations, blocks, blocks ? (double)serializations / blocks : 0.);
+#endif
     bitcoin::save_mempool(mempool, std::string(argv[1]) + "/mempool.tmp");
 }
 
 tiny::rpc* rpc = nullptr;
 
 void do_stuff() {
-    rpc = new tiny::rpc("bitcoin-cli");
+    rpc = tiny::rpc::from_env("bitcoin-cli");
+    // cache fetched blocks and txs in a packed store, rather than as one file each
+    auto store = std::make_shared<tiny::store>();
+    if (store->open("store")) {
+        rpc->m_store = store;
+    } else {
+        fprintf(stderr, "falling back to the blockdata/ and txdata/ cache directories\n");
+    }
     amap::amap_path = "amap";
     amap::enabled = true;
 }
@@ -0,0 +1,88 @@
+// Copyright (c) 2018 The Bitcoin Core developers
+// Distributed under the MIT software license, see the accompanying
+// file COPYING or http://www.opensource.org/licenses/mit-license.php.
+
+// Whole-recording statistics (the space used by each kind of event, and
+// optionally the most touched txids), gathered by scanning all segments in
+// parallel (see bcq/scan.h).
+
+#include <utiltime.h>
+
+#include <bcq/bitcoin.h>
+#include <bcq/scan.h>
+
+static const uint32_t cluster_size = 2016;
+
+int main(int argc, const char** argv) {
+    if (argc < 2 || argc > 4) {
+        fprintf(stderr, "syntax: %s <db path> [<threads>=all cores] [--touchmap]\n", argv[0]);
+        return 1;
+    }
+    const std::string dbpath = argv[1];
+    size_t threads = 0;
+    bool touchmap = false;
+    for (int i = 2; i < argc; ++i) {
+        if (!strcmp(argv[i], "--touchmap")) touchmap = true; else threads = atoi(argv[i]);
+    }
+
+    bitcoin::segment_scanner<bitcoin::mff_analyzer> scanner(dbpath, bitcoin::mff::detect_prefix(dbpath), cluster_size, threads);
+    if (touchmap) {
+        scanner.m_on_event = [](bitcoin::mff& f, bitcoin::mff_analyzer& azr) {
+            std::set<uint256> touched_txids;
+            azr.populate_touched_txids(touched_txids);
+        };
+    }
+    std::atomic<size_t> segments{0};
+    scanner.m_on_segment = [&](const bitcoin::segment_info& segment, const bitcoin::mff_analyzer& azr) {
+        printf(" %zu segments scanned (%s)     \r", ++segments, segment.path.c_str());
+        fflush(stdout);
+    };
+
+    bitcoin::mff_analyzer prototype;
+    prototype.enable_touchmap = touchmap;
+    bitcoin::mff_analyzer azr;
+    int64_t start_time = GetTime();
+    if (!scanner.run(prototype, azr)) {
+        fprintf(stderr, "no segments found in %s\n", dbpath.c_str());
+        return 1;
+    }
+    int64_t elapsed = GetTime() - start_time;
+    uint64_t entries = 0;
+    for (const auto& c : azr.count) entries += c.second;
+    printf("\n%zu segments, %" PRIu64 " entries parsed in %" PRIi64 " seconds\n", segments.load(), entries, elapsed);
+
+    uint64_t total = azr.total_bytes;
+    uint64_t counted = total;
+    printf("%-25s   %-10s (%-6s) [%-8s (%-6s)] {%-10s}\n", "category", "bytes", "%", "count", "%", "avg bytes");
+    printf("=========================   ==========  ======   ========  ======    ==========\n");
+    #define P(category, bytes, count, avgbytes) printf("%-25s : %10zu (%5.2lf%%) [%8" PRIi64 " (%5.2lf%%)] {%10.2f}\n", category, bytes, 100.0 * (bytes) / total, count, 100.0 * (count) / entries, avgbytes);
+
+    for (auto& x : azr.usage) {
+        counted -= x.second;
+        uint64_t count = azr.count[x.first];
+        float avgbytes = (float)x.second / count;
+        P(bitcoin::cmd_string(x.first).c_str(), x.second, count, avgbytes);
+        if (x.first == bitcoin::mff::cmd_mempool_in) {
+            uint64_t count2 = azr.total_txrecs;
+            size_t amount = azr.total_txrec_bytes;
+            float avgbytes2 = (float)amount / count2;
+            P("    (tx recordings)", amount, count2, avgbytes2);
+            amount = x.second - amount;
+            count2 = count - count2;
+            avgbytes2 = (float)amount / count2;
+            P("    (tx references)", amount, count2, avgbytes2);
+        }
+    }
+    printf("unaccounted: %10" PRIi64 " (%.2f%%)\n", counted, 100.0 * counted / total);
+
+    if (touchmap) {
+        printf("txid hits:\n");
+        uint32_t max = 0;
+        for (const auto& th : azr.touchmap) {
+            if (th.second > max || (th.second == max && max > 4)) {
+                printf("%s: %6u\n", th.first.ToString().c_str(), th.second);
+                max = th.second;
+            }
+        }
+    }
+}
@@ -138,6 +138,66 @@ private:
     size_t nPos;
 };
 
+/* Minimal stream for reading from an existing region of memory, such as a
+ * memory mapped file
+ *
+ * The referenced memory must outlive the reader
+ */
+class CSpanReader
+{
+private:
+    const int nType;
+    const int nVersion;
+    const unsigned char* pBegin;
+    const unsigned char* pEnd;
+    const unsigned char* pCur;
+
+public:
+    CSpanReader(int nTypeIn, int nVersionIn, const unsigned char* pBeginIn, const unsigned char* pEndIn)
+    : nType(nTypeIn), nVersion(nVersionIn), pBegin(pBeginIn), pEnd(pEndIn), pCur(pBeginIn) {}
+
+    template<typename T>
+    CSpanReader& operator>>(T&& obj)
+    {
+        // Unserialize from this stream
+        ::Unserialize(*this, obj);
+        return (*this);
+    }
+
+    int GetVersion() const { return nVersion; }
+    int GetType() const { return nType; }
+
+    size_t size() const { return pEnd - pCur; }
+    bool empty() const { return pCur == pEnd; }
+    size_t tell() const { return pCur - pBegin; }
+    const unsigned char* data() const { return pCur; }
+
+    void read(char* dst, size_t n)
+    {
+        if (n > size()) {
+            throw std::ios_base::failure("CSpanReader::read(): end of data");
+        }
+        memcpy(dst, pCur, n);
+        pCur += n;
+    }
+
+    void ignore(size_t n)
+    {
+        if (n > size()) {
+            throw std::ios_base::failure("CSpanReader::ignore(): end of data");
+        }
+        pCur += n;
+    }
+
+    void seek(size_t pos)
+    {
+        if (pos > size_t(pEnd - pBegin)) {
+            throw std::ios_base::failure("CSpanReader::seek(): out of bounds");
+        }
+        pCur = pBegin + pos;
+    }
+};
+
 /** Double ended buffer combining vector and stream-like interfaces.
  *
  * >> and << read and write unformatted data using the above serialization templates.
@@ -0,0 +1,179 @@
+#include "catch.hpp"
+
+#include <map>
+#include <random>
+#include <sys/stat.h>
+#include <unistd.h>
+
+#include <amap.h>
+#include <uint256.h>
+
+static const std::string amap_test_path = "/tmp/mff-test-amap";
+
+/** Write an amap directory containing the given txs. Prefixes without txs are left out. */
+static void write_amap(const std::string& path, const std::map<uint256, amap::amount_list_t>& txs) {
+    mkdir(path.c_str(), 0777);
+    std::vector<std::vector<std::pair<uint256, amap::amount_list_t>>> buckets(amap::prefix_count);
+    for (const auto& t : txs) {
+        amap::prefix_t prefix;
+        memcpy(&prefix, t.first.begin(), amap::prefix_len);
+        buckets[prefix].push_back(t);
+    }
+    for (size_t p = 0; p < amap::prefix_count; ++p) {
+        if (!buckets[p].empty()) REQUIRE(amap::write_table(path, p, buckets[p]));
+    }
+}
+
+TEST_CASE("amap reader", "[amap]") {
+    std::mt19937_64 rng(3);
+    std::map<uint256, amap::amount_list_t> txs;
+    for (int i = 0; i < 22000; ++i) {
+        uint256 txid;
+        for (int j = 0; j < 4; ++j) {
+            uint64_t v = rng();
+            memcpy(txid.begin() + j * 8, &v, 8);
+        }
+        // pack the txids into a few prefixes so that the tables are big
+        // enough for the search strategy to matter; the last prefix is
+        // skewed, as the interpolation search must cope with that too
+        txid.begin()[1] = 0;
+        if (i < 20000) {
+            txid.begin()[0] = i % 4;
+        } else {
+            txid.begin()[0] = 4;
+            txid.begin()[2] = txid.begin()[3] = txid.begin()[4] = 0;
+        }
+        auto& amounts = txs[txid];
+        amounts.resize(1 + rng() % 5);
+        for (auto& a : amounts) a = rng() % 2100000000000000ULL;
+    }
+    write_amap(amap_test_path, txs);
+    amap::reader r(amap_test_path);
+
+    SECTION("known txids are found, with all of their outputs") {
+        amap::amount_list_t amounts;
+        for (auto mode : {amap::search_mode::binary, amap::search_mode::interpolation}) {
+            r.set_mode(mode);
+            for (const auto& t : txs) {
+                REQUIRE(r.output_amounts(t.first, amounts));
+                REQUIRE(amounts == t.second);
+                for (size_t n = 0; n < t.second.size(); ++n) REQUIRE(r.output_amount(t.first, n) == t.second[n]);
+            }
+        }
+    }
+
+    SECTION("unknown txids are not found") {
+        amap::amount_list_t amounts;
+        for (auto mode : {amap::search_mode::binary, amap::search_mode::interpolation}) {
+            r.set_mode(mode);
+            for (const auto& t : txs) {
+                uint256 other = t.first;
+                other.begin()[31] ^= 1;
+                if (txs.count(other)) continue;
+                REQUIRE(!r.output_amounts(other, amounts));
+                REQUIRE(r.output_amount(other, 0) == -1);
+            }
+        }
+
+        // the interpolating reader should get there in far fewer probes
+        amap::reader rb(amap_test_path, amap::search_mode::binary);
+        amap::reader ri(amap_test_path, amap::search_mode::interpolation);
+        for (const auto& t : txs) {
+            if (t.first.begin()[0] == 4) continue; // skip the skewed table
+            rb.output_amounts(t.first, amounts);
+            ri.output_amounts(t.first, amounts);
+        }
+        REQUIRE(ri.probes() * 2 < rb.probes());
+    }
+
+    SECTION("only so many tables stay mapped") {
+        amap::reader small(amap_test_path, amap::search_mode::interpolation, 2);
+        amap::amount_list_t amounts;
+        // alternate between the tables, so that each lookup unmaps one
+        std::vector<std::vector<std::pair<uint256, amap::amount_list_t>>> by_prefix(5);
+        for (const auto& t : txs) by_prefix[t.first.begin()[0]].push_back(t);
+        for (size_t i = 0; i < 1000; ++i) {
+            const auto& t = by_prefix[i % 5][i / 5];
+            REQUIRE(small.output_amounts(t.first, amounts));
+            REQUIRE(amounts == t.second);
+            REQUIRE(small.output_amount(t.first, t.second.size() - 1) == t.second.back());
+            REQUIRE(small.mapped() <= 2);
+        }
+        small.preload();
+        REQUIRE(small.mapped() == 2);
+        small.reload(0);
+        REQUIRE(small.mapped() == 1);
+    }
+}
+
+TEST_CASE("amap delta", "[amap]") {
+    const std::string path = amap_test_path + "-delta";
+    const std::string delta_path = path + "/delta";
+    unlink(delta_path.c_str());
+    std::mt19937_64 rng(4);
+    auto make_txs = [&](size_t count, std::map<uint256, amap::amount_list_t>& txs) {
+        for (size_t i = 0; i < count; ++i) {
+            uint256 txid;
+            for (int j = 0; j < 4; ++j) {
+                uint64_t v = rng();
+                memcpy(txid.begin() + j * 8, &v, 8);
+            }
+            txid.begin()[0] = i % 4;
+            txid.begin()[1] = 0;
+            txs[txid] = amap::amount_list_t(1 + rng() % 3, rng() % 100000000);
+        }
+    };
+    std::map<uint256, amap::amount_list_t> base, confirmed;
+    make_txs(1000, base);
+    make_txs(500, confirmed);
+    write_amap(path, base);
+
+    {
+        amap::delta d(delta_path);
+        REQUIRE(d.size() == 0);
+        for (const auto& t : confirmed) d.add(t.first, t.second);
+        d.flush();
+        REQUIRE(d.size() == confirmed.size());
+        for (const auto& t : confirmed) REQUIRE(*d.find(t.first) == t.second);
+        REQUIRE(d.find(base.begin()->first) == nullptr);
+    }
+
+    SECTION("the log is replayed when reopened") {
+        amap::delta d(delta_path);
+        REQUIRE(d.size() == confirmed.size());
+        for (const auto& t : confirmed) REQUIRE(*d.find(t.first) == t.second);
+    }
+
+    SECTION("a partially written record is dropped") {
+        FILE* fp = fopen(delta_path.c_str(), "ab");
+        fwrite(confirmed.begin()->first.begin(), 1, 20, fp);
+        fclose(fp);
+        {
+            amap::delta d(delta_path);
+            REQUIRE(d.size() == confirmed.size());
+            // appending after the truncation point must produce a readable log
+            d.add(base.begin()->first, base.begin()->second);
+        }
+        amap::delta d(delta_path);
+        REQUIRE(d.size() == confirmed.size() + 1);
+    }
+
+    SECTION("compaction merges the delta into the base tables") {
+        amap::reader r(path);
+        amap::amount_list_t amounts;
+        REQUIRE(r.output_amounts(base.begin()->first, amounts)); // map a table before it is rewritten
+        {
+            amap::delta d(delta_path);
+            REQUIRE(d.compact(r));
+            REQUIRE(d.size() == 0);
+        }
+        amap::delta d(delta_path);
+        REQUIRE(d.size() == 0);
+        for (const auto* txs : {&base, &confirmed}) {
+            for (const auto& t : *txs) {
+                REQUIRE(r.output_amounts(t.first, amounts));
+                REQUIRE(amounts == t.second);
+            }
+        }
+    }
+}
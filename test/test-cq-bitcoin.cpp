@@ -247,6 +247,324 @@ TEST_CASE("mff", "[mff]") {
         }
     }
 
+    SECTION("read_event") {
+        long pos;
+        auto ob = make_random_tx(nullptr);
+        auto ob2 = make_random_tx(nullptr);
+        uint256 block_hash = random_hash();
+        std::vector<uint8_t> rawtx{0x01, 0x02, 0x03};
+        {
+            auto mff = new_mff(nullptr);
+            ob->m_compressor = mff.get();
+            ob2->m_compressor = mff.get();
+            mff->begin_segment(500000);
+            pos = mff->m_file->tell();
+            mff->tx_entered(1558067026, ob);
+            mff->tx_entered(1558067026, ob2);
+            mff->tx_left(1558067027, ob, bitcoin::mff::reason_expired);
+            mff->tx_entered(1558067027, ob);
+            mff->tx_discarded(1558067028, ob, rawtx, bitcoin::mff::reason_replaced, ob2);
+            mff->confirm_block(1558067029, 500001, block_hash, std::set<std::shared_ptr<bitcoin::tx>>{ob2});
+            mff->unconfirm_tip(1558067030);
+        }
+        {
+            bitcoin::mff_analyzer azr;
+            auto mff = open_mff(&azr);
+            mff->m_file->seek(pos, SEEK_SET);
+            mff->m_current_time = 0;
+            bitcoin::mff_event ev;
+            REQUIRE(mff->read_event(ev));
+            REQUIRE(ev.cmd == bitcoin::mff::cmd_mempool_in);
+            REQUIRE(ev.time == 1558067026);
+            REQUIRE(ev.starting_pos > pos); // past the format marker
+            REQUIRE(ev.resulting_pos == mff->m_file->tell());
+            REQUIRE(ev.object);
+            REQUIRE(*ev.object == *ob);
+            REQUIRE(ev.txid == ob->m_hash);
+            REQUIRE(mff->read_event(ev));
+            REQUIRE(ev.txid == ob2->m_hash);
+            REQUIRE(mff->read_event(ev));
+            REQUIRE(ev.cmd == bitcoin::mff::cmd_mempool_out);
+            REQUIRE(ev.txid == ob->m_hash);
+            REQUIRE(ev.reason == bitcoin::mff::reason_expired);
+            REQUIRE(!ev.has_cause);
+            REQUIRE(mff->read_event(ev));
+            REQUIRE(ev.cmd == bitcoin::mff::cmd_mempool_in);
+            REQUIRE(ev.txid == ob->m_hash);
+            REQUIRE(mff->read_event(ev));
+            REQUIRE(ev.cmd == bitcoin::mff::cmd_mempool_invalidated);
+            REQUIRE(ev.txid == ob->m_hash);
+            REQUIRE(ev.rawtx == rawtx);
+            REQUIRE(ev.has_cause);
+            REQUIRE(ev.cause == ob2->m_hash);
+            REQUIRE(mff->read_event(ev));
+            REQUIRE(ev.cmd == bitcoin::mff::cmd_block_mined);
+            REQUIRE(ev.time == 1558067029);
+            REQUIRE(ev.height == 500001);
+            REQUIRE(ev.mined);
+            REQUIRE(ev.mined->m_hash == block_hash);
+            REQUIRE(ev.tx_hashes == std::set<uint256>{ob2->m_hash});
+            REQUIRE(mff->m_chain.m_tip == 500001);
+            // events are read without involving the delegate
+            REQUIRE(azr.count.empty());
+            // which iterate() then hands them to
+            REQUIRE(mff->iterate());
+            REQUIRE(azr.last_command == bitcoin::mff::cmd_block_unmined);
+            REQUIRE(azr.last_unmined_height == 500001);
+            REQUIRE(!mff->read_event(ev));
+        }
+    }
+
+    SECTION("event mask") {
+        for (uint8_t format : {bitcoin::mff::format_original, bitcoin::mff::format_current}) {
+            long pos;
+            auto ob = make_random_tx(nullptr);
+            auto ob2 = make_random_tx(nullptr);
+            uint256 block_hash = random_hash();
+            std::vector<uint8_t> rawtx(300, 0xab);
+            {
+                auto mff = new_mff(nullptr);
+                mff->m_segment_format = format;
+                ob->m_compressor = mff.get();
+                ob2->m_compressor = mff.get();
+                mff->begin_segment(500000);
+                pos = mff->m_file->tell();
+                mff->tx_entered(1558067026, ob);
+                mff->tx_entered(1558067026, ob2);
+                mff->tx_discarded(1558067027, ob, rawtx, bitcoin::mff::reason_replaced, ob2);
+                mff->confirm_block(1558067028, 500001, block_hash, std::set<std::shared_ptr<bitcoin::tx>>{ob2});
+                mff->tx_entered(1558067029, ob);
+                mff->tx_discarded(1558067030, ob, rawtx, bitcoin::mff::reason_conflict);
+                mff->unconfirm_tip(1558067031);
+            }
+            bitcoin::mff_analyzer azr;
+            auto mff = open_mff(&azr);
+            bitcoin::mff_event ev;
+
+            // blocks only
+            mff->m_file->seek(pos, SEEK_SET);
+            uint8_t blocks = bitcoin::mff::event_mask(bitcoin::mff::cmd_block_mined) | bitcoin::mff::event_mask(bitcoin::mff::cmd_block_unmined);
+            REQUIRE(mff->read_event(ev, blocks));
+            REQUIRE(ev.cmd == bitcoin::mff::cmd_block_mined);
+            REQUIRE(ev.time == 1558067028);
+            REQUIRE(ev.mined->m_hash == block_hash);
+            REQUIRE(ev.tx_hashes == std::set<uint256>{ob2->m_hash});
+            // the discard before it was skipped rather than read, where the format allows it
+            REQUIRE(ev.rawtx.empty() == (format >= bitcoin::mff::format_framed));
+            REQUIRE(mff->read_event(ev, blocks));
+            REQUIRE(ev.cmd == bitcoin::mff::cmd_block_unmined);
+            REQUIRE(ev.height == 500001);
+            REQUIRE(ev.rawtx.empty() == (format >= bitcoin::mff::format_framed));
+            REQUIRE(!mff->read_event(ev, blocks));
+
+            // discards only, handed to the delegate by iterate()
+            mff->m_file->seek(pos, SEEK_SET);
+            REQUIRE(mff->iterate(bitcoin::mff::event_mask(bitcoin::mff::cmd_mempool_invalidated)));
+            REQUIRE(azr.last_command == bitcoin::mff::cmd_mempool_invalidated);
+            REQUIRE(azr.last_txids.back() == ob->m_hash);
+            REQUIRE(azr.last_rawtx == rawtx);
+            REQUIRE(azr.last_cause == ob2->m_hash);
+            REQUIRE(mff->iterate(bitcoin::mff::event_mask(bitcoin::mff::cmd_mempool_invalidated)));
+            REQUIRE(azr.last_reason == bitcoin::mff::reason_conflict);
+            REQUIRE(azr.last_rawtx == rawtx);
+            REQUIRE(azr.count[bitcoin::mff::cmd_mempool_invalidated] == 2);
+            REQUIRE(azr.count.size() == 1);
+            REQUIRE(!mff->iterate(bitcoin::mff::event_mask(bitcoin::mff::cmd_mempool_invalidated)));
+
+            // references to txs recorded in skipped events still resolve
+            mff->m_file->seek(pos, SEEK_SET);
+            REQUIRE(mff->read_event(ev, bitcoin::mff::event_mask(bitcoin::mff::cmd_mempool_in)));
+            REQUIRE(ev.object);
+            REQUIRE(ev.txid == ob->m_hash);
+            REQUIRE(mff->read_event(ev, bitcoin::mff::event_mask(bitcoin::mff::cmd_mempool_in)));
+            REQUIRE(ev.txid == ob2->m_hash);
+            REQUIRE(mff->read_event(ev, bitcoin::mff::event_mask(bitcoin::mff::cmd_mempool_in)));
+            REQUIRE(ev.time == 1558067029);
+            REQUIRE(ev.txid == ob->m_hash);
+            REQUIRE(!mff->read_event(ev, bitcoin::mff::event_mask(bitcoin::mff::cmd_mempool_in)));
+        }
+    }
+
+    SECTION("resumed segments") {
+        const std::vector<std::pair<uint8_t, uint8_t>> formats{
+            {bitcoin::mff::format_original, bitcoin::mff::format_framed},
+            {bitcoin::mff::format_framed, bitcoin::mff::format_original},
+            {bitcoin::mff::format_original, bitcoin::mff::format_original},
+        };
+        for (const auto& f : formats) {
+            long pos;
+            auto ob = make_random_tx(nullptr);
+            auto ob2 = make_random_tx(nullptr);
+            std::vector<uint8_t> rawtx(300, 0xab);
+            std::vector<uint8_t> rawtx2(200, 0xcd);
+            {
+                auto mff = new_mff(nullptr);
+                mff->m_segment_format = f.first;
+                ob->m_compressor = mff.get();
+                mff->begin_segment(500000);
+                pos = mff->m_file->tell();
+                mff->tx_entered(1558067026, ob);
+                mff->tx_discarded(1558067027, ob, rawtx, bitcoin::mff::reason_conflict);
+            }
+            {
+                // appended to by a writer which does not know what format the segment was begun in
+                auto mff = open_mff(nullptr);
+                mff->m_segment_format = f.second;
+                ob2->m_compressor = mff.get();
+                mff->tx_entered(1558067028, ob2);
+                mff->tx_discarded(1558067029, ob2, rawtx2, bitcoin::mff::reason_expired);
+            }
+            auto mff = open_mff(nullptr);
+
+            mff->m_file->seek(pos, SEEK_SET);
+            bitcoin::mff_event ev;
+            REQUIRE(mff->read_event(ev));
+            REQUIRE(ev.txid == ob->m_hash);
+            REQUIRE(mff->read_event(ev));
+            REQUIRE(ev.cmd == bitcoin::mff::cmd_mempool_invalidated);
+            REQUIRE(ev.rawtx == rawtx);
+            REQUIRE(mff->read_event(ev));
+            REQUIRE(ev.cmd == bitcoin::mff::cmd_mempool_in);
+            REQUIRE(ev.time == 1558067028);
+            REQUIRE(ev.txid == ob2->m_hash);
+            REQUIRE(mff->read_event(ev));
+            REQUIRE(ev.cmd == bitcoin::mff::cmd_mempool_invalidated);
+            REQUIRE(ev.reason == bitcoin::mff::reason_expired);
+            REQUIRE(ev.rawtx == rawtx2);
+            REQUIRE(!mff->read_event(ev));
+
+            // each part is skipped, or not, according to the format it was written in
+            mff->m_file->seek(pos, SEEK_SET);
+            bitcoin::mff_event ev2;
+            REQUIRE(mff->read_event(ev2, bitcoin::mff::event_mask(bitcoin::mff::cmd_mempool_in)));
+            REQUIRE(mff->read_event(ev2, bitcoin::mff::event_mask(bitcoin::mff::cmd_mempool_in)));
+            REQUIRE(ev2.txid == ob2->m_hash);
+            REQUIRE(ev2.rawtx.empty() == (f.first >= bitcoin::mff::format_framed));
+        }
+    }
+
+    SECTION("batches") {
+        long pos;
+        auto ob = make_random_tx(nullptr);
+        auto ob2 = make_random_tx(nullptr);
+        auto ob3 = make_random_tx(nullptr);
+        uint256 block_hash = random_hash();
+        {
+            auto mff = new_mff(nullptr);
+            ob->m_compressor = mff.get();
+            ob2->m_compressor = mff.get();
+            ob3->m_compressor = mff.get();
+            mff->begin_segment(500000);
+            pos = mff->m_file->tell();
+            mff->tx_entered(1558067026, ob);
+            mff->tx_entered(1558067026, ob2);
+            mff->tx_left(1558067027, ob, bitcoin::mff::reason_expired);
+            mff->confirm_block(1558067028, 500001, block_hash, std::set<std::shared_ptr<bitcoin::tx>>{ob2});
+            mff->tx_entered(1558067029, ob3);
+            mff->tx_discarded(1558067030, ob3, std::vector<uint8_t>{1, 2, 3}, bitcoin::mff::reason_conflict);
+            mff->tx_entered(1558067031, ob);
+        }
+        auto mff = open_mff(nullptr);
+        std::vector<bitcoin::mff_event> events;
+
+        // a batch ends after a block is mined
+        mff->m_file->seek(pos, SEEK_SET);
+        REQUIRE(mff->read_events(events, 16) == 4);
+        REQUIRE(events.size() == 16);
+        REQUIRE(events[0].txid == ob->m_hash);
+        REQUIRE(events[1].txid == ob2->m_hash);
+        REQUIRE(events[2].cmd == bitcoin::mff::cmd_mempool_out);
+        REQUIRE(events[3].cmd == bitcoin::mff::cmd_block_mined);
+        REQUIRE(events[3].mined->m_hash == block_hash);
+        REQUIRE(mff->read_events(events, 2) == 2);
+        REQUIRE(events[0].txid == ob3->m_hash);
+        REQUIRE(events[1].cmd == bitcoin::mff::cmd_mempool_invalidated);
+        REQUIRE(mff->read_events(events, 2) == 1);
+        REQUIRE(events[0].txid == ob->m_hash);
+        REQUIRE(mff->read_events(events, 2) == 0);
+
+        // the analyzer gathers the same statistics from batches as it does one event at a time
+        bitcoin::mff_analyzer single, batched;
+        mff->m_file->seek(pos, SEEK_SET);
+        mff->m_delegate = &single;
+        while (mff->iterate()) {}
+        mff->m_delegate = nullptr;
+        mff->m_file->seek(pos, SEEK_SET);
+        size_t batches = 0;
+        while (mff->iterate_batch(batched, 3)) ++batches;
+        REQUIRE(batches == 3); // 3 events, then the block on its own, then 3 more
+        REQUIRE(single.count == batched.count);
+        REQUIRE(single.usage == batched.usage);
+        REQUIRE(single.total_bytes == batched.total_bytes);
+        REQUIRE(single.total_txrecs == batched.total_txrecs);
+        REQUIRE(single.total_txrec_bytes == batched.total_txrec_bytes);
+        REQUIRE(batched.last_command == bitcoin::mff::cmd_mempool_in);
+        REQUIRE(batched.last_txids.back() == ob->m_hash);
+    }
+
+    SECTION("batches across time gaps") {
+        // long gaps between events, which the recording may need time_set events for; those
+        // count towards whatever was read before them, in batches as one event at a time
+        long pos;
+        auto ob = make_random_tx(nullptr);
+        auto ob2 = make_random_tx(nullptr);
+        {
+            auto mff = new_mff(nullptr);
+            ob->m_compressor = mff.get();
+            ob2->m_compressor = mff.get();
+            mff->begin_segment(500000);
+            pos = mff->m_file->tell();
+            mff->tx_entered(1558067026, ob);
+            mff->tx_entered(1558167026, ob2);
+            mff->tx_left(1558267026, ob, bitcoin::mff::reason_expired);
+            mff->confirm_block(1558367026, 500001, random_hash(), std::set<std::shared_ptr<bitcoin::tx>>{ob2});
+            mff->tx_entered(1558467026, ob);
+            mff->tx_entered(1558567026, ob2);
+        }
+        auto mff = open_mff(nullptr);
+        bitcoin::mff_analyzer single;
+        mff->m_file->seek(pos, SEEK_SET);
+        mff->m_delegate = &single;
+        while (mff->iterate()) {}
+        mff->m_delegate = nullptr;
+        for (size_t max : {1, 2, 3, 256}) {
+            bitcoin::mff_analyzer batched;
+            mff->m_file->seek(pos, SEEK_SET);
+            while (mff->iterate_batch(batched, max)) {}
+            REQUIRE(single.count == batched.count);
+            REQUIRE(single.usage == batched.usage);
+            REQUIRE(single.total_bytes == batched.total_bytes);
+            REQUIRE(single.total_txrecs == batched.total_txrecs);
+            REQUIRE(single.total_txrec_bytes == batched.total_txrec_bytes);
+            REQUIRE(batched.last_command == bitcoin::mff::cmd_mempool_in);
+            REQUIRE(batched.last_txids.back() == ob2->m_hash);
+        }
+    }
+
+    SECTION("segment filters") {
+        auto ob = make_random_tx(nullptr);
+        auto ob2 = make_random_tx(nullptr);
+        std::string filtered;
+        {
+            auto mff = new_mff(nullptr);
+            ob->m_compressor = mff.get();
+            ob2->m_compressor = mff.get();
+            // the first segment is not filtered, as it may have been begun before the recording
+            mff->begin_segment(500000);
+            mff->tx_entered(1558067026, ob);
+            mff->begin_segment(502016);
+            filtered = mff->m_file->get_path();
+            mff->tx_entered(1558067027, ob2);
+            // the recording stops right after beginning another segment (as confirm_block()
+            // does after a segment's last block), before anything is recorded in it
+            mff->begin_segment(504032);
+            REQUIRE(mff->m_file->get_path() != filtered);
+        }
+        bitcoin::segment_filter filter;
+        REQUIRE(filter.load(filtered));
+        REQUIRE(filter.may_contain(ob2->m_hash));
+    }
+
 
     //     void confirm_block(long timestamp, uint32_t height, const uint256& hash, const std::set<std::shared_ptr<tx>>& txs) {
     //         if (m_reg.m_tip < height - 1) begin_segment(height - 1);
@@ -268,8 +586,19 @@ TEST_CASE("mff", "[mff]") {
     //     //
 }
 
+/** An analyzer whose methods can be called without going through the vtable (see mff::iterate_static()). */
+struct final_analyzer final : public bitcoin::mff_analyzer {};
+
+struct static_counter : public bitcoin::mff_static_delegate {
+    size_t mined{0}, unmined{0}, events{0};
+    void block_confirmed(const bitcoin::block& b) { ++mined; }
+    void block_reorged(uint32_t height) { ++unmined; }
+    void iterated(long starting_pos, long resulting_pos) { ++events; }
+};
+
 TEST_CASE("randomized sequence", "[random-sequence]") {
     SECTION("sequence 1 (10k)") {
+        std::map<uint8_t,size_t> replayed_counts;
         record head;
         std::vector<record*> rex;
         head.records_ptr = &rex;
@@ -393,6 +722,33 @@ TEST_CASE("randomized sequence", "[random-sequence]") {
                 // fprintf(stderr, "② %s\n", rec->to_string().c_str());
                 rec->check(&azr);
             }
+            replayed_counts = azr.count;
+        }
+        {
+            // the same replay, with the delegate's methods called directly rather than virtually
+            final_analyzer azr;
+            auto mff = open_mff(nullptr, default_dbpath, false);
+            mff->goto_segment(500000);
+            mff->m_current_time = 0;
+            for (rec = head.m_next; rec; rec = rec->m_next) {
+                REQUIRE(mff->iterate_static(azr));
+                rec->check(&azr);
+            }
+            REQUIRE(!mff->iterate_static(azr));
+            REQUIRE(azr.count == replayed_counts);
+        }
+        {
+            // and with a delegate only interested in some of the events
+            static_counter counter;
+            auto mff = open_mff(nullptr, default_dbpath, false);
+            mff->goto_segment(500000);
+            mff->m_current_time = 0;
+            while (mff->iterate_static(counter)) {}
+            REQUIRE(counter.mined == replayed_counts[bitcoin::mff::cmd_block_mined]);
+            REQUIRE(counter.unmined == replayed_counts[bitcoin::mff::cmd_block_unmined]);
+            size_t events = 0;
+            for (const auto& c : replayed_counts) events += c.second;
+            REQUIRE(counter.events == events);
         }
         for (record* r : rex) delete r;
     }
@@ -0,0 +1,58 @@
+#include "catch.hpp"
+
+#include <random>
+
+#include <utilstrencodings.h>
+
+/** ParseHex as it was, one char at a time. */
+static std::vector<unsigned char> reference_parse_hex(const std::string& str) {
+    const char* psz = str.c_str();
+    std::vector<unsigned char> vch;
+    for (;;) {
+        while (isspace((unsigned char)*psz)) psz++;
+        signed char c = HexDigit(*psz++);
+        if (c < 0) break;
+        unsigned char n = c << 4;
+        c = HexDigit(*psz++);
+        if (c < 0) break;
+        vch.push_back(n | c);
+    }
+    return vch;
+}
+
+TEST_CASE("hex decoding", "[hex]") {
+    REQUIRE(ParseHex("00ff10Ab") == std::vector<unsigned char>({0x00, 0xff, 0x10, 0xab}));
+    REQUIRE(ParseHex(" 12 34\n") == std::vector<unsigned char>({0x12, 0x34}));
+    REQUIRE(ParseHex("123").size() == 1);
+    REQUIRE(ParseHex("1 2").empty());
+
+    std::mt19937_64 rng(1);
+    const char digits[] = "0123456789abcdefABCDEF";
+    // one odd char (whitespace, or something that ends the input) at every
+    // position of inputs spanning several SIMD blocks, and none at all
+    const char odd[] = {' ', '\n', '\t', 'g', 'G', '/', ':', '@', '`', 0, (char)0x80, (char)0xb0, (char)0xe1};
+    for (size_t len : {0, 1, 2, 31, 32, 33, 63, 64, 65, 130, 257}) {
+        std::string hex(len, '0');
+        for (auto& c : hex) c = digits[rng() % 22];
+        for (size_t pos = 0; pos <= len; ++pos) {
+            std::string str = hex;
+            if (pos < len) str[pos] = odd[rng() % sizeof(odd)];
+            std::vector<unsigned char> expected = reference_parse_hex(str);
+            REQUIRE(ParseHex(str) == expected);
+
+            // into a caller buffer, with nothing written beyond the decoded bytes
+            std::vector<unsigned char> out(str.size() / 2 + 1, 0x5a);
+            size_t n = DecodeHex(str.data(), str.size(), out.data());
+            REQUIRE(std::vector<unsigned char>(out.begin(), out.begin() + n) == expected);
+            for (size_t i = n; i < out.size(); ++i) REQUIRE(out[i] == 0x5a);
+        }
+    }
+
+    // a block sized input; the length bounds the input, rather than a terminating 0
+    std::string big(2000000, '0');
+    for (auto& c : big) c = digits[rng() % 22];
+    std::vector<unsigned char> out(big.size() / 2);
+    REQUIRE(DecodeHex(big.data(), big.size() - 3, out.data()) == big.size() / 2 - 2);
+    out.resize(big.size() / 2 - 2);
+    REQUIRE(out == reference_parse_hex(big.substr(0, big.size() - 4)));
+}
@@ -0,0 +1,64 @@
+#include "catch.hpp"
+
+#include <bcq/bitcoin.h>
+#include <bcq/scan.h>
+
+#include "helpers.h"
+
+static const std::string scan_dbpath = "/tmp/cq-bitcoin-scan";
+
+TEST_CASE("segment scanner", "[scan]") {
+    size_t recorded_blocks = 0;
+    size_t recorded_txs = 0;
+    {
+        auto mff = new_mff(nullptr, scan_dbpath, false);
+        mff->begin_segment(500000);
+        tracker t(mff);
+        long timestamp = 1550000000;
+        // a few segments' worth of blocks, with some mempool activity in between
+        for (uint32_t height = 500001; height < 500000 + 2016 * 3 + 100; ++height) {
+            for (int i = random_byte() % 4; i > 0; --i) {
+                auto x = make_random_tx(mff.get());
+                t += x;
+                mff->tx_entered(++timestamp, x);
+                ++recorded_txs;
+            }
+            std::set<std::shared_ptr<bitcoin::tx>> confirmed;
+            while (t.size() > 5) confirmed.insert(t.sample_pop());
+            mff->confirm_block(++timestamp, height, random_hash(), confirmed);
+            ++recorded_blocks;
+        }
+    }
+
+    std::vector<bitcoin::segment_info> segments;
+    REQUIRE(bitcoin::list_segments(scan_dbpath, "mff", segments));
+    REQUIRE(segments.size() >= 4);
+    for (size_t i = 1; i < segments.size(); ++i) REQUIRE(segments[i - 1].cluster < segments[i].cluster);
+
+    bitcoin::mff_analyzer prototype;
+    prototype.enable_touchmap = true;
+    auto populate = [](bitcoin::mff& f, bitcoin::mff_analyzer& azr) {
+        std::set<uint256> touched_txids;
+        azr.populate_touched_txids(touched_txids);
+    };
+
+    bitcoin::mff_analyzer single, multi;
+    bitcoin::segment_scanner<bitcoin::mff_analyzer> scanner1(scan_dbpath, "mff", 2016, 1);
+    scanner1.m_on_event = populate;
+    REQUIRE(scanner1.run(prototype, single));
+    bitcoin::segment_scanner<bitcoin::mff_analyzer> scanner4(scan_dbpath, "mff", 2016, 4);
+    scanner4.m_on_event = populate;
+    REQUIRE(scanner4.run(prototype, multi));
+
+    // every event is seen exactly once
+    REQUIRE(single.count[bitcoin::mff::cmd_block_mined] == recorded_blocks);
+    REQUIRE(single.count[bitcoin::mff::cmd_mempool_in] == recorded_txs);
+
+    // and the result does not depend on the number of threads
+    REQUIRE(single.count == multi.count);
+    REQUIRE(single.usage == multi.usage);
+    REQUIRE(single.total_bytes == multi.total_bytes);
+    REQUIRE(single.touchmap == multi.touchmap);
+
+    cq::rmdir_r(scan_dbpath);
+}
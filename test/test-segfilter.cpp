@@ -0,0 +1,85 @@
+#include "catch.hpp"
+
+#include <random>
+
+#include <unistd.h>
+
+#include <bcq/segfilter.h>
+
+static const std::string flt_test_segment = "/tmp/mff-test-filter00277.cq";
+
+static uint256 random_key(std::mt19937_64& rng) {
+    uint256 key;
+    for (int i = 0; i < 4; ++i) {
+        uint64_t v = rng();
+        memcpy(key.begin() + i * 8, &v, 8);
+    }
+    return key;
+}
+
+static void write_segment(size_t size) {
+    FILE* fp = fopen(flt_test_segment.c_str(), "wb");
+    std::vector<uint8_t> data(size, 0x5a);
+    fwrite(data.data(), 1, size, fp);
+    fclose(fp);
+}
+
+TEST_CASE("segment filter", "[segfilter]") {
+    REQUIRE(bitcoin::segment_filter::path_for("/db/mff00277.cq") == "/db/mff00277.flt");
+
+    std::mt19937_64 rng(1);
+    std::vector<uint256> keys;
+    std::vector<uint64_t> fingerprints;
+    for (int i = 0; i < 20000; ++i) {
+        keys.push_back(random_key(rng));
+        fingerprints.push_back(bitcoin::segment_filter::fingerprint(keys.back()));
+    }
+    // duplicates are common, as the same txid is touched by several events
+    for (int i = 0; i < 5000; ++i) fingerprints.push_back(fingerprints[i]);
+
+    bitcoin::segment_filter filter;
+    filter.build(fingerprints);
+    REQUIRE(filter.size() >= 20000 * bitcoin::segment_filter::bits_per_key);
+    REQUIRE(filter.size() < 20000 * bitcoin::segment_filter::bits_per_key + 64);
+
+    size_t missing = 0;
+    for (const auto& key : keys) if (!filter.may_contain(key)) ++missing;
+    REQUIRE(missing == 0);
+
+    size_t false_positives = 0;
+    for (int i = 0; i < 100000; ++i) if (filter.may_contain(random_key(rng))) ++false_positives;
+    REQUIRE(false_positives < 2000);
+
+    SECTION("an empty filter rules out everything") {
+        std::vector<uint64_t> none;
+        bitcoin::segment_filter empty;
+        empty.build(none);
+        REQUIRE(!empty.may_contain(keys[0]));
+    }
+
+    SECTION("saving and loading") {
+        write_segment(12345);
+        REQUIRE(filter.save(flt_test_segment, 12345));
+        bitcoin::segment_filter loaded;
+        REQUIRE(loaded.load(flt_test_segment));
+        REQUIRE(loaded.size() == filter.size());
+        missing = 0;
+        for (const auto& key : keys) if (!loaded.may_contain(key)) ++missing;
+        REQUIRE(missing == 0);
+
+        // once the segment changes, the filter no longer applies
+        write_segment(12346);
+        REQUIRE(!loaded.load(flt_test_segment));
+        REQUIRE(loaded.may_contain(random_key(rng)));
+    }
+
+    SECTION("no filter") {
+        write_segment(100);
+        unlink(bitcoin::segment_filter::path_for(flt_test_segment).c_str());
+        bitcoin::segment_filter loaded;
+        REQUIRE(!loaded.load(flt_test_segment));
+    }
+
+    unlink(flt_test_segment.c_str());
+    unlink(bitcoin::segment_filter::path_for(flt_test_segment).c_str());
+}
@@ -0,0 +1,131 @@
+#include "catch.hpp"
+
+#include <random>
+
+#include <hash.h>
+#include <tinyblock.h>
+
+static uint256 double_sha256(const unsigned char* data, size_t len) {
+    uint256 result;
+    CHash256().Write(data, len).Finalize(result.begin());
+    return result;
+}
+
+TEST_CASE("batched double sha256", "[sha256]") {
+    REQUIRE(!SHA256AutoDetect().empty());
+
+    std::mt19937_64 rng(1);
+    std::vector<std::vector<unsigned char>> messages;
+    // every padding case (0..129 bytes), then a mix of tx-sized and large messages
+    for (size_t len = 0; len < 130; ++len) messages.emplace_back(len);
+    for (int i = 0; i < 200; ++i) messages.emplace_back(rng() % (i % 10 ? 600 : 5000));
+    for (auto& m : messages) for (auto& b : m) b = rng();
+
+    // batches smaller than, equal to and larger than the number of lanes
+    for (size_t count : {0, 1, 7, 8, 9, 64, 330}) {
+        std::vector<const unsigned char*> in;
+        std::vector<size_t> len;
+        for (size_t i = 0; i < count; ++i) {
+            const auto& m = messages[(i * 7) % messages.size()];
+            in.push_back(m.data());
+            len.push_back(m.size());
+        }
+        std::vector<uint256> hashes(count);
+        SHA256D(count ? hashes[0].begin() : nullptr, in.data(), len.data(), count);
+        for (size_t i = 0; i < count; ++i) REQUIRE(hashes[i] == double_sha256(in[i], len[i]));
+    }
+
+    SECTION("txs") {
+        std::vector<tiny::tx> txs(50);
+        std::vector<tiny::tx*> ptrs;
+        for (size_t i = 0; i < txs.size(); ++i) {
+            auto& t = txs[i];
+            t.locktime = i;
+            for (size_t j = rng() % 20; j > 0; --j) t.vin.emplace_back(tiny::outpoint(uint256S("01"), j), tiny::script_data_t(rng() % 110, 0x51));
+            for (size_t j = rng() % 5; j > 0; --j) t.vout.emplace_back(j, tiny::script_data_t(22, 0x51));
+            // witnesses are not part of the txid
+            if (i & 1 && !t.vin.empty()) t.vin[0].scriptWit.emplace_back(72, 0x30);
+            ptrs.push_back(&t);
+        }
+        tiny::UpdateHashes(ptrs.data(), ptrs.size());
+        for (auto& t : txs) {
+            uint256 batched = t.hash;
+            t.UpdateHash();
+            REQUIRE(batched == t.hash);
+        }
+    }
+}
+
+TEST_CASE("multi-lane double sha256", "[sha256]") {
+    // whichever implementation the CPU ended up with, run the lane scheduling on each one there is
+    auto transforms = SHA256Transforms8();
+    REQUIRE(transforms[0].first == "scalar");
+
+    std::mt19937_64 rng(3);
+    // lengths around the padding boundaries, mixed so that lanes finish at different times
+    std::vector<std::vector<unsigned char>> messages;
+    for (size_t len : {0, 55, 56, 64, 129, 200, 1000}) messages.emplace_back(len);
+    for (auto& m : messages) for (auto& b : m) b = rng();
+
+    for (const auto& t : transforms) {
+        for (size_t count : {8, 9, 17}) {
+            for (size_t offset = 0; offset < messages.size(); ++offset) {
+                std::vector<const unsigned char*> in;
+                std::vector<size_t> len;
+                for (size_t i = 0; i < count; ++i) {
+                    const auto& m = messages[(i * 3 + offset) % messages.size()];
+                    in.push_back(m.data());
+                    len.push_back(m.size());
+                }
+                std::vector<uint256> hashes(count);
+                SHA256D(hashes[0].begin(), in.data(), len.data(), count, t.second);
+                for (size_t i = 0; i < count; ++i) {
+                    INFO(t.first << ": message " << i << " of " << count << ", " << len[i] << " bytes");
+                    REQUIRE(hashes[i] == double_sha256(in[i], len[i]));
+                }
+            }
+        }
+    }
+}
+
+/** The merkle root of hashes, one node at a time. */
+static uint256 naive_merkle_root(std::vector<uint256> hashes) {
+    while (hashes.size() > 1) {
+        std::vector<uint256> parents;
+        for (size_t i = 0; i < hashes.size(); i += 2) {
+            const uint256& right = hashes[i + 1 < hashes.size() ? i + 1 : i];
+            parents.emplace_back();
+            CHash256().Write(hashes[i].begin(), 32).Write(right.begin(), 32).Finalize(parents.back().begin());
+        }
+        hashes.swap(parents);
+    }
+    return hashes[0];
+}
+
+TEST_CASE("merkle root", "[sha256]") {
+    std::mt19937_64 rng(2);
+    std::vector<unsigned char> in(64 * 100);
+    for (auto& b : in) b = rng();
+
+    // also in place, as compute_merkle_root() does
+    std::vector<unsigned char> out(32 * 100);
+    SHA256D64(out.data(), in.data(), 100);
+    for (size_t i = 0; i < 100; ++i) REQUIRE(uint256(std::vector<unsigned char>(&out[32 * i], &out[32 * i + 32])) == double_sha256(&in[64 * i], 64));
+    SHA256D64(in.data(), in.data(), 100);
+    REQUIRE(std::vector<unsigned char>(in.begin(), in.begin() + out.size()) == out);
+
+    for (size_t count : {1, 2, 3, 7, 8, 9, 64, 65, 1000}) {
+        std::vector<uint256> txids(count);
+        for (auto& txid : txids) for (auto& b : txid) b = rng();
+        bool mutated;
+        uint256 root = tiny::compute_merkle_root(txids, &mutated);
+        REQUIRE(root == naive_merkle_root(txids));
+        REQUIRE(!mutated);
+        if (count & 1 && count > 1) {
+            // duplicating the last tx of an odd-sized block leaves the root as is
+            txids.push_back(txids.back());
+            REQUIRE(tiny::compute_merkle_root(txids, &mutated) == root);
+            REQUIRE(mutated);
+        }
+    }
+}
@@ -0,0 +1,72 @@
+#include "catch.hpp"
+
+#include <unistd.h>
+
+#include <bcq/timeindex.h>
+
+static const std::string tix_test_path = "/tmp/mff-test.tix";
+
+static bitcoin::checkpoint make_checkpoint(int64_t time, uint32_t height, int64_t offset) {
+    bitcoin::checkpoint cp;
+    cp.time = time;
+    cp.height = height;
+    cp.segment = height - height % 2016;
+    cp.cluster = height / 2016;
+    cp.offset = offset;
+    return cp;
+}
+
+TEST_CASE("time index", "[timeindex]") {
+    unlink(tix_test_path.c_str());
+    {
+        bitcoin::time_index idx(tix_test_path);
+        REQUIRE(!idx.load());
+        REQUIRE(idx.open_for_writing());
+        REQUIRE(idx.before_time(1500000000) == nullptr);
+        // times and heights level out when nothing happens between checkpoints
+        idx.add(make_checkpoint(1500000000, 560000, 10));
+        idx.add(make_checkpoint(1500000600, 560001, 2000));
+        idx.add(make_checkpoint(1500000600, 560001, 3000));
+        idx.add(make_checkpoint(1500001200, 560003, 4000));
+    }
+
+    bitcoin::time_index idx(tix_test_path);
+    REQUIRE(idx.load());
+    REQUIRE(idx.checkpoints().size() == 4);
+    REQUIRE(idx.last()->offset == 4000);
+    REQUIRE(idx.last()->cluster == 560003 / 2016);
+
+    SECTION("lookups by time") {
+        REQUIRE(idx.before_time(1500000000) == nullptr);
+        REQUIRE(idx.before_time(1500000001)->offset == 10);
+        REQUIRE(idx.before_time(1500000600)->offset == 10);
+        REQUIRE(idx.before_time(1500000601)->offset == 3000);
+        REQUIRE(idx.before_time(1600000000)->offset == 4000);
+    }
+
+    SECTION("lookups by height") {
+        REQUIRE(idx.before_height(560000) == nullptr);
+        REQUIRE(idx.before_height(560001)->offset == 10);
+        REQUIRE(idx.before_height(560002)->offset == 3000);
+        REQUIRE(idx.before_height(560003)->offset == 3000);
+        REQUIRE(idx.before_height(570000)->offset == 4000);
+    }
+
+    SECTION("a partial record is dropped when appending") {
+        FILE* fp = fopen(tix_test_path.c_str(), "ab");
+        fwrite("garbage", 1, 7, fp);
+        fclose(fp);
+        {
+            bitcoin::time_index w(tix_test_path);
+            REQUIRE(w.open_for_writing());
+            REQUIRE(w.checkpoints().size() == 4);
+            w.add(make_checkpoint(1500001800, 560004, 5000));
+        }
+        bitcoin::time_index r(tix_test_path);
+        REQUIRE(r.load());
+        REQUIRE(r.checkpoints().size() == 5);
+        REQUIRE(r.before_time(1600000000)->offset == 5000);
+    }
+
+    unlink(tix_test_path.c_str());
+}
@@ -0,0 +1,108 @@
+#include "catch.hpp"
+
+#include <map>
+#include <memory>
+#include <random>
+#include <vector>
+
+#include <tinymap.h>
+#include <tinyqueue.h>
+
+static inline uint256 seeded_hash(std::mt19937_64& rng) {
+    uint256 hash;
+    for (int i = 0; i < 4; ++i) {
+        uint64_t v = rng();
+        memcpy(hash.begin() + i * 8, &v, 8);
+    }
+    return hash;
+}
+
+TEST_CASE("hashmap", "[tiny-containers]") {
+    std::mt19937_64 rng(1);
+
+    SECTION("insert, find, erase") {
+        tiny::hashmap<uint256, int> m;
+        auto a = seeded_hash(rng);
+        auto b = seeded_hash(rng);
+        REQUIRE(m.size() == 0);
+        REQUIRE(m.find(a) == m.end());
+        m[a] = 1;
+        REQUIRE(m.size() == 1);
+        REQUIRE(m.count(a) == 1);
+        REQUIRE(m.count(b) == 0);
+        REQUIRE(m.at(a) == 1);
+        m[b] = 2;
+        REQUIRE(m.find(b)->second == 2);
+        REQUIRE(m.erase(a) == 1);
+        REQUIRE(m.erase(a) == 0);
+        REQUIRE(m.size() == 1);
+        REQUIRE(m.count(a) == 0);
+        REQUIRE(m.at(b) == 2);
+    }
+
+    SECTION("matches std::map under random operations") {
+        tiny::hashmap<uint256, uint64_t> m;
+        std::map<uint256, uint64_t> ref;
+        std::vector<uint256> keys;
+        for (size_t i = 0; i < 100000; ++i) {
+            auto action = rng() % 3;
+            if (action < 2 || keys.empty()) {
+                auto k = seeded_hash(rng);
+                keys.push_back(k);
+                m[k] = i;
+                ref[k] = i;
+            } else {
+                size_t idx = rng() % keys.size();
+                auto k = keys[idx];
+                keys[idx] = keys.back();
+                keys.pop_back();
+                REQUIRE(m.erase(k) == ref.erase(k));
+            }
+            if (!(i % 10000)) {
+                REQUIRE(m.size() == ref.size());
+                for (const auto& r : ref) REQUIRE(m.at(r.first) == r.second);
+                size_t iterated = 0;
+                for (const auto& e : m) {
+                    REQUIRE(ref.at(e.first) == e.second);
+                    ++iterated;
+                }
+                REQUIRE(iterated == ref.size());
+            }
+        }
+    }
+}
+
+struct queued_int : public tiny::queue_hook<queued_int> {
+    int v;
+    queued_int(int v_in) : v(v_in) {}
+};
+
+TEST_CASE("rank_queue", "[tiny-containers]") {
+    std::mt19937_64 rng(2);
+
+    SECTION("matches std::vector under random operations") {
+        std::vector<std::unique_ptr<queued_int>> pool;
+        std::vector<const queued_int*> ref;
+        tiny::rank_queue<queued_int> q;
+        for (int i = 0; i < 20000; ++i) {
+            auto action = rng() % 3;
+            if (action < 2 || ref.empty()) {
+                pool.emplace_back(new queued_int(i));
+                size_t pos = rng() % (ref.size() + 1);
+                q.insert(pos, pool.back().get(), rng());
+                ref.insert(ref.begin() + pos, pool.back().get());
+            } else {
+                size_t pos = rng() % ref.size();
+                REQUIRE(q.index_of(ref[pos]) == pos);
+                q.erase(ref[pos]);
+                REQUIRE(!ref[pos]->queued());
+                ref.erase(ref.begin() + pos);
+            }
+            REQUIRE(q.size() == ref.size());
+            if (!ref.empty()) REQUIRE(q.front() == ref[0]);
+            if (!(i % 1000)) {
+                for (size_t j = 0; j < ref.size(); ++j) REQUIRE(q.at(j) == ref[j]);
+            }
+        }
+    }
+}
@@ -0,0 +1,83 @@
+#include "catch.hpp"
+
+#include <random>
+#include <thread>
+
+#include <streams.h>
+#include <tinyblock.h>
+#include <tinyhashpool.h>
+
+static std::vector<tiny::tx> make_txs(size_t count, std::mt19937_64& rng) {
+    std::vector<tiny::tx> txs(count);
+    for (size_t i = 0; i < count; ++i) {
+        auto& t = txs[i];
+        t.locktime = i;
+        for (size_t j = 1 + rng() % 4; j > 0; --j) t.vin.emplace_back(tiny::outpoint(uint256S("01"), j), tiny::script_data_t(rng() % 110, 0x51));
+        for (size_t j = 1 + rng() % 3; j > 0; --j) t.vout.emplace_back(j, tiny::script_data_t(22, 0x51));
+        if (i & 1) t.vin[0].scriptWit.emplace_back(72, 0x30);
+        t.UpdateHash();
+    }
+    return txs;
+}
+
+TEST_CASE("deferred tx hashing", "[tinyhashpool]") {
+    std::mt19937_64 rng(1);
+    tiny::block b;
+    b.vtx = make_txs(1000, rng);
+    CDataStream ds(SER_DISK, 0);
+    ds << b;
+
+    SECTION("deserialized txs are hashed once the scope is closed") {
+        tiny::tx t;
+        {
+            tiny::deferred_hashing defer;
+            CDataStream ds2(SER_DISK, 0);
+            ds2 << b.vtx[3];
+            ds2 >> t;
+            REQUIRE(t.hash.IsNull());
+        }
+        CDataStream ds2(SER_DISK, 0);
+        ds2 << b.vtx[3];
+        ds2 >> t;
+        REQUIRE(t.hash == b.vtx[3].hash);
+    }
+
+    SECTION("blocks hash their txs together") {
+        // also when nested in another deferral scope
+        tiny::deferred_hashing defer;
+        tiny::block b2;
+        ds >> b2;
+        REQUIRE(b2.vtx.size() == b.vtx.size());
+        for (size_t i = 0; i < b.vtx.size(); ++i) REQUIRE(b2.vtx[i].hash == b.vtx[i].hash);
+    }
+
+    SECTION("worker pool") {
+        tiny::hash_pool pool;
+        pool.start(3);
+        REQUIRE(pool.workers() == 3);
+        std::vector<std::vector<tiny::tx>> sets{make_txs(777, rng), make_txs(64, rng), make_txs(2000, rng)};
+        std::vector<std::vector<uint256>> expected;
+        for (auto& txs : sets) {
+            expected.emplace_back();
+            for (auto& t : txs) {
+                expected.back().push_back(t.hash);
+                t.hash.SetNull();
+            }
+        }
+        // several callers at once
+        std::vector<std::thread> callers;
+        for (auto& txs : sets) callers.emplace_back([&pool, &txs]() { pool.hash(txs); });
+        for (auto& c : callers) c.join();
+        for (size_t i = 0; i < sets.size(); ++i) {
+            for (size_t j = 0; j < sets[i].size(); ++j) REQUIRE(sets[i][j].hash == expected[i][j]);
+        }
+
+        // the shared pool is used for blocks
+        tiny::hash_pool::shared().start(2);
+        tiny::block b2;
+        ds >> b2;
+        tiny::hash_pool::shared().stop();
+        REQUIRE(tiny::hash_pool::shared().workers() == 0);
+        for (size_t i = 0; i < b.vtx.size(); ++i) REQUIRE(b2.vtx[i].hash == b.vtx[i].hash);
+    }
+}
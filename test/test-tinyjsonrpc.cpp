@@ -0,0 +1,401 @@
+#include "catch.hpp"
+
+#include <atomic>
+#include <functional>
+#include <thread>
+
+#include <netinet/in.h>
+#include <sys/socket.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+#include <streams.h>
+#include <tinyprefetcher.h>
+#include <tinyrpc.h>
+
+/**
+ * Single-threaded local HTTP JSON-RPC server, answering calls through the
+ * given handler, which returns either a result or (via error) an error
+ * message. Batch responses are sent in reverse order, as nothing says they
+ * have to be in order. Errors are reported with bitcoind's codes: -8 for
+ * "Block height out of range", and -5 for anything else.
+ */
+struct stub_server {
+    typedef std::function<std::string(const std::string& method, const tiny::json& params, std::string& error)> handler_t;
+
+    int m_fd;
+    uint16_t port;
+    handler_t m_handler;
+    bool m_close_after_response{false};
+    std::atomic<int> accepted{0};
+    std::atomic<int> calls{0};
+    std::thread m_thread;
+
+    stub_server(handler_t handler) : m_handler(handler) {
+        m_fd = socket(AF_INET, SOCK_STREAM, 0);
+        struct sockaddr_in addr;
+        memset(&addr, 0, sizeof(addr));
+        addr.sin_family = AF_INET;
+        addr.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+        addr.sin_port = 0;
+        bind(m_fd, (struct sockaddr*)&addr, sizeof(addr));
+        socklen_t len = sizeof(addr);
+        getsockname(m_fd, (struct sockaddr*)&addr, &len);
+        port = ntohs(addr.sin_port);
+        listen(m_fd, 4);
+        m_thread = std::thread([this]() { serve(); });
+    }
+
+    ~stub_server() {
+        shutdown(m_fd, SHUT_RDWR);
+        close(m_fd);
+        m_thread.join();
+    }
+
+    std::string respond(const tiny::json& call) {
+        ++calls;
+        std::string error;
+        std::string result = m_handler(call["method"].get_str(), call["params"], error);
+        if (!error.empty()) return strprintf("{\"result\":null,\"error\":{\"code\":%d,\"message\":%s},\"id\":%s}", error == "Block height out of range" ? -8 : -5, tiny::json::quote(error), call["id"].str);
+        return strprintf("{\"result\":%s,\"error\":null,\"id\":%s}", result, call["id"].str);
+    }
+
+    void serve() {
+        for (;;) {
+            int c = accept(m_fd, nullptr, nullptr);
+            if (c == -1) return;
+            ++accepted;
+            std::string buf;
+            char tmp[65536];
+            for (;;) {
+                size_t header_end;
+                bool lost = false;
+                while ((header_end = buf.find("\r\n\r\n")) == std::string::npos) {
+                    ssize_t r = recv(c, tmp, sizeof(tmp), 0);
+                    if (r <= 0) { lost = true; break; }
+                    buf.append(tmp, r);
+                }
+                if (lost) break;
+                size_t cl = buf.find("Content-Length: ");
+                size_t len = atol(buf.c_str() + cl + 16);
+                buf.erase(0, header_end + 4);
+                while (buf.size() < len) {
+                    ssize_t r = recv(c, tmp, sizeof(tmp), 0);
+                    if (r <= 0) { lost = true; break; }
+                    buf.append(tmp, r);
+                }
+                if (lost) break;
+                tiny::json req;
+                tiny::json::parse(buf.substr(0, len), req);
+                buf.erase(0, len);
+                std::string body;
+                if (req.type == tiny::json::array_t) {
+                    for (size_t i = req.arr.size(); i > 0; --i) body += (body.empty() ? "" : ",") + respond(req.arr[i - 1]);
+                    body = "[" + body + "]";
+                } else {
+                    body = respond(req);
+                }
+                std::string resp = strprintf("HTTP/1.1 200 OK\r\nContent-Type: application/json\r\nContent-Length: %zu\r\n\r\n", body.size()) + body;
+                send(c, resp.data(), resp.size(), MSG_NOSIGNAL);
+                if (m_close_after_response) break;
+            }
+            close(c);
+        }
+    }
+};
+
+/** Runs the enclosed code in a fresh working directory, as that is where the rpc cache lives. */
+struct scoped_cache_dir {
+    char m_cwd[1024];
+    std::string m_dir;
+    scoped_cache_dir(const std::string& name) {
+        REQUIRE(getcwd(m_cwd, sizeof(m_cwd)));
+        m_dir = "/tmp/" + name + "-" + std::to_string(getpid());
+        system(("rm -rf " + m_dir).c_str());
+        mkdir(m_dir.c_str(), 0777);
+        REQUIRE(chdir(m_dir.c_str()) == 0);
+        mkdir("blockdata", 0777);
+        mkdir("txdata", 0777);
+    }
+    ~scoped_cache_dir() {
+        if (chdir(m_cwd) == 0) system(("rm -rf " + m_dir).c_str());
+    }
+};
+
+TEST_CASE("json", "[tinyjsonrpc]") {
+    tiny::json j;
+    REQUIRE(tiny::json::parse(" {\"a\": [1, -2.5e3, true, false, null], \"b\": \"x\\\"\\\\\\n\\u00e9\\ud83d\\ude00\", \"c\": {}} ", j));
+    REQUIRE(j.type == tiny::json::object_t);
+    REQUIRE(j["a"].arr.size() == 5);
+    REQUIRE(j["a"][0].get_int() == 1);
+    REQUIRE(j["a"][1].str == "-2.5e3");
+    REQUIRE(j["a"][2].b);
+    REQUIRE(j["a"][3].type == tiny::json::bool_t);
+    REQUIRE(!j["a"][3].b);
+    REQUIRE(j["a"][4].is_null());
+    REQUIRE(j["a"][5].is_null());
+    REQUIRE(j["b"].get_str() == "x\"\\\n\xc3\xa9\xf0\x9f\x98\x80");
+    REQUIRE(j["c"].type == tiny::json::object_t);
+    REQUIRE(j["missing"].is_null());
+
+    REQUIRE(!tiny::json::parse("", j));
+    REQUIRE(!tiny::json::parse("{\"a\":1", j));
+    REQUIRE(!tiny::json::parse("[1,]", j));
+    REQUIRE(!tiny::json::parse("\"abc", j));
+    REQUIRE(!tiny::json::parse("[1] 2", j));
+    REQUIRE(!tiny::json::parse(std::string(100, '['), j));
+
+    std::string s = "a\"b\\c\nd\x01";
+    REQUIRE(tiny::json::parse(tiny::json::quote(s), j));
+    REQUIRE(j.get_str() == s);
+}
+
+TEST_CASE("jsonrpc client", "[tinyjsonrpc]") {
+    stub_server server([](const std::string& method, const tiny::json& params, std::string& error) -> std::string {
+        if (method == "getblockcount") return "123";
+        if (method == "echo") return tiny::json::quote(params[0].get_str());
+        error = "Method not found";
+        return "";
+    });
+    tiny::jsonrpc_client client("127.0.0.1", server.port, "user:pass");
+
+    SECTION("calls share one connection") {
+        REQUIRE(client.call("getblockcount", "[]").get_int() == 123);
+        REQUIRE(client.call("echo", "[\"hello\"]").get_str() == "hello");
+        REQUIRE(client.call("getblockcount", "[]").get_int() == 123);
+        REQUIRE(client.connections() == 1);
+        REQUIRE(server.accepted == 1);
+        REQUIRE_THROWS_AS(client.call("nope", "[]"), tiny::rpc_error);
+        // an error reply does not affect the connection
+        REQUIRE(client.call("getblockcount", "[]").get_int() == 123);
+        REQUIRE(client.connections() == 1);
+    }
+
+    SECTION("batches are matched up by id") {
+        std::vector<std::pair<std::string, std::string>> calls;
+        for (int i = 0; i < 50; ++i) calls.emplace_back(i == 7 ? "nope" : "echo", strprintf("[\"%d\"]", i));
+        auto responses = client.batch(calls);
+        REQUIRE(responses.size() == 50);
+        REQUIRE(server.calls == 50);
+        for (int i = 0; i < 50; ++i) {
+            if (i == 7) {
+                REQUIRE(!responses[i].ok());
+                REQUIRE(responses[i].error_message() == "Method not found (code -5)");
+            } else {
+                REQUIRE(responses[i].ok());
+                REQUIRE(responses[i].result.get_str() == std::to_string(i));
+            }
+        }
+        REQUIRE(client.connections() == 1);
+    }
+
+    SECTION("dropped connections are reestablished") {
+        server.m_close_after_response = true;
+        for (int i = 0; i < 3; ++i) REQUIRE(client.call("getblockcount", "[]").get_int() == 123);
+        REQUIRE(client.connections() == 3);
+    }
+
+    SECTION("URLs") {
+        auto c = tiny::jsonrpc_client::from_url(strprintf("http://u:p@127.0.0.1:%u", server.port), "/nonexistent");
+        REQUIRE(c);
+        REQUIRE(c->call("getblockcount", "[]").get_int() == 123);
+        REQUIRE(!tiny::jsonrpc_client::from_url("http://127.0.0.1:8332", "/nonexistent"));
+    }
+}
+
+TEST_CASE("rpc over jsonrpc", "[tinyjsonrpc]") {
+    // a chain of one block, containing a tx which spends two outputs of another tx
+    tiny::tx funding;
+    funding.vin.emplace_back(tiny::outpoint(uint256S("01"), 0));
+    funding.vout.emplace_back(1000, tiny::script_data_t(22, 0x51));
+    funding.vout.emplace_back(2000, tiny::script_data_t(22, 0x51));
+    funding.UpdateHash();
+    tiny::block b;
+    b.time = 1500000000;
+    b.vtx.emplace_back();
+    b.vtx[0].vin.emplace_back(tiny::outpoint(funding.hash, 0));
+    b.vtx[0].vin.emplace_back(tiny::outpoint(funding.hash, 1));
+    b.vtx[0].vout.emplace_back(2500, tiny::script_data_t(22, 0x51));
+    b.vtx[0].UpdateHash();
+    b.merkle_root = b.vtx[0].hash;
+    const uint256 blockhash = b.GetHash();
+    CDataStream ds(SER_NETWORK, PROTOCOL_VERSION);
+    ds << b;
+    const std::string block_hex = HexStr(ds.begin(), ds.end());
+    ds.clear();
+    ds << funding;
+    const std::string funding_hex = HexStr(ds.begin(), ds.end());
+
+    stub_server server([&](const std::string& method, const tiny::json& params, std::string& error) -> std::string {
+        if (method == "getblockhash" && params[0].get_int() == 7) return tiny::json::quote(blockhash.ToString());
+        if (method == "getblock" && params[0].get_str() == blockhash.ToString()) return tiny::json::quote(block_hex);
+        if (method == "getblockheader" && params[0].get_str() == blockhash.ToString()) return "{\"height\":7}";
+        if (method == "getrawtransaction" && params[0].get_str() == funding.hash.ToString()) return tiny::json::quote(funding_hex);
+        error = method == "getblockhash" && params[0].get_int() == 8 ? "Block height out of range" : "not found";
+        return "";
+    });
+
+    scoped_cache_dir cache("mff-test-rpc");
+    {
+        tiny::rpc rpc(std::make_shared<tiny::jsonrpc_client>("127.0.0.1", server.port, "user:pass"));
+        tiny::block b2;
+        uint256 hash;
+        uint32_t height = 0;
+        REQUIRE(rpc.get_block(7, b2, hash));
+        REQUIRE(hash == blockhash);
+        REQUIRE(b2.GetHash() == blockhash);
+        REQUIRE(b2.vtx.size() == 1);
+        REQUIRE(b2.vtx[0].hash == b.vtx[0].hash);
+        int calls = server.calls;
+        REQUIRE(calls == 3); // getblockhash, then getblock+getblockheader as one batch
+
+        // cached now
+        REQUIRE(rpc.get_block(blockhash, b2, height));
+        REQUIRE(height == 7);
+        REQUIRE(rpc.get_block(7, b2, hash));
+        REQUIRE(server.calls == calls);
+
+        // orphans are reported as such
+        REQUIRE(!rpc.get_block(uint256S("02"), b2, height));
+
+        // as are heights beyond the tip, but no other errors
+        REQUIRE(!rpc.get_block(8, b2, hash));
+        REQUIRE_THROWS_AS(rpc.get_block(9, b2, hash), tiny::rpc_error);
+
+        // both inputs are fetched in one batch, and only once
+        calls = server.calls;
+        REQUIRE(rpc.get_tx_input_amount(b2.vtx[0]) == 3000);
+        REQUIRE(server.calls == calls + 1);
+        REQUIRE(rpc.get_tx_input_amount(b2.vtx[0]) == 3000);
+        REQUIRE(server.calls == calls + 1);
+
+        REQUIRE_THROWS_AS(rpc.get_tx(uint256S("03"), b2.vtx[0]), tiny::rpc_error);
+        REQUIRE(server.accepted == 1);
+    }
+
+    // with a store, entries are picked up from the cache directories as needed,
+    // and new ones only go into the store
+    {
+        auto store = std::make_shared<tiny::store>();
+        REQUIRE(store->open("store"));
+        tiny::rpc rpc(std::make_shared<tiny::jsonrpc_client>("127.0.0.1", server.port, "user:pass"));
+        rpc.m_store = store;
+        tiny::block b2;
+        uint256 hash;
+        int calls = server.calls;
+        REQUIRE(rpc.get_block(7, b2, hash));
+        REQUIRE(b2.GetHash() == blockhash);
+        REQUIRE(server.calls == calls);
+        REQUIRE(store->has(tiny::store::block_hash, tiny::store::height_key(7)));
+        REQUIRE(store->has(tiny::store::block, blockhash));
+
+        system("rm -rf blockdata txdata");
+        mkdir("blockdata", 0777);
+        mkdir("txdata", 0777);
+        REQUIRE(rpc.get_block(7, b2, hash));
+        REQUIRE(b2.GetHash() == blockhash);
+        REQUIRE(rpc.get_tx_input_amount(b2.vtx[0]) == 3000);
+        REQUIRE(server.calls == calls + 1);
+        REQUIRE(store->has(tiny::store::tx, funding.hash));
+        REQUIRE(!tiny::OpenFile("txdata/" + funding.hash.ToString() + ".mfft", "rb")->has_data());
+        REQUIRE(!tiny::OpenFile("blockdata/7.hth", "rb")->has_data());
+
+        // a corrupt cache entry is fetched again, and replaced
+        const uint8_t* data;
+        size_t len;
+        REQUIRE(store->get(tiny::store::block, blockhash, data, len));
+        std::vector<uint8_t> corrupt(data, data + len);
+        corrupt.back() ^= 1;
+        REQUIRE(store->replace(tiny::store::block, blockhash, corrupt.data(), corrupt.size()));
+        REQUIRE(rpc.check_cached_blocks() == std::vector<uint256>{blockhash});
+        calls = server.calls;
+        REQUIRE(rpc.get_block(7, b2, hash));
+        REQUIRE(b2.vtx[0].hash == b.vtx[0].hash);
+        REQUIRE(server.calls == calls + 2); // getblock+getblockheader
+        REQUIRE(rpc.check_cached_blocks().empty());
+    }
+}
+
+TEST_CASE("block prefetcher", "[tinyjsonrpc]") {
+    std::vector<tiny::block> chain(20);
+    std::vector<std::string> chain_hex;
+    for (size_t i = 0; i < chain.size(); ++i) {
+        chain[i].time = 1500000000 + i * 600;
+        if (i) chain[i].prev_blk = chain[i - 1].GetHash();
+        chain[i].vtx.emplace_back();
+        chain[i].vtx[0].locktime = i;
+        chain[i].vtx[0].UpdateHash();
+        chain[i].merkle_root = chain[i].vtx[0].hash;
+        CDataStream ds(SER_NETWORK, PROTOCOL_VERSION);
+        ds << chain[i];
+        chain_hex.push_back(HexStr(ds.begin(), ds.end()));
+    }
+    std::atomic<int> max_height{-1};
+    std::atomic<bool> broken{false};
+    stub_server server([&](const std::string& method, const tiny::json& params, std::string& error) -> std::string {
+        if (broken) {
+            error = "Work queue depth exceeded";
+            return "";
+        }
+        for (size_t i = 0; i < chain.size(); ++i) {
+            if (method == "getblockhash" && params[0].get_int() == (int64_t)i) {
+                if ((int)i > max_height) max_height = i;
+                return tiny::json::quote(chain[i].GetHash().ToString());
+            }
+            if (params[0].is_string() && params[0].get_str() == chain[i].GetHash().ToString()) {
+                if (method == "getblock") return tiny::json::quote(chain_hex[i]);
+                if (method == "getblockheader") return strprintf("{\"height\":%zu}", i);
+            }
+        }
+        error = method == "getblockhash" ? "Block height out of range" : "not found";
+        return "";
+    });
+
+    scoped_cache_dir cache("mff-test-prefetch");
+    tiny::rpc rpc(std::make_shared<tiny::jsonrpc_client>("127.0.0.1", server.port, "user:pass"));
+    tiny::block_prefetcher prefetcher(rpc, 4);
+    tiny::block b;
+    uint256 hash;
+    uint32_t height;
+
+    REQUIRE(prefetcher.get(0, b, hash));
+    REQUIRE(hash == chain[0].GetHash());
+    REQUIRE(b.time == chain[0].time);
+
+    // the blocks ahead of the cursor are fetched in the background, but no further
+    for (int i = 0; i < 500 && prefetcher.size() < 4; ++i) std::this_thread::sleep_for(std::chrono::milliseconds(10));
+    REQUIRE(prefetcher.size() == 4);
+    REQUIRE(max_height == 3);
+    REQUIRE(prefetcher.find(chain[3].GetHash(), b, height));
+    REQUIRE(height == 3);
+    REQUIRE(b.GetHash() == chain[3].GetHash());
+    REQUIRE(!prefetcher.find(chain[4].GetHash(), b, height));
+
+    // walking forward
+    for (uint32_t i = 1; i < chain.size(); ++i) {
+        REQUIRE(prefetcher.get(i, b, hash));
+        REQUIRE(hash == chain[i].GetHash());
+        REQUIRE(b.prev_blk == chain[i - 1].GetHash());
+    }
+    // blocks behind the cursor are dropped
+    REQUIRE(!prefetcher.find(chain[5].GetHash(), b, height));
+
+    // beyond the tip
+    REQUIRE(!prefetcher.get(20, b, hash));
+    REQUIRE(!prefetcher.get(20, b, hash));
+
+    // jumping back
+    REQUIRE(prefetcher.get(2, b, hash));
+    REQUIRE(hash == chain[2].GetHash());
+
+    // other failures reach the caller, as they would without a prefetcher
+    broken = true;
+    REQUIRE_THROWS_AS(prefetcher.get(20, b, hash), tiny::rpc_error);
+    REQUIRE_THROWS_AS(prefetcher.get(20, b, hash), tiny::rpc_error);
+    broken = false;
+    // a failure may have been fetched again in the meantime; moving away drops it
+    REQUIRE(prefetcher.get(2, b, hash));
+    REQUIRE(!prefetcher.get(20, b, hash));
+    REQUIRE(prefetcher.get(19, b, hash));
+    REQUIRE(hash == chain[19].GetHash());
+}
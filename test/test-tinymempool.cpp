@@ -0,0 +1,277 @@
+#include "catch.hpp"
+
+#include <algorithm>
+#include <random>
+
+#include <streams.h>
+#include <tinymempool.h>
+
+static uint32_t tx_counter = 0;
+
+static inline std::shared_ptr<tiny::tx> make_tx(const std::vector<tiny::outpoint>& prevouts, size_t outputs, tiny::amount value) {
+    auto t = std::make_shared<tiny::tx>();
+    t->locktime = ++tx_counter; // make txids unique
+    for (const auto& prevout : prevouts) t->vin.emplace_back(prevout);
+    for (size_t i = 0; i < outputs; ++i) t->vout.emplace_back(value, tiny::script_data_t(22, 0x51));
+    t->UpdateHash();
+    return t;
+}
+
+struct recording_callback : public tiny::mempool_callback {
+    std::vector<std::pair<uint256, tiny::MemPoolRemovalReason>> removals;
+    std::vector<uint256> additions;
+    void add_entry(std::shared_ptr<const tiny::mempool_entry>& entry) override { additions.push_back(entry->x->hash); }
+    void skipping_mined_tx(std::shared_ptr<tiny::tx> tx) override {}
+    void remove_entry(std::shared_ptr<const tiny::mempool_entry>& entry, tiny::MemPoolRemovalReason reason, std::shared_ptr<tiny::tx> cause) override { removals.emplace_back(entry->x->hash, reason); }
+    void push_block(int height, uint256 hash, const std::vector<tiny::tx>& txs) override {}
+    void pop_block(int height) override {}
+};
+
+TEST_CASE("mempool spend index", "[tinymempool]") {
+    tiny::mempool mp;
+    recording_callback cb;
+    mp.callback = &cb;
+
+    // a retained funding tx whose outputs the other txs spend
+    auto funding = make_tx({tiny::outpoint(uint256S("01"), 0)}, 4, 100000);
+    mp.insert_tx(funding, true);
+    REQUIRE(mp.spenders.size() == 1);
+
+    SECTION("insertion and removal keep the index in sync") {
+        auto a = make_tx({tiny::outpoint(funding->hash, 0), tiny::outpoint(funding->hash, 1)}, 1, 150000);
+        mp.insert_tx(a);
+        REQUIRE(mp.spenders.size() == 3);
+        REQUIRE(mp.spenders.at(tiny::outpoint(funding->hash, 1))->x->hash == a->hash);
+        REQUIRE(!mp.is_tx_conflicting(make_tx({tiny::outpoint(funding->hash, 2)}, 1, 1000)));
+        REQUIRE(mp.is_tx_conflicting(make_tx({tiny::outpoint(funding->hash, 1)}, 1, 1000)));
+        mp.remove_entry(mp.entry_map.at(a->hash), tiny::MemPoolRemovalReason::EXPIRY);
+        REQUIRE(mp.spenders.size() == 1);
+        REQUIRE(!mp.is_tx_conflicting(make_tx({tiny::outpoint(funding->hash, 1)}, 1, 1000)));
+    }
+
+    SECTION("conflicts are evicted through the index") {
+        auto a = make_tx({tiny::outpoint(funding->hash, 0)}, 1, 90000);
+        auto child = make_tx({tiny::outpoint(a->hash, 0)}, 1, 80000);
+        mp.insert_tx(a);
+        mp.insert_tx(child);
+        REQUIRE(mp.entry_map.size() == 3);
+        // b double-spends a's input, paying a higher fee over the same input
+        auto b = make_tx({tiny::outpoint(funding->hash, 0)}, 1, 50000);
+        mp.insert_tx(b);
+        REQUIRE(mp.entry_map.size() == 2);
+        REQUIRE(mp.entry_map.count(b->hash));
+        REQUIRE(mp.spenders.at(tiny::outpoint(funding->hash, 0))->x->hash == b->hash);
+        REQUIRE(!mp.spenders.count(tiny::outpoint(a->hash, 0)));
+        REQUIRE(cb.removals.size() == 2);
+        REQUIRE(cb.removals[0].first == child->hash);
+        REQUIRE(cb.removals[1].first == a->hash);
+        REQUIRE(cb.removals[1].second == tiny::MemPoolRemovalReason::REPLACED);
+    }
+
+    SECTION("the index is rebuilt on load") {
+        mp.insert_tx(make_tx({tiny::outpoint(funding->hash, 0)}, 2, 40000));
+        mp.insert_tx(make_tx({tiny::outpoint(funding->hash, 1), tiny::outpoint(funding->hash, 2)}, 1, 40000));
+        CDataStream ds(SER_DISK, 0);
+        ds << mp;
+        tiny::mempool mp2;
+        ds >> mp2;
+        REQUIRE(mp2.entry_map.size() == mp.entry_map.size());
+        REQUIRE(mp2.entry_queue.size() == mp2.entry_map.size()); // loading enqueues everything, retained or not
+        REQUIRE(mp2.spenders.size() == mp.spenders.size());
+        for (const auto& s : mp.spenders) {
+            REQUIRE(mp2.spenders.at(s.first)->x->hash == s.second->x->hash);
+            // the index must point at the canonical entries
+            REQUIRE(mp2.spenders.at(s.first) == mp2.entry_map.at(s.second->x->hash));
+        }
+    }
+}
+
+TEST_CASE("mempool entry fee and weight", "[tinymempool]") {
+    auto x = make_tx({tiny::outpoint(uint256S("02"), 0), tiny::outpoint(uint256S("03"), 1)}, 2, 40000);
+    // put together by hand, so the weight is not cached, but computed when asked for
+    REQUIRE(x->weight == 0);
+    int64_t weight = x->ComputeWeight();
+    REQUIRE(x->GetWeight() == weight);
+
+    tiny::mempool_entry entry(x, 100000, false);
+    REQUIRE(entry.fee() == 20000);
+    REQUIRE(entry.weight() == weight);
+    REQUIRE(entry.feerate() == 4.0 * 20000 / weight);
+
+    // unknown inputs mean an unknown fee
+    tiny::mempool_entry unknown(x, 0, true);
+    REQUIRE(unknown.fee() == 0);
+    REQUIRE(unknown.feerate() == 0);
+
+    // deserialized txs and entries come with everything computed
+    CDataStream ds(SER_DISK, 0);
+    ds << entry;
+    auto loaded = std::make_shared<const tiny::mempool_entry>(deserialize, ds);
+    REQUIRE(loaded->x->weight == weight);
+    REQUIRE(loaded->fee() == entry.fee());
+    REQUIRE(loaded->weight() == weight);
+    REQUIRE(loaded->feerate() == entry.feerate());
+}
+
+TEST_CASE("mempool fee queue order", "[tinymempool]") {
+    tiny::mempool mp;
+    recording_callback cb;
+    mp.callback = &cb;
+    auto funding = make_tx({tiny::outpoint(uint256S("01"), 0)}, 200, 100000);
+    mp.insert_tx(funding, true);
+
+    // 10, 20 and 30 sat/vbyte (82 vbytes each); the last one is more expensive than
+    // anything the search probes, which used to put it in front of the last entry probed
+    auto a = make_tx({tiny::outpoint(funding->hash, 0)}, 1, 100000 - 820);
+    auto b = make_tx({tiny::outpoint(funding->hash, 1)}, 1, 100000 - 1640);
+    auto c = make_tx({tiny::outpoint(funding->hash, 2)}, 1, 100000 - 2460);
+    mp.insert_tx(a);
+    mp.insert_tx(b);
+    mp.insert_tx(c);
+    REQUIRE(mp.entry_queue.size() == 3);
+    REQUIRE(mp.entry_queue.at(0)->x->hash == a->hash);
+    REQUIRE(mp.entry_queue.at(1)->x->hash == b->hash);
+    REQUIRE(mp.entry_queue.at(2)->x->hash == c->hash);
+
+    // feerates further apart than the search's 1 sat/vbyte tolerance, in random order
+    std::vector<uint32_t> rates;
+    for (uint32_t i = 3; i < 200; ++i) rates.push_back(2 * i + 1);
+    std::shuffle(rates.begin(), rates.end(), std::mt19937_64(1));
+    for (uint32_t i = 3; i < 200; ++i) mp.insert_tx(make_tx({tiny::outpoint(funding->hash, i)}, 1, 100000 - 82 * rates[i - 3]));
+    REQUIRE(mp.entry_queue.size() == 200);
+    for (size_t i = 1; i < mp.entry_queue.size(); ++i) {
+        REQUIRE(mp.entry_queue.at(i - 1)->feerate() < mp.entry_queue.at(i)->feerate());
+    }
+}
+
+/** Check the package totals of every entry against ones found by walking the mempool. */
+static void check_packages(const tiny::mempool& mp) {
+    for (const auto& e : mp.entry_map) {
+        std::set<uint256> ancestors, descendants, pending{e.first};
+        while (!pending.empty()) {
+            uint256 txid = *pending.begin();
+            pending.erase(pending.begin());
+            for (const auto& in : mp.entry_map.at(txid)->x->vin) {
+                if (mp.entry_map.count(in.prevout.hash) && ancestors.insert(in.prevout.hash).second) pending.insert(in.prevout.hash);
+            }
+        }
+        pending.insert(e.first);
+        while (!pending.empty()) {
+            uint256 txid = *pending.begin();
+            pending.erase(pending.begin());
+            for (const auto& c : mp.entry_map) {
+                for (const auto& in : c.second->x->vin) {
+                    if (in.prevout.hash == txid && descendants.insert(c.first).second) pending.insert(c.first);
+                }
+            }
+        }
+        uint64_t fee = e.second->fee();
+        int64_t weight = e.second->weight();
+        for (const auto& a : ancestors) { fee += mp.entry_map.at(a)->fee(); weight += mp.entry_map.at(a)->weight(); }
+        REQUIRE(e.second->ancestor_count == 1 + ancestors.size());
+        REQUIRE(e.second->ancestor_fee == fee);
+        REQUIRE(e.second->ancestor_weight == weight);
+        fee = e.second->fee();
+        weight = e.second->weight();
+        for (const auto& d : descendants) { fee += mp.entry_map.at(d)->fee(); weight += mp.entry_map.at(d)->weight(); }
+        REQUIRE(e.second->descendant_count == 1 + descendants.size());
+        REQUIRE(e.second->descendant_fee == fee);
+        REQUIRE(e.second->descendant_weight == weight);
+    }
+}
+
+TEST_CASE("package eviction", "[tinymempool]") {
+    tiny::mempool mp;
+    mp.package_eviction = true;
+    recording_callback cb;
+    mp.callback = &cb;
+
+    auto funding = make_tx({tiny::outpoint(uint256S("01"), 0)}, 8, 100000);
+    mp.insert_tx(funding, true);
+
+    // a low fee parent, bumped by a high fee child
+    auto parent = make_tx({tiny::outpoint(funding->hash, 0)}, 1, 99900);
+    auto child = make_tx({tiny::outpoint(parent->hash, 0)}, 1, 50000);
+    // and an unrelated tx in between the two
+    auto middle = make_tx({tiny::outpoint(funding->hash, 1)}, 1, 95000);
+    mp.insert_tx(parent);
+    mp.insert_tx(middle);
+    REQUIRE(mp.entry_queue.front()->x->hash == parent->hash);
+    mp.insert_tx(child);
+    check_packages(mp);
+    const auto& p = *mp.entry_map.at(parent->hash);
+    REQUIRE(p.descendant_count == 2);
+    REQUIRE(p.descendant_fee == 100 + 49900);
+    REQUIRE(mp.entry_map.at(child->hash)->ancestor_count == 3); // the (retained) funding tx is an ancestor too
+    // the parent is no longer the cheapest to evict, as its child pays for it
+    REQUIRE(p.descendant_feerate() > mp.entry_map.at(middle->hash)->feerate());
+    REQUIRE(mp.entry_queue.front()->x->hash == middle->hash);
+    REQUIRE(mp.entry_map.at(funding->hash)->descendant_count == 4);
+
+    SECTION("removal updates the ancestors") {
+        mp.remove_entry(mp.entry_map.at(child->hash), tiny::MemPoolRemovalReason::EXPIRY);
+        check_packages(mp);
+        REQUIRE(p.descendant_count == 1);
+        REQUIRE(mp.entry_queue.front()->x->hash == parent->hash);
+    }
+
+    SECTION("mining the parent leaves the child with fewer ancestors") {
+        mp.process_block(1, uint256S("02"), std::vector<tiny::tx>{*funding, *parent});
+        check_packages(mp);
+        REQUIRE(mp.entry_map.at(child->hash)->ancestor_count == 1);
+    }
+
+    SECTION("a parent seen after its children, in a diamond") {
+        // late spends both of its outputs to a and b, which are both spent by c
+        auto late = make_tx({tiny::outpoint(funding->hash, 2)}, 2, 45000);
+        auto a = make_tx({tiny::outpoint(late->hash, 0)}, 1, 40000);
+        auto b = make_tx({tiny::outpoint(late->hash, 1)}, 1, 40000);
+        auto c = make_tx({tiny::outpoint(a->hash, 0), tiny::outpoint(b->hash, 0)}, 1, 70000);
+        auto d = make_tx({tiny::outpoint(c->hash, 0), tiny::outpoint(funding->hash, 3)}, 1, 150000);
+        // the funding tx pays for late's inputs, and late for a and b's; as late is not
+        // known when they enter, their fees are unknown, but their place in the graph is not
+        mp.insert_tx(a);
+        mp.insert_tx(b);
+        mp.insert_tx(c);
+        mp.insert_tx(d);
+        check_packages(mp);
+        mp.insert_tx(late);
+        check_packages(mp);
+        REQUIRE(mp.entry_map.at(late->hash)->descendant_count == 5);
+        REQUIRE(mp.entry_map.at(d->hash)->ancestor_count == 6);
+        mp.remove_entry(mp.entry_map.at(b->hash), tiny::MemPoolRemovalReason::EXPIRY);
+        check_packages(mp);
+        REQUIRE(!mp.entry_map.count(c->hash));
+        mp.process_block(1, uint256S("03"), std::vector<tiny::tx>{*funding, *late});
+        check_packages(mp);
+    }
+
+    SECTION("a long chain, with a shortcut, seen out of order") {
+        // more ancestors than fit in one word of the bitsets in descent_from()
+        std::vector<std::shared_ptr<tiny::tx>> chain{make_tx({tiny::outpoint(funding->hash, 4)}, 2, 99000)};
+        for (size_t i = 1; i < 150; ++i) chain.push_back(make_tx({tiny::outpoint(chain.back()->hash, 0)}, 2, 99000 - 100 * i));
+        // the end of the chain also spends the second output of the first tx
+        auto shortcut = make_tx({tiny::outpoint(chain.back()->hash, 0), tiny::outpoint(chain[0]->hash, 1)}, 1, 90000);
+        mp.insert_tx(shortcut);
+        for (size_t i = 0; i < chain.size(); i += 2) mp.insert_tx(chain[i]);
+        check_packages(mp);
+        for (size_t i = 1; i < chain.size(); i += 2) mp.insert_tx(chain[i]);
+        check_packages(mp);
+        REQUIRE(mp.entry_map.at(shortcut->hash)->ancestor_count == 152);
+        mp.process_block(1, uint256S("04"), std::vector<tiny::tx>{*funding, *chain[0], *chain[1]});
+        check_packages(mp);
+        mp.remove_entry(mp.entry_map.at(chain[70]->hash), tiny::MemPoolRemovalReason::EXPIRY);
+        check_packages(mp);
+        REQUIRE(!mp.entry_map.count(shortcut->hash));
+    }
+
+    SECTION("the totals are rebuilt on load") {
+        CDataStream ds(SER_DISK, 0);
+        ds << mp;
+        tiny::mempool mp2;
+        mp2.package_eviction = true;
+        ds >> mp2;
+        check_packages(mp2);
+        REQUIRE(mp2.entry_queue.front()->x->hash == middle->hash);
+    }
+}
@@ -0,0 +1,248 @@
+#include "catch.hpp"
+
+#include <random>
+#include <sys/stat.h>
+#include <unistd.h>
+
+#include <tinyrpc.h>
+#include <tinystore.h>
+
+static const std::string store_test_path = "/tmp/mff-test-store";
+
+static uint256 random_key(std::mt19937_64& rng) {
+    uint256 key;
+    for (int j = 0; j < 4; ++j) {
+        uint64_t v = rng();
+        memcpy(key.begin() + j * 8, &v, 8);
+    }
+    return key;
+}
+
+static std::vector<uint8_t> value_for(const uint256& key, size_t len) {
+    std::vector<uint8_t> value(len);
+    for (size_t i = 0; i < len; ++i) value[i] = key.begin()[i % 32] ^ i;
+    return value;
+}
+
+static bool has_value(tiny::store& s, tiny::store::kind k, const uint256& key, const std::vector<uint8_t>& expected) {
+    const uint8_t* data;
+    size_t len;
+    return s.get(k, key, data, len) && std::vector<uint8_t>(data, data + len) == expected;
+}
+
+TEST_CASE("store", "[tinystore]") {
+    system(("rm -rf " + store_test_path).c_str());
+    std::mt19937_64 rng(9);
+    // enough records to make the index grow (twice)
+    std::vector<uint256> keys;
+    for (int i = 0; i < 100000; ++i) keys.push_back(random_key(rng));
+
+    {
+        tiny::store s;
+        REQUIRE(s.open(store_test_path));
+        size_t failed = 0;
+        for (size_t i = 0; i < keys.size(); ++i) failed += !s.put(tiny::store::tx, keys[i], value_for(keys[i], i % 97));
+        REQUIRE(failed == 0);
+        // the same key under another kind is a different record
+        REQUIRE(s.put(tiny::store::tx_block, keys[0], value_for(keys[1], 32)));
+        REQUIRE(s.put(tiny::store::block_hash, tiny::store::height_key(7), value_for(keys[2], 32)));
+        // records are never replaced
+        REQUIRE(s.put(tiny::store::tx, keys[0], value_for(keys[3], 10)));
+        REQUIRE(s.size() == keys.size() + 2);
+        REQUIRE(s.flush());
+
+        // a value handed out stays valid while the store grows
+        const uint8_t* early;
+        size_t early_len;
+        REQUIRE(s.get(tiny::store::tx, keys[50], early, early_len));
+        for (int i = 0; i < 1000; ++i) {
+            uint256 key = random_key(rng);
+            REQUIRE(s.put(tiny::store::block, key, value_for(key, 10000)));
+        }
+        REQUIRE(std::vector<uint8_t>(early, early + early_len) == value_for(keys[50], 50 % 97));
+
+        // only one process may have the store open
+        tiny::store other;
+        REQUIRE(!other.open(store_test_path));
+    }
+
+    auto check = [&](tiny::store& s) {
+        REQUIRE(s.size() == keys.size() + 1002);
+        size_t missing = 0;
+        for (size_t i = 0; i < keys.size(); ++i) missing += !has_value(s, tiny::store::tx, keys[i], value_for(keys[i], i % 97));
+        REQUIRE(missing == 0);
+        REQUIRE(has_value(s, tiny::store::tx_block, keys[0], value_for(keys[1], 32)));
+        REQUIRE(has_value(s, tiny::store::block_hash, tiny::store::height_key(7), value_for(keys[2], 32)));
+        REQUIRE(!s.has(tiny::store::block_hash, tiny::store::height_key(8)));
+        REQUIRE(!s.has(tiny::store::tx_block, keys[1]));
+        REQUIRE(!s.has(tiny::store::tx, random_key(rng)));
+    };
+
+    SECTION("everything is there when reopened") {
+        tiny::store s;
+        REQUIRE(s.open(store_test_path));
+        check(s);
+        std::vector<uint256> tx_keys;
+        s.keys(tiny::store::tx, tx_keys);
+        REQUIRE(tx_keys == keys);
+    }
+
+    SECTION("a missing index is rebuilt") {
+        unlink((store_test_path + "/store.idx").c_str());
+        tiny::store s;
+        REQUIRE(s.open(store_test_path));
+        check(s);
+    }
+
+    SECTION("replaced values supersede the old ones, also when the index is rebuilt") {
+        std::vector<uint8_t> value = value_for(keys[1], 500);
+        {
+            tiny::store s;
+            REQUIRE(s.open(store_test_path));
+            const uint8_t* old;
+            size_t old_len;
+            REQUIRE(s.get(tiny::store::tx, keys[5], old, old_len));
+            REQUIRE(s.replace(tiny::store::tx, keys[5], value.data(), value.size()));
+            REQUIRE(has_value(s, tiny::store::tx, keys[5], value));
+            REQUIRE(s.size() == keys.size() + 1002);
+            // the old value stays readable
+            REQUIRE(std::vector<uint8_t>(old, old + old_len) == value_for(keys[5], 5));
+        }
+        for (int rebuild = 0; rebuild < 2; ++rebuild) {
+            if (rebuild) unlink((store_test_path + "/store.idx").c_str());
+            tiny::store s;
+            REQUIRE(s.open(store_test_path));
+            REQUIRE(has_value(s, tiny::store::tx, keys[5], value));
+            REQUIRE(s.size() == keys.size() + 1002);
+            std::vector<uint256> tx_keys;
+            s.keys(tiny::store::tx, tx_keys);
+            REQUIRE(tx_keys.size() == keys.size());
+            REQUIRE(std::count(tx_keys.begin(), tx_keys.end(), keys[5]) == 1);
+        }
+    }
+
+    SECTION("records that were not indexed are picked up, and a partial record is dropped") {
+        uint256 key = random_key(rng);
+        std::vector<uint8_t> value = value_for(key, 100);
+        {
+            // write a record followed by the first half of another behind the store's back
+            FILE* fp = fopen((store_test_path + "/store.dat").c_str(), "ab");
+            REQUIRE(fp);
+            uint8_t header[37] = {tiny::store::tx};
+            memcpy(&header[1], key.begin(), 32);
+            header[33] = value.size();
+            fwrite(header, 1, sizeof(header), fp);
+            fwrite(value.data(), 1, value.size(), fp);
+            fwrite(header, 1, sizeof(header), fp);
+            fwrite(value.data(), 1, value.size() / 2, fp);
+            fclose(fp);
+        }
+        {
+            tiny::store s;
+            REQUIRE(s.open(store_test_path));
+            REQUIRE(has_value(s, tiny::store::tx, key, value));
+            REQUIRE(s.size() == keys.size() + 1003);
+            uint256 key2 = random_key(rng);
+            REQUIRE(s.put(tiny::store::tx, key2, value));
+        }
+        tiny::store s;
+        REQUIRE(s.open(store_test_path));
+        REQUIRE(s.size() == keys.size() + 1004);
+        REQUIRE(has_value(s, tiny::store::tx, key, value));
+    }
+
+    SECTION("a zero filled tail is dropped, but a corrupt record elsewhere is left alone") {
+        const std::string data_path = store_test_path + "/store.dat";
+        struct stat st;
+        REQUIRE(!stat(data_path.c_str(), &st));
+        const off_t size = st.st_size;
+        REQUIRE(!truncate(data_path.c_str(), size + 4096));
+        {
+            tiny::store s;
+            REQUIRE(s.open(store_test_path));
+            check(s);
+        }
+        REQUIRE(!stat(data_path.c_str(), &st));
+        REQUIRE(st.st_size == size);
+
+        // clobber the kind of the first record, and make the index rebuild run into it
+        FILE* fp = fopen(data_path.c_str(), "r+b");
+        REQUIRE(fp);
+        fseek(fp, 8, SEEK_SET);
+        fputc(0xee, fp);
+        fclose(fp);
+        unlink((store_test_path + "/store.idx").c_str());
+        tiny::store s;
+        REQUIRE(!s.open(store_test_path));
+        REQUIRE(!stat(data_path.c_str(), &st));
+        REQUIRE(st.st_size == size);
+    }
+
+    system(("rm -rf " + store_test_path).c_str());
+}
+
+TEST_CASE("block cache verification", "[tinystore]") {
+    system(("rm -rf " + store_test_path).c_str());
+    std::mt19937_64 rng(3);
+    tiny::rpc rpc("false");
+    rpc.m_store = std::make_shared<tiny::store>();
+    REQUIRE(rpc.m_store->open(store_test_path));
+
+    // a handful of blocks, stored as their height followed by the block
+    std::vector<uint256> hashes;
+    std::vector<std::vector<uint8_t>> entries;
+    for (uint32_t height = 0; height < 20; ++height) {
+        tiny::block b;
+        b.time = height;
+        for (size_t i = 1 + rng() % 30; i > 0; --i) {
+            tiny::tx t;
+            t.locktime = rng();
+            t.vin.emplace_back(tiny::outpoint(random_key(rng), 0), tiny::script_data_t(1 + rng() % 100, 0x51));
+            t.vout.emplace_back(i, tiny::script_data_t(22, 0x51));
+            t.UpdateHash();
+            b.vtx.push_back(t);
+        }
+        std::vector<uint256> txids;
+        for (const auto& t : b.vtx) txids.push_back(t.hash);
+        b.merkle_root = tiny::compute_merkle_root(txids);
+        REQUIRE(b.check_merkle_root());
+        CDataStream ds(SER_DISK, 0);
+        ds.write((const char*)&height, sizeof(height));
+        ds << b;
+        hashes.push_back(b.GetHash());
+        entries.emplace_back(ds.begin(), ds.end());
+        REQUIRE(rpc.m_store->put(tiny::store::block, hashes.back(), entries.back()));
+    }
+    REQUIRE(rpc.check_cached_blocks(3).empty());
+
+    // a truncated entry, one with a flipped bit in a tx, and one filed under the wrong hash
+    std::vector<uint256> corrupt{hashes[2], hashes[7], hashes[11]};
+    std::sort(corrupt.begin(), corrupt.end());
+    std::vector<uint8_t> truncated(entries[2].begin(), entries[2].end() - 10);
+    REQUIRE(rpc.m_store->replace(tiny::store::block, hashes[2], truncated.data(), truncated.size()));
+    std::vector<uint8_t> flipped = entries[7];
+    flipped.back() ^= 1;
+    REQUIRE(rpc.m_store->replace(tiny::store::block, hashes[7], flipped.data(), flipped.size()));
+    REQUIRE(rpc.m_store->replace(tiny::store::block, hashes[11], entries[12].data(), entries[12].size()));
+    size_t last_checked = 0;
+    REQUIRE(rpc.check_cached_blocks(2, [&](size_t checked, size_t total) {
+        REQUIRE(total == hashes.size());
+        last_checked = checked;
+    }) == corrupt);
+    REQUIRE(last_checked == hashes.size());
+
+    tiny::block b;
+    uint32_t height;
+    for (size_t i = 0; i < hashes.size(); ++i) {
+        const uint8_t* data;
+        size_t len;
+        REQUIRE(rpc.m_store->get(tiny::store::block, hashes[i], data, len));
+        CSpanReader r(SER_DISK, 0, data, data + len);
+        bool valid = tiny::rpc::decode_block(hashes[i], r, b, height);
+        REQUIRE(valid == !std::binary_search(corrupt.begin(), corrupt.end(), hashes[i]));
+        if (valid) REQUIRE(height == i);
+    }
+
+    rpc.m_store.reset();
+    system(("rm -rf " + store_test_path).c_str());
+}
@@ -0,0 +1,102 @@
+#include "catch.hpp"
+
+#include <unistd.h>
+
+#include <bcq/txindex.h>
+
+static const std::string txi_test_path = "/tmp/mff-test.txi";
+
+static uint256 key_for(int i) {
+    uint256 key;
+    // spread the keys over the key space, so that they are not added in order
+    key.begin()[0] = (uint8_t)(i * 37);
+    key.begin()[1] = (uint8_t)i;
+    return key;
+}
+
+static bitcoin::tx_hit hit_for(int event) {
+    bitcoin::tx_hit hit;
+    hit.cluster = 277 + event / 1000;
+    hit.segment = hit.cluster * 2016;
+    hit.offset = event % 1000 ? 100 + event % 1000 * 50 : 0;
+    hit.height = 560000 + event / 100;
+    hit.time = 1550000000 + event;
+    return hit;
+}
+
+/** Event i touches keys i % 50 and i % 7 (which are the same key, for some events). */
+static void build(size_t run_limit, int events) {
+    bitcoin::tx_index::builder builder(txi_test_path, run_limit);
+    for (int i = 0; i < events; ++i) {
+        builder.add(key_for(i % 50), hit_for(i));
+        if (i % 50 != i % 7) builder.add(key_for(i % 7), hit_for(i));
+    }
+    REQUIRE(builder.finish());
+}
+
+static void check(int events) {
+    bitcoin::tx_index idx(txi_test_path);
+    REQUIRE(idx.open());
+    size_t total = 0;
+    size_t mismatches = 0;
+    for (int k = 0; k < 50; ++k) {
+        std::vector<bitcoin::tx_hit> hits;
+        size_t found = idx.find(key_for(k), hits);
+        REQUIRE(found == hits.size());
+        total += found;
+        // expected: every event touching k, in order
+        size_t pos = 0;
+        for (int i = 0; i < events; ++i) {
+            if (i % 50 != k && i % 7 != k) continue;
+            bitcoin::tx_hit expected = hit_for(i);
+            if (pos >= hits.size() || hits[pos].offset != expected.offset || hits[pos].cluster != expected.cluster || hits[pos].time != expected.time || hits[pos].height != expected.height || hits[pos].segment != expected.segment) ++mismatches;
+            ++pos;
+        }
+        if (pos != hits.size()) ++mismatches;
+    }
+    REQUIRE(mismatches == 0);
+    REQUIRE(total == idx.size());
+    std::vector<bitcoin::tx_hit> hits;
+    REQUIRE(idx.find(key_for(50), hits) == 0);
+    REQUIRE(hits.empty());
+}
+
+TEST_CASE("txid index", "[txindex]") {
+    unlink(txi_test_path.c_str());
+
+    SECTION("no index") {
+        bitcoin::tx_index idx(txi_test_path);
+        REQUIRE(!idx.open());
+        REQUIRE(!idx.is_open());
+    }
+
+    SECTION("empty index") {
+        build(100, 0);
+        bitcoin::tx_index idx(txi_test_path);
+        REQUIRE(idx.open());
+        REQUIRE(idx.size() == 0);
+        std::vector<bitcoin::tx_hit> hits;
+        REQUIRE(idx.find(key_for(1), hits) == 0);
+    }
+
+    SECTION("built in memory") {
+        build(1 << 20, 5000);
+        check(5000);
+    }
+
+    SECTION("built from merged runs") {
+        build(777, 5000);
+        check(5000);
+        // the runs are removed once merged
+        REQUIRE(access((txi_test_path + ".run0").c_str(), F_OK) == -1);
+    }
+
+    SECTION("hits convert to checkpoints") {
+        bitcoin::checkpoint cp = hit_for(1234).position();
+        REQUIRE(cp.cluster == 278);
+        REQUIRE(cp.segment == 278 * 2016);
+        REQUIRE(cp.offset == 100 + 234 * 50);
+    }
+
+    unlink(txi_test_path.c_str());
+}
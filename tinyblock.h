@@ -8,6 +8,10 @@
 #include <uint256.h>
 #include <tinytx.h>
 
+#ifndef TINY_NOHASH
+#   include <tinyhashpool.h>
+#endif
+
 namespace tiny {
 
 struct block_header {
@@ -40,17 +44,61 @@ struct block_header {
 #endif
 };
 
+#ifndef TINY_NOHASH
+/**
+ * The merkle root of the given txids, hashing each level of the tree in one
+ * batch (see SHA256D64). If mutated is given, it is set to whether the tree
+ * has two identical siblings anywhere, which happens if a block's txs are
+ * duplicated (CVE-2012-2459).
+ */
+inline uint256 compute_merkle_root(std::vector<uint256> hashes, bool* mutated = nullptr) {
+    bool mutation = false;
+    while (hashes.size() > 1) {
+        for (size_t pos = 0; pos + 1 < hashes.size(); pos += 2) {
+            if (hashes[pos] == hashes[pos + 1]) mutation = true;
+        }
+        if (hashes.size() & 1) hashes.push_back(hashes.back());
+        SHA256D64(hashes[0].begin(), hashes[0].begin(), hashes.size() / 2);
+        hashes.resize(hashes.size() / 2);
+    }
+    if (mutated) *mutated = mutation;
+    return hashes.empty() ? uint256() : hashes[0];
+}
+#endif
+
 struct block: public block_header {
     std::vector<tx> vtx;
     block() {}
     block(const block_header& header) : block_header(header) {}
 
+#ifndef TINY_NOHASH
+    /** Whether merkle_root matches vtx, e.g. to catch corrupt cached blocks. */
+    bool check_merkle_root() const {
+        std::vector<uint256> txids;
+        txids.reserve(vtx.size());
+        for (const auto& x : vtx) txids.push_back(x.hash);
+        bool mutated;
+        return !vtx.empty() && compute_merkle_root(std::move(txids), &mutated) == merkle_root && !mutated;
+    }
+#endif
+
 #ifndef TINY_NOSERIALIZE
     ADD_SERIALIZE_METHODS;
 
     template <typename Stream, typename Operation>
     inline void SerializationOp(Stream& s, Operation ser_action) {
         READWRITEAS(block_header, *this);
+#ifndef TINY_NOHASH
+        if (ser_action.ForRead()) {
+            // hash the txs together, once they have all been read
+            {
+                deferred_hashing defer;
+                READWRITE(vtx);
+            }
+            hash_pool::shared().hash(vtx);
+            return;
+        }
+#endif
         READWRITE(vtx);
     }
 #endif
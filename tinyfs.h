@@ -4,6 +4,11 @@
 #include <string>
 #include <streams.h>
 
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
 namespace tiny {
 
 struct file {
@@ -64,6 +69,89 @@ struct file {
     }
 };
 
+/**
+ * Read-only view of an entire file, memory mapped if possible. If the mapping
+ * fails (e.g. because the process ran out of map slots), the file is read into
+ * memory instead, so callers never need to care which one they got.
+ */
+struct mapped_file {
+    const uint8_t* m_data{nullptr};
+    size_t m_size{0};
+    bool m_mapped{false};
+    std::vector<uint8_t> m_buffer;
+
+    mapped_file() {}
+    mapped_file(const mapped_file&) = delete;
+    mapped_file& operator=(const mapped_file&) = delete;
+
+    ~mapped_file() { close(); }
+
+    /** Map the file at the given path. Returns false if it could not be opened. */
+    bool open(const std::string& path) {
+        close();
+        int fd = ::open(path.c_str(), O_RDONLY);
+        if (fd == -1) return false;
+        struct stat st;
+        if (fstat(fd, &st) == -1) {
+            ::close(fd);
+            return false;
+        }
+        m_size = st.st_size;
+        if (m_size == 0) {
+            ::close(fd);
+            return true;
+        }
+        void* p = mmap(nullptr, m_size, PROT_READ, MAP_SHARED, fd, 0);
+        if (p != MAP_FAILED) {
+            m_data = (const uint8_t*)p;
+            m_mapped = true;
+        } else {
+            m_buffer.resize(m_size);
+            size_t got = 0;
+            while (got < m_size) {
+                ssize_t r = pread(fd, m_buffer.data() + got, m_size - got, got);
+                if (r <= 0) break;
+                got += r;
+            }
+            m_buffer.resize(got);
+            m_size = got;
+            m_data = m_buffer.data();
+        }
+        ::close(fd);
+        return true;
+    }
+
+    void close() {
+        if (m_mapped) munmap((void*)m_data, m_size);
+        m_data = nullptr;
+        m_size = 0;
+        m_mapped = false;
+        m_buffer.clear();
+        m_buffer.shrink_to_fit();
+    }
+
+    /** Hint that the contents will be accessed at random, so read-ahead is wasted. */
+    void advise_random() const {
+        if (m_mapped) madvise((void*)m_data, m_size, MADV_RANDOM);
+    }
+
+    /** Hint that the contents will be read front to back, so read-ahead pays off. */
+    void advise_sequential() const {
+        if (m_mapped) madvise((void*)m_data, m_size, MADV_SEQUENTIAL);
+    }
+
+    const uint8_t* begin() const { return m_data; }
+    const uint8_t* end() const { return m_data + m_size; }
+    size_t size() const { return m_size; }
+    bool empty() const { return m_size == 0; }
+
+    CSpanReader reader(size_t pos = 0) const {
+        CSpanReader r(SER_DISK, 0, m_data, m_data + m_size);
+        r.seek(pos);
+        return r;
+    }
+};
+
 typedef std::shared_ptr<file> File;
 static inline File OpenFile(const std::string& path, const std::string& mode) {
     return std::make_shared<file>(path, mode);
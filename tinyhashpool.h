@@ -0,0 +1,135 @@
+// Copyright (c) 2018 The Bitcoin Core developers
+// Distributed under the MIT software license, see the accompanying
+// file COPYING or http://www.opensource.org/licenses/mit-license.php.
+
+#ifndef BITCOIN_TINYHASHPOOL_H
+#define BITCOIN_TINYHASHPOOL_H
+
+#include <algorithm>
+#include <condition_variable>
+#include <deque>
+#include <mutex>
+#include <thread>
+#include <vector>
+
+#include <tinytx.h>
+
+namespace tiny {
+
+/**
+ * Hashes the txs decoded with deferred_hashing, in batches (see
+ * UpdateHashes()), optionally spread out over a pool of worker threads.
+ *
+ * Without workers, everything is hashed on the calling thread. With them,
+ * the txs are split into chunks which the workers and the calling thread
+ * take on together; hash() returns once every chunk is done. Several threads
+ * may call hash() at the same time (e.g. the replay and a block_prefetcher),
+ * in which case the workers go through their requests in order.
+ */
+class hash_pool {
+private:
+    struct job {
+        tx* const* txs;
+        size_t count;
+        size_t next;     //!< start of the next unclaimed chunk
+        size_t pending;  //!< number of chunks not yet done
+    };
+
+    std::vector<std::thread> m_workers;
+    std::deque<job*> m_jobs;  //!< jobs with unclaimed chunks
+    bool m_stop{false};
+    std::mutex m_mutex;
+    std::condition_variable m_cv;
+    std::condition_variable m_done_cv;
+
+    /** Claim the next chunk of j, if any, dropping j from the queue once all are claimed. Requires m_mutex. */
+    bool claim(job& j, size_t& begin, size_t& count) {
+        if (j.next >= j.count) return false;
+        begin = j.next;
+        count = j.count - begin < chunk_size ? j.count - begin : chunk_size;
+        j.next += count;
+        if (j.next >= j.count) m_jobs.erase(std::find(m_jobs.begin(), m_jobs.end(), &j));
+        return true;
+    }
+
+    /** Hash a claimed chunk; lock is held on entry and exit, but not while hashing. */
+    void run_chunk(std::unique_lock<std::mutex>& lock, job& j, size_t begin, size_t count) {
+        lock.unlock();
+        UpdateHashes(j.txs + begin, count);
+        lock.lock();
+        if (--j.pending == 0) m_done_cv.notify_all();
+    }
+
+    void run() {
+        std::unique_lock<std::mutex> lock(m_mutex);
+        for (;;) {
+            m_cv.wait(lock, [this]() { return m_stop || !m_jobs.empty(); });
+            if (m_stop) return;
+            job& j = *m_jobs.front();
+            size_t begin, count;
+            if (claim(j, begin, count)) run_chunk(lock, j, begin, count);
+        }
+    }
+
+public:
+    //! Number of txs hashed in one go; small enough to spread a block over several threads
+    static constexpr size_t chunk_size = 64;
+
+    /** The pool used when decoding blocks, AJB entries and the mempool; has no workers until start()ed. */
+    static hash_pool& shared() {
+        static hash_pool pool;
+        return pool;
+    }
+
+    hash_pool() {}
+    hash_pool(const hash_pool&) = delete;
+    hash_pool& operator=(const hash_pool&) = delete;
+    ~hash_pool() { stop(); }
+
+    /** Start the given number of worker threads, on top of the calling thread. */
+    void start(size_t threads) {
+        stop();
+        std::lock_guard<std::mutex> lock(m_mutex);
+        m_stop = false;
+        for (size_t i = 0; i < threads; ++i) m_workers.emplace_back([this]() { run(); });
+    }
+
+    /** Stop the worker threads; must not be called while hash() is running. */
+    void stop() {
+        {
+            std::lock_guard<std::mutex> lock(m_mutex);
+            m_stop = true;
+            m_cv.notify_all();
+        }
+        for (auto& t : m_workers) t.join();
+        m_workers.clear();
+    }
+
+    size_t workers() const { return m_workers.size(); }
+
+    /** Hash txs[0..count), returning once all of them have been hashed. */
+    void hash(tx* const* txs, size_t count) {
+        if (m_workers.empty() || count <= chunk_size) {
+            UpdateHashes(txs, count);
+            return;
+        }
+        job j{txs, count, 0, (count + chunk_size - 1) / chunk_size};
+        std::unique_lock<std::mutex> lock(m_mutex);
+        m_jobs.push_back(&j);
+        m_cv.notify_all();
+        size_t begin, n;
+        while (claim(j, begin, n)) run_chunk(lock, j, begin, n);
+        m_done_cv.wait(lock, [&j]() { return j.pending == 0; });
+    }
+
+    void hash(std::vector<tx>& txs) {
+        std::vector<tx*> ptrs;
+        ptrs.reserve(txs.size());
+        for (auto& t : txs) ptrs.push_back(&t);
+        hash(ptrs.data(), ptrs.size());
+    }
+};
+
+} // namespace tiny
+
+#endif // BITCOIN_TINYHASHPOOL_H
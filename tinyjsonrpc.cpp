@@ -0,0 +1,447 @@
+// Copyright (c) 2018 The Bitcoin Core developers
+// Distributed under the MIT software license, see the accompanying
+// file COPYING or http://www.opensource.org/licenses/mit-license.php.
+
+#include <tinyjsonrpc.h>
+
+#include <errno.h>
+#include <inttypes.h>
+#include <string.h>
+
+#include <netdb.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+#include <sys/socket.h>
+#include <unistd.h>
+
+#include <tinyformat.h>
+#include <utilstrencodings.h>
+
+namespace tiny {
+
+///////// JSON
+
+static const json null_json;
+
+const json& json::operator[](const std::string& key) const {
+    if (type != object_t) return null_json;
+    for (const auto& kv : obj) if (kv.first == key) return kv.second;
+    return null_json;
+}
+
+const json& json::operator[](size_t index) const {
+    if (type != array_t || index >= arr.size()) return null_json;
+    return arr[index];
+}
+
+int64_t json::get_int() const {
+    if (type != number_t) throw rpc_error("JSON value is not a number");
+    return strtoll(str.c_str(), nullptr, 10);
+}
+
+const std::string& json::get_str() const {
+    if (type != string_t) throw rpc_error("JSON value is not a string");
+    return str;
+}
+
+static inline void append_utf8(std::string& s, uint32_t cp) {
+    if (cp < 0x80) {
+        s += char(cp);
+    } else if (cp < 0x800) {
+        s += char(0xc0 | (cp >> 6));
+        s += char(0x80 | (cp & 0x3f));
+    } else if (cp < 0x10000) {
+        s += char(0xe0 | (cp >> 12));
+        s += char(0x80 | ((cp >> 6) & 0x3f));
+        s += char(0x80 | (cp & 0x3f));
+    } else {
+        s += char(0xf0 | (cp >> 18));
+        s += char(0x80 | ((cp >> 12) & 0x3f));
+        s += char(0x80 | ((cp >> 6) & 0x3f));
+        s += char(0x80 | (cp & 0x3f));
+    }
+}
+
+struct json_parser {
+    const char* p;
+    const char* end;
+    int depth{0};
+
+    json_parser(const char* begin, const char* end_in) : p(begin), end(end_in) {}
+
+    void skip_ws() {
+        while (p < end && (*p == ' ' || *p == '\t' || *p == '\n' || *p == '\r')) ++p;
+    }
+
+    bool literal(const char* lit) {
+        size_t len = strlen(lit);
+        if (size_t(end - p) < len || memcmp(p, lit, len)) return false;
+        p += len;
+        return true;
+    }
+
+    bool hex4(uint32_t& v) {
+        if (end - p < 4) return false;
+        v = 0;
+        for (int i = 0; i < 4; ++i) {
+            signed char d = HexDigit(*p++);
+            if (d < 0) return false;
+            v = (v << 4) | d;
+        }
+        return true;
+    }
+
+    bool string(std::string& s) {
+        ++p; // opening quote
+        for (;;) {
+            // copy runs without escapes in one go; block hex strings are megabytes long
+            const char* run = p;
+            while (p < end && *p != '"' && *p != '\\') ++p;
+            s.append(run, p);
+            if (p == end) return false;
+            if (*p++ == '"') return true;
+            if (p == end) return false;
+            switch (*p++) {
+            case '"':  s += '"'; break;
+            case '\\': s += '\\'; break;
+            case '/':  s += '/'; break;
+            case 'b':  s += '\b'; break;
+            case 'f':  s += '\f'; break;
+            case 'n':  s += '\n'; break;
+            case 'r':  s += '\r'; break;
+            case 't':  s += '\t'; break;
+            case 'u': {
+                uint32_t cp;
+                if (!hex4(cp)) return false;
+                if (cp >= 0xd800 && cp < 0xdc00) {
+                    // surrogate pair
+                    uint32_t lo;
+                    if (!literal("\\u") || !hex4(lo) || lo < 0xdc00 || lo >= 0xe000) return false;
+                    cp = 0x10000 + ((cp - 0xd800) << 10) + (lo - 0xdc00);
+                }
+                append_utf8(s, cp);
+                break;
+            }
+            default:
+                return false;
+            }
+        }
+    }
+
+    bool number(std::string& s) {
+        const char* start = p;
+        if (p < end && *p == '-') ++p;
+        while (p < end && ((*p >= '0' && *p <= '9') || *p == '.' || *p == 'e' || *p == 'E' || *p == '+' || *p == '-')) ++p;
+        if (p == start) return false;
+        s.assign(start, p);
+        return true;
+    }
+
+    bool value(json& v) {
+        skip_ws();
+        if (p == end) return false;
+        switch (*p) {
+        case '{': {
+            if (++depth > 64) return false;
+            v.type = json::object_t;
+            ++p;
+            skip_ws();
+            if (p < end && *p == '}') { ++p; --depth; return true; }
+            for (;;) {
+                skip_ws();
+                if (p == end || *p != '"') return false;
+                v.obj.emplace_back();
+                if (!string(v.obj.back().first)) return false;
+                skip_ws();
+                if (p == end || *p++ != ':') return false;
+                if (!value(v.obj.back().second)) return false;
+                skip_ws();
+                if (p == end) return false;
+                if (*p == '}') { ++p; --depth; return true; }
+                if (*p++ != ',') return false;
+            }
+        }
+        case '[': {
+            if (++depth > 64) return false;
+            v.type = json::array_t;
+            ++p;
+            skip_ws();
+            if (p < end && *p == ']') { ++p; --depth; return true; }
+            for (;;) {
+                v.arr.emplace_back();
+                if (!value(v.arr.back())) return false;
+                skip_ws();
+                if (p == end) return false;
+                if (*p == ']') { ++p; --depth; return true; }
+                if (*p++ != ',') return false;
+            }
+        }
+        case '"':
+            v.type = json::string_t;
+            return string(v.str);
+        case 't':
+            v.type = json::bool_t;
+            v.b = true;
+            return literal("true");
+        case 'f':
+            v.type = json::bool_t;
+            return literal("false");
+        case 'n':
+            v.type = json::null_t;
+            return literal("null");
+        default:
+            v.type = json::number_t;
+            return number(v.str);
+        }
+    }
+};
+
+bool json::parse(const char* begin, const char* end, json& out) {
+    out = json();
+    json_parser parser(begin, end);
+    if (!parser.value(out)) return false;
+    parser.skip_ws();
+    return parser.p == end;
+}
+
+std::string json::quote(const std::string& s) {
+    std::string rv = "\"";
+    for (char c : s) {
+        switch (c) {
+        case '"':  rv += "\\\""; break;
+        case '\\': rv += "\\\\"; break;
+        case '\n': rv += "\\n"; break;
+        case '\r': rv += "\\r"; break;
+        case '\t': rv += "\\t"; break;
+        default:
+            if ((unsigned char)c < 0x20) rv += strprintf("\\u%04x", c); else rv += c;
+        }
+    }
+    return rv + "\"";
+}
+
+std::string jsonrpc_response::error_message() const {
+    if (error.is_null()) return "";
+    const json& message = error["message"];
+    const json& code = error["code"];
+    return strprintf("%s (code %s)", message.is_string() ? message.str : "unknown error", code.is_null() ? "?" : code.str);
+}
+
+///////// HTTP
+
+jsonrpc_client::jsonrpc_client(const std::string& host, uint16_t port, const std::string& auth)
+: m_host(host), m_port(port), m_auth(auth), m_auth_header("Authorization: Basic " + EncodeBase64(auth) + "\r\n") {}
+
+jsonrpc_client::~jsonrpc_client() {
+    disconnect();
+}
+
+std::shared_ptr<jsonrpc_client> jsonrpc_client::from_url(const std::string& url, const std::string& cookie_path) {
+    std::string rest = url;
+    if (rest.compare(0, 7, "http://") == 0) rest = rest.substr(7);
+    size_t slash = rest.find('/');
+    if (slash != std::string::npos) rest = rest.substr(0, slash);
+    std::string auth;
+    size_t at = rest.rfind('@');
+    if (at != std::string::npos) {
+        auth = rest.substr(0, at);
+        rest = rest.substr(at + 1);
+    } else {
+        FILE* fp = fopen(cookie_path.c_str(), "r");
+        if (!fp) return nullptr;
+        char buf[256];
+        if (!fgets(buf, sizeof(buf), fp)) buf[0] = 0;
+        fclose(fp);
+        auth = buf;
+        while (!auth.empty() && (auth.back() == '\n' || auth.back() == '\r')) auth.pop_back();
+        if (auth.empty()) return nullptr;
+    }
+    uint16_t port = 8332;
+    size_t colon = rest.rfind(':');
+    if (colon != std::string::npos) {
+        port = atoi(rest.substr(colon + 1).c_str());
+        rest = rest.substr(0, colon);
+    }
+    if (rest.empty() || port == 0) return nullptr;
+    return std::make_shared<jsonrpc_client>(rest, port, auth);
+}
+
+void jsonrpc_client::connect() {
+    struct addrinfo hints;
+    memset(&hints, 0, sizeof(hints));
+    hints.ai_family = AF_UNSPEC;
+    hints.ai_socktype = SOCK_STREAM;
+    struct addrinfo* res;
+    if (getaddrinfo(m_host.c_str(), std::to_string(m_port).c_str(), &hints, &res)) {
+        throw rpc_error("unable to resolve RPC host " + m_host);
+    }
+    for (struct addrinfo* ai = res; ai; ai = ai->ai_next) {
+        m_fd = socket(ai->ai_family, ai->ai_socktype, ai->ai_protocol);
+        if (m_fd == -1) continue;
+        if (::connect(m_fd, ai->ai_addr, ai->ai_addrlen) == 0) break;
+        ::close(m_fd);
+        m_fd = -1;
+    }
+    freeaddrinfo(res);
+    if (m_fd == -1) throw rpc_error(strprintf("unable to connect to RPC server at %s:%u", m_host, m_port));
+    int one = 1;
+    setsockopt(m_fd, IPPROTO_TCP, TCP_NODELAY, &one, sizeof(one));
+    m_inbuf.clear();
+    ++m_connections;
+}
+
+void jsonrpc_client::disconnect() {
+    if (m_fd != -1) ::close(m_fd);
+    m_fd = -1;
+    m_inbuf.clear();
+}
+
+bool jsonrpc_client::read_more() {
+    char buf[65536];
+    ssize_t r;
+    do {
+        r = recv(m_fd, buf, sizeof(buf), 0);
+    } while (r == -1 && errno == EINTR);
+    if (r <= 0) return false;
+    m_inbuf.append(buf, r);
+    return true;
+}
+
+bool jsonrpc_client::roundtrip(const std::string& body, int& status, std::string& response) {
+    if (m_fd == -1) connect();
+    std::string req = strprintf(
+        "POST / HTTP/1.1\r\n"
+        "Host: %s\r\n"
+        "Connection: keep-alive\r\n"
+        "Content-Type: application/json\r\n"
+        "Content-Length: %zu\r\n"
+        "%s"
+        "\r\n", m_host, body.size(), m_auth_header) + body;
+    for (size_t sent = 0; sent < req.size(); ) {
+        ssize_t w = send(m_fd, req.data() + sent, req.size() - sent, MSG_NOSIGNAL);
+        if (w == -1 && errno == EINTR) continue;
+        if (w <= 0) return false;
+        sent += w;
+    }
+
+    // headers
+    size_t header_end;
+    while ((header_end = m_inbuf.find("\r\n\r\n")) == std::string::npos) {
+        if (!read_more()) return false;
+    }
+    std::string headers = m_inbuf.substr(0, header_end + 2);
+    m_inbuf.erase(0, header_end + 4);
+    if (sscanf(headers.c_str(), "HTTP/%*d.%*d %d", &status) != 1) return false;
+    long content_length = -1;
+    bool chunked = false;
+    bool close_after = headers.compare(0, 8, "HTTP/1.0") == 0;
+    for (size_t pos = headers.find("\r\n") + 2; pos < headers.size(); ) {
+        size_t eol = headers.find("\r\n", pos);
+        std::string line = headers.substr(pos, eol - pos);
+        pos = eol + 2;
+        size_t colon = line.find(':');
+        if (colon == std::string::npos) continue;
+        std::string name = line.substr(0, colon);
+        std::string value = line.substr(colon + 1);
+        while (!value.empty() && value[0] == ' ') value.erase(0, 1);
+        for (auto& c : name) c = tolower(c);
+        for (auto& c : value) c = tolower(c);
+        if (name == "content-length") content_length = atol(value.c_str());
+        else if (name == "transfer-encoding") chunked = value.find("chunked") != std::string::npos;
+        else if (name == "connection") close_after = value == "close";
+    }
+
+    // body
+    response.clear();
+    if (chunked) {
+        for (;;) {
+            size_t eol;
+            while ((eol = m_inbuf.find("\r\n")) == std::string::npos) if (!read_more()) return false;
+            size_t len = strtoul(m_inbuf.c_str(), nullptr, 16);
+            m_inbuf.erase(0, eol + 2);
+            while (m_inbuf.size() < len + 2) if (!read_more()) return false;
+            response.append(m_inbuf, 0, len);
+            m_inbuf.erase(0, len + 2);
+            if (len == 0) break; // (trailers are not supported)
+        }
+    } else if (content_length >= 0) {
+        while (m_inbuf.size() < (size_t)content_length) if (!read_more()) return false;
+        response.assign(m_inbuf, 0, content_length);
+        m_inbuf.erase(0, content_length);
+    } else {
+        // body runs until the server closes the connection
+        while (read_more());
+        response.swap(m_inbuf);
+        close_after = true;
+    }
+    if (close_after) disconnect();
+    return true;
+}
+
+json jsonrpc_client::request(const std::string& body) {
+    int status = 0;
+    std::string response;
+    if (!roundtrip(body, status, response)) {
+        // the server may have dropped the keep-alive connection; retry once on a fresh one
+        disconnect();
+        if (!roundtrip(body, status, response)) {
+            disconnect();
+            throw rpc_error(strprintf("lost connection to RPC server at %s:%u", m_host, m_port));
+        }
+    }
+    if (status == 401 || status == 403) throw rpc_error("RPC server refused our credentials");
+    json rv;
+    // bitcoind replies with non-200 statuses for failed calls, but still includes a JSON error
+    if (!json::parse(response, rv)) throw rpc_error(strprintf("invalid RPC response (HTTP status %d)", status));
+    return rv;
+}
+
+json jsonrpc_client::call(const std::string& method, const std::string& params) {
+    uint64_t id = m_next_id++;
+    json rv = request(strprintf("{\"jsonrpc\":\"1.0\",\"id\":%" PRIu64 ",\"method\":%s,\"params\":%s}", id, json::quote(method), params));
+    jsonrpc_response r;
+    r.result = rv["result"];
+    r.error = rv["error"];
+    if (!r.ok()) throw rpc_error(method + ": " + r.error_message());
+    return r.result;
+}
+
+std::vector<jsonrpc_response> jsonrpc_client::batch(const std::vector<std::pair<std::string, std::string>>& calls) {
+    std::vector<jsonrpc_response> rv(calls.size());
+    if (calls.empty()) return rv;
+    uint64_t base = m_next_id;
+    m_next_id += calls.size();
+    std::string body = "[";
+    for (size_t i = 0; i < calls.size(); ++i) {
+        body += strprintf("%s{\"jsonrpc\":\"1.0\",\"id\":%" PRIu64 ",\"method\":%s,\"params\":%s}", i ? "," : "", base + i, json::quote(calls[i].first), calls[i].second);
+    }
+    body += "]";
+    json response = request(body);
+    if (response.type != json::array_t) {
+        // a batch that fails as a whole yields a single error object
+        jsonrpc_response r;
+        r.error = response["error"];
+        throw rpc_error("batch request failed: " + r.error_message());
+    }
+    std::vector<bool> seen(calls.size());
+    for (auto& entry : response.arr) {
+        const json& id = entry["id"];
+        if (id.type != json::number_t) continue;
+        uint64_t idx = strtoull(id.str.c_str(), nullptr, 10) - base;
+        if (idx >= calls.size()) continue;
+        seen[idx] = true;
+        rv[idx].result = entry["result"];
+        rv[idx].error = entry["error"];
+    }
+    for (size_t i = 0; i < calls.size(); ++i) {
+        if (!seen[i]) {
+            rv[i].error.type = json::object_t;
+            rv[i].error.obj.emplace_back("message", json());
+            rv[i].error.obj.back().second.type = json::string_t;
+            rv[i].error.obj.back().second.str = "no response for call";
+        }
+    }
+    return rv;
+}
+
+} // namespace tiny
@@ -0,0 +1,129 @@
+// Copyright (c) 2018 The Bitcoin Core developers
+// Distributed under the MIT software license, see the accompanying
+// file COPYING or http://www.opensource.org/licenses/mit-license.php.
+
+#ifndef BITCOIN_TINYJSONRPC_H
+#define BITCOIN_TINYJSONRPC_H
+
+#include <cstdlib>
+#include <memory>
+#include <stdexcept>
+#include <string>
+#include <vector>
+
+namespace tiny {
+
+class rpc_error : public std::runtime_error { public: explicit rpc_error(const std::string& str) : std::runtime_error(str) {} };
+
+/**
+ * Minimal JSON value, covering what the bitcoind RPC interface hands back.
+ * Numbers are kept in their textual form, and converted on demand.
+ */
+struct json {
+    enum type_t { null_t, bool_t, number_t, string_t, array_t, object_t };
+
+    type_t type{null_t};
+    bool b{false};
+    std::string str;                                    //!< string value, or the number as written
+    std::vector<json> arr;
+    std::vector<std::pair<std::string, json>> obj;
+
+    bool is_null() const { return type == null_t; }
+    bool is_string() const { return type == string_t; }
+
+    /** Object member with the given key, or null if there is none (or this is not an object). */
+    const json& operator[](const std::string& key) const;
+    /** Array element at the given index, or null if out of range (or this is not an array). */
+    const json& operator[](size_t index) const;
+
+    int64_t get_int() const;
+    const std::string& get_str() const;
+
+    /** Parse the JSON text in [begin, end) into out. Returns false on malformed input. */
+    static bool parse(const char* begin, const char* end, json& out);
+    static bool parse(const std::string& text, json& out) { return parse(text.data(), text.data() + text.size(), out); }
+
+    /** Quote and escape the given string as a JSON string literal. */
+    static std::string quote(const std::string& s);
+};
+
+/** The outcome of a single JSON-RPC call. */
+struct jsonrpc_response {
+    //! bitcoind's error code for invalid parameters, e.g. a block height beyond the tip
+    static const int RPC_INVALID_PARAMETER = -8;
+
+    json result;
+    json error;
+
+    bool ok() const { return error.is_null(); }
+    /** The error code, or 0 if there is none. */
+    int error_code() const { return error["code"].is_null() ? 0 : atoi(error["code"].str.c_str()); }
+    std::string error_message() const;
+};
+
+/**
+ * Client for the bitcoind JSON-RPC interface, speaking HTTP/1.1 over a single
+ * persistent (keep-alive) connection, rather than spawning bitcoin-cli once
+ * per call.
+ *
+ * Batches are sent as one JSON-RPC batch request, i.e. in a single round trip.
+ *
+ * If the server has closed the connection since the last call, the client
+ * reconnects and retries once. Transport failures are reported as rpc_error.
+ *
+ * Not thread safe.
+ */
+class jsonrpc_client {
+public:
+    /**
+     * Connect to host:port (lazily), authenticating with auth, which is either
+     * "<user>:<password>" or the contents of a bitcoind cookie file.
+     */
+    jsonrpc_client(const std::string& host, uint16_t port, const std::string& auth);
+    ~jsonrpc_client();
+
+    /**
+     * Create a client from a URL of the form http://[user:password@]host[:port].
+     * Without credentials in the URL, the cookie file at cookie_path is used.
+     * Returns nullptr if the URL is malformed or no credentials are available.
+     */
+    static std::shared_ptr<jsonrpc_client> from_url(const std::string& url, const std::string& cookie_path);
+
+    /** A new client for the same server, with a connection of its own. */
+    std::shared_ptr<jsonrpc_client> clone() const { return std::make_shared<jsonrpc_client>(m_host, m_port, m_auth); }
+
+    /** Perform a single call. params is a JSON array (e.g. "[\"abc\", 0]"). Throws rpc_error on failure. */
+    json call(const std::string& method, const std::string& params);
+
+    /**
+     * Perform a batch of calls in one request; the responses are returned in
+     * the order of the calls. Individual calls may fail without affecting the
+     * rest; rpc_error is only thrown if the request as a whole fails.
+     */
+    std::vector<jsonrpc_response> batch(const std::vector<std::pair<std::string, std::string>>& calls);
+
+    /** Number of connections opened so far. */
+    size_t connections() const { return m_connections; }
+
+private:
+    std::string m_host;
+    uint16_t m_port;
+    std::string m_auth;
+    std::string m_auth_header;
+    int m_fd{-1};
+    size_t m_connections{0};
+    uint64_t m_next_id{0};
+    std::string m_inbuf;
+
+    void connect();
+    void disconnect();
+    /** Send body as a POST and read the response. Returns false if the connection was lost. */
+    bool roundtrip(const std::string& body, int& status, std::string& response);
+    bool read_more();
+    /** Send a request body, reconnecting once if needed, and parse the JSON response. */
+    json request(const std::string& body);
+};
+
+} // namespace tiny
+
+#endif // BITCOIN_TINYJSONRPC_H
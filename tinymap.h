@@ -0,0 +1,184 @@
+// Copyright (c) 2018 The Bitcoin Core developers
+// Distributed under the MIT software license, see the accompanying
+// file COPYING or http://www.opensource.org/licenses/mit-license.php.
+
+#ifndef BITCOIN_TINYMAP_H
+#define BITCOIN_TINYMAP_H
+
+#include <assert.h>
+#include <utility>
+#include <vector>
+
+#include <uint256.h>
+
+namespace tiny {
+
+/**
+ * Default hasher. Keys are expected to be (or contain) uniformly distributed
+ * hashes, so we simply take 64 bits out of the middle of the key.
+ */
+template<typename K> struct key_hasher;
+
+template<> struct key_hasher<uint256> {
+    uint64_t operator()(const uint256& k) const { return k.GetUint64(1); }
+};
+
+/**
+ * Open-addressing (linear probing) hash map.
+ *
+ * The table size is always a power of two, and is doubled whenever it is
+ * more than 3/4 full. Removals use backward-shift deletion, so there are no
+ * tombstones and lookups never degrade over time.
+ *
+ * Iteration order is unspecified; callers that need a stable order (e.g. for
+ * serialization) must sort.
+ */
+template<typename K, typename V, typename H = key_hasher<K>>
+class hashmap {
+public:
+    typedef std::pair<K, V> value_type;
+
+private:
+    struct slot {
+        bool used{false};
+        value_type kv;
+    };
+
+    std::vector<slot> m_slots;
+    size_t m_size{0};
+    size_t m_mask{0};
+    H m_hasher;
+
+    inline size_t ideal(const K& k) const { return m_hasher(k) & m_mask; }
+
+    size_t locate(const K& k) const {
+        if (m_slots.empty()) return (size_t)-1;
+        for (size_t i = ideal(k); ; i = (i + 1) & m_mask) {
+            const slot& s = m_slots[i];
+            if (!s.used) return (size_t)-1;
+            if (s.kv.first == k) return i;
+        }
+    }
+
+    void rehash(size_t cap) {
+        std::vector<slot> old;
+        old.swap(m_slots);
+        m_slots.resize(cap);
+        m_mask = cap - 1;
+        for (auto& s : old) {
+            if (!s.used) continue;
+            size_t i = ideal(s.kv.first);
+            while (m_slots[i].used) i = (i + 1) & m_mask;
+            m_slots[i].used = true;
+            m_slots[i].kv = std::move(s.kv);
+        }
+    }
+
+public:
+    template<typename S, typename P>
+    class iterator_base {
+        friend class hashmap;
+        S* m_s;
+        S* m_end;
+        void skip() { while (m_s != m_end && !m_s->used) ++m_s; }
+    public:
+        iterator_base(S* s, S* end) : m_s(s), m_end(end) { skip(); }
+        P& operator*() const { return m_s->kv; }
+        P* operator->() const { return &m_s->kv; }
+        iterator_base& operator++() { ++m_s; skip(); return *this; }
+        bool operator==(const iterator_base& other) const { return m_s == other.m_s; }
+        bool operator!=(const iterator_base& other) const { return m_s != other.m_s; }
+    };
+    typedef iterator_base<slot, value_type> iterator;
+    typedef iterator_base<const slot, const value_type> const_iterator;
+
+    hashmap() {}
+    explicit hashmap(size_t reserve_count) { reserve(reserve_count); }
+
+    size_t size() const { return m_size; }
+    bool empty() const { return m_size == 0; }
+    size_t capacity() const { return m_slots.size(); }
+
+    iterator begin() { return iterator(m_slots.data(), m_slots.data() + m_slots.size()); }
+    iterator end() { return iterator(m_slots.data() + m_slots.size(), m_slots.data() + m_slots.size()); }
+    const_iterator begin() const { return const_iterator(m_slots.data(), m_slots.data() + m_slots.size()); }
+    const_iterator end() const { return const_iterator(m_slots.data() + m_slots.size(), m_slots.data() + m_slots.size()); }
+
+    /** Make room for at least count entries without rehashing. */
+    void reserve(size_t count) {
+        size_t cap = 16;
+        while (cap * 3 < count * 4) cap <<= 1;
+        if (cap > m_slots.size()) rehash(cap);
+    }
+
+    void clear() {
+        m_slots.clear();
+        m_size = 0;
+        m_mask = 0;
+    }
+
+    iterator find(const K& k) {
+        size_t i = locate(k);
+        return i == (size_t)-1 ? end() : iterator(m_slots.data() + i, m_slots.data() + m_slots.size());
+    }
+
+    const_iterator find(const K& k) const {
+        size_t i = locate(k);
+        return i == (size_t)-1 ? end() : const_iterator(m_slots.data() + i, m_slots.data() + m_slots.size());
+    }
+
+    size_t count(const K& k) const { return locate(k) == (size_t)-1 ? 0 : 1; }
+
+    V& at(const K& k) {
+        size_t i = locate(k);
+        assert(i != (size_t)-1);
+        return m_slots[i].kv.second;
+    }
+
+    const V& at(const K& k) const {
+        size_t i = locate(k);
+        assert(i != (size_t)-1);
+        return m_slots[i].kv.second;
+    }
+
+    V& operator[](const K& k) {
+        if ((m_size + 1) * 4 > m_slots.size() * 3) rehash(m_slots.empty() ? 16 : m_slots.size() << 1);
+        size_t i = ideal(k);
+        for (;; i = (i + 1) & m_mask) {
+            slot& s = m_slots[i];
+            if (!s.used) break;
+            if (s.kv.first == k) return s.kv.second;
+        }
+        slot& s = m_slots[i];
+        s.used = true;
+        s.kv.first = k;
+        s.kv.second = V();
+        ++m_size;
+        return s.kv.second;
+    }
+
+    size_t erase(const K& k) {
+        size_t i = locate(k);
+        if (i == (size_t)-1) return 0;
+        // backward-shift: pull subsequent entries in the probe run into the hole
+        // whenever the hole lies between their ideal slot and their current slot
+        for (size_t j = (i + 1) & m_mask; m_slots[j].used; j = (j + 1) & m_mask) {
+            size_t k_ideal = ideal(m_slots[j].kv.first);
+            bool movable = i <= j ? (k_ideal <= i || k_ideal > j) : (k_ideal <= i && k_ideal > j);
+            if (movable) {
+                m_slots[i].kv = std::move(m_slots[j].kv);
+                i = j;
+            }
+        }
+        m_slots[i].used = false;
+        m_slots[i].kv = value_type();
+        --m_size;
+        return 1;
+    }
+
+    void erase(const iterator& it) { erase(it->first); }
+};
+
+} // namespace tiny
+
+#endif // BITCOIN_TINYMAP_H
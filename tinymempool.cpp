@@ -1,5 +1,6 @@
 #include <tinymempool.h>
 #include <amap.h>
+#include <algorithm>
 #include <cmath>
 
 namespace tiny {
@@ -29,24 +30,12 @@ void mempool::evict_for_tx(std::shared_ptr<tx> x, std::shared_ptr<const mempool_
     if (!x->IsCoinBase()) {
         // printf("- locating evictees\n");
         for (const auto& in : x->vin) {
-            bool found = false;
-            auto prevout = in.prevout;
-            // printf("  - prevout %s %s\n", prevout.hash.ToString().c_str(), ancestry.count(prevout.hash) ? "found" : "not found");
-            if (ancestry.count(prevout.hash)) {
-                for (const auto& candidate : ancestry[prevout.hash]) {
-                    for (const auto& c_in : candidate->x->vin) {
-                        auto c_prevout = c_in.prevout;
-                        if (c_prevout.hash == prevout.hash && c_prevout.n == prevout.n) {
-                            // found a match
-                            // printf("  - evicting %s\n", candidate->x->hash.ToString().c_str());
-                            assert(candidate->x->hash != x->hash);
-                            evictees.insert(candidate);
-                            found = true;
-                            break; // c_in
-                        }
-                    }
-                    if (found) break; // candidate
-                }
+            auto it = spenders.find(in.prevout);
+            // printf("  - prevout %s %s\n", in.prevout.ToString().c_str(), it != spenders.end() ? "spent" : "not spent");
+            if (it != spenders.end()) {
+                // printf("  - evicting %s\n", it->second->x->hash.ToString().c_str());
+                assert(it->second->x->hash != x->hash);
+                evictees.insert(it->second);
             }
         }
     }
@@ -67,16 +56,25 @@ void mempool::insert_tx(std::shared_ptr<tx> x, bool retain) {
     uint64_t in_sum = 0;
     bool unknown_inputs = false;
     if (!x->IsCoinBase()) {
+        // inputs frequently spend several outputs of the same tx; the amap
+        // hands us all of a tx's outputs in one lookup, so hang on to them
+        uint256 amounts_txid;
+        amap::amount_list_t amounts;
         for (const auto& in : x->vin) {
-            if (entry_map.count(in.prevout.hash)) {
-                in_sum += entry_map[in.prevout.hash]->x->vout[in.prevout.n].value;
+            auto it = entry_map.find(in.prevout.hash);
+            if (it != entry_map.end()) {
+                in_sum += it->second->x->vout[in.prevout.n].value;
             } else {
-                auto a = amap::output_amount(in.prevout.hash, in.prevout.n);
-                if (a == -1) {
-                    unknown_inputs = true;
-                    break;
+                if (amounts.empty() || amounts_txid != in.prevout.hash) {
+                    amounts.clear();
+                    if (!amap::output_amounts(in.prevout.hash, amounts)) {
+                        unknown_inputs = true;
+                        break;
+                    }
+                    amounts_txid = in.prevout.hash;
                 }
-                in_sum += a;
+                assert(amounts.size() > in.prevout.n);
+                in_sum += amounts[in.prevout.n];
             }
         }
     }
@@ -94,7 +92,7 @@ void mempool::insert_tx(std::shared_ptr<tx> x, bool retain) {
     // would this tx be dropped immediately? if so we don't bother inserting it
     if (!retain && (entry_queue.size() + 1 > MAX_ENTRIES || ancestry.size() + x->vin.size() > MAX_REFS)) {
         // mempool is full... would we bump out lowest tx?
-        if (entry->feerate() <= entry_queue[0]->feerate()) {
+        if (eviction_score(*entry) <= eviction_score(*entry_queue.front())) {
             // we would be bumped out actually; so ignore us
             ++selfbumps;
             return;
@@ -103,12 +101,16 @@ void mempool::insert_tx(std::shared_ptr<tx> x, bool retain) {
 
     evict_for_tx(x, entry);
 
+    // before linking, so that the walks in there do not go through the new entry
+    if (package_eviction) add_to_packages(*entry);
+
     entry_map[x->hash] = entry;
 
     // link ancestry
     if (!x->IsCoinBase()) {
         for (const auto& in : x->vin) {
             ancestry[in.prevout.hash].push_back(entry);
+            spenders[in.prevout] = entry;
         }
     }
 
@@ -145,13 +147,14 @@ void mempool::insert_tx(std::shared_ptr<tx> x, bool retain) {
 void mempool::remove_entry(std::shared_ptr<const mempool_entry> entry, MemPoolRemovalReason reason, std::shared_ptr<tx> cause) {
     // printf("*** remove %s ***\n", entry->x->ToString().c_str());
     // entrypoint _e;
-    if (!entry_map.count(entry->x->hash)) return;
+    const uint256 hash = entry->x->hash;
+    if (!entry_map.count(hash)) return;
 
     if (reason != MemPoolRemovalReason::BLOCK) {
         // evict any tx dependent on x
         // printf("- remove dependent transactions\n");
-        while (ancestry.count(entry->x->hash)) {
-            remove_entry(ancestry[entry->x->hash].back(), reason, cause);
+        for (auto it = ancestry.find(hash); it != ancestry.end(); it = ancestry.find(hash)) {
+            remove_entry(it->second.back(), reason, cause);
         }
     }
 
@@ -159,47 +162,56 @@ void mempool::remove_entry(std::shared_ptr<const mempool_entry> entry, MemPoolRe
         callback->remove_entry(entry, reason, cause);
     }
 
+    // the object in entry_map, which is not necessarily the same object as entry,
+    // and the members of its packages, from before it is unlinked
+    std::shared_ptr<const mempool_entry> linked = entry_map.at(hash);
+    std::set<const mempool_entry*> package_ancestors, package_descendants;
+    if (package_eviction) {
+        collect_ancestors(*linked, package_ancestors);
+        collect_descendants(hash, package_descendants);
+    }
+
     // unlink ancestry
     if (!entry->x->IsCoinBase()) {
         // printf("- unlinking ancestry\n");
         for (const auto& in : entry->x->vin) {
-            assert(ancestry.count(in.prevout.hash));
-            auto it = find_shared_entry(ancestry[in.prevout.hash], entry);
-            //  std::find_if(ancestry[in.prevout.hash].begin(), ancestry[in.prevout.hash].end(),
-            // [entry](std::shared_ptr<const mempool_entry> const& e) {
-            //     return *e == *entry;
-            // });
-            if (it == ancestry[in.prevout.hash].end()) {
+            auto ait = ancestry.find(in.prevout.hash);
+            assert(ait != ancestry.end());
+            auto& siblings = ait->second;
+            auto it = find_shared_entry(siblings, entry);
+            if (it == siblings.end()) {
                 printf("cannot find %s in ancestry[%s]:\n", entry->x->hash.ToString().c_str(), in.prevout.hash.ToString().c_str());
                 debug_ancestry = true;
-                find_shared_entry(ancestry[in.prevout.hash], entry);
-                // std::find_if(ancestry[in.prevout.hash].begin(), ancestry[in.prevout.hash].end(),
-                // [entry](std::shared_ptr<const mempool_entry> const& e) {
-                //     return *e == *entry;
-                // });
-                for (auto it : ancestry[in.prevout.hash]) {
+                find_shared_entry(siblings, entry);
+                for (auto it : siblings) {
                     printf("- %s: %s==%s ? %d; e1=e2 ? %d\n", it->x->hash.ToString().c_str(), entry->x->hash.ToString().c_str(), it->x->hash.ToString().c_str(), entry->x->hash == it->x->hash, entry == it);
                 }
                 debug_ancestry = false;
                 printf("(END)\n");
             }
-            assert(it != ancestry[in.prevout.hash].end());
-            ancestry[in.prevout.hash].erase(it);
-            if (ancestry[in.prevout.hash].size() == 0) {
+            assert(it != siblings.end());
+            siblings.erase(it);
+            if (siblings.size() == 0) {
                 // printf("  - ancestry for %s is cleared out, erasing\n", in.prevout.hash.ToString().c_str());
                 ancestry.erase(in.prevout.hash);
             }
+            auto sit = spenders.find(in.prevout);
+            if (sit != spenders.end() && sit->second->x->hash == hash) {
+                spenders.erase(in.prevout);
+            }
         }
     }
 
+    // remove from entry queue; the queued object is the one in entry_map
+    if (linked->queued()) {
+        entry_queue.erase(linked.get());
+    }
+
     // remove from entry map
-    entry_map.erase(entry->x->hash);
+    entry_map.erase(hash);
 
-    // remove from entry queue
-    auto it = find_shared_entry(entry_queue, entry);
-    if (it != entry_queue.end()) {
-        entry_queue.erase(it);
-    }
+    // and finally from the packages it was part of
+    if (package_eviction) remove_from_packages(*linked, package_ancestors, package_descendants);
 
     // if (check() && entry_map.size() > 0) {
     //     // assert validity
@@ -226,8 +238,9 @@ void mempool::process_block(int height, uint256 hash, const std::vector<tx>& txs
             if (callback) callback->skipping_mined_tx(std::make_shared<tx>(x));
             evict_for_tx(std::make_shared<tx>(x));
         }
-        if (entry_map.count(x.hash)) {
-            remove_entry(entry_map[x.hash], MemPoolRemovalReason::BLOCK);
+        auto it = entry_map.find(x.hash);
+        if (it != entry_map.end()) {
+            remove_entry(it->second, MemPoolRemovalReason::BLOCK);
         }
     }
     if (callback) callback->push_block(height, hash, txs);
@@ -256,17 +269,7 @@ void mempool::reorg_block(int height) {
 bool mempool::is_tx_conflicting(std::shared_ptr<tx> x) {
     // find transactions that conflict with x
     for (const auto& in : x->vin) {
-        auto prevout = in.prevout;
-        if (ancestry.count(prevout.hash)) {
-            for (const auto& candidate : ancestry[prevout.hash]) {
-                for (const auto& c_in : candidate->x->vin) {
-                    auto c_prevout = c_in.prevout;
-                    if (c_prevout.hash == prevout.hash && c_prevout.n == prevout.n) {
-                        return true;
-                    }
-                }
-            }
-        }
+        if (spenders.count(in.prevout)) return true;
     }
     return false;
 }
@@ -274,8 +277,8 @@ bool mempool::is_tx_conflicting(std::shared_ptr<tx> x) {
 MemPoolRemovalReason mempool::determine_reason(std::shared_ptr<const mempool_entry> added, std::shared_ptr<const mempool_entry> removed) {
     // RBF if added has higher fee and spends all inputs spent by removed
     // Strictly speaking, this is not perfect but it's a reasonable estimate
-    int64_t added_w = added->x->GetWeight();
-    int64_t removed_w = removed->x->GetWeight();
+    int64_t added_w = added->weight();
+    int64_t removed_w = removed->weight();
     uint64_t added_fee = added->fee();
     uint64_t removed_fee = removed->fee();
     if (added_fee <= removed_fee) return MemPoolRemovalReason::CONFLICT;
@@ -299,12 +302,16 @@ MemPoolRemovalReason mempool::determine_reason(std::shared_ptr<const mempool_ent
 
 void mempool::enqueue(const std::shared_ptr<const mempool_entry>& entry, bool preserve_size_limits) {
     size_t l = 0, r = entry_queue.size(), m = 0;
-    double in_feerate = entry->feerate();
+    double in_feerate = eviction_score(*entry);
     while (r > l) {
         m = l+((r-l)>>1);
-        double feerate = entry_queue[m]->feerate();
+        double feerate = eviction_score(*entry_queue.at(m));
         // printf("enqueue FR=%lf ([%zu..%zu]: %zu=%lf)\n", in_feerate, l, r, m, feerate);
-        if (std::fabs(in_feerate - feerate) < 1) break;
+        if (std::fabs(in_feerate - feerate) < 1) {
+            // close enough
+            l = m;
+            break;
+        }
         if (in_feerate < feerate) {
             // in cheaper, move towards front
             r = m;
@@ -313,13 +320,257 @@ void mempool::enqueue(const std::shared_ptr<const mempool_entry>& entry, bool pr
             l = m + 1;
         }
     }
-    // if (entry_queue.size() > m) printf("enqueue FR=%lf: %zu=%lf\n", in_feerate, m, entry_queue[m]->feerate());
-    entry_queue.insert(entry_queue.begin() + m, entry);
+    // if (entry_queue.size() > l) printf("enqueue FR=%lf: %zu=%lf\n", in_feerate, l, entry_queue[l]->feerate());
+    // txids are uniformly distributed, so their bits make for good treap priorities
+    entry_queue.insert(l, entry.get(), entry->x->hash.GetUint64(0));
 
     if (preserve_size_limits) {
         // do not exceed entry/ref limit
         while (entry_queue.size() > MAX_ENTRIES || ancestry.size() > MAX_REFS) {
-            remove_entry(entry_queue[0], MemPoolRemovalReason::SIZELIMIT);
+            remove_entry(entry_map.at(entry_queue.front()->x->hash), MemPoolRemovalReason::SIZELIMIT);
+        }
+    }
+}
+
+void mempool::load_index(const std::map<uint256, std::shared_ptr<const mempool_entry>>& entries, const std::map<uint256, std::vector<std::shared_ptr<const mempool_entry>>>& ancestors) {
+    entry_queue.clear();
+    entry_map.clear();
+    ancestry.clear();
+    spenders.clear();
+    entry_map.reserve(entries.size());
+    ancestry.reserve(ancestors.size());
+    for (const auto& e : entries) entry_map[e.first] = e.second;
+    // ancestry records are deserialized as separate copies; point them back at
+    // the entry_map objects, as those are the ones linked into the entry queue
+    for (const auto& a : ancestors) {
+        auto& siblings = ancestry[a.first];
+        siblings.reserve(a.second.size());
+        for (const auto& e : a.second) {
+            auto it = entry_map.find(e->x->hash);
+            siblings.push_back(it != entry_map.end() ? it->second : e);
+        }
+    }
+    // the spend index is not part of the serialized format; derive it from the entries
+    for (const auto& e : entry_map) {
+        if (e.second->x->IsCoinBase()) continue;
+        for (const auto& in : e.second->x->vin) {
+            spenders[in.prevout] = e.second;
+        }
+    }
+    // neither are the package totals
+    if (package_eviction) {
+        for (const auto& e : entry_map) {
+            const mempool_entry& entry = *e.second;
+            std::set<const mempool_entry*> package;
+            collect_ancestors(entry, package);
+            entry.ancestor_count = 1 + package.size();
+            entry.ancestor_fee = entry.fee();
+            entry.ancestor_weight = entry.weight();
+            for (const mempool_entry* a : package) {
+                entry.ancestor_fee += a->fee();
+                entry.ancestor_weight += a->weight();
+            }
+            package.clear();
+            collect_descendants(entry.x->hash, package);
+            entry.descendant_count = 1 + package.size();
+            entry.descendant_fee = entry.fee();
+            entry.descendant_weight = entry.weight();
+            for (const mempool_entry* d : package) {
+                entry.descendant_fee += d->fee();
+                entry.descendant_weight += d->weight();
+            }
+        }
+    }
+}
+
+double mempool::eviction_score(const mempool_entry& entry) const {
+    return package_eviction ? std::max(entry.feerate(), entry.descendant_feerate()) : entry.feerate();
+}
+
+void mempool::requeue(const mempool_entry& entry) {
+    if (!entry.queued()) return;
+    entry_queue.erase(&entry);
+    enqueue(entry_map.at(entry.x->hash), false);
+}
+
+void mempool::collect_ancestors(const mempool_entry& entry, std::set<const mempool_entry*>& ancestors) const {
+    std::vector<const mempool_entry*> pending{&entry};
+    while (!pending.empty()) {
+        const mempool_entry* e = pending.back();
+        pending.pop_back();
+        if (e->x->IsCoinBase()) continue;
+        for (const auto& in : e->x->vin) {
+            auto it = entry_map.find(in.prevout.hash);
+            if (it != entry_map.end() && ancestors.insert(it->second.get()).second) pending.push_back(it->second.get());
+        }
+    }
+}
+
+void mempool::collect_descendants(const uint256& txid, std::set<const mempool_entry*>& descendants) const {
+    std::vector<uint256> pending{txid};
+    while (!pending.empty()) {
+        auto it = ancestry.find(pending.back());
+        pending.pop_back();
+        if (it == ancestry.end()) continue;
+        for (const auto& child : it->second) {
+            if (descendants.insert(child.get()).second) pending.push_back(child->x->hash);
+        }
+    }
+}
+
+/**
+ * For each entry descending from any of the given ancestors, which of them
+ * it descends from, as a bitset over their positions in the vector. As for
+ * collect_descendants(), only links in the mempool are followed, so an entry
+ * that is not (or no longer) linked is not passed through.
+ *
+ * The ancestors' descendants are visited once, parents before children,
+ * each handing its own bitset (and its own bit, for an ancestor) on to its
+ * children, rather than walking the graph again for every ancestor.
+ */
+std::map<const mempool_entry*, std::vector<uint64_t>> mempool::descent_from(const std::vector<const mempool_entry*>& ancestors) const {
+    const size_t words = (ancestors.size() + 63) / 64;
+    std::map<const mempool_entry*, std::vector<uint64_t>> from;
+    // the links each visited entry is still waiting for; a child spending
+    // several outputs of a parent is listed (and thus counted) once for each
+    std::map<const mempool_entry*, size_t> waiting;
+    std::vector<const mempool_entry*> pending;
+    for (const mempool_entry* a : ancestors) {
+        if (from.emplace(a, std::vector<uint64_t>(words)).second) pending.push_back(a);
+    }
+    while (!pending.empty()) {
+        const mempool_entry* e = pending.back();
+        pending.pop_back();
+        auto it = ancestry.find(e->x->hash);
+        if (it == ancestry.end()) continue;
+        for (const auto& child : it->second) {
+            ++waiting[child.get()];
+            if (from.emplace(child.get(), std::vector<uint64_t>(words)).second) pending.push_back(child.get());
+        }
+    }
+
+    for (const auto& f : from) {
+        if (!waiting.count(f.first)) pending.push_back(f.first);
+    }
+    std::map<const mempool_entry*, size_t> position;
+    for (size_t i = 0; i < ancestors.size(); ++i) position[ancestors[i]] = i;
+    while (!pending.empty()) {
+        const mempool_entry* e = pending.back();
+        pending.pop_back();
+        std::vector<uint64_t> bits = from.at(e);
+        auto pos = position.find(e);
+        if (pos != position.end()) bits[pos->second / 64] |= 1ULL << (pos->second % 64);
+        auto it = ancestry.find(e->x->hash);
+        if (it == ancestry.end()) continue;
+        for (const auto& child : it->second) {
+            auto& child_bits = from.at(child.get());
+            for (size_t w = 0; w < words; ++w) child_bits[w] |= bits[w];
+            if (--waiting.at(child.get()) == 0) pending.push_back(child.get());
+        }
+    }
+    return from;
+}
+
+/** Whether the entry descends from ancestor number i, going by descent_from(). */
+static inline bool descends(const std::map<const mempool_entry*, std::vector<uint64_t>>& from, const mempool_entry* entry, size_t i) {
+    auto it = from.find(entry);
+    return it != from.end() && (it->second[i / 64] >> (i % 64)) & 1;
+}
+
+/**
+ * Add an entry, which is not yet linked into the mempool, to the package
+ * totals of its ancestors and descendants, and set its own.
+ *
+ * Descendants only exist if they entered the mempool before the entry did
+ * (e.g. when their parent was seen late). In that case an ancestor may
+ * already have had some of them as descendants through another path, so
+ * only those it did not have are added to it (and vice versa for the
+ * descendants). Which ones those are is found by a single walk over the
+ * ancestors' descendants (see descent_from()), and only if there are
+ * descendants to begin with.
+ */
+void mempool::add_to_packages(const mempool_entry& entry) {
+    std::set<const mempool_entry*> ancestor_set, descendants;
+    collect_ancestors(entry, ancestor_set);
+    collect_descendants(entry.x->hash, descendants);
+    const std::vector<const mempool_entry*> ancestors(ancestor_set.begin(), ancestor_set.end());
+    std::map<const mempool_entry*, std::vector<uint64_t>> from;
+    if (!ancestors.empty() && !descendants.empty()) from = descent_from(ancestors);
+
+    entry.ancestor_count = entry.descendant_count = 1;
+    entry.ancestor_fee = entry.descendant_fee = entry.fee();
+    entry.ancestor_weight = entry.descendant_weight = entry.weight();
+    for (const mempool_entry* a : ancestors) {
+        ++entry.ancestor_count;
+        entry.ancestor_fee += a->fee();
+        entry.ancestor_weight += a->weight();
+    }
+    for (const mempool_entry* d : descendants) {
+        ++entry.descendant_count;
+        entry.descendant_fee += d->fee();
+        entry.descendant_weight += d->weight();
+    }
+
+    for (size_t i = 0; i < ancestors.size(); ++i) {
+        const mempool_entry* a = ancestors[i];
+        ++a->descendant_count;
+        a->descendant_fee += entry.fee();
+        a->descendant_weight += entry.weight();
+        for (const mempool_entry* d : descendants) {
+            if (descends(from, d, i)) continue;
+            ++a->descendant_count;
+            a->descendant_fee += d->fee();
+            a->descendant_weight += d->weight();
+        }
+        requeue(*a);
+    }
+    for (const mempool_entry* d : descendants) {
+        ++d->ancestor_count;
+        d->ancestor_fee += entry.fee();
+        d->ancestor_weight += entry.weight();
+        for (size_t i = 0; i < ancestors.size(); ++i) {
+            if (descends(from, d, i)) continue;
+            ++d->ancestor_count;
+            d->ancestor_fee += ancestors[i]->fee();
+            d->ancestor_weight += ancestors[i]->weight();
+        }
+    }
+}
+
+/**
+ * Take an entry, which has just been unlinked from the mempool, out of the
+ * package totals of the ancestors and descendants it had while linked. As
+ * in add_to_packages(), the descendants (which only remain when the entry
+ * is mined) an ancestor can still reach through another path stay in its
+ * totals, and vice versa.
+ */
+void mempool::remove_from_packages(const mempool_entry& entry, const std::set<const mempool_entry*>& ancestor_set, const std::set<const mempool_entry*>& descendants) {
+    const std::vector<const mempool_entry*> ancestors(ancestor_set.begin(), ancestor_set.end());
+    std::map<const mempool_entry*, std::vector<uint64_t>> from;
+    if (!ancestors.empty() && !descendants.empty()) from = descent_from(ancestors);
+
+    for (size_t i = 0; i < ancestors.size(); ++i) {
+        const mempool_entry* a = ancestors[i];
+        --a->descendant_count;
+        a->descendant_fee -= entry.fee();
+        a->descendant_weight -= entry.weight();
+        for (const mempool_entry* d : descendants) {
+            if (descends(from, d, i)) continue;
+            --a->descendant_count;
+            a->descendant_fee -= d->fee();
+            a->descendant_weight -= d->weight();
+        }
+        requeue(*a);
+    }
+    for (const mempool_entry* d : descendants) {
+        --d->ancestor_count;
+        d->ancestor_fee -= entry.fee();
+        d->ancestor_weight -= entry.weight();
+        for (size_t i = 0; i < ancestors.size(); ++i) {
+            if (descends(from, d, i)) continue;
+            --d->ancestor_count;
+            d->ancestor_fee -= ancestors[i]->fee();
+            d->ancestor_weight -= ancestors[i]->weight();
         }
     }
 }
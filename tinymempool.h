@@ -5,8 +5,14 @@
 #ifndef BITCOIN_TINYMEMPOOL_H
 #define BITCOIN_TINYMEMPOOL_H
 
+#include <map>
+#include <set>
+
 #include <uint256.h>
 #include <tinytx.h>
+#include <tinyhashpool.h>
+#include <tinymap.h>
+#include <tinyqueue.h>
 
 #ifndef TINY_NOSERIALIZE
 #include <serialize.h>
@@ -29,14 +35,28 @@ enum class MemPoolRemovalReason {
     REPLACED     //! Removed for replacement
 };
 
-struct mempool_entry {
+template<> struct key_hasher<outpoint> {
+    uint64_t operator()(const outpoint& o) const { return o.hash.GetUint64(1) ^ (o.n * 0x9e3779b97f4a7c15ULL); }
+};
+
+struct mempool_entry : public queue_hook<mempool_entry> {
     std::shared_ptr<const tx> x;
     uint64_t in_sum{0};
     bool unknown_inputs{false};
+    //! fee(), weight() and feerate(), computed once when the entry is built (see update_cache())
+    uint64_t cached_fee{0};
+    int64_t cached_weight{0};
+    double cached_feerate{0};
+    //! Fee and weight totals of the entry and its in-mempool ancestors/descendants; only kept
+    //! up to date by mempool::package_eviction (and mutable, as the entries are shared as const)
+    mutable uint64_t ancestor_count{1}, ancestor_fee{0};
+    mutable int64_t ancestor_weight{0};
+    mutable uint64_t descendant_count{1}, descendant_fee{0};
+    mutable int64_t descendant_weight{0};
 
     mempool_entry() {}
     mempool_entry(std::shared_ptr<tx> x_in, uint64_t in_sum_in, bool unknown_inputs_in)
-    : x(x_in), in_sum(in_sum_in), unknown_inputs(unknown_inputs_in) {}
+    : x(x_in), in_sum(in_sum_in), unknown_inputs(unknown_inputs_in) { update_cache(); }
 
 #ifndef TINY_NOSERIALIZE
     ADD_SERIALIZE_METHODS;
@@ -59,6 +79,7 @@ struct mempool_entry {
         }
         s >> *xp >> unknown_inputs;
         if (!unknown_inputs) s >> VARINT(in_sum);
+        update_cache();
     }
 #endif
 
@@ -75,7 +96,7 @@ struct mempool_entry {
         return *x == other;
     }
 
-    uint64_t fee() const {
+    uint64_t compute_fee() const {
         if (x->IsCoinBase() || unknown_inputs) return 0;
         uint64_t fee = in_sum;
         for (const auto& vout : x->vout) {
@@ -83,14 +104,31 @@ struct mempool_entry {
         }
         return fee;
     }
-#ifndef TINY_NOSERIALIZE
+
     /**
-     * Calculates the fee rate in satoshi per virtual byte.
+     * Compute the fee, weight and fee rate; the entry is not meant to change
+     * once built, so this is done by the constructors.
      */
-    double feerate() const {
-        if (x->IsCoinBase() || unknown_inputs) return 0;
-        return 4.0 * fee() / x->GetWeight();
+    void update_cache() {
+        cached_fee = compute_fee();
+#ifndef TINY_NOSERIALIZE
+        cached_weight = x->GetWeight();
+        cached_feerate = x->IsCoinBase() || unknown_inputs ? 0 : 4.0 * cached_fee / cached_weight;
+#endif
     }
+
+    uint64_t fee() const { return cached_fee; }
+#ifndef TINY_NOSERIALIZE
+    int64_t weight() const { return cached_weight; }
+    /**
+     * The fee rate in satoshi per virtual byte.
+     */
+    double feerate() const { return cached_feerate; }
+    /**
+     * The fee rate of the entry together with its descendants, i.e. of what
+     * is removed along with it.
+     */
+    double descendant_feerate() const { return descendant_weight ? 4.0 * descendant_fee / descendant_weight : 0; }
 #endif
 };
 
@@ -107,17 +145,36 @@ class mempool {
 private:
     MemPoolRemovalReason determine_reason(std::shared_ptr<const mempool_entry> added, std::shared_ptr<const mempool_entry> removed);
     void enqueue(const std::shared_ptr<const mempool_entry>& entry, bool preserve_size_limits = true);
+    void load_index(const std::map<uint256, std::shared_ptr<const mempool_entry>>& entries, const std::map<uint256, std::vector<std::shared_ptr<const mempool_entry>>>& ancestors);
+    double eviction_score(const mempool_entry& entry) const;
+    void requeue(const mempool_entry& entry);
+    void collect_ancestors(const mempool_entry& entry, std::set<const mempool_entry*>& ancestors) const;
+    void collect_descendants(const uint256& txid, std::set<const mempool_entry*>& descendants) const;
+    std::map<const mempool_entry*, std::vector<uint64_t>> descent_from(const std::vector<const mempool_entry*>& ancestors) const;
+    void add_to_packages(const mempool_entry& entry);
+    void remove_from_packages(const mempool_entry& entry, const std::set<const mempool_entry*>& ancestor_set, const std::set<const mempool_entry*>& descendants);
 public:
     constexpr static size_t MAX_ENTRIES = 200000; // keep max this many transactions
     constexpr static size_t MAX_REFS =   1000000; // keep this many references
     double min_feerate = 0; // satoshi/vbyte minimum feerate required to allow a transaction into the mempool
     size_t rejections = 0; // number of txs that were rejected due to feerate minimum check
     size_t selfbumps = 0; // number of txs that rejected themselves because they would have been thrown out immediately anyway
+    /**
+     * Evict by descendant package fee rate (the higher of an entry's own fee
+     * rate and that of it together with its descendants), as Bitcoin Core
+     * does, rather than by individual fee rate; this keeps a low fee parent
+     * bumped by a high fee child (CPFP) around. The ancestor and descendant
+     * totals of the entries (see mempool_entry) are only maintained in this
+     * mode, which has to be set before the mempool is populated.
+     */
+    bool package_eviction = false;
     mempool_callback* callback = nullptr;
-    std::map<uint256, std::shared_ptr<const mempool_entry>> entry_map;
-    std::map<uint256, std::vector<std::shared_ptr<const mempool_entry>>> ancestry;
-    //! Fee-ordered list of mempool entries used for purging
-    std::vector<std::shared_ptr<const mempool_entry>> entry_queue;
+    hashmap<uint256, std::shared_ptr<const mempool_entry>> entry_map;
+    hashmap<uint256, std::vector<std::shared_ptr<const mempool_entry>>> ancestry;
+    //! The mempool entry spending each outpoint; derived from entry_map, and rebuilt on load
+    hashmap<outpoint, std::shared_ptr<const mempool_entry>> spenders;
+    //! Fee-ordered list of mempool entries used for purging; entries are owned by entry_map
+    rank_queue<mempool_entry> entry_queue;
     /**
      * Insert x into the mempool, removing any conflicting transactions.
      * Retained transactions are not enqueued, and thus never subject to
@@ -159,6 +216,7 @@ public:
         if (entry_map.size() > 0) {
             // assert validity
             std::set<uint256> inputs;
+            std::set<outpoint> prevouts;
             uint32_t max_ins = 0;
             uint64_t sum_ins = 0;
             for (const auto& e : entry_map) {
@@ -166,20 +224,46 @@ public:
                 sum_ins += e.second->x->vin.size();
                 for (const auto& vin : e.second->x->vin) {
                     inputs.insert(vin.prevout.hash);
+                    if (!e.second->x->IsCoinBase()) prevouts.insert(vin.prevout);
                 }
             }
             printf("ancestry size = %zu, inputs size = %zu; max inputs = %u; tx count = %zu, input sum = %" PRIu64 ", avg in/tx = %.2f\n", ancestry.size(), inputs.size(), max_ins, entry_map.size(), sum_ins, (float)sum_ins / entry_map.size());
             assert(ancestry.size() == inputs.size());
+            assert(spenders.size() == prevouts.size());
+        }
+        // the on-disk format orders both maps by txid, which also keeps the
+        // entry queue population below deterministic
+        std::map<uint256, std::shared_ptr<const mempool_entry>> sorted_entries;
+        std::map<uint256, std::vector<std::shared_ptr<const mempool_entry>>> sorted_ancestry;
+        if (!ser_action.ForRead()) {
+            for (const auto& e : entry_map) sorted_entries.insert(e);
+            for (const auto& a : ancestry) sorted_ancestry.insert(a);
+        }
+        if (ser_action.ForRead()) {
+            // hash all the txs together, before indexing them by hash
+            {
+                deferred_hashing defer;
+                READWRITE(sorted_entries);
+                READWRITE(sorted_ancestry);
+            }
+            std::vector<tx*> txs;
+            for (const auto& e : sorted_entries) txs.push_back(const_cast<tx*>(e.second->x.get()));
+            for (const auto& a : sorted_ancestry) {
+                for (const auto& e : a.second) txs.push_back(const_cast<tx*>(e->x.get()));
+            }
+            hash_pool::shared().hash(txs.data(), txs.size());
+            load_index(sorted_entries, sorted_ancestry);
+        } else {
+            READWRITE(sorted_entries);
+            READWRITE(sorted_ancestry);
         }
-        READWRITE(entry_map);
-        READWRITE(ancestry);
         // populate entry queue
         if (entry_queue.size() == 0) {
-            for (const auto& it : entry_map) {
+            for (const auto& it : sorted_entries) {
                 enqueue(it.second, false);
             }
         }
-        printf("(%zu entries in mempool, %zu ancestry records)\n", entry_map.size(), ancestry.size());
+        printf("(%zu entries in mempool, %zu ancestry records, %zu spent outpoints)\n", entry_map.size(), ancestry.size(), spenders.size());
     }
 #endif
 };
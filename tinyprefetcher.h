@@ -0,0 +1,159 @@
+// Copyright (c) 2018 The Bitcoin Core developers
+// Distributed under the MIT software license, see the accompanying
+// file COPYING or http://www.opensource.org/licenses/mit-license.php.
+
+#ifndef BITCOIN_TINYPREFETCHER_H
+#define BITCOIN_TINYPREFETCHER_H
+
+#include <condition_variable>
+#include <exception>
+#include <map>
+#include <memory>
+#include <mutex>
+#include <thread>
+
+#include <tinyrpc.h>
+
+namespace tiny {
+
+/**
+ * Background block fetcher, which keeps the blocks at the heights following
+ * the replay cursor fetched and deserialized, so that the replay itself
+ * (mostly) never has to wait for block I/O.
+ *
+ * At most `depth` blocks are held at any one time: those at heights
+ * [cursor, cursor + depth). The cursor is moved by get(); blocks below it are
+ * dropped, and the window is refilled in height order.
+ *
+ * Blocks are fetched through a private rpc instance (see rpc::clone()), as
+ * rpc objects are not thread safe. The prefetcher itself is, though it is
+ * meant to be driven by a single replay thread.
+ */
+class block_prefetcher {
+private:
+    struct entry {
+        bool ok{false};
+        std::exception_ptr error;   //!< set if the fetch failed, other than by being beyond the tip
+        uint256 hash;
+        std::shared_ptr<const block> blk;
+    };
+
+    rpc m_rpc;
+    size_t m_depth;
+    uint32_t m_cursor{0};
+    bool m_started{false};
+    bool m_stop{false};
+    std::map<uint32_t, entry> m_entries;
+    std::mutex m_mutex;
+    std::condition_variable m_cv;
+    std::thread m_thread;
+
+    /** The next height that should be fetched, if any. Requires m_mutex. */
+    bool next_height(uint32_t& height) const {
+        if (!m_started) return false;
+        for (height = m_cursor; height < m_cursor + m_depth; ++height) {
+            auto it = m_entries.find(height);
+            if (it == m_entries.end()) return true;
+            // don't go past a height the node does not (yet) have
+            if (!it->second.ok) return false;
+        }
+        return false;
+    }
+
+    void run() {
+        std::unique_lock<std::mutex> lock(m_mutex);
+        while (!m_stop) {
+            uint32_t height;
+            if (!next_height(height)) {
+                m_cv.wait(lock);
+                continue;
+            }
+            lock.unlock();
+            entry e;
+            std::shared_ptr<block> blk = std::make_shared<block>();
+            try {
+                e.ok = m_rpc.get_block(height, *blk, e.hash);
+            } catch (const std::exception&) {
+                // handed to the replay by get(), as if it had fetched the block itself
+                e.error = std::current_exception();
+            }
+            e.blk = blk;
+            lock.lock();
+            // the window may have moved on while we were busy
+            if (height >= m_cursor && height < m_cursor + m_depth) m_entries[height] = e;
+            m_cv.notify_all();
+        }
+    }
+
+    /** Move the cursor to height, dropping everything outside the new window. Requires m_mutex. */
+    void move_cursor(uint32_t height) {
+        m_cursor = height;
+        m_started = true;
+        for (auto it = m_entries.begin(); it != m_entries.end(); ) {
+            if (it->first < m_cursor || it->first >= m_cursor + m_depth) it = m_entries.erase(it); else ++it;
+        }
+        m_cv.notify_all();
+    }
+
+public:
+    block_prefetcher(const rpc& source, size_t depth) : m_rpc(source.clone()), m_depth(depth ? depth : 1) {
+        m_thread = std::thread([this]() { run(); });
+    }
+
+    ~block_prefetcher() {
+        {
+            std::lock_guard<std::mutex> lock(m_mutex);
+            m_stop = true;
+            m_cv.notify_all();
+        }
+        m_thread.join();
+    }
+
+    /**
+     * Fetch the block at the given height, waiting for it if it has not been
+     * prefetched yet, and move the cursor there. Returns false if the height
+     * is beyond the tip; any other failure to fetch the block is rethrown.
+     */
+    bool get(uint32_t height, block& b, uint256& hash) {
+        std::unique_lock<std::mutex> lock(m_mutex);
+        move_cursor(height);
+        m_cv.wait(lock, [&]() { return m_entries.count(height) > 0; });
+        entry e = m_entries[height];
+        if (!e.ok) {
+            // forget about the failure, so that it is retried next time
+            m_entries.erase(height);
+            m_cv.notify_all();
+            if (e.error) std::rethrow_exception(e.error);
+            return false;
+        }
+        hash = e.hash;
+        b = *e.blk;
+        return true;
+    }
+
+    /**
+     * Look up an already prefetched block by hash, without waiting. Returns
+     * false if the block is not (yet) available.
+     */
+    bool find(const uint256& hash, block& b, uint32_t& height) {
+        std::lock_guard<std::mutex> lock(m_mutex);
+        for (const auto& e : m_entries) {
+            if (e.second.ok && e.second.hash == hash) {
+                height = e.first;
+                b = *e.second.blk;
+                return true;
+            }
+        }
+        return false;
+    }
+
+    /** Number of blocks currently held. */
+    size_t size() {
+        std::lock_guard<std::mutex> lock(m_mutex);
+        return m_entries.size();
+    }
+};
+
+} // namespace tiny
+
+#endif // BITCOIN_TINYPREFETCHER_H
@@ -0,0 +1,171 @@
+// Copyright (c) 2018 The Bitcoin Core developers
+// Distributed under the MIT software license, see the accompanying
+// file COPYING or http://www.opensource.org/licenses/mit-license.php.
+
+#ifndef BITCOIN_TINYQUEUE_H
+#define BITCOIN_TINYQUEUE_H
+
+#include <assert.h>
+#include <stddef.h>
+#include <stdint.h>
+
+namespace tiny {
+
+/**
+ * Intrusive hook for rank_queue. Objects placed in a rank_queue derive from
+ * this, and thereby carry their own queue position around with them, which
+ * is what lets the queue remove an arbitrary entry without searching for it.
+ *
+ * The fields are mutable so that const objects (e.g. shared_ptr<const T>) can
+ * be queued; they are owned by the queue and must not be touched by anyone
+ * else. Copies start out unqueued.
+ */
+template<typename T>
+struct queue_hook {
+    mutable const T* q_parent{nullptr};
+    mutable const T* q_left{nullptr};
+    mutable const T* q_right{nullptr};
+    mutable size_t q_count{0};      //!< size of the subtree rooted at this node; 0 if not queued
+    mutable uint64_t q_priority{0}; //!< heap priority (treap balancing)
+
+    queue_hook() {}
+    queue_hook(const queue_hook&) {}
+    queue_hook& operator=(const queue_hook&) { return *this; }
+
+    bool queued() const { return q_count > 0; }
+};
+
+/**
+ * Positional sequence of intrusively linked objects, backed by an order
+ * statistic treap. It behaves like a std::vector<const T*> in that entries
+ * are addressed by index and inserted at a given index, but indexing,
+ * insertion and removal (by object, not by index) are all O(log n).
+ *
+ * Priorities only affect the shape of the tree, never the order of the
+ * entries, so any well-distributed value will do (the mempool uses txid bits).
+ */
+template<typename T>
+class rank_queue {
+private:
+    const T* m_root{nullptr};
+
+    static inline size_t count(const T* n) { return n ? n->q_count : 0; }
+    static inline void recount(const T* n) { n->q_count = 1 + count(n->q_left) + count(n->q_right); }
+
+    inline void replace_child(const T* parent, const T* from, const T* to) {
+        if (!parent) m_root = to;
+        else if (parent->q_left == from) parent->q_left = to;
+        else parent->q_right = to;
+        if (to) to->q_parent = parent;
+    }
+
+    /** Rotate x above its parent, keeping the in-order sequence intact. */
+    void rotate_up(const T* x) {
+        const T* p = x->q_parent;
+        const T* g = p->q_parent;
+        if (p->q_left == x) {
+            p->q_left = x->q_right;
+            if (x->q_right) x->q_right->q_parent = p;
+            x->q_right = p;
+        } else {
+            p->q_right = x->q_left;
+            if (x->q_left) x->q_left->q_parent = p;
+            x->q_left = p;
+        }
+        p->q_parent = x;
+        replace_child(g, p, x);
+        recount(p);
+        recount(x);
+    }
+
+public:
+    size_t size() const { return count(m_root); }
+    bool empty() const { return m_root == nullptr; }
+
+    /** Drop all entries. The entries themselves are left as they are, so
+     * this must only be used when they are about to be discarded. */
+    void clear() { m_root = nullptr; }
+
+    /** Return the entry at the given index. */
+    const T* at(size_t index) const {
+        assert(index < size());
+        const T* n = m_root;
+        for (;;) {
+            size_t l = count(n->q_left);
+            if (index < l) {
+                n = n->q_left;
+            } else if (index == l) {
+                return n;
+            } else {
+                index -= l + 1;
+                n = n->q_right;
+            }
+        }
+    }
+
+    const T* front() const {
+        const T* n = m_root;
+        if (n) while (n->q_left) n = n->q_left;
+        return n;
+    }
+
+    /** Return the current index of a queued entry. */
+    size_t index_of(const T* e) const {
+        assert(e->queued());
+        size_t index = count(e->q_left);
+        for (const T* n = e; n->q_parent; n = n->q_parent) {
+            if (n->q_parent->q_right == n) index += count(n->q_parent->q_left) + 1;
+        }
+        return index;
+    }
+
+    /** Insert e so that it ends up at the given index (0 <= index <= size()). */
+    void insert(size_t index, const T* e, uint64_t priority) {
+        assert(!e->queued());
+        assert(index <= size());
+        e->q_left = e->q_right = nullptr;
+        e->q_count = 1;
+        e->q_priority = priority;
+        if (!m_root) {
+            e->q_parent = nullptr;
+            m_root = e;
+            return;
+        }
+        // descend to a leaf position, growing every subtree we pass through
+        const T* n = m_root;
+        for (;;) {
+            ++n->q_count;
+            size_t l = count(n->q_left);
+            if (index <= l) {
+                if (!n->q_left) { n->q_left = e; break; }
+                n = n->q_left;
+            } else {
+                index -= l + 1;
+                if (!n->q_right) { n->q_right = e; break; }
+                n = n->q_right;
+            }
+        }
+        e->q_parent = n;
+        // restore the heap property
+        while (e->q_parent && e->q_parent->q_priority < e->q_priority) rotate_up(e);
+    }
+
+    /** Remove a queued entry. */
+    void erase(const T* e) {
+        assert(e->queued());
+        // rotate e down until it has at most one child
+        while (e->q_left && e->q_right) {
+            rotate_up(e->q_left->q_priority > e->q_right->q_priority ? e->q_left : e->q_right);
+        }
+        const T* child = e->q_left ? e->q_left : e->q_right;
+        const T* p = e->q_parent;
+        replace_child(p, e, child);
+        for (; p; p = p->q_parent) --p->q_count;
+        e->q_parent = e->q_left = e->q_right = nullptr;
+        e->q_count = 0;
+    }
+};
+
+} // namespace tiny
+
+#endif // BITCOIN_TINYQUEUE_H
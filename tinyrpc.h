@@ -1,19 +1,262 @@
 #ifndef included_tinyrpc_h
 #define included_tinyrpc_h
 
+#include <algorithm>
+#include <atomic>
+#include <dirent.h>
+#include <functional>
 #include <ios>
+#include <mutex>
+#include <thread>
 
 #include <tinyfs.h>
 #include <tinyblock.h>
+#include <tinyjsonrpc.h>
+#include <tinystore.h>
+#include <tinyformat.h>
+#include <utilstrencodings.h>
 
 namespace tiny {
 
-class rpc_error : public std::runtime_error { public: explicit rpc_error(const std::string& str) : std::runtime_error(str) {} };
-
+/**
+ * Block/transaction fetcher, caching everything it fetches, either in a
+ * packed store (m_store), or, if there is none, as one file per entry in
+ * blockdata/ and txdata/. With a store, entries still found in those
+ * directories are picked up (and copied into the store) as they are needed.
+ *
+ * Fetches go through either a native JSON-RPC client (m_client), or, if there
+ * is none, by running the bitcoin-cli command line m_call.
+ *
+ * Cached blocks are checked against their hash and merkle root as they are
+ * loaded, and fetched again if they turn out to be corrupt (see
+ * m_verify_blocks and check_cached_blocks()).
+ */
 struct rpc {
     std::string m_call;
+    std::shared_ptr<jsonrpc_client> m_client;
+    std::shared_ptr<store> m_store;
+    //! Whether get_block() verifies cached blocks before handing them out
+    bool m_verify_blocks{true};
 
     rpc(const std::string& call) : m_call(call) {}
+    rpc(std::shared_ptr<jsonrpc_client> client) : m_client(client) {}
+
+    /** An rpc using the same backend, which may be used from another thread. */
+    rpc clone() const {
+        rpc r = m_client ? rpc(m_client->clone()) : rpc(m_call);
+        r.m_store = m_store;
+        r.m_verify_blocks = m_verify_blocks;
+        return r;
+    }
+
+    /**
+     * Create an rpc talking to the JSON-RPC server at $MFF_RPC_URL
+     * (http://[user:password@]host[:port]) if set, using the cookie file at
+     * $MFF_RPC_COOKIE (default ~/.bitcoin/.cookie) unless the URL includes
+     * credentials. Otherwise, the bitcoin-cli command line call is used.
+     */
+    static rpc* from_env(const std::string& call) {
+        const char* url = getenv("MFF_RPC_URL");
+        if (!url) return new rpc(call);
+        const char* cookie = getenv("MFF_RPC_COOKIE");
+        const char* home = getenv("HOME");
+        std::string cookie_path = cookie ? cookie : std::string(home ? home : ".") + "/.bitcoin/.cookie";
+        auto client = jsonrpc_client::from_url(url, cookie_path);
+        if (!client) throw rpc_error(std::string("invalid MFF_RPC_URL (or missing cookie file ") + cookie_path + ")");
+        return new rpc(client);
+    }
+
+    /**
+     * Write data to path via a temporary file, so that an interrupted write
+     * never leaves a partial cache entry. The temporary file is private to
+     * this rpc instance, so several instances may fill in the same entry at
+     * the same time (e.g. when prefetching).
+     */
+    void write_cache_file(const std::string& path, const uint8_t* data, size_t len) {
+        std::string tmp = strprintf("%s.%d.%p.tmp", path, getpid(), (const void*)this);
+        FILE* fp = fopen(tmp.c_str(), "wb");
+        if (!fp || fwrite(data, 1, len, fp) != len || fclose(fp)) {
+            if (fp) fclose(fp);
+            throw rpc_error("failed to write " + tmp);
+        }
+        if (rename(tmp.c_str(), path.c_str())) throw rpc_error("failed to rename " + tmp);
+    }
+
+    /** Decode hex (without a copy via ParseHex), appending it to data. */
+    static void append_hex(std::vector<uint8_t>& data, const char* hex, size_t len) {
+        size_t offset = data.size();
+        data.resize(offset + len / 2);
+        data.resize(offset + DecodeHex(hex, len, data.data() + offset));
+    }
+
+    /** Whether there is a cache entry for the given key, either in the store or at legacy_path. */
+    bool has_cached(store::kind k, const uint256& key, const std::string& legacy_path) {
+        if (m_store && m_store->has(k, key)) return true;
+        return OpenFile(legacy_path, "rb")->has_data();
+    }
+
+    /**
+     * Look up the cache entry for the given key, and hand it to read (as a
+     * CSpanReader). Returns false if there is no such entry.
+     */
+    template<typename F>
+    bool read_cached(store::kind k, const uint256& key, const std::string& legacy_path, F read) {
+        const uint8_t* data;
+        size_t len;
+        if (m_store && m_store->get(k, key, data, len)) {
+            CSpanReader r(SER_DISK, 0, data, data + len);
+            read(r);
+            return true;
+        }
+        mapped_file file;
+        if (!file.open(legacy_path) || file.empty()) return false;
+        if (m_store && !m_store->put(k, key, file.begin(), file.size())) throw rpc_error("failed to write to the store");
+        CSpanReader r = file.reader();
+        read(r);
+        return true;
+    }
+
+    /** Add a cache entry; if replace is set, an existing entry for the key is overwritten. */
+    void write_cached(store::kind k, const uint256& key, const std::string& legacy_path, const uint8_t* data, size_t len, bool replace = false) {
+        if (!m_store) return write_cache_file(legacy_path, data, len);
+        if (!(replace ? m_store->replace(k, key, data, len) : m_store->put(k, key, data, len))) throw rpc_error("failed to write to the store");
+    }
+
+    /**
+     * Decode a block cache entry (the block's height, followed by the block).
+     * If verify is set, also check that the entry has nothing trailing, and
+     * that the block matches blockhex and its merkle root. Returns false if
+     * the entry is corrupt.
+     */
+    static bool decode_block(const uint256& blockhex, CSpanReader& r, block& b, uint32_t& height, bool verify = true) {
+        try {
+            r.read((char*)&height, sizeof(height));
+            r >> b;
+        } catch (const std::exception&) {
+            // truncated, or garbage sizes
+            return false;
+        }
+        return !verify || (r.empty() && b.GetHash() == blockhex && b.check_merkle_root());
+    }
+
+    /** The hashes of all cached blocks, in the store and in blockdata/. */
+    std::vector<uint256> cached_blocks() {
+        std::vector<uint256> hashes;
+        if (m_store) m_store->keys(store::block, hashes);
+        DIR* dir = opendir("blockdata");
+        if (!dir) return hashes;
+        size_t stored = hashes.size();
+        std::sort(hashes.begin(), hashes.end());
+        while (struct dirent* ent = readdir(dir)) {
+            std::string name = ent->d_name;
+            if (name.size() != 69 || name.substr(64) != ".mffb" || !IsHex(name.substr(0, 64))) continue;
+            uint256 hash = uint256S(name.substr(0, 64));
+            if (!std::binary_search(hashes.begin(), hashes.begin() + stored, hash)) hashes.push_back(hash);
+        }
+        closedir(dir);
+        return hashes;
+    }
+
+    /**
+     * Verify every cached block (see decode_block()), spread out over the
+     * given number of threads (0 for one per core). progress, if given, is
+     * called now and then with the number of blocks checked so far, from the
+     * calling thread. Returns the hashes of the corrupt blocks, sorted.
+     */
+    std::vector<uint256> check_cached_blocks(size_t threads = 0, std::function<void(size_t checked, size_t total)> progress = nullptr) {
+        std::vector<uint256> hashes = cached_blocks();
+        if (threads == 0) threads = std::max(1u, std::thread::hardware_concurrency());
+        std::atomic<size_t> next{0}, checked{0};
+        std::vector<uint256> corrupt;
+        std::mutex corrupt_mutex;
+        auto run = [&](bool report) {
+            block b;
+            uint32_t height;
+            for (size_t i; (i = next++) < hashes.size(); ) {
+                const uint256& hash = hashes[i];
+                bool valid = true;
+                bool found = read_cached(store::block, hash, "blockdata/" + hash.ToString() + ".mffb", [&](CSpanReader& r) { valid = decode_block(hash, r, b, height); });
+                if (!found || !valid) {
+                    std::lock_guard<std::mutex> lock(corrupt_mutex);
+                    corrupt.push_back(hash);
+                }
+                ++checked;
+                if (report && progress) progress(checked, hashes.size());
+            }
+        };
+        std::vector<std::thread> workers;
+        for (size_t i = 1; i < threads; ++i) workers.emplace_back(run, false);
+        run(true);
+        for (auto& w : workers) w.join();
+        if (progress) progress(checked, hashes.size());
+        std::sort(corrupt.begin(), corrupt.end());
+        return corrupt;
+    }
+
+    /**
+     * Fetch the given blocks along with their heights, in a single batch, and
+     * write them to the block cache. Blocks that are already cached are
+     * skipped, unless replace is set (e.g. to repair corrupt entries). Returns
+     * false if any of the blocks could not be fetched because the node does
+     * not know them (e.g. orphans). JSON-RPC only.
+     */
+    bool cache_blocks(const std::vector<uint256>& hashes, bool replace = false) {
+        assert(m_client);
+        std::vector<uint256> missing;
+        std::vector<std::pair<std::string, std::string>> calls;
+        for (const auto& hash : hashes) {
+            if (std::find(missing.begin(), missing.end(), hash) != missing.end()) continue;
+            if (!replace && has_cached(store::block, hash, "blockdata/" + hash.ToString() + ".mffb")) continue;
+            missing.push_back(hash);
+            calls.emplace_back("getblock", strprintf("[\"%s\", 0]", hash.ToString()));
+            calls.emplace_back("getblockheader", strprintf("[\"%s\"]", hash.ToString()));
+        }
+        if (missing.empty()) return true;
+        auto responses = m_client->batch(calls);
+        bool rv = true;
+        for (size_t i = 0; i < missing.size(); ++i) {
+            const auto& blk = responses[i * 2];
+            const auto& hdr = responses[i * 2 + 1];
+            if (!hdr.ok() || !blk.ok()) {
+                // block is probably an orphan block
+                printf("failure to load orphan block %s: %s                          \n", missing[i].ToString().c_str(), (hdr.ok() ? blk : hdr).error_message().c_str());
+                rv = false;
+                continue;
+            }
+            uint32_t height = hdr.result["height"].get_int();
+            const std::string& hex = blk.result.get_str();
+            std::vector<uint8_t> data(sizeof(height));
+            memcpy(data.data(), &height, sizeof(height));
+            append_hex(data, hex.data(), hex.size());
+            write_cached(store::block, missing[i], "blockdata/" + missing[i].ToString() + ".mffb", data.data(), data.size(), replace);
+        }
+        return rv;
+    }
+
+    /**
+     * Fetch the given transactions in a single batch, and write them to the
+     * tx cache. Transactions that are already cached are skipped. JSON-RPC only.
+     */
+    void cache_txs(const std::vector<uint256>& txids) {
+        assert(m_client);
+        std::vector<uint256> missing;
+        std::vector<std::pair<std::string, std::string>> calls;
+        for (const auto& txid : txids) {
+            if (std::find(missing.begin(), missing.end(), txid) != missing.end()) continue;
+            if (has_cached(store::tx, txid, "txdata/" + txid.ToString() + ".mfft")) continue;
+            missing.push_back(txid);
+            calls.emplace_back("getrawtransaction", strprintf("[\"%s\"]", txid.ToString()));
+        }
+        if (missing.empty()) return;
+        auto responses = m_client->batch(calls);
+        for (size_t i = 0; i < missing.size(); ++i) {
+            if (!responses[i].ok()) throw rpc_error("failed to fetch tx " + missing[i].ToString() + ": " + responses[i].error_message());
+            const std::string& hex = responses[i].result.get_str();
+            std::vector<uint8_t> txdata;
+            append_hex(txdata, hex.data(), hex.size());
+            write_cached(store::tx, missing[i], "txdata/" + missing[i].ToString() + ".mfft", txdata.data(), txdata.size());
+        }
+    }
 
     inline File fetch(const char* cmd, const std::string& dst, bool abort_on_failure = false) {
         system(cmd);
@@ -32,6 +275,7 @@ struct rpc {
     }
 
     uint32_t get_block_count() {
+        if (m_client) return m_client->call("getblockcount", "[]").get_int();
         auto f = fetch("getblockcount > .blockcount", ".blockcount");
         uint32_t count = 0;
         fscanf(f->m_fp, "%u", &count);
@@ -65,170 +309,199 @@ struct rpc {
     //     return true;
     // }
 
+    /**
+     * Fetch the block at the given height. Returns false if the node has no
+     * block at that height (yet). JSON-RPC only; with bitcoin-cli, that is
+     * indistinguishable from other failures, which throw rpc_error.
+     */
     bool get_block(uint32_t height, block& b, uint256& blockhex) {
         std::string dstfinal = "blockdata/" + std::to_string(height) + ".hth";
-        File fp = OpenFile(dstfinal, "rb");
-        if (!fp->has_data()) {
-            std::string dsttxt = "blockdata/" + std::to_string(height) + ".hth.txt";
-            File fptxt = OpenFile(dsttxt, "r");
-            if (!fptxt->has_data()) {
-                std::string cmd = m_call + " getblockhash " + std::to_string(height) + " > " + dsttxt;
-                fptxt = fetch(cmd.c_str(), dsttxt);
+        if (!read_cached(store::block_hash, store::height_key(height), dstfinal, [&](CSpanReader& r) { r >> blockhex; })) {
+            if (m_client) {
+                const auto r = m_client->batch({{"getblockhash", strprintf("[%u]", height)}})[0];
+                if (r.error_code() == jsonrpc_response::RPC_INVALID_PARAMETER) return false;
+                if (!r.ok()) throw rpc_error("getblockhash: " + r.error_message());
+                blockhex = uint256S(r.result.get_str());
+            } else {
+                std::string dsttxt = "blockdata/" + std::to_string(height) + ".hth.txt";
+                File fptxt = OpenFile(dsttxt, "r");
+                if (!fptxt->has_data()) {
+                    std::string cmd = m_call + " getblockhash " + std::to_string(height) + " > " + dsttxt;
+                    fptxt = fetch(cmd.c_str(), dsttxt);
+                }
+                char hex[128];
+                fscanf(fptxt->m_fp, "%s", hex);
+                assert(strlen(hex) == 64);
+                blockhex = uint256S(hex);
+                fptxt->close();
             }
-            char hex[128];
-            fscanf(fptxt->m_fp, "%s", hex);
-            assert(strlen(hex) == 64);
-            blockhex = uint256S(hex);
-            fptxt->close();
-            fp = OpenFile(dstfinal, "wb");
-            fp->autofile() << blockhex;
-            return get_block(blockhex, b, height);
+            write_cached(store::block_hash, store::height_key(height), dstfinal, blockhex.begin(), blockhex.size());
         }
-        fp->autofile() >> blockhex;
         return get_block(blockhex, b, height);
     }
 
     bool get_block(const uint256& blockhex, block& b, uint32_t& height) {
         // printf("get block %s\n", blockhex.ToString().c_str());
         std::string dstfinal = "blockdata/" + blockhex.ToString() + ".mffb";
-        File fp = OpenFile(dstfinal, "rb");
-        if (!fp->has_data()) {
-            std::string dsthex = "blockdata/" + blockhex.ToString() + ".hex";
-            std::string dsthdr = "blockdata/" + blockhex.ToString() + ".hdr";
-            File fphex = OpenFile(dsthex, "r");
-            File fphdr = OpenFile(dsthdr, "r");
-            if (!fphex->has_data()) {
-                std::string cmd = m_call + " getblock " + blockhex.ToString() + " 0 > " + dsthex;
-                fphex = fetch(cmd.c_str(), dsthex);
-            }
-            if (!fphdr->has_data()) {
-                std::string cmd = m_call + " getblockheader " + blockhex.ToString() + " > " + dsthdr;
-                fphdr = fetch(cmd.c_str(), dsthdr);
-            }
-            fphdr->close();
-            // fclose(fphdr);                                      // closes fphdr
-            std::string dstheight = std::string("blockdata/") + blockhex.ToString() + ".height";
-            std::string cmd = std::string("cat ") + dsthdr + " | jq -r .height > " + dstheight;
-            system(cmd.c_str());
-            fphdr = OpenFile(dstheight, "r");
-            if (fscanf(fphdr->m_fp, "%u", &height) != 1) {
-                // block is probably an orphan block
-                printf("failure to load orphan block %u=%s                          \n", height, blockhex.ToString().c_str());
-                // fprintf(stderr, "UNDETECTED FAILURE: BLOCK=%s\n", blockhex.ToString().c_str());
-                return false;
-            }
-            fphdr->close();
-            // fclose(fphdr);                                      // closes fphdr (.height open)
-            fseek(fphex->m_fp, 0, SEEK_END);
-            size_t sz = ftell(fphex->m_fp);
-            fseek(fphex->m_fp, 0, SEEK_SET);
-            char* blk = (char*)malloc(sz + 1);
-            assert(blk);
-            fread(blk, 1, sz, fphex->m_fp);
-            fphex->close();                                        // closes fphex
-            blk[sz] = 0;
-            std::vector<uint8_t> blkdata = ParseHex(blk);
-            free(blk);
-            fp = OpenFile(dstfinal, "wb+");
-            // write height
-            fp->write(height);
-            // write block
-            fp->write(blkdata);
-            fseek(fp->m_fp, 0, SEEK_SET);
-            // unlink
-            unlink(dsthex.c_str());
-            unlink(dsthdr.c_str());
-            unlink(dstheight.c_str());
+        bool valid = true;
+        auto read_block = [&](CSpanReader& r) {
+            valid = decode_block(blockhex, r, b, height, m_verify_blocks);
+        };
+        if (read_cached(store::block, blockhex, dstfinal, read_block)) {
+            if (valid) return true;
+            fprintf(stderr, "cached block %s is corrupt; fetching it again\n", blockhex.ToString().c_str());
+        }
+        // a corrupt entry is replaced by the fresh copy
+        bool replace = !valid;
+        if (m_client) {
+            if (!cache_blocks(std::vector<uint256>{blockhex}, replace) || !read_cached(store::block, blockhex, dstfinal, read_block)) return false;
+            if (!valid) throw rpc_error("block " + blockhex.ToString() + " from the node does not verify");
+            return true;
+        }
+        std::string dsthex = "blockdata/" + blockhex.ToString() + ".hex";
+        std::string dsthdr = "blockdata/" + blockhex.ToString() + ".hdr";
+        File fphex = OpenFile(dsthex, "r");
+        File fphdr = OpenFile(dsthdr, "r");
+        if (!fphex->has_data()) {
+            std::string cmd = m_call + " getblock " + blockhex.ToString() + " 0 > " + dsthex;
+            fphex = fetch(cmd.c_str(), dsthex);
         }
-        // read height
-        fp->read(height);
-        // deserialize block
-        fp->autofile() >> b;
+        if (!fphdr->has_data()) {
+            std::string cmd = m_call + " getblockheader " + blockhex.ToString() + " > " + dsthdr;
+            fphdr = fetch(cmd.c_str(), dsthdr);
+        }
+        fphdr->close();
+        // fclose(fphdr);                                      // closes fphdr
+        std::string dstheight = std::string("blockdata/") + blockhex.ToString() + ".height";
+        std::string cmd = std::string("cat ") + dsthdr + " | jq -r .height > " + dstheight;
+        system(cmd.c_str());
+        fphdr = OpenFile(dstheight, "r");
+        if (fscanf(fphdr->m_fp, "%u", &height) != 1) {
+            // block is probably an orphan block
+            printf("failure to load orphan block %u=%s                          \n", height, blockhex.ToString().c_str());
+            // fprintf(stderr, "UNDETECTED FAILURE: BLOCK=%s\n", blockhex.ToString().c_str());
+            return false;
+        }
+        fphdr->close();
+        // fclose(fphdr);                                      // closes fphdr (.height open)
+        fseek(fphex->m_fp, 0, SEEK_END);
+        size_t sz = ftell(fphex->m_fp);
+        fseek(fphex->m_fp, 0, SEEK_SET);
+        char* blk = (char*)malloc(sz + 1);
+        assert(blk);
+        fread(blk, 1, sz, fphex->m_fp);
+        fphex->close();                                        // closes fphex
+        blk[sz] = 0;
+        std::vector<uint8_t> data(sizeof(height));
+        memcpy(data.data(), &height, sizeof(height));
+        append_hex(data, blk, sz);
+        free(blk);
+        write_cached(store::block, blockhex, dstfinal, data.data(), data.size(), replace);
+        // unlink
+        unlink(dsthex.c_str());
+        unlink(dsthdr.c_str());
+        unlink(dstheight.c_str());
+        CSpanReader r(SER_DISK, 0, data.data(), data.data() + data.size());
+        read_block(r);
+        if (!valid) throw rpc_error("block " + blockhex.ToString() + " from the node does not verify");
         return true;
     }
 
     void get_tx(const uint256& txhex, tx& tx, size_t retries = 0) {
         printf("get tx %s\n", txhex.ToString().c_str());
         std::string dstfinal = "txdata/" + txhex.ToString() + ".mfft";
-        File fp = OpenFile(dstfinal, "rb");
-        if (!fp->has_data()) {
-            std::string dsthex = "txdata/" + txhex.ToString() + ".hex";
-            std::string cmd = m_call + " getrawtransaction " + txhex.ToString() + " > " + dsthex;
-            File fphex = OpenFile(dsthex, "r");
-            if (!fphex->has_data()) {
-                fphex = fetch(cmd.c_str(), dsthex.c_str());
-            }
-            fseek(fphex->m_fp, 0, SEEK_END);
-            size_t sz = ftell(fphex->m_fp);
-            fseek(fphex->m_fp, 0, SEEK_SET);
-            if (sz == 0) {
-                if (retries == 5) {
-                    throw rpc_error("failed to fetch tx " + txhex.ToString() + " after 5 tries");
-                }
-                fprintf(stderr, "failed to fetch tx %s... waiting 5 seconds and trying again...\n", txhex.ToString().c_str());
-                unlink(dsthex.c_str());
-                sleep(5);
-                return get_tx(txhex, tx, retries + 1);
+        // deserialize tx
+        auto read_tx = [&](CSpanReader& r) { r >> tx; };
+        if (read_cached(store::tx, txhex, dstfinal, read_tx)) return;
+        if (m_client) {
+            cache_txs(std::vector<uint256>{txhex});
+            if (read_cached(store::tx, txhex, dstfinal, read_tx)) return;
+        }
+        std::string dsthex = "txdata/" + txhex.ToString() + ".hex";
+        std::string cmd = m_call + " getrawtransaction " + txhex.ToString() + " > " + dsthex;
+        File fphex = OpenFile(dsthex, "r");
+        if (!fphex->has_data()) {
+            fphex = fetch(cmd.c_str(), dsthex.c_str());
+        }
+        fseek(fphex->m_fp, 0, SEEK_END);
+        size_t sz = ftell(fphex->m_fp);
+        fseek(fphex->m_fp, 0, SEEK_SET);
+        if (sz == 0) {
+            if (retries == 5) {
+                throw rpc_error("failed to fetch tx " + txhex.ToString() + " after 5 tries");
             }
-            char* txhex = (char*)malloc(sz + 1);
-            assert(txhex);
-            fread(txhex, 1, sz, fphex->m_fp);
-            fphex->close();                                      // closes fphex
-            txhex[sz] = 0;
-            std::vector<uint8_t> txdata = ParseHex(txhex);
-            free(txhex);
-            fp = OpenFile(dstfinal, "wb+");
-            // write tx
-            fp->write(txdata);
-            fseek(fp->m_fp, 0, SEEK_SET);
-            // unlink
+            fprintf(stderr, "failed to fetch tx %s... waiting 5 seconds and trying again...\n", txhex.ToString().c_str());
             unlink(dsthex.c_str());
+            sleep(5);
+            return get_tx(txhex, tx, retries + 1);
         }
-        // deserialize tx
-        fp->autofile() >> tx;
+        char* hex = (char*)malloc(sz + 1);
+        assert(hex);
+        fread(hex, 1, sz, fphex->m_fp);
+        fphex->close();                                      // closes fphex
+        hex[sz] = 0;
+        std::vector<uint8_t> txdata;
+        append_hex(txdata, hex, sz);
+        free(hex);
+        write_cached(store::tx, txhex, dstfinal, txdata.data(), txdata.size());
+        // unlink
+        unlink(dsthex.c_str());
+        CSpanReader r(SER_DISK, 0, txdata.data(), txdata.data() + txdata.size());
+        read_tx(r);
     }
 
     bool get_tx_block(const uint256& txhex, tiny::block& block, uint32_t& height, size_t retries = 0) {
         uint256 blockhex;
         std::string dstfinal = "txdata/" + txhex.ToString() + ".blk";
-        File fp = OpenFile(dstfinal, "rb");
-        if (!fp->has_data()) {
-            std::string dsthex = "txdata/" + txhex.ToString() + ".blktxt";
-            std::string cmd = m_call + " getrawtransaction " + txhex.ToString() + " 1 | jq -r .blockhash > " + dsthex;
-            File fphex = OpenFile(dsthex, "r");
-            if (!fphex->has_data()) {
-                fphex = fetch(cmd.c_str(), dsthex.c_str());
-            }
-            fseek(fphex->m_fp, 0, SEEK_END);
-            size_t sz = ftell(fphex->m_fp);
-            if (sz == 0) {
-                if (retries == 5) {
-                    throw rpc_error("failed to fetch tx " + txhex.ToString() + " after 5 tries");
-                }
-                fprintf(stderr, "failed to fetch tx %s... waiting 5 seconds and trying again...\n", txhex.ToString().c_str());
-                unlink(dsthex.c_str());
-                sleep(5);
-                return get_tx_block(txhex, block, height, retries + 1);
+        if (read_cached(store::tx_block, txhex, dstfinal, [&](CSpanReader& r) { r >> blockhex; })) {
+            return get_block(blockhex, block, height);
+        }
+        if (m_client) {
+            json txinfo = m_client->call("getrawtransaction", strprintf("[\"%s\", 1]", txhex.ToString()));
+            const json& hash = txinfo["blockhash"];
+            if (!hash.is_string()) throw rpc_error("tx " + txhex.ToString() + " is not in a block");
+            blockhex = uint256S(hash.get_str());
+            write_cached(store::tx_block, txhex, dstfinal, blockhex.begin(), blockhex.size());
+            return get_block(blockhex, block, height);
+        }
+        std::string dsthex = "txdata/" + txhex.ToString() + ".blktxt";
+        std::string cmd = m_call + " getrawtransaction " + txhex.ToString() + " 1 | jq -r .blockhash > " + dsthex;
+        File fphex = OpenFile(dsthex, "r");
+        if (!fphex->has_data()) {
+            fphex = fetch(cmd.c_str(), dsthex.c_str());
+        }
+        fseek(fphex->m_fp, 0, SEEK_END);
+        size_t sz = ftell(fphex->m_fp);
+        if (sz == 0) {
+            if (retries == 5) {
+                throw rpc_error("failed to fetch tx " + txhex.ToString() + " after 5 tries");
             }
-            if (sz != 65) fprintf(stderr, "block hash wrong size: %zu\n", sz);
-            fseek(fphex->m_fp, 0, SEEK_SET);
-            char buf[sz+1];
-            fread(buf, 1, sz, fphex->m_fp);
-            fphex->close();
-            buf[sz] = 0;
-            blockhex = uint256S(buf);
+            fprintf(stderr, "failed to fetch tx %s... waiting 5 seconds and trying again...\n", txhex.ToString().c_str());
             unlink(dsthex.c_str());
-            fp = OpenFile(dstfinal, "wb");
-            fp->autofile() << blockhex;
-            return get_block(blockhex, block, height);
+            sleep(5);
+            return get_tx_block(txhex, block, height, retries + 1);
         }
-        fp->autofile() >> blockhex;
+        if (sz != 65) fprintf(stderr, "block hash wrong size: %zu\n", sz);
+        fseek(fphex->m_fp, 0, SEEK_SET);
+        char buf[sz+1];
+        fread(buf, 1, sz, fphex->m_fp);
+        fphex->close();
+        buf[sz] = 0;
+        blockhex = uint256S(buf);
+        unlink(dsthex.c_str());
+        write_cached(store::tx_block, txhex, dstfinal, blockhex.begin(), blockhex.size());
         return get_block(blockhex, block, height);
     }
 
     amount get_tx_input_amount(tx& t) {
         amount amount = 0;
         tx t2;
+        if (m_client) {
+            // fetch all the inputs in one go
+            std::vector<uint256> txids;
+            for (auto& input : t.vin) txids.push_back(input.prevout.hash);
+            cache_txs(txids);
+        }
         for (auto& input : t.vin) {
             get_tx(input.prevout.hash, t2);
             amount += t2.vout[input.prevout.n].value;
@@ -0,0 +1,375 @@
+// Copyright (c) 2018 The Bitcoin Core developers
+// Distributed under the MIT software license, see the accompanying
+// file COPYING or http://www.opensource.org/licenses/mit-license.php.
+
+#include <tinystore.h>
+
+#include <crypto/common.h>
+
+#include <algorithm>
+#include <cinttypes>
+#include <cstring>
+
+#include <fcntl.h>
+#include <sys/file.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+namespace tiny {
+
+static const uint8_t DATA_MAGIC[8] = {'M', 'F', 'F', 'S', 'D', 'A', 'T', 1};
+static const uint8_t INDEX_MAGIC[8] = {'M', 'F', 'F', 'S', 'I', 'D', 'X', 1};
+
+// record header: kind, key, value length
+static const size_t RECORD_HEADER = 1 + 32 + 4;
+
+// index header: magic, capacity, count, indexed end of the data file (padded to 64 bytes)
+static const size_t INDEX_HEADER = 64;
+static const uint64_t INITIAL_CAPACITY = 1 << 16;
+
+// data file mappings are made at least this large, so that the store can grow
+// for a good while before it has to be mapped again
+static const size_t MIN_DATA_MAP = 1 << 30;
+
+struct store::slot {
+    uint8_t key[32];
+    uint64_t offset;    //!< offset of the record in the data file, or 0 if the slot is empty
+    uint8_t kind;
+    uint8_t padding[7];
+};
+static_assert(sizeof(store::slot) == 48, "store::slot must be packed");
+
+static inline uint64_t slot_hash(store::kind k, const uint256& key) {
+    // keys are hashes (apart from heights), but the mixing is cheap enough to
+    // not bother special casing those
+    uint64_t h = ReadLE64(key.begin()) ^ (uint64_t(k) * 0x9e3779b97f4a7c15ULL);
+    h = (h ^ (h >> 30)) * 0xbf58476d1ce4e5b9ULL;
+    h = (h ^ (h >> 27)) * 0x94d049bb133111ebULL;
+    return h ^ (h >> 31);
+}
+
+static store::slot* probe(store::slot* slots, uint64_t capacity, store::kind k, const uint256& key) {
+    uint64_t mask = capacity - 1;
+    for (uint64_t i = slot_hash(k, key) & mask; ; i = (i + 1) & mask) {
+        store::slot* s = &slots[i];
+        if (!s->offset || (s->kind == k && !memcmp(s->key, key.begin(), 32))) return s;
+    }
+}
+
+static inline bool valid_kind(uint8_t k) {
+    return k >= store::block && k <= store::tx_block;
+}
+
+store::~store() {
+    close();
+}
+
+uint64_t store::capacity() const { return ((const uint64_t*)(m_index + 8))[0]; }
+uint64_t& store::count() { return ((uint64_t*)(m_index + 8))[1]; }
+uint64_t& store::indexed_end() { return ((uint64_t*)(m_index + 8))[2]; }
+store::slot* store::slots() { return (slot*)(m_index + INDEX_HEADER); }
+
+uint256 store::height_key(uint32_t height) {
+    uint256 key;
+    WriteLE32(key.begin(), height);
+    return key;
+}
+
+bool store::open(const std::string& path) {
+    std::lock_guard<std::mutex> lock(m_mutex);
+    if (m_data_fd != -1) return false;
+    m_path = path;
+    mkdir(m_path.c_str(), 0777);
+
+    std::string data_path = m_path + "/store.dat";
+    int fd = ::open(data_path.c_str(), O_RDWR | O_CREAT, 0666);
+    if (fd == -1) {
+        fprintf(stderr, "cannot open store %s\n", data_path.c_str());
+        return false;
+    }
+    if (flock(fd, LOCK_EX | LOCK_NB)) {
+        fprintf(stderr, "store %s is in use by another process\n", m_path.c_str());
+        ::close(fd);
+        return false;
+    }
+    struct stat st;
+    if (fstat(fd, &st)) {
+        ::close(fd);
+        return false;
+    }
+    uint64_t size = st.st_size;
+    if (size == 0) {
+        if (pwrite(fd, DATA_MAGIC, sizeof(DATA_MAGIC), 0) != sizeof(DATA_MAGIC)) {
+            fprintf(stderr, "cannot write to store %s\n", data_path.c_str());
+            ::close(fd);
+            return false;
+        }
+        size = sizeof(DATA_MAGIC);
+    }
+    uint8_t magic[sizeof(DATA_MAGIC)];
+    if (size < sizeof(DATA_MAGIC) || pread(fd, magic, sizeof(magic), 0) != sizeof(magic) || memcmp(magic, DATA_MAGIC, sizeof(magic))) {
+        fprintf(stderr, "%s is not a store data file\n", data_path.c_str());
+        ::close(fd);
+        return false;
+    }
+    m_data_fd = fd;
+    if (!map_data(size)) {
+        close();
+        return false;
+    }
+
+    uint64_t index_from_offset = open_index(size);
+    if (!index_from_offset || !index_from(index_from_offset)) {
+        close();
+        return false;
+    }
+    return true;
+}
+
+void store::close() {
+    for (const auto& m : m_data_maps) munmap(m.first, m.second);
+    m_data_maps.clear();
+    unmap_index();
+    if (m_data_fd != -1) ::close(m_data_fd); // releases the lock
+    m_data_fd = -1;
+    m_data_end = 0;
+}
+
+bool store::map_data(uint64_t needed) {
+    if (!m_data_maps.empty() && m_data_maps.back().second >= needed) return true;
+    // pages beyond the end of the file cannot be touched, but they become
+    // accessible as the file grows into them
+    size_t size = std::max<size_t>(needed * 2, MIN_DATA_MAP);
+    void* p = mmap(nullptr, size, PROT_READ, MAP_SHARED, m_data_fd, 0);
+    if (p == MAP_FAILED) {
+        fprintf(stderr, "cannot map store %s (%zu bytes)\n", m_path.c_str(), size);
+        return false;
+    }
+    // earlier mappings stay, as values handed out from them may still be in use
+    m_data_maps.emplace_back((uint8_t*)p, size);
+    return true;
+}
+
+bool store::map_index() {
+    unmap_index();
+    std::string index_path = m_path + "/store.idx";
+    m_index_fd = ::open(index_path.c_str(), O_RDWR);
+    if (m_index_fd == -1) return false;
+    struct stat st;
+    if (fstat(m_index_fd, &st) || st.st_size < (off_t)INDEX_HEADER) {
+        unmap_index();
+        return false;
+    }
+    void* p = mmap(nullptr, st.st_size, PROT_READ | PROT_WRITE, MAP_SHARED, m_index_fd, 0);
+    if (p == MAP_FAILED) {
+        unmap_index();
+        return false;
+    }
+    m_index = (uint8_t*)p;
+    m_index_size = st.st_size;
+    uint64_t cap = capacity();
+    if (memcmp(m_index, INDEX_MAGIC, sizeof(INDEX_MAGIC)) || !cap || (cap & (cap - 1)) || m_index_size != INDEX_HEADER + cap * sizeof(slot)) {
+        unmap_index();
+        return false;
+    }
+    return true;
+}
+
+void store::unmap_index() {
+    if (m_index) munmap(m_index, m_index_size);
+    m_index = nullptr;
+    m_index_size = 0;
+    if (m_index_fd != -1) ::close(m_index_fd);
+    m_index_fd = -1;
+}
+
+bool store::create_index(const std::string& path, uint64_t cap) {
+    int fd = ::open(path.c_str(), O_RDWR | O_CREAT | O_TRUNC, 0666);
+    if (fd == -1) return false;
+    uint8_t header[INDEX_HEADER] = {0};
+    memcpy(header, INDEX_MAGIC, sizeof(INDEX_MAGIC));
+    memcpy(header + 8, &cap, sizeof(cap));
+    bool ok = ftruncate(fd, INDEX_HEADER + cap * sizeof(slot)) == 0 && pwrite(fd, header, sizeof(header), 0) == sizeof(header);
+    ::close(fd);
+    if (!ok) unlink(path.c_str());
+    return ok;
+}
+
+uint64_t store::open_index(uint64_t data_size) {
+    if (map_index() && indexed_end() >= sizeof(DATA_MAGIC) && indexed_end() <= data_size) return indexed_end();
+    // no index, or not one we can trust; index everything from scratch
+    if (data_size > sizeof(DATA_MAGIC)) fprintf(stderr, "store %s: rebuilding index\n", m_path.c_str());
+    std::string index_path = m_path + "/store.idx";
+    if (!create_index(index_path + ".tmp", INITIAL_CAPACITY) || rename((index_path + ".tmp").c_str(), index_path.c_str()) || !map_index()) {
+        fprintf(stderr, "cannot create store index %s\n", index_path.c_str());
+        return 0;
+    }
+    indexed_end() = sizeof(DATA_MAGIC);
+    return indexed_end();
+}
+
+bool store::grow_index() {
+    std::string index_path = m_path + "/store.idx";
+    std::string tmp_path = index_path + ".tmp";
+    uint64_t cap = capacity() * 2;
+    if (!create_index(tmp_path, cap)) return false;
+    int fd = ::open(tmp_path.c_str(), O_RDWR);
+    size_t size = INDEX_HEADER + cap * sizeof(slot);
+    void* p = fd == -1 ? MAP_FAILED : mmap(nullptr, size, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+    if (fd != -1) ::close(fd);
+    if (p == MAP_FAILED) {
+        unlink(tmp_path.c_str());
+        return false;
+    }
+    uint8_t* index = (uint8_t*)p;
+    slot* new_slots = (slot*)(index + INDEX_HEADER);
+    slot* old_slots = slots();
+    for (uint64_t i = 0; i < capacity(); ++i) {
+        if (!old_slots[i].offset) continue;
+        uint256 key;
+        memcpy(key.begin(), old_slots[i].key, 32);
+        *probe(new_slots, cap, (kind)old_slots[i].kind, key) = old_slots[i];
+    }
+    // count and indexed end
+    memcpy(index + 16, m_index + 16, 16);
+    bool ok = msync(index, size, MS_SYNC) == 0;
+    munmap(index, size);
+    if (!ok || rename(tmp_path.c_str(), index_path.c_str())) {
+        unlink(tmp_path.c_str());
+        return false;
+    }
+    return map_index();
+}
+
+bool store::insert(kind k, const uint256& key, uint64_t offset) {
+    // keep the load factor below 70%
+    if ((count() + 1) * 10 > capacity() * 7 && !grow_index()) {
+        fprintf(stderr, "cannot grow store index %s/store.idx\n", m_path.c_str());
+        return false;
+    }
+    slot* s = probe(slots(), capacity(), k, key);
+    if (s->offset) {
+        // a newer record for the same key (see replace()) supersedes the old one
+        s->offset = offset;
+        return true;
+    }
+    memcpy(s->key, key.begin(), 32);
+    s->kind = k;
+    s->offset = offset;
+    ++count();
+    return true;
+}
+
+bool store::index_from(uint64_t offset) {
+    struct stat st;
+    if (fstat(m_data_fd, &st)) return false;
+    uint64_t size = st.st_size;
+    if (!map_data(size)) return false;
+    const uint8_t* data = m_data_maps.back().first;
+    // records are only ever appended, so only the last one can be partially
+    // written: cut short, or (after a crash) zero filled. Anything else is
+    // corruption, which is left alone, rather than dropping every record
+    // following it.
+    while (offset + RECORD_HEADER <= size) {
+        const uint8_t* rec = data + offset;
+        uint64_t len = ReadLE32(rec + 33);
+        if (!valid_kind(rec[0])) {
+            if (std::all_of(rec, data + size, [](uint8_t b) { return b == 0; })) break;
+            fprintf(stderr, "store %s: corrupt record at position %" PRIu64 " of %" PRIu64 "; refusing to open it\n", m_path.c_str(), offset, size);
+            return false;
+        }
+        if (offset + RECORD_HEADER + len > size) break;
+        uint256 key;
+        memcpy(key.begin(), rec + 1, 32);
+        if (!insert((kind)rec[0], key, offset)) return false;
+        offset += RECORD_HEADER + len;
+    }
+    if (offset < size) {
+        // a record cut short (e.g. by a crash mid-write); drop it
+        fprintf(stderr, "store %s: dropping partial record at position %" PRIu64 "\n", m_path.c_str(), offset);
+        if (ftruncate(m_data_fd, offset)) {
+            fprintf(stderr, "store %s: failed to truncate data file to %" PRIu64 " bytes\n", m_path.c_str(), offset);
+            return false;
+        }
+    }
+    m_data_end = offset;
+    indexed_end() = offset;
+    return true;
+}
+
+bool store::put(kind k, const uint256& key, const uint8_t* data, size_t len) {
+    std::lock_guard<std::mutex> lock(m_mutex);
+    if (m_data_fd == -1 || len > 0xffffffff) return false;
+    if (probe(slots(), capacity(), k, key)->offset) return true;
+    return append(k, key, data, len);
+}
+
+bool store::replace(kind k, const uint256& key, const uint8_t* data, size_t len) {
+    std::lock_guard<std::mutex> lock(m_mutex);
+    if (m_data_fd == -1 || len > 0xffffffff) return false;
+    return append(k, key, data, len);
+}
+
+bool store::append(kind k, const uint256& key, const uint8_t* data, size_t len) {
+    uint8_t header[RECORD_HEADER];
+    header[0] = k;
+    memcpy(&header[1], key.begin(), 32);
+    WriteLE32(&header[33], len);
+    std::vector<uint8_t> rec;
+    rec.reserve(RECORD_HEADER + len);
+    rec.insert(rec.end(), header, header + RECORD_HEADER);
+    rec.insert(rec.end(), data, data + len);
+    size_t written = 0;
+    while (written < rec.size()) {
+        ssize_t w = pwrite(m_data_fd, rec.data() + written, rec.size() - written, m_data_end + written);
+        if (w <= 0) {
+            fprintf(stderr, "failed to write to store %s\n", m_path.c_str());
+            // whatever made it is dropped when the store is next opened
+            return false;
+        }
+        written += w;
+    }
+    if (!map_data(m_data_end + rec.size()) || !insert(k, key, m_data_end)) return false;
+    m_data_end += rec.size();
+    indexed_end() = m_data_end;
+    return true;
+}
+
+bool store::get(kind k, const uint256& key, const uint8_t*& data, size_t& len) {
+    std::lock_guard<std::mutex> lock(m_mutex);
+    if (m_data_fd == -1) return false;
+    const slot* s = probe(slots(), capacity(), k, key);
+    if (!s->offset) return false;
+    const uint8_t* rec = m_data_maps.back().first + s->offset;
+    len = ReadLE32(rec + 33);
+    data = rec + RECORD_HEADER;
+    return true;
+}
+
+void store::keys(kind k, std::vector<uint256>& keys_out) {
+    std::lock_guard<std::mutex> lock(m_mutex);
+    if (m_data_fd == -1) return;
+    const uint8_t* data = m_data_maps.back().first;
+    for (uint64_t offset = sizeof(DATA_MAGIC); offset < m_data_end; offset += RECORD_HEADER + ReadLE32(data + offset + 33)) {
+        if (data[offset] != k) continue;
+        uint256 key;
+        memcpy(key.begin(), data + offset + 1, 32);
+        // skip records which have since been replaced
+        if (probe(slots(), capacity(), k, key)->offset != offset) continue;
+        keys_out.push_back(key);
+    }
+}
+
+bool store::flush() {
+    std::lock_guard<std::mutex> lock(m_mutex);
+    if (m_data_fd == -1) return false;
+    return fdatasync(m_data_fd) == 0 && msync(m_index, m_index_size, MS_SYNC) == 0;
+}
+
+size_t store::size() {
+    std::lock_guard<std::mutex> lock(m_mutex);
+    return m_index ? count() : 0;
+}
+
+} // namespace tiny
@@ -0,0 +1,141 @@
+// Copyright (c) 2018 The Bitcoin Core developers
+// Distributed under the MIT software license, see the accompanying
+// file COPYING or http://www.opensource.org/licenses/mit-license.php.
+
+#ifndef BITCOIN_TINYSTORE_H
+#define BITCOIN_TINYSTORE_H
+
+#include <mutex>
+#include <string>
+#include <vector>
+
+#include <uint256.h>
+
+namespace tiny {
+
+/**
+ * Packed, append-only key/value store for the rpc cache, replacing the one
+ * file per block/tx layout of blockdata/ and txdata/.
+ *
+ * A store is a directory holding two files:
+ * - store.dat: the records, appended one after the other; each record is a
+ *   kind byte, a 32 byte key, a 4 byte length and the value itself
+ * - store.idx: an open addressing (linear probing) hash table mapping
+ *   (kind, key) to the offset of the record in store.dat, along with a header
+ *   saying how much of store.dat has been indexed
+ *
+ * Both files are memory mapped. The data file is mapped with plenty of room
+ * to grow, and every mapping is kept for as long as the store is open, so
+ * values handed out by get() stay valid and can be read without holding any
+ * locks. Records are never modified once written; a value is replaced by
+ * appending a newer record for its key (see replace()), which the index then
+ * points at instead.
+ *
+ * If the process dies between appending a record and indexing it, the
+ * record is indexed when the store is next opened; a partially written
+ * record at the end of the data file is dropped. If the index is missing or
+ * damaged, it is rebuilt from the data file. A corrupt record anywhere else
+ * makes open() fail, leaving the data file as it is.
+ *
+ * Thread safe. A store may only be opened by one process at a time.
+ */
+class store {
+public:
+    enum kind : uint8_t {
+        block = 1,      //!< block hash -> 4 byte height followed by the serialized block (.mffb)
+        block_hash = 2, //!< height_key(height) -> block hash (.hth)
+        tx = 3,         //!< txid -> serialized tx (.mfft)
+        tx_block = 4,   //!< txid -> hash of the block containing it (.blk)
+    };
+
+    store() {}
+    store(const store&) = delete;
+    store& operator=(const store&) = delete;
+    ~store();
+
+    /**
+     * Open the store in the directory at path, creating it if necessary.
+     * Returns false if it could not be opened (e.g. because another process
+     * has it open).
+     */
+    bool open(const std::string& path);
+
+    void close();
+
+    bool is_open() const { return m_data_fd != -1; }
+
+    /**
+     * Append the given value, unless there is a value for the key already.
+     * Returns false if the value could not be written.
+     */
+    bool put(kind k, const uint256& key, const uint8_t* data, size_t len);
+    bool put(kind k, const uint256& key, const std::vector<uint8_t>& data) { return put(k, key, data.data(), data.size()); }
+
+    /**
+     * Append the given value, superseding the existing value for the key, if
+     * any (e.g. a corrupt cache entry). Values handed out for the old record
+     * stay valid. Returns false if the value could not be written.
+     */
+    bool replace(kind k, const uint256& key, const uint8_t* data, size_t len);
+
+    /**
+     * Look up the value for the given key. The returned pointer remains valid
+     * until the store is closed. Returns false if there is no such value.
+     */
+    bool get(kind k, const uint256& key, const uint8_t*& data, size_t& len);
+
+    bool has(kind k, const uint256& key) {
+        const uint8_t* data;
+        size_t len;
+        return get(k, key, data, len);
+    }
+
+    /** Append the keys of every record of the given kind to keys_out, in insertion order. */
+    void keys(kind k, std::vector<uint256>& keys_out);
+
+    /** Write everything to disk. */
+    bool flush();
+
+    /** Number of records. */
+    size_t size();
+
+    /** The key under which the block hash for a height is stored. */
+    static uint256 height_key(uint32_t height);
+
+    /** An index entry (defined in tinystore.cpp). */
+    struct slot;
+
+private:
+
+    std::string m_path;
+    std::mutex m_mutex;
+    int m_data_fd{-1};
+    uint64_t m_data_end{0};
+    /** Data file mappings, oldest first; only the last one is used for new lookups. */
+    std::vector<std::pair<uint8_t*, size_t>> m_data_maps;
+    int m_index_fd{-1};
+    uint8_t* m_index{nullptr};
+    size_t m_index_size{0};
+
+    uint64_t capacity() const;
+    uint64_t& count();
+    uint64_t& indexed_end();
+    slot* slots();
+
+    bool map_data(uint64_t needed);
+    bool map_index();
+    void unmap_index();
+    /** Map the index, (re)creating it if necessary; returns the data file offset to index from, or 0 on failure. */
+    uint64_t open_index(uint64_t data_size);
+    bool create_index(const std::string& path, uint64_t capacity);
+    bool grow_index();
+    /** Point the index at the record at offset, for a new key or superseding an older record. */
+    bool insert(kind k, const uint256& key, uint64_t offset);
+    /** Write a record, and index it. Requires m_mutex. */
+    bool append(kind k, const uint256& key, const uint8_t* data, size_t len);
+    bool index_from(uint64_t offset);
+};
+
+} // namespace tiny
+
+#endif // BITCOIN_TINYSTORE_H
@@ -30,8 +30,50 @@
 #   endif
 #endif
 
+#ifdef TINY_COUNT_SERIALIZATIONS
+#   include <atomic>
+#endif
+
 namespace tiny {
 
+#ifdef TINY_COUNT_SERIALIZATIONS
+/**
+ * Number of times a tx has been serialized in order to compute its hash or
+ * weight. Only counted when built with TINY_COUNT_SERIALIZATIONS defined.
+ */
+inline std::atomic<uint64_t>& serializations() {
+    static std::atomic<uint64_t> count{0};
+    return count;
+}
+#   define TINY_COUNT_SERIALIZATIONS_ADD(n) tiny::serializations() += (n)
+#else
+#   define TINY_COUNT_SERIALIZATIONS_ADD(n)
+#endif
+
+#ifndef TINY_NOHASH
+/**
+ * While one of these is alive, txs deserialized on the same thread are left
+ * with a null hash rather than hashed one at a time. Whoever opens the scope
+ * hashes them all at once afterwards (see UpdateHashes() and hash_pool), and
+ * must do so before handing any of them on.
+ */
+class deferred_hashing {
+public:
+    deferred_hashing() { ++depth(); }
+    ~deferred_hashing() { --depth(); }
+    deferred_hashing(const deferred_hashing&) = delete;
+    deferred_hashing& operator=(const deferred_hashing&) = delete;
+
+    static bool active() { return depth() > 0; }
+
+private:
+    static int& depth() {
+        static thread_local int d = 0;
+        return d;
+    }
+};
+#endif
+
 typedef int64_t amount;
 static const amount COIN = 100000000;
 
@@ -196,8 +238,10 @@ struct tx {
     uint32_t locktime;
 
     uint256 hash;
+    //! GetWeight(), as computed on deserialization (or by UpdateWeight()); 0 if not yet computed
+    int64_t weight;
 
-    tx() : vin(), vout(), version(2), locktime(0), hash() {}
+    tx() : vin(), vout(), version(2), locktime(0), hash(), weight(0) {}
 
     friend bool operator==(const tx& a, const tx& b)
     {
@@ -214,6 +258,7 @@ struct tx {
 
 #ifndef TINY_NOHASH
     void UpdateHash() {
+        TINY_COUNT_SERIALIZATIONS_ADD(1);
         hash = SerializeHash(*this, SER_GETHASH, SERIALIZE_TRANSACTION_NO_WITNESS);
     }
 #endif
@@ -268,8 +313,9 @@ struct tx {
         }
         s >> locktime;
 #ifndef TINY_NOHASH
-        UpdateHash();
+        if (deferred_hashing::active()) hash.SetNull(); else UpdateHash();
 #endif
+        UpdateWeight();
     }
 
     template<typename Stream>
@@ -315,13 +361,29 @@ struct tx {
         return str;
     }
 
-    inline int64_t GetWeight() const {
+    inline int64_t ComputeWeight() const {
         #define WITNESS_SCALE_FACTOR 4
+        TINY_COUNT_SERIALIZATIONS_ADD(2);
         return GetSerializeSize(*this, SER_NETWORK, PROTOCOL_VERSION | SERIALIZE_TRANSACTION_NO_WITNESS) * (WITNESS_SCALE_FACTOR - 1) + GetSerializeSize(*this, SER_NETWORK, PROTOCOL_VERSION);
     }
+
+    /** Cache the weight; txs which are put together rather than deserialized call this once done. */
+    void UpdateWeight() { weight = ComputeWeight(); }
+
+    inline int64_t GetWeight() const { return weight ? weight : ComputeWeight(); }
 #endif
 };
 
+#ifndef TINY_NOHASH
+/** UpdateHash() for count txs at once, hashing several of them side by side where the CPU allows it. */
+inline void UpdateHashes(tx* const* txs, size_t count) {
+    TINY_COUNT_SERIALIZATIONS_ADD(count);
+    std::vector<uint256> hashes(count);
+    SerializeHashes(txs, count, hashes.data(), SER_GETHASH, SERIALIZE_TRANSACTION_NO_WITNESS);
+    for (size_t i = 0; i < count; ++i) txs[i]->hash = hashes[i];
+}
+#endif
+
 }
 
 #endif // BITCOIN_TINYTX_H
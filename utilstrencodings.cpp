@@ -3,6 +3,10 @@
 // Distributed under the MIT software license, see the accompanying
 // file COPYING or http://www.opensource.org/licenses/mit-license.php.
 
+#if defined(HAVE_CONFIG_H)
+#include <config/bitcoin-config.h>
+#endif
+
 #include <utilstrencodings.h>
 
 #include <tinyformat.h>
@@ -12,6 +16,13 @@
 #include <errno.h>
 #include <limits>
 
+#if defined(__SSE2__)
+#include <emmintrin.h>
+#endif
+#if defined(ENABLE_AVX2)
+#include <immintrin.h>
+#endif
+
 static const std::string CHARS_ALPHA_NUM = "abcdefghijklmnopqrstuvwxyzABCDEFGHIJKLMNOPQRSTUVWXYZ0123456789";
 
 static const std::string SAFE_CHARS[] =
@@ -78,30 +89,130 @@ bool IsHexNumber(const std::string& str)
     return (str.size() > starting_location);
 }
 
-std::vector<unsigned char> ParseHex(const char* psz)
+namespace {
+/**
+ * Hex decoding kernels: decode as many whole blocks of hex digits at
+ * [p, end) as possible, advancing p and out, and stop at the first block
+ * containing anything else (which DecodeHex then looks at one pair at a time).
+ */
+typedef void (*DecodeHexBlocks)(const char*& p, const char* end, unsigned char*& out);
+
+#if defined(__SSE2__)
+/** The nibbles of 16 hex digits, and in valid whether all of them were hex digits. */
+inline __m128i HexNibbles(__m128i c, bool& valid)
 {
-    // convert hex dump to vector
-    std::vector<unsigned char> vch;
-    while (true)
-    {
-        while (isspace(*psz))
-            psz++;
-        signed char c = HexDigit(*psz++);
-        if (c == (signed char)-1)
-            break;
-        unsigned char n = (c << 4);
-        c = HexDigit(*psz++);
-        if (c == (signed char)-1)
-            break;
-        n |= c;
-        vch.push_back(n);
+    // ASCII only; anything from 0x80 on compares as negative, and fails both ranges
+    const __m128i digit = _mm_and_si128(_mm_cmpgt_epi8(c, _mm_set1_epi8('0' - 1)), _mm_cmplt_epi8(c, _mm_set1_epi8('9' + 1)));
+    const __m128i lower = _mm_or_si128(c, _mm_set1_epi8(0x20));
+    const __m128i alpha = _mm_and_si128(_mm_cmpgt_epi8(lower, _mm_set1_epi8('a' - 1)), _mm_cmplt_epi8(lower, _mm_set1_epi8('f' + 1)));
+    valid = _mm_movemask_epi8(_mm_or_si128(digit, alpha)) == 0xffff;
+    return _mm_or_si128(_mm_and_si128(digit, _mm_sub_epi8(c, _mm_set1_epi8('0'))),
+                        _mm_and_si128(alpha, _mm_sub_epi8(lower, _mm_set1_epi8('a' - 10))));
+}
+
+/** Combine the nibble pairs in each 16-bit lane (high nibble first) into bytes, in the low byte of the lane. */
+inline __m128i HexBytes(__m128i n)
+{
+    return _mm_or_si128(_mm_slli_epi16(_mm_and_si128(n, _mm_set1_epi16(0x00ff)), 4), _mm_srli_epi16(n, 8));
+}
+
+void DecodeHexBlocksSSE2(const char*& p, const char* end, unsigned char*& out)
+{
+    while (end - p >= 32) {
+        bool valid_lo, valid_hi;
+        const __m128i lo = HexNibbles(_mm_loadu_si128((const __m128i*)p), valid_lo);
+        const __m128i hi = HexNibbles(_mm_loadu_si128((const __m128i*)(p + 16)), valid_hi);
+        if (!valid_lo || !valid_hi) return;
+        _mm_storeu_si128((__m128i*)out, _mm_packus_epi16(HexBytes(lo), HexBytes(hi)));
+        p += 32;
+        out += 16;
+    }
+}
+#endif
+
+#if defined(ENABLE_AVX2)
+#define AVX2_TARGET __attribute__((target("avx2")))
+
+inline AVX2_TARGET __m256i HexNibbles(__m256i c, bool& valid)
+{
+    const __m256i digit = _mm256_and_si256(_mm256_cmpgt_epi8(c, _mm256_set1_epi8('0' - 1)), _mm256_cmpgt_epi8(_mm256_set1_epi8('9' + 1), c));
+    const __m256i lower = _mm256_or_si256(c, _mm256_set1_epi8(0x20));
+    const __m256i alpha = _mm256_and_si256(_mm256_cmpgt_epi8(lower, _mm256_set1_epi8('a' - 1)), _mm256_cmpgt_epi8(_mm256_set1_epi8('f' + 1), lower));
+    valid = _mm256_movemask_epi8(_mm256_or_si256(digit, alpha)) == -1;
+    return _mm256_or_si256(_mm256_and_si256(digit, _mm256_sub_epi8(c, _mm256_set1_epi8('0'))),
+                           _mm256_and_si256(alpha, _mm256_sub_epi8(lower, _mm256_set1_epi8('a' - 10))));
+}
+
+inline AVX2_TARGET __m256i HexBytes(__m256i n)
+{
+    return _mm256_or_si256(_mm256_slli_epi16(_mm256_and_si256(n, _mm256_set1_epi16(0x00ff)), 4), _mm256_srli_epi16(n, 8));
+}
+
+AVX2_TARGET void DecodeHexBlocksAVX2(const char*& p, const char* end, unsigned char*& out)
+{
+    while (end - p >= 64) {
+        bool valid_lo, valid_hi;
+        const __m256i lo = HexNibbles(_mm256_loadu_si256((const __m256i*)p), valid_lo);
+        const __m256i hi = HexNibbles(_mm256_loadu_si256((const __m256i*)(p + 32)), valid_hi);
+        if (!valid_lo || !valid_hi) break;
+        // packing works within each 128-bit half; put the four quarters back in order
+        const __m256i bytes = _mm256_packus_epi16(HexBytes(lo), HexBytes(hi));
+        _mm256_storeu_si256((__m256i*)out, _mm256_permute4x64_epi64(bytes, 0xd8));
+        p += 64;
+        out += 32;
     }
+#if defined(__SSE2__)
+    DecodeHexBlocksSSE2(p, end, out);
+#endif
+}
+#endif
+
+DecodeHexBlocks SelectDecodeHexBlocks()
+{
+#if defined(ENABLE_AVX2)
+    if (__builtin_cpu_supports("avx2")) return DecodeHexBlocksAVX2;
+#endif
+#if defined(__SSE2__)
+    return DecodeHexBlocksSSE2;
+#else
+    return [](const char*& p, const char* end, unsigned char*& out) {};
+#endif
+}
+} // namespace
+
+size_t DecodeHex(const char* hex, size_t len, unsigned char* out)
+{
+    static const DecodeHexBlocks decode_blocks = SelectDecodeHexBlocks();
+    const char* p = hex;
+    const char* end = hex + len;
+    unsigned char* begin = out;
+    for (;;) {
+        decode_blocks(p, end, out);
+        // whitespace, the end of the input, or an invalid char: one pair at a time
+        while (p < end && isspace((unsigned char)*p)) p++;
+        if (end - p < 2) break;
+        signed char hi = HexDigit(p[0]);
+        signed char lo = HexDigit(p[1]);
+        if (hi < 0 || lo < 0) break;
+        *out++ = (hi << 4) | lo;
+        p += 2;
+    }
+    return out - begin;
+}
+
+std::vector<unsigned char> ParseHex(const char* psz)
+{
+    size_t len = strlen(psz);
+    std::vector<unsigned char> vch(len / 2);
+    vch.resize(DecodeHex(psz, len, vch.data()));
     return vch;
 }
 
 std::vector<unsigned char> ParseHex(const std::string& str)
 {
-    return ParseHex(str.c_str());
+    std::vector<unsigned char> vch(str.size() / 2);
+    vch.resize(DecodeHex(str.data(), str.size(), vch.data()));
+    return vch;
 }
 
 void SplitHostPort(std::string in, int &portOut, std::string &hostOut) {
@@ -37,6 +37,13 @@ enum SafeChars
 std::string SanitizeString(const std::string& str, int rule = SAFE_CHARS_DEFAULT);
 std::vector<unsigned char> ParseHex(const char* psz);
 std::vector<unsigned char> ParseHex(const std::string& str);
+/**
+ * Decode the hex at [hex, hex + len) into out, which must have room for len / 2
+ * bytes, using SSE2 or AVX2 where available. Like ParseHex, whitespace between
+ * bytes is skipped, and decoding stops at the first other non-hex char.
+ * @return the number of bytes written
+ */
+size_t DecodeHex(const char* hex, size_t len, unsigned char* out);
 signed char HexDigit(char c);
 /* Returns true if each character in str is a hex character, and has an even
  * number of hex digits.*/